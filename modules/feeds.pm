@@ -12,8 +12,8 @@ use HTML::Entities;
 
 # Holds access to our feeds database within this process
 my $Feeds = Feeds->new(path => $mod_perl::config::module_db);
-mod_perl::commands::register_command('feeds', \&run);
-mod_perl::commands::register_command('feed', \&run);
+mod_perl::commands::register_command('feeds', \&run, 'slow');
+mod_perl::commands::register_command('feed', \&run, 'slow');
 
 
 sub feeds_help {
@@ -33,7 +33,13 @@ sub feeds_add {
 	my ($irc, $name, $source) = @_;
 
 	eval {
-		$Feeds->add(name => $name, url => $source);
+		$Feeds->add(name => $name, url => $source, sub {
+			my $err = shift;
+			if ($err) {
+				chomp($err);
+				$irc->say($err);
+			}
+		});
 	};
 	if ($@) { 
 		chomp($@); 
@@ -58,31 +64,47 @@ sub feeds_search {
 		return;
 	}
 
+	# Fetch every feed at once and look through them when they're all in
+	my @feeds = grep { !$limit || $_->name =~ $limit } $Feeds->entries;
+	my $left = @feeds;
+	return $irc->say("No results found.") if (!$left);
+
 	my @results;
-	foreach my $feed ($Feeds->entries) {
-		# We're only looking for feeds matching pattern '$limit' (or all feeds if no pattern given)
-		next if ($limit && $feed->name !~ $limit);
-
-		# Limit search to 100 for a single feed or latest 10 for an "all feed" search
-		my $max = $limit ? 100 : 10;
-		foreach my $entry ($feed->update()->entries()) {
-			if ($entry->title =~ $query) {
-				push(@results, sprintf("\00303,01[%s]\003 \00310,01%s\003 :: %s", $feed->title(), $entry->title, mod_perl::modules::utils::tinyurl($entry->link)));
+	foreach my $feed (@feeds) {
+		$feed->update(sub {
+			my ($feed, $err) = @_;
+			if (!$err) {
+				# Limit search to 100 for a single feed or latest 10 for an "all feed" search
+				my $max = $limit ? 100 : 10;
+				foreach my $entry ($feed->entries()) {
+					push(@results, [$feed, $entry]) if ($entry->title =~ $query);
+					last if --$max <= 0;
+				}
 			}
-			last if --$max <= 0;
-		}
+			search_results($irc, @results) if (!--$left);
+		});
 	}
+}
+
+# Show what feeds_search found, [feed, entry] pairs
+sub search_results {
+	my ($irc, @results) = @_;
 
 	if (!scalar(@results)) {
 		$irc->say("No results found.");
 		return;
 	}
 
-	# Print out up to 5 results if any were found
-	$irc->say("Showing max 5 out of ".(scalar(@results))." total found");
-	foreach my $result (@results[0..4]) {
-		$irc->say($result);
-	}
+	# Print out up to 5 results if any were found, only those need short links
+	my @shown = grep { defined } @results[0..4];
+	mod_perl::modules::utils::tinyurls([ map { $_->[1]->link } @shown ], sub {
+		my @links = @_;
+		$irc->say("Showing max 5 out of ".(scalar(@results))." total found");
+		foreach my $result (@shown) {
+			my ($feed, $entry) = @$result;
+			$irc->say(sprintf("\00303,01[%s]\003 \00310,01%s\003 :: %s", $feed->title(), $entry->title, shift(@links)));
+		}
+	});
 }
 
 sub feeds_lookup {
@@ -90,50 +112,70 @@ sub feeds_lookup {
 	$limit ||= 1; # Default to only showing the first item
 
 	# Handle paging requests (repeated lookup for same feed, shows more results, no further lookups)
-	my $feed = eval { $Feeds->get_latest($name) };
+	eval {
+		$Feeds->get_latest($name, sub {
+			my ($feed, $err) = @_;
+			if ($err) {
+				chomp($err);
+				$irc->say($err);
+				return;
+			}
+			feeds_show($irc, $feed, $limit);
+		});
+	};
 	if ($@) {
+		chomp($@);
 		$irc->say($@);
 		return;
 	}
+}
 
-	my $count;
-	my $prefix = sprintf("[%s]", $feed->title);
+sub feeds_show {
+	my ($irc, $feed, $limit) = @_;
 	my @entries = $feed->entries();
+	my @shown = grep { defined } @entries[0 .. $limit - 1];
+
+	# Shorten the links we show all at once
+	mod_perl::modules::utils::tinyurls([ map { $_->link() } @shown ], sub {
+		my @links = @_;
+		my $count;
+		my $prefix = sprintf("[%s]", $feed->title);
+
+		my $format = sub { return sprintf("\00303,01%s\003 \00310,01%s\003 :: %s", @_); };
+		foreach my $entry (@entries) {
+			# Print feed title on first iteration (only if printing more than 1 item)
+			if (!$count && $limit > 1) { 
+				$irc->say($feed->title); 
+				$prefix = '*';
+			}
 
-	my $format = sub { return sprintf("\00303,01%s\003 \00310,01%s\003 :: %s", @_); };
-	foreach my $entry (@entries) {
-		# Print feed title on first iteration (only if printing more than 1 item)
-		if (!$count && $limit > 1) { 
-			$irc->say($feed->title); 
-			$prefix = '*';
-		}
+			my $title = decode_entities($entry->title());
+			my $link = shift(@links);
+			$irc->say($format->($prefix, $title, $link));
+			# If we're only printing 1 feed, show it's description also
+			if ($limit == 1) {
+				my $tree = HTML::TreeBuilder->new;
+				$tree->parse($entry->content()->body || '');
+				my $summary = $tree->as_trimmed_text();
+
+				$summary = length($summary) > 420 ? substr($summary, 0, 420) . "..." : $summary;
+				$irc->say($summary);
+			}
 
-		my $title = decode_entities($entry->title());
-		my $link = mod_perl::modules::utils::tinyurl($entry->link());
-		$irc->say($format->($prefix, $title, $link));
-		# If we're only printing 1 feed, show it's description also
-		if ($limit == 1) {
-			my $tree = HTML::TreeBuilder->new;
-			$tree->parse($entry->content()->body || '');
-			my $summary = $tree->as_trimmed_text();
-
-			$summary = length($summary) > 420 ? substr($summary, 0, 420) . "..." : $summary;
-			$irc->say($summary);
+			# Reached limit
+			last if (++$count >= $limit);
 		}
 
-		# Reached limit
-		last if (++$count >= $limit);
-	}
-
-	# If they're already spamming, lets just give them a url with everything else
-	if ($limit > 3 && $count < scalar(@entries)) {
-		my $content = $feed->title . "\n";
-		for ($count = 0; $count < scalar(@entries); ++$count) {
-			my $entry = $entries[$count];
-			$content .= $format->($prefix, $entry->title, $entry->link) . "\n";
-			$content .= $entry->content()->body() . "\n";
+		# If they're already spamming, lets just give them a url with everything else
+		if ($limit > 3 && $count < scalar(@entries)) {
+			my $content = $feed->title . "\n";
+			for ($count = 0; $count < scalar(@entries); ++$count) {
+				my $entry = $entries[$count];
+				$content .= $format->($prefix, $entry->title, $entry->link) . "\n";
+				$content .= $entry->content()->body() . "\n";
+			}
 		}
-	}
+	});
 }
 
 sub run {
@@ -142,31 +184,39 @@ sub run {
     my ($ret, @argv) = mod_perl::commands::handle_arg(\%opt, $irc, \&feeds_help, $arg, qw(list|l limit|L=i add|a help|h search|s));
     return if (!$ret);
 
-	# Make sure we're up to date on each run, this only does something if the file changed
-	$Feeds->update();
+	# Feeds are fetched after we return, answer on a copy of the event
+	$irc = $irc->defer;
 
-	if ($opt{list}) {
-		$irc->say("Sources: ".join(", ", $Feeds->list));
-		return;
-	}
+	# Make sure we're up to date on each run, another worker may have added some
+	$Feeds->update(sub {
+		if ($opt{list}) {
+			$irc->say("Sources: ".join(", ", $Feeds->list));
+			return;
+		}
+		return feeds_run($irc, \%opt, @argv) if (@argv);
 
-	# If no argument, check if this user has a list of feeds, and show them
-	if (!@argv) { 
+		# If no argument, check if this user has a list of feeds, and show them
 		my $Users = mod_perl::modules::users::get_instance();
-		my $user = $Users->get(username => $irc->nick);
-		if ($user->{feeds}) {
-			@argv = split(/,/, $user->{feeds});
-		} else {
-			return feeds_help($irc); 
-		}
-	}
+		$Users->get(username => $irc->nick, sub {
+			my $user = shift;
+			if ($user && $user->{feeds}) {
+				feeds_run($irc, \%opt, split(/,/, $user->{feeds}));
+			} else {
+				feeds_help($irc);
+			}
+		});
+	});
+}
 
-	if ($opt{add}) { return feeds_add($irc, @argv); }
-	if ($opt{search}) { return feeds_search($irc, @argv); }
+sub feeds_run {
+	my ($irc, $opt, @argv) = @_;
+
+	if ($opt->{add}) { return feeds_add($irc, @argv); }
+	if ($opt->{search}) { return feeds_search($irc, @argv); }
 
 	foreach my $f (@argv) {
 		$f = lc($f);
-		feeds_lookup($irc, $f, $opt{limit});
+		feeds_lookup($irc, $f, $opt->{limit});
 	}
 }
 
@@ -174,78 +224,62 @@ sub run {
 ################################################################################
 # Feeds object
 ################################################################################
-# Load feeds from database and store them in memory,
-# when list of feeds is requested check filestat of database
-# against last update time stored in our object
+# Load feeds from database and store them in memory, the list is read
+# again from the storage process (which has it cached) when it's asked for
 package Feeds;
 
 use strict;
 use warnings;
 
-use DBI;
-
 our %defaults = (
 	dbname => 'test.db',
-	dbuser => '',
-	dbpass => '',
 );
 
 sub new {
 	my $class = shift;
 	my %opt = @_;
+	my $schema = q|
+		CREATE TABLE IF NOT EXISTS feeds(
+			name text primary key not null,
+			title text default 'Untitled',
+			url text not null
+		)
+	|;
 
 	my $self = bless { 
-		last_update => 0,
-		dbname => $opt{path} || $defaults{dbname},
-		dbuser => $opt{user} || $defaults{dbuser},
-		dbpass => $opt{pass} || $defaults{dbpass},
+		feeds => {},
+		db => IRC::Database->new($opt{path} || $defaults{dbname}, schema => [$schema]),
 	}, $class;
 
-	$self->{dbh} = DBI->connect(
-		sprintf("dbi:SQLite:dbname=%s", $self->{dbname}),
-		$self->{dbuser}, $self->{dbpass}
-	);
-
-	# Create the table and update the database all in one swoop
-	return $self->_create_table()->update();
-}
-
-sub DESTROY {
-	my $self = shift;
-	if ($self->{dbh}) {
-		$self->{dbh}->disconnect();
-	}
+	return $self;
 }
 
+# Read the list of feeds again, $cb is called once it's in
 sub update {
-	my $self = shift;
-
-	# Check to see if we even need to do an update
-	my $mtime = (lstat($self->{dbname}))[9]; # 9 = mtime
-	if ($mtime > 0 && $mtime < $self->{last_update}) {
-		# No update needed, done!
-		return $self;
-	}
-
-	# Key field is the 'name' field
-	my $feeds = $self->{dbh}->selectall_hashref("select * from feeds", 'name');
-
-	if (!scalar(keys %$feeds)) {
-		warn "No feeds found in database, probably something went wrong, skipping update\n";
-		return $self;
-	}
-
-	# Load list of feeds into Feed objects but don't parse the content yet
-	foreach my $name (keys %$feeds) {
-		my $feed = $feeds->{$name};
-		$self->{feeds}->{$name} = Feed->new(
-			feed_name => $name,
-			source_url => $feed->{url}, 
-			dont_parse => 1
-		);
-	}
-	# Record that we've now updated our records
-	$self->{last_update} = time;
+	my ($self, $cb) = @_;
+
+	$self->{db}->select("select * from feeds", sub {
+		my ($rows, $err) = @_;
+		if ($err) {
+			warn "Couldn't read the feeds: $err\n";
+		} elsif (!@$rows) {
+			warn "No feeds found in database, probably something went wrong, skipping update\n";
+		} else {
+			# Load list of feeds into Feed objects but don't parse the content yet,
+			# the ones we have already stay unless their url changed
+			my %feeds;
+			foreach my $feed (@$rows) {
+				my $old = $self->{feeds}->{$feed->{name}};
+				$feeds{$feed->{name}} = $old && $old->url eq $feed->{url} ? $old : Feed->new(
+					feed_name => $feed->{name},
+					source_url => $feed->{url}, 
+					dont_parse => 1
+				);
+			}
+			$self->{feeds} = \%feeds;
+		}
+		$cb->($self);
+	});
 
 	return $self;
 }
@@ -267,11 +301,13 @@ sub get {
 
 # Return a feed's latest updates
 # '$name' name of the feed being looked up
+# '$cb' if given, fetch it without blocking and call $cb with ($feed, $err)
 sub get_latest {
 	my $self = shift;
 	my $name = shift;
+	my $cb = shift;
 
-	return $self->get($name)->update();
+	return $self->get($name)->update($cb);
 }
 
 # Return an array of feed names in the database
@@ -289,42 +325,32 @@ sub entries {
 # Add a feed to the database
 # name => name used to refer to feed
 # url => url used to refer to feed
+# $cb (last) is called with an error if the feed couldn't be fetched and parsed
 # NOTE this will overwrite existing feeds by the same name, in the database
 sub add {
 	my $self = shift;
+	my $cb = pop;
 	my %opt = @_;
 
 	if (!$opt{name} || !$opt{url}) {
 		die "Can't create new feed with no name or url\n";
 	}
 
-	my $feed = Feed->new(feed_name => $opt{name}, source_url => $opt{url});
+	my $feed = Feed->new(feed_name => $opt{name}, source_url => $opt{url}, dont_parse => 1);
+	$feed->update(sub {
+		my ($feed, $err) = @_;
+		return $cb->($err) if ($err);
 
-	# Update the database
-	my $sth = $self->{dbh}->prepare("replace into feeds (name, title, url) values(?, ?, ?)");
-	$sth->execute($feed->name, $feed->title, $feed->url);
+		# Update the database
+		$self->{db}->do("replace into feeds (name, title, url) values(?, ?, ?)", $feed->name, $feed->title, $feed->url, sub {
+			my (undef, $err) = @_;
+			return $cb->("Couldn't save $opt{name}: $err\n") if ($err);
 
-	# Update our in memory object
-	$self->{feeds}->{$feed->name} = {
-		name => $feed->name,
-		title => $feed->title,
-		url => $feed->url,
-	};
-
-	return $self;
-}
-
-sub _create_table {
-	my $self = shift;
-	my $schema = q|
-		CREATE TABLE IF NOT EXISTS feeds(
-			name text primary key not null,
-			title text default 'Untitled',
-			url text not null
-		)
-	|;
-
-	$self->{dbh}->do($schema);
+			# Update our in memory object
+			$self->{feeds}->{$feed->name} = $feed;
+			$cb->();
+		});
+	});
 
 	return $self;
 }
@@ -361,9 +387,29 @@ sub new {
 }
 
 # Re-parse feed for new updates
+# '$cb' if given, fetch it on the worker's event loop instead and call $cb with ($self, $err)
 sub update {
 	my $self = shift;
-	$self->{_document} = XML::Feed->parse(URI->new($self->{source_url}));
+	my $cb = shift;
+
+	if (!$cb) {
+		$self->{_document} = XML::Feed->parse(URI->new($self->{source_url}));
+		return $self;
+	}
+
+	mod_perl::modules::utils::http_get($self->{source_url}, cache => 300, sub {
+		my $res = shift;
+		if (!$res->is_success) {
+			return $cb->($self, "Couldn't retrieve $self->{feed_name}: ".$res->status_line."\n");
+		}
+		my $content = $res->decoded_content;
+		my $document = eval { XML::Feed->parse(\$content) };
+		if (!$document) {
+			return $cb->($self, "Couldn't parse $self->{feed_name}: ".($@ || XML::Feed->errstr)."\n");
+		}
+		$self->{_document} = $document;
+		$cb->($self);
+	});
 	return $self;
 }
 
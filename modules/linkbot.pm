@@ -1,8 +1,5 @@
 package mod_perl::modules::linkbot;
 
-use LWP::UserAgent;
-use LWP::MediaTypes qw(guess_media_type);
-use HTTP::Message;
 use HTML::TreeBuilder;
 use Time::Piece;
 
@@ -32,24 +29,40 @@ my $table_schema = qq(
 		`tinyurl` text DEFAULT NULL
 	)
 );
+# Word index of the titles and links for .link, it points at the rows of
+# the table instead of keeping its own copy and the triggers keep it up to
+# date. Prefixes of 2 and 3 characters are indexed too, or a short word
+# has to go through every word it starts
+my @index_schema = (
+	"CREATE INDEX IF NOT EXISTS ${table_name}_date ON $table_name (date)",
+	"CREATE VIRTUAL TABLE IF NOT EXISTS ${table_name}_fts USING fts5(title, link, content='$table_name', content_rowid='rowid', prefix='2 3')",
+	"CREATE TRIGGER IF NOT EXISTS ${table_name}_ai AFTER INSERT ON $table_name BEGIN
+		INSERT INTO ${table_name}_fts (rowid, title, link) VALUES (new.rowid, new.title, new.link);
+	END",
+	"CREATE TRIGGER IF NOT EXISTS ${table_name}_ad AFTER DELETE ON $table_name BEGIN
+		INSERT INTO ${table_name}_fts (${table_name}_fts, rowid, title, link) VALUES ('delete', old.rowid, old.title, old.link);
+	END",
+	"CREATE TRIGGER IF NOT EXISTS ${table_name}_au AFTER UPDATE ON $table_name BEGIN
+		INSERT INTO ${table_name}_fts (${table_name}_fts, rowid, title, link) VALUES ('delete', old.rowid, old.title, old.link);
+		INSERT INTO ${table_name}_fts (rowid, title, link) VALUES (new.rowid, new.title, new.link);
+	END",
+);
 my $links = Links->new(); # Links is a class defined within this file
 
-# Linkbot
-mod_perl::base::event_register('PRIVMSG', \&run);
+# Linkbot, the master only sends it lines with a link in them
+mod_perl::base::event_register('PRIVMSG', \&run, 'slow', contains => '://');
 
 # Recall past links
-mod_perl::base::command_register('link', \&link_handler);
-
-sub get_user_agent
-{
-	my $ua = LWP::UserAgent->new(
-		'timeout' => 120,
-		'max_redirect' => 8,
-		'max_size' => 5 * 1024 * 1024 * 1024,  # 5MB
-	);
-
-    return $ua;
-}
+mod_perl::base::command_register('link', \&link_handler, 'slow');
+
+# Options for our requests, they run on the worker's event loop (utils::http_request)
+my %http_options = (
+	'timeout' => 120,
+	'redirects' => 8,
+	'max_size' => 5 * 1024 * 1024,  # 5MB
+	# The same link tends to get pasted in several channels at once
+	'cache' => 600,
+);
 
 sub humanBytes {
     my $bytes = shift(@_);
@@ -63,59 +76,61 @@ sub humanBytes {
     return "$bytes$units[$unit_measure]";
 }
 
+# Calls $cb with ($title, $err) for $source
 sub get_title {
-	my ($source) = @_;
-
-    my $err = undef;
-    my $title = undef;
-
-    my $ua = get_user_agent();
-	my $r = $ua->head($source);
-    my $content_type = 'html'; 
-	if ($r->is_success) {
-		$content_type = $r->header('Content-Type') || $content_type;
-	} else {
-		$err = $r->status_line;
-	}
+	my ($source, $cb) = @_;
 
-	# Assume html if our head request failed
-	if ($content_type =~ /html/io) {
-		# We must perform a GET now to get the <title> and <h2> elements
-		my $parser = HTML::TreeBuilder->new;
-		my $doc;
-		$r = $ua->get($source);
+	mod_perl::modules::utils::http_head($source, %http_options, sub {
+		my $r = shift;
+		my $err = undef;
+		my $content_type = 'html';
 		if ($r->is_success) {
-			$doc = $parser->parse_content($r->decoded_content());
-			$err = undef; # ignore any HEAD request errors now
+			$content_type = $r->header('Content-Type') || $content_type;
 		} else {
 			$err = $r->status_line;
 		}
 
-		if (!$doc) {
-			print STDERR "linkbot: failed to retrieve webpage: $source $err\n";
-			return ($title, $err);
+		# Assume html if our head request failed, html and text need the page itself
+		if ($content_type !~ /html|text/io) {
+			return $cb->(make_title($source, $r, $content_type, undef, $err));
 		}
 
-		# Get title or first h2 element
-		if ( ($title = $doc->find('title')) ) {
-#			print STDERR "got title: ".$title->as_trimmed_text()." for uri: $source\n";
-#			print STDERR " decoded content was: ".substr($r->decoded_content(), 0, 4096)."\n";
-			$title = $title->as_trimmed_text();
-		} elsif ( ($title = $doc->find('h2')) ) {
-			$title = $title->as_trimmed_text();
-		} elsif ( ($title = $doc->find('h3')) ) {
-			$title = $title->as_trimmed_text();
-		} elsif ( ($title = $doc->find('h4')) ) {
-			$title = $title->as_trimmed_text();
-		}
-	} elsif ($content_type =~ /text/io) {
-		my $get = $ua->get($source);
-		if ($get->is_success) {
-			$title = $get->decoded_content;
-		} else {
-			$err = "text error:" . $get->status_line;
-		}
-	}
+		mod_perl::modules::utils::http_get($source, %http_options, sub {
+			my $get = shift;
+			my $title = undef;
+
+			if ($content_type =~ /html/io) {
+				# We must perform a GET now to get the <title> and <h2> elements
+				if (!$get->is_success) {
+					$err = $get->status_line;
+					print STDERR "linkbot: failed to retrieve webpage: $source $err\n";
+					return $cb->($title, $err);
+				}
+				$err = undef; # ignore any HEAD request errors now
+				my $doc = HTML::TreeBuilder->new->parse_content($get->decoded_content());
+
+				# Get title or first h2 element
+				foreach my $tag (qw(title h2 h3 h4)) {
+					if ( ($title = $doc->find($tag)) ) {
+						$title = $title->as_trimmed_text();
+						last;
+					}
+				}
+				$r = $get;
+			} elsif ($get->is_success) {
+				$title = $get->decoded_content;
+			} else {
+				$err = "text error:" . $get->status_line;
+			}
+
+			$cb->(make_title($source, $r, $content_type, $title, $err));
+		});
+	});
+}
+
+# Trim the title we found or make one up from the response, returns ($title, $err)
+sub make_title {
+	my ($source, $r, $content_type, $title, $err) = @_;
 
 	if ($title) {
 		$title = substr($title, 0, $line_limit);
@@ -140,57 +155,59 @@ sub make_threat_checker {
         key => '298aa0a47a9c4703103f0c9b2d7c0e8394485613',
         uri => 'http://api.urlvoid.com/api1000'
     };
-	my $ua = get_user_agent();
 	my $parser = XML::LibXML->new;
+	# Calls $cb with the host, colored by how much of a threat it is
 	return sub {
-		my ($uri) = @_;
+		my ($uri, $cb) = @_;
 		(my $host = $uri) =~ s/^\S+:\/\/(?:www)?\.?//;
 		$host =~ s/\/.*$//;
 		my $threat = $host;
 
 		if (!$mod_perl::config::conf{linkbot_threat_check}) {
-			return $host;
+			return $cb->($host);
 		}
 
 		my $query = sprintf("%s/%s/host/%s/", $api->{uri}, $api->{key}, $host);
 		#print STDERR "threatcheck query: $query\n";
-		my $req = $ua->get($query);
-		if (!$req->is_success()) {
-			print STDERR "threatcheck: [$query] failed to retrieve: ".$req->status_line."\n";
-			return $threat;
-		}
-
-		my $doc = $parser->load_xml(string => $req->content());
-		if (!$doc) {
-			print STDERR "threatcheck: parse failure: $!\n";
-			return $threat;
-		}
-
-		# Decide threat of a site based on alexa rank and google rank
-		# and if there are redirects and if the domain age 
-		my $grank = int("".$doc->getElementsByTagName('google_page_rank')->to_literal);
-		my $alexa = int("".$doc->getElementsByTagName('alexa_rank')->to_literal);
-		my $domain_age = int("".$doc->getElementsByTagName('domain_age')->to_literal);
-
-		my $rank = $grank + $alexa;
-		my $good_threshold = 1000;
-		my $bad_threshold = 5000;           
-		my $age_limit = 3 * 365*24*3600; # 3 years
-
-		if (($rank >= $bad_threshold || $rank < 1.0) && $domain_age < $age_limit) {
-			$threat = "\00304$host\003"; # Bad site
-		} elsif ($rank >= 1.0 && $rank <= $good_threshold) {
-			$threat = "\00309$host\003"; # Good site
-		} else {
-			$threat = "\00307$host\003"; # Warning, unknown, but older than 3 years
-		}
-
-		# Only append rank if its actualy above 0.0
-		if ($rank > 0.0) {
-			$threat .= ' rank:'.$rank;
-		}
-
-		return $threat;
+		mod_perl::modules::utils::http_get($query, %http_options, sub {
+			my $req = shift;
+			if (!$req->is_success()) {
+				print STDERR "threatcheck: [$query] failed to retrieve: ".$req->status_line."\n";
+				return $cb->($threat);
+			}
+
+			my $doc = $parser->load_xml(string => $req->content());
+			if (!$doc) {
+				print STDERR "threatcheck: parse failure: $!\n";
+				return $cb->($threat);
+			}
+
+			# Decide threat of a site based on alexa rank and google rank
+			# and if there are redirects and if the domain age 
+			my $grank = int("".$doc->getElementsByTagName('google_page_rank')->to_literal);
+			my $alexa = int("".$doc->getElementsByTagName('alexa_rank')->to_literal);
+			my $domain_age = int("".$doc->getElementsByTagName('domain_age')->to_literal);
+
+			my $rank = $grank + $alexa;
+			my $good_threshold = 1000;
+			my $bad_threshold = 5000;           
+			my $age_limit = 3 * 365*24*3600; # 3 years
+
+			if (($rank >= $bad_threshold || $rank < 1.0) && $domain_age < $age_limit) {
+				$threat = "\00304$host\003"; # Bad site
+			} elsif ($rank >= 1.0 && $rank <= $good_threshold) {
+				$threat = "\00309$host\003"; # Good site
+			} else {
+				$threat = "\00307$host\003"; # Warning, unknown, but older than 3 years
+			}
+
+			# Only append rank if its actualy above 0.0
+			if ($rank > 0.0) {
+				$threat .= ' rank:'.$rank;
+			}
+
+			$cb->($threat);
+		});
 	};
 }
 
@@ -230,6 +247,7 @@ sub run
 {
     my $irc = shift;
     my $text = $irc->text;
+    my $reply;
 
 	# Check if we should ignore this line due to an exemption
 	if ($is_exempt->($irc)) {
@@ -247,103 +265,177 @@ sub run
             next;
         }
 
-        my ($title, $err) = get_title($uri);
-        if ($err) {
-            print STDERR "Failed to retrieve $uri: $err\n";
-			$links->insert(title => "Failed to retrieve $err", tinyurl => "", link => $uri);
-            next;
-        }
-        my $threat = $threat_check->($uri);
-        my $tinyurl = mod_perl::modules::utils::tinyurl($uri);
-		# Add link to database
-		$links->insert(title => $title, tinyurl => $tinyurl, link => $uri);
-        $irc->say(" $tinyurl :: $threat :: $title ");
+        # The lookups finish after we return, answer them on a copy of the event
+        $reply ||= $irc->defer;
+        get_title($uri, sub {
+            my ($title, $err) = @_;
+            if ($err) {
+                print STDERR "Failed to retrieve $uri: $err\n";
+                $links->insert(title => "Failed to retrieve $err", tinyurl => "", link => $uri);
+                return;
+            }
+            $threat_check->($uri, sub {
+                my $threat = shift;
+                mod_perl::modules::utils::tinyurl($uri, sub {
+                    my $tinyurl = shift;
+                    # Add link to database
+                    $links->insert(title => $title, tinyurl => $tinyurl, link => $uri);
+                    $reply->say(" $tinyurl :: $threat :: $title ");
+                });
+            });
+        });
     }
 }
 
+sub link_help {
+	my $irc = shift;
+	$irc->say("usage: .link [--date|-d <YYYY-MM-DD>] [--days|-n <days>] [words]");
+	$irc->say("Recall the last links whose title or link has every word (or a word starting with it)");
+	$irc->say("--date looks at the days from that date on (5 unless --days says), --days alone at the last days");
+}
+
 #
 # Recall links from the database
 sub link_handler {
 	my ($irc, $arg_string) = @_;
 	my $max_results = 5;
-
-	# Allow searching links by title or link itself
-	# Allow retrieving (up to) last 5 links seen
-	# Allow looking up links by date posted
-	my $res = $links->search(title => $arg_string, link => $arg_string, tinyurl => $arg_string);
-	for (my $i = 0; $i < @$res && $i < $max_results; ++$i) {
-		my $data = $res->[$i];
-		my $t = localtime($data->{date});
-		$irc->say(sprintf("\00311[%02d]\003 (%s) %s \00311::\003 %s", $i + 1, 
-			$t->strftime("%m/%d/%Y"), 
-			$data->{title}, 
-			$data->{link}
-		));
+	my %opt;
+
+	my ($ret, @argv) = mod_perl::commands::handle_arg(\%opt, $irc, \&link_help, $arg_string // '', qw(date|d=s days|n=i help|h));
+	return if (!$ret);
+	my %search = (match => join(' ', @argv), limit => $max_results);
+	if (defined($opt{date})) {
+		my $t = eval { localtime->strptime($opt{date}, "%Y-%m-%d") };
+		return $irc->say("Bad date '$opt{date}', it goes YYYY-MM-DD") if (!$t);
+		$search{start_date} = $t->epoch;
+	}
+	if (defined($opt{days})) {
+		return $irc->say("--days has to be more than 0") if ($opt{days} <= 0);
+		$search{interval} = $opt{days} * 24 * 3600;
 	}
+
+	# The results come in after we return, answer on a copy of the event
+	$irc = $irc->defer;
+	$links->search(%search, sub {
+		my ($res, $err) = @_;
+		if ($err) {
+			print STDERR "linkbot: link search failed: $err\n";
+			return;
+		}
+		for (my $i = 0; $i < @$res && $i < $max_results; ++$i) {
+			my $data = $res->[$i];
+			my $t = localtime($data->{date});
+			$irc->say(sprintf("\00311[%02d]\003 (%s) %s \00311::\003 %s", $i + 1, 
+				$t->strftime("%m/%d/%Y"), 
+				$data->{title}, 
+				$data->{link}
+			));
+		}
+	});
 }
 
 1;
 
 package Links;
 
-use DBI;
-
+# The storage process has the database, the link table is made on first use
 sub new {
 	my ($class) = shift;
 	my %opt = @_;
 	my $self = { 
 		%opt,
-		dbh => undef,
+		db => IRC::Database->new($mod_perl::config::module_db, schema => [$table_schema, @index_schema]),
+		indexed => 0,
 	};
 	bless $self, $class;
-	$self->_create_table();
 
 	return $self;
 }
 
-sub DESTROY {
+# Links from before the index existed are indexed in the background, the
+# newest first and a chunk per query so the storage process keeps answering
+# everyone else. Each worker starts on its first query, the chunks all go
+# through the storage process one at a time so none is indexed twice. The
+# index goes by rowid, a VACUUM can renumber them, rebuild it after one:
+#   INSERT INTO links_fts (links_fts) VALUES ('rebuild')
+my $index_chunk = 1000;
+sub update_index {
+	my $self = shift;
+	return if ($self->{indexed} == $$);
+	$self->{indexed} = $$;
+	$self->index_chunk();
+}
+
+sub index_chunk {
 	my $self = shift;
-	if ($self->{dbh}) {
-		$self->{dbh}->disconnect();
+	my $query = "insert into ${table_name}_fts (rowid, title, link)
+		select rowid, title, link from $table_name
+		where rowid < (select coalesce(min(id), 9223372036854775807) from ${table_name}_fts_docsize)
+		order by rowid desc limit ?";
+	$self->{db}->do($query, $index_chunk, sub {
+		my ($changes, $err) = @_;
+		return print STDERR "linkbot: indexing old links failed: $err\n" if (defined($err));
+		$self->index_chunk() if ($changes >= $index_chunk);
+	});
+}
+
+# Words for the index: all of them, each one a word or the start of one.
+# Single letters are whole words, every word starts with one, and
+# punctuation alone isn't in the index at all
+sub match_query {
+	my $text = shift;
+	my @words;
+	foreach my $word (split(/\s+/, $text // '')) {
+		next if ($word !~ /\w/);
+		$word =~ s/"/""/g;
+		push(@words, length($word) > 1 ? qq("$word"*) : qq("$word"));
 	}
+	return join(' AND ', @words);
 }
 
 # Search the links table for links by passing
-# search criteria as a hashref. Start date and interval can also be passed to
-# limit the search to that day
-# 'title' => search the title of links
-# 'link' => search the link text itself
-# 'tinyurl' => search the tiny url for this link itself (this is not very useful) 
+# search criteria as a hash, and $cb (last) which gets the rows and an error.
+# Newest links come first
+# 'match' => words the title or the link has (or has a word starting with), all of them
+# 'start_date' => search forward by 'interval' or 5 days, starting at this date (UNIX time)
+# 'interval' => search forward by this interval (seconds) if used with start_date, or search backward from now, if no start_date
 # 'limit' => limit the search results to this many, defaults to 10 if unset, unlimited results NOT supported
-# TODO more granular search options not yet implemented:
-# 'start_date' => search forward by 'interval' or 5 days, starting at this date
-# 'interval' => search forward by this interval  if used with start_date, or search backward from today, if no start_date
 sub search {
+	my $cb = pop;
 	my ($self, %pattern) = @_;
 	$pattern{limit} ||= 10;
-	my $query_template = "select {{columns}} from {{table_name}} {{where_clause}} {{order_by}}";
-	my $data = { 
-		sort_column => 'date',
-		columns => '*',
-		table_name => $table_name 
-	};
-	my @tmp;
-	my @bindings;
-	foreach my $type (qw(title link tinyurl)) {
-		if (exists($pattern{$type})) {
-			push(@tmp, sprintf("%s like ?", $type));
-			push(@bindings, $pattern{$type} ? "%" . $pattern{$type} . "%" : "%");
-		}
+	my $match = match_query($pattern{match});
+	my @range;
+	if ($pattern{start_date}) {
+		@range = ($pattern{start_date}, $pattern{start_date} + ($pattern{interval} || 5 * 24 * 3600));
+	} elsif ($pattern{interval}) {
+		@range = (time - $pattern{interval}, time + 1);
+	}
+	$self->update_index();
+
+	# Without words the date index has them in order
+	if (!$match) {
+		my $where = @range ? 'where date >= ? and date < ?' : '';
+		return $self->{db}->select("select * from $table_name $where order by date desc limit ?", @range, $pattern{limit}, $cb);
 	}
-	$data->{where_clause} = @tmp ? 'where ' . join(" OR ", @tmp) : '';
-	$data->{order_by} = sprintf('order by %s desc limit %d', $data->{sort_column}, $pattern{limit});
 
-	(my $query = $query_template) =~ s/\{\{(\S+)}}/$data->{$1}/eg;
+	# Links go in as they're seen, so their rowids go with their dates: the
+	# index only looks at the rowids between the range's first and last
+	# link and stops at the first 'limit' matches going back from the newest
+	my $fts = "${table_name}_fts";
+	my $where = "$fts match ?";
+	my @bindings = ($match);
+	if (@range) {
+		$where .= " and $fts.rowid between
+			(select rowid from $table_name where date >= ? order by date limit 1) and
+			(select rowid from $table_name where date < ? order by date desc limit 1)
+			and $table_name.date >= ? and $table_name.date < ?";
+		push(@bindings, @range, @range);
+	}
+	my $query = "select * from (select $table_name.* from $fts join $table_name on $table_name.rowid = $fts.rowid
+		where $where order by $fts.rowid desc limit ?) order by date desc";
 #	print STDERR "linkdb query: [$query] bindings: [".join(", ", @bindings)."\n";
-	my $ref = $self->{dbh}->selectall_arrayref($query, { Slice => {} }, @bindings);
-#	use Data::Dumper;
-#	print STDERR Dumper($ref);
-	return $ref;
+	return $self->{db}->select($query, @bindings, $pattern{limit}, $cb);
 }
 
 # Insert a record into the links table
@@ -351,9 +443,12 @@ sub search {
 # 'link' => link itself (the url)
 # 'title' => title of link
 # 'tinyurl' => tiny url generated for this link
+# A link that's already there keeps its row, unless that only says we
+# failed to retrieve it (no tinyurl), then this one takes its place.
+# It's written with other workers' writes, failures only show in the log
 sub insert {
 	my ($self, %opt) = @_;
-	my $query_template = "insert into %s (%s) values (%s)";
+	my $query_template = "insert into %s (%s) values (%s) on conflict (link) do update set %s where %s.tinyurl = ''";
 	my @cols;
 	my @bindings;
 	$opt{date} ||= time;
@@ -365,23 +460,12 @@ sub insert {
 	}
 
 	my $query = sprintf($query_template, 
-		$table_name, join(", ", @cols), join(", ", map { "?" } @cols)
+		$table_name, join(", ", @cols), join(", ", map { "?" } @cols),
+		join(", ", map { "$_ = excluded.$_" } grep { $_ ne 'link' } @cols), $table_name
 	);
 #	print STDERR "linkdb insert query: [$query]\n";
-	$self->{dbh}->do($query, {}, @bindings);
-}
-
-# Create link table if it doesn't exist already
-sub _create_table {
-	my $self = shift;
-	if (!$self->{dbh}) {
-		$self->{dbh}  = DBI->connect(
-			sprintf("dbi:SQLite:dbname=%s", $mod_perl::config::module_db),
-			'', ''
-		);
-	}
-#	print STDERR "creating table $table_schema\n";
-	$self->{dbh}->do($table_schema);
+	$self->update_index();
+	$self->{db}->do($query, @bindings);
 }
 
 1;
@@ -4,18 +4,17 @@ use warnings;
 
 use mod_perl::commands;
 
-use IPC::Shareable;
-
 # Table of sources and destinations
 # source => [ 'destination', 'destination', .... ]
-my %logchan_routes;
-
-tie %logchan_routes, 'IPC::Shareable', 'logchan', {
-    exclusive => 0, destroy => 1, create => 1
-};
-
-# Handler to listen for routable messages and route them as appropriate
-mod_perl::commands::register_handler('PRIVMSG', \&logchan_handler);
+# The store keeps its sources in the 'logchan' set
+my $routes = IRC::Store->new('logchan', match => 'logchan');
+# A master that started over from its snapshot doesn't know them yet
+$routes->announce();
+mod_perl::commands::register_post_fork(sub { $routes->announce(); });
+
+# Handler to listen for routable messages and route them as appropriate,
+# the master only sends it the sources in the 'logchan' set
+mod_perl::commands::register_handler('PRIVMSG', \&logchan_handler, undef, source_in => 'logchan');
 # Command to add/remove routes (turn on/off channel logging to another channel)
 mod_perl::commands::register_command('logchan', \&logchan);
 
@@ -24,7 +23,7 @@ sub logchan_handler {
 
 	my $source = $irc->servername . ":" . $irc->target;
 #	print STDERR "checking routes for $source\n";
-	my $entries = $logchan_routes{$source};
+	my $entries = $routes->get($source);
 	if ($entries && @$entries) {
 		foreach my $dest (@$entries) {
 			my ($server, $target) = split(/:/, $dest, 2);
@@ -58,22 +57,20 @@ sub logchan {
 		$source = $irc->servername . ":" . $source;
 	}
 
-	if (!exists($logchan_routes{$source})) {
-		$logchan_routes{$source} = [];
-	}
-	my $entries = $logchan_routes{$source};
 	# Entry exists already, so delete it instead of adding anything
-	for (my $count = @$entries - 1; $count >= 0; --$count) {
-		if ($entries->[$count] eq $dest) {
-			splice(@$entries, $count, 1);
-			$irc->say("Deleted destination $dest for source $source");
-			return;
-		}
+	my $deleted;
+	$routes->update($source, sub {
+		my @entries = @{shift || []};
+		$deleted = grep { $_ eq $dest } @entries;
+		@entries = $deleted ? grep { $_ ne $dest } @entries : (@entries, $dest);
+		return @entries ? \@entries : undef;
+	});
+
+	if ($deleted) {
+		$irc->say("Deleted destination $dest for source $source");
+	} else {
+		$irc->say("Added destination $dest for source $source");
 	}
-
-	# Otherwise just add the entry
-	push(@{$logchan_routes{$source}}, $dest);
-	$irc->say("Added destination $dest for source $source");
 }
 
 
@@ -3,7 +3,6 @@ package mod_perl::modules::pollster;
 use mod_perl::commands;
 use mod_perl::modules::utils;
 
-use LWP::UserAgent;
 use JSON::XS;
 use Date::Format;
 use Date::Parse;
@@ -15,8 +14,8 @@ my $date_format = '%Y-%m-%d %H:%M:%S %z';
 #####################################
 # (INIT) Run when the module is first included
 #####################################
-mod_perl::commands::register_command('polls', \&run);
-mod_perl::commands::register_command('poll', \&run);
+mod_perl::commands::register_command('polls', \&run, 'slow');
+mod_perl::commands::register_command('poll', \&run, 'slow');
 
 
 #####################################
@@ -47,27 +46,30 @@ sub pretty_time {
 }
 
 
+# Calls $cb with ($json, $err)
 sub api_call {
-	my ($query, %opt) = @_;
+	my ($query, $cb) = @_;
 	my $call = sprintf("%s/%s", $pollster_api_base_url, $query);
 
-	my $ua = LWP::UserAgent->new();
-	my $res = $ua->get($call);
+	mod_perl::modules::utils::http_get($call, cache => 300, sub {
+		my $res = shift;
+		if (!$res->is_success) {
+			return $cb->(undef, $res->status_line."\n");
+		}
 
-	my $json;
-	if ($res->is_success) {
 		# Croaks on error
-		$json = decode_json($res->decoded_content);
-	} else {
-		die $res->status_line;
-	}
+		my $json = eval { decode_json($res->decoded_content) };
+		return $cb->(undef, $@) if (!$json);
 
 #use Data::Dumper;
-#	print STDERR Dumper($json), "\n";
-	return $json;
+#		print STDERR Dumper($json), "\n";
+		$cb->($json);
+	});
 }
 
+# Calls $cb with ($data, $err)
 sub list_objects {
+	my $cb = pop;
 	my ($type, %args) = @_;
 
 	my %type_map = (
@@ -82,34 +84,46 @@ sub list_objects {
 		}
 	);
 
-	my $data;
-
 	if ($type_map{$type}) {
-		$data = $type_map{$type}->(%args);
-	} else {
-		my $query = $type =~ /(chart|topic)/ ? 'charts.json' : 'polls.json?sort=updated';
-		my $json = api_call($query);
+		return $cb->($type_map{$type}->(%args));
+	}
+
+	my $query = $type =~ /(chart|topic)/ ? 'charts.json' : 'polls.json?sort=updated';
+	api_call($query, sub {
+		my ($json, $err) = @_;
+		return $cb->(undef, $err) if ($err);
 
 		# Map the data to an arrayref, rename index names correctly
 		my %alias_map = ( 'chart' => 'slug', 'poll' => 'pollster' );
+		my $data;
 		foreach my $entry (@$json) {
 			my $name = $entry->{$alias_map{$type} || $type};
 			next if (!$name);
 			$data->{$name} = 1;
 		}
-	}
-
-	return $data;
+		$cb->($data);
+	});
 }
 
+# Calls $cb with ($err, @chart_lines)
 sub chart {
-	my ($slug) = @_;
+	my ($slug, $cb) = @_;
+
+	api_call(join('', 'charts/', $slug, ".json"), sub {
+		my ($json, $err) = @_;
+		return $cb->($err) if ($err);
+		my @lines = eval { chart_lines($slug, $json) };
+		$cb->($@, @lines);
+	});
+}
+
+sub chart_lines {
+	my ($slug, $json) = @_;
 	# These are IRC colors (will be used sequentially)
 	my @colors = (8, 11, 3, 12, 4, 13, 2);
 	# Display width of the chart 
 	my $display_width = 40;
 
-	my $json = api_call(join('', 'charts/', $slug, ".json"));
 	my @estimates = @{$json->{estimates}};
 
 	# If there were no current estimates, try to get the first previous estimate
@@ -168,14 +182,19 @@ sub run {
 		return;
 	}
 
-	eval {
-		# If we were asked for a list, get it and return, we're done.
-		if ($opt{list}) {
-			# There are shit ton of charts, so let's make sure
-			# we only get charts for the current year.
-			my $current_year = (localtime())[5] + 1900;
+	# Our api calls finish after we return, answer on a copy of the event
+	$irc = $irc->defer;
+	my $error = sub { my $err = shift; chomp($err); $irc->say($err); };
+
+	# If we were asked for a list, get it and return, we're done.
+	if ($opt{list}) {
+		# There are shit ton of charts, so let's make sure
+		# we only get charts for the current year.
+		my $current_year = (localtime())[5] + 1900;
 
-			my $data = list_objects($opt{list});
+		list_objects($opt{list}, sub {
+			my ($data, $err) = @_;
+			return $error->($err) if ($err);
 			my @results = sort keys %$data;
 			my $output = "$opt{list}s: ".join(", ", @results);
 
@@ -183,24 +202,28 @@ sub run {
 			my @lines = $output =~ /.{$output_limit}/g;
 			if (@lines >= 3) {
 				$output = join("\n", @results), "\n";
-				$irc->say(mod_perl::modules::utils::upload_content($output));
+				mod_perl::modules::utils::upload_content($output, sub {
+					my $url = shift;
+					$irc->say($url) if ($url);
+				});
 				return;
 			}
 
 			$irc->say($_) foreach (@lines);
-			return;
-		}
+		});
+		return;
+	}
 
 
-		# At this point they shouldn't be missing an argument
-		if (!@argv) { return $irc->say("Please enter an object name."); }
+	# At this point they shouldn't be missing an argument
+	if (!@argv) { return $irc->say("Please enter an object name."); }
 
-		# Get the requested object and visualize it
-		my @lines = chart($argv[0]);
+	# Get the requested object and visualize it
+	chart($argv[0], sub {
+		my ($err, @lines) = @_;
+		return $error->($err) if ($err);
 		$irc->say($_) foreach (@lines);
-	};
-
-	if ($@) { chomp($@); $irc->say($@); }
+	});
 }
 
 1;
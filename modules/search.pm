@@ -2,11 +2,11 @@ package mod_perl::modules::search;
 
 use mod_perl::commands;
 use mod_perl::config;
+use mod_perl::modules::utils;
 use strict;
 use warnings;
 
 #use lib '/home/dead/perl5/lib/perl5';
-use LWP::UserAgent;
 use JSON::XS;
 use URI::Escape;
 use Encode;
@@ -21,9 +21,9 @@ my $google_api = $mod_perl::config::conf{google_api_url} ||
 my $ddg_api = $mod_perl::config::conf{ddg_api_url} ||
 'https://api.duckduckgo.com/?no_html=1&format=json&q=';
 
-mod_perl::commands::register_command('g', \&google_run);
-mod_perl::commands::register_command('google', \&google_run);
-mod_perl::commands::register_command('ddg', \&ddg_run);
+mod_perl::commands::register_command('g', \&google_run, 'slow');
+mod_perl::commands::register_command('google', \&google_run, 'slow');
+mod_perl::commands::register_command('ddg', \&ddg_run, 'slow');
 
 sub google_help {
 	my $irc = shift;
@@ -41,11 +41,11 @@ sub ddg_help {
 
 sub lookup {
     my ($irc, $api_url, $query) = @_;
-    my $ua = LWP::UserAgent->new;
-    my $req = $ua->get($api_url . uri_escape($query));
+    my $reply = $irc->defer;
+    mod_perl::modules::utils::http_get($api_url . uri_escape($query), cache => 3600, sub {
+        my $req = shift;
+        return if (!$req->is_success);
 
-    if ($req->is_success) {
-        my $content = $req->decoded_content;
         # Must ensure the data is encoded as utf-8 
         my $json = decode_json(encode('utf-8', $req->decoded_content));
 		print STDERR Dumper($json), "\n";
@@ -57,27 +57,33 @@ sub lookup {
 
         return if (!@results);
 
-        $irc->say(sprintf("[%s] results: %s took %.2fms", $query, $resultCount, $searchTime));
+        $reply->say(sprintf("[%s] results: %s took %.2fms", $query, $resultCount, $searchTime));
         foreach my $result (@results[0..5]) {
             my $title = decode_entities($result->{titleNoFormatting} || '');
             my $url = uri_unescape($result->{url} || '');
             next if (!$title || !$url);
-            $irc->say("$title :: $url");
+            $reply->say("$title :: $url");
         }
-    } 
+    });
 }
 
 sub ddg_lookup {
 	my ($irc, $api_url, $query) = @_;
 
-	my $ua = LWP::UserAgent->new;
-	my $req = $ua->get($api_url . uri_escape($query));
-	if (!$req->is_success) {
-		print STDERR $api_url.uri_escape($query).": ".$req->status_line."\n";
-		return;
-	}
+	# Answer on a copy of the event, the request finishes after we return
+	my $reply = $irc->defer;
+	mod_perl::modules::utils::http_get($api_url . uri_escape($query), cache => 3600, sub {
+		my $req = shift;
+		if (!$req->is_success) {
+			print STDERR $api_url.uri_escape($query).": ".$req->status_line."\n";
+			return;
+		}
+		ddg_answer($reply, decode_json($req->content));
+	});
+}
 
-	my $json = decode_json($req->content);
+sub ddg_answer {
+	my ($irc, $json) = @_;
 	my ($summary, $url, $source, $results);
 	if ($json->{AbstractText}) {
 		$summary = $json->{AbstractText};
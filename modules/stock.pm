@@ -1,17 +1,16 @@
 package mod_perl::modules::stock;
 use mod_perl::commands;
+use mod_perl::modules::utils;
 
 use JSON::XS;
-use LWP::UserAgent;
 use URI::Escape;
 
-our $UserAgent;
 my $api_base = 'https://query.yahooapis.com/v1/public/yql?q=';
 my $symbol_api_base = "http://autoc.finance.yahoo.com/autoc?query=";
 
 
 # Register our stock command
-mod_perl::commands::register_command('stock', \&run);
+mod_perl::commands::register_command('stock', \&run, 'slow');
 
 sub stock_help {
 	my $irc = shift;
@@ -21,23 +20,19 @@ sub stock_help {
 	return;
 }
 
+# Calls $cb with the decoded json if we got any
 sub yql_query {
-	my ($msg, $source) = @_;
-
-	if (!$UserAgent) {
-		$UserAgent = LWP::UserAgent->new;
-	}
-	my $r = $UserAgent->get($source);
-
-	my $json = undef;
-	if ($r->is_success) {
-		my $content = $r->decoded_content;
-		$json = decode_json $content;
-	} else {
-		$msg->say("[error] Couldn't retrieve '$source': ".$r->status_line);
-	}
-
-	return $json;
+	my ($msg, $source, $cb) = @_;
+
+	mod_perl::modules::utils::http_get($source, cache => 60, sub {
+		my $r = shift;
+		if ($r->is_success) {
+			my $content = $r->decoded_content;
+			$cb->(decode_json $content);
+		} else {
+			$msg->say("[error] Couldn't retrieve '$source': ".$r->status_line);
+		}
+	});
 }
 
 sub symbol_lookup {
@@ -45,12 +40,13 @@ sub symbol_lookup {
 	my $api_query = uri_escape(join(" ",@search));
 	my $api_params = "&region=US&lang=en";
 
-	my $json = yql_query($msg,join('',$symbol_api_base,$api_query,$api_params));
-	return if !$json;
-	my $results = $json->{ResultSet}->{Result};
-	foreach my $s (@$results) {
-		$msg->say(sprintf("%-10s %30s %20s", $s->{symbol}, $s->{name}, $s->{exchDisp}));
-	}
+	yql_query($msg,join('',$symbol_api_base,$api_query,$api_params), sub {
+		my $json = shift;
+		my $results = $json->{ResultSet}->{Result};
+		foreach my $s (@$results) {
+			$msg->say(sprintf("%-10s %30s %20s", $s->{symbol}, $s->{name}, $s->{exchDisp}));
+		}
+	});
 }
 
 
@@ -110,6 +106,8 @@ sub run {
     my ($ret, @argv) = mod_perl::commands::handle_arg(\%opt, $msg, \&stock_help, $arg, qw(lookup|l help|h));
     return if (!$ret);
 
+	# Our queries finish after we return, answer on a copy of the event
+	$msg = $msg->defer;
 	if ($opt{lookup}) {
 		symbol_lookup($msg, @argv);
 		return;
@@ -118,8 +116,11 @@ sub run {
 	my $symbols = join(', ', map { $_=uc("\"$_\""); } @argv);
 	my $api_query = uri_escape("select * from yahoo.finance.quotes where symbol in ($symbols)");
 	my $api_params = "&format=json&env=store://datatables.org/alltableswithkeys";
-	my $json = yql_query($msg, join('',$api_base,$api_query,$api_params));
-	return if !$json;
+	yql_query($msg, join('',$api_base,$api_query,$api_params), sub { quotes($msg, shift); });
+}
+
+sub quotes {
+	my ($msg, $json) = @_;
 
 	# Report info for each symbol requested
 	my $results = $json->{query}->{results}->{quote};
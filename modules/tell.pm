@@ -4,14 +4,14 @@ use warnings;
 
 use mod_perl::commands;
 
-use IPC::Shareable;
-
-my %messages;
-tie %messages, 'IPC::Shareable', 'tell', {
-    exclusive => 0, destroy => 1, create => 1
-};
+# Messages waiting for each nick, the master only sends the handler
+# nicks that have some (the store keeps its keys in the 'tell' set)
+my $messages = IRC::Store->new('tell', match => 'tell');
+# A master that started over from its snapshot doesn't know them yet
+$messages->announce();
+mod_perl::commands::register_post_fork(sub { $messages->announce(); });
 # Tell handler
-mod_perl::commands::register_handler('PRIVMSG', \&tell_handler);
+mod_perl::commands::register_handler('PRIVMSG', \&tell_handler, undef, nick_in => 'tell');
 # Tell command
 mod_perl::commands::register_command('tell', \&tell);
 
@@ -19,7 +19,8 @@ sub tell_handler {
     my ($irc) = @_;
     my $ident = lc($irc->nick);
 
-    if (my $data = $messages{$ident}) {
+    # Taken out in one go, so no other worker shows them too
+    if (my $data = $messages->delete($ident)) {
         foreach my $message (@$data) {
             my $timestamp = "" . gmtime($message->{time});
             $irc->say(sprintf("%s: %s <%s> %s",
@@ -27,8 +28,6 @@ sub tell_handler {
                 )
             );
         }
-        # Delete their messages now
-        delete $messages{$ident};
     }
 }
 
@@ -40,8 +39,11 @@ sub tell {
     my $from = $irc->nick();
 
     # Add message to the queue
-    $messages{$ident} ||= [];
-    push(@{$messages{$to}}, {'time' => time, from => $irc->nick, message => $message});
+    $messages->update($ident, sub {
+        my $queue = shift || [];
+        push(@$queue, {'time' => time, from => $from, message => $message});
+        return $queue;
+    });
 
 
     my @responses = (
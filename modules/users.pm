@@ -7,7 +7,7 @@ use warnings;
 
 use JSON::XS;
 
-my $UsersDB = Users->get_instance(file => "$mod_perl::config::conf_dir/users.tct");
+my $UsersDB = Users->get_instance(path => $mod_perl::config::module_db, import => "$mod_perl::config::conf_dir/users.tct");
 mod_perl::commands::register_command('users', \&main);
 mod_perl::commands::register_command('user', \&main);
 
@@ -33,41 +33,51 @@ sub main {
     my ($ret, @argv) = mod_perl::commands::handle_arg(\%opt, $irc, \&users_help, $arg, qw(list|l add|a=s help|h del|d=s set|s=s));
     return if (!$ret);
 
+	# The database answers after we return, reply on a copy of the event
+	$irc = $irc->defer;
+
 	if ($opt{list}) {
 		my $search = $argv[0];
-		$irc->say("Users: ".join(", ", $UsersDB->list($search)));
+		$UsersDB->list($search, sub {
+			my ($users, $err) = @_;
+			$irc->say($err ? "Error listing users: $err" : "Users: ".join(", ", @$users));
+		});
 		return;
 	}
 
 	if ($opt{add}) { 
-		if (!$UsersDB->add(username => $opt{add})) {
-			$irc->say("Error adding user $opt{add}");
-		}
+		$UsersDB->add(username => $opt{add}, sub {
+			my (undef, $err) = @_;
+			$irc->say("Error adding user $opt{add}") if ($err);
+		});
 		return;
 	}
 
 	if ($opt{del}) { 
-		if (!$UsersDB->del(username => $opt{del})) {
-			$irc->say("Error deleting user $opt{del}");
-		}
+		$UsersDB->del(username => $opt{del}, sub {
+			my (undef, $err) = @_;
+			$irc->say("Error deleting user $opt{del}") if ($err);
+		});
 		return;
 	}
 
 	if ($opt{set} && @argv) { 
 		my $username = $irc->nick();
-		my $user = $UsersDB->update(username => $username, "$opt{set}" => $argv[0]);
-		if (!$user) {
-			$irc->say("Error updating user setting: $opt{set}!");
-		}
+		$UsersDB->update(username => $username, "$opt{set}" => $argv[0], sub {
+			my (undef, $err) = @_;
+			$irc->say("Error updating user setting: $opt{set}!") if ($err);
+		});
 		return;
 	}
 
 	# Print out user settings
 	foreach my $username (@argv) {
-		my $user = $UsersDB->get(username => $username);
-		next if (!$user);
-		delete($user->{password});
-		$irc->say("User $username: " . encode_json($user));
+		$UsersDB->get(username => $username, sub {
+			my $user = shift;
+			return if (!$user);
+			delete($user->{password});
+			$irc->say("User $username: " . encode_json($user));
+		});
 	}
 }
 
@@ -78,140 +88,138 @@ package Users;
 use strict;
 use warnings;
 
-use TokyoCabinet;
+use JSON::XS;
 
-our $db_file = "$mod_perl::config::conf_dir/users.tct";
 our $db_ref;
 
+# Every method takes a callback last, it gets the result and an error
 sub get_instance {
 	my $class = shift;
 	my %opt = @_;
 
 	if (!$Users::db_ref) {
-		$Users::db_ref = bless {}, $class;
-		$Users::db_ref->initdb($opt{file});
+		# A user's settings are a JSON object in 'data'
+		my $schema = q|
+			CREATE TABLE IF NOT EXISTS users(
+				username text primary key not null,
+				data text not null
+			)
+		|;
+		$Users::db_ref = bless {
+			db => IRC::Database->new($opt{path}, schema => [$schema]),
+		}, $class;
+		$Users::db_ref->load_tct($opt{import}) if ($opt{import} && -e $opt{import});
 	}
 
 	return $Users::db_ref;
 }
 
-sub initdb {
+# Users used to live in a TokyoCabinet table, read what's there so the
+# first query copies them over (the file is renamed once that's done)
+sub load_tct {
 	my ($self, $dbfile) = @_;
-	return if ($self->{tdb});
-
-	$self->{dbfile} = $dbfile;
-
-	if (!-e $dbfile) {
-		my $tdb = TokyoCabinet::TDB->new();
-		if (!$tdb->open($dbfile, $tdb->OWRITER | $tdb->OCREAT)) {
-			my $ecode = $tdb->ecode();
-			printf STDERR ("Error opening userdb %s+wc: %s\n", $dbfile, $tdb->errmsg($ecode));
-			return;
-		}
-		$tdb->close();
-	} 
-}
 
-# Get a write handle to the database
-sub opendb {
-	my ($self, $mode) = @_;
+	if (!eval { require TokyoCabinet; 1 }) {
+		print STDERR "Can't import $dbfile without TokyoCabinet\n";
+		return;
+	}
 	my $tdb = TokyoCabinet::TDB->new();
-	my $dbfile = $self->{dbfile};
-
-	$mode ||= "r";
-	my $dbmode = $mode eq "w" ? $tdb->OWRITER | $tdb->OCREAT : $tdb->OREADER;
-	if (!$tdb->open($dbfile, $dbmode)) {
-		my $ecode = $tdb->ecode();
-		printf STDERR ("Error opening userdb %s+%s: %s\n", $dbfile, $mode, $tdb->errmsg($ecode));
+	if (!$tdb->open($dbfile, $tdb->OREADER)) {
+		printf STDERR ("Error opening userdb %s: %s\n", $dbfile, $tdb->errmsg($tdb->ecode()));
 		return;
 	}
-	return $tdb;
+	$tdb->iterinit();
+	while (defined(my $username = $tdb->iternext())) {
+		push(@{$self->{import}}, [$username, encode_json($tdb->get($username) || {})]);
+	}
+	$tdb->close();
+	$self->{import_file} = $dbfile;
+}
+
+# Send the imported users ahead of our first query, workers doing it too only get ignored
+sub prepare {
+	my $self = shift;
+	my $import = delete($self->{import}) or return;
+	my $file = $self->{import_file};
+	my $left = @$import;
+
+	foreach my $user (@$import) {
+		$self->{db}->do("insert or ignore into users (username, data) values(?, ?)", @$user, sub {
+			my (undef, $err) = @_;
+			print STDERR "Failed to import user $user->[0]: $err\n" if ($err);
+			rename($file, "$file.imported") if (!--$left && -e $file);
+		});
+	}
 }
 
 # Get/lookup user from database
 sub get {
+	my $cb = pop;
 	my ($self, %opt) = @_;
-	my $dbfile = $self->{dbfile};
-	my $tdb = $self->opendb("r");
-	if ($tdb) {
-		my $user = $tdb->get($opt{username});
-		$tdb->close();
-		return $user;
-	}
+	$self->prepare();
+	$self->{db}->select("select data from users where username = ?", $opt{username}, sub {
+		my ($rows, $err) = @_;
+		return $cb->(undef, $err) if ($err);
+		$cb->(@$rows ? decode_json($rows->[0]{data}) : undef);
+	});
 }
 
 # Add user to the database
 sub add {
+	my $cb = pop;
 	my ($self, %opt) = @_;
 	my $username = $opt{username};
 	my $user = {
 		username => $username,
 		feeds => "",
 	};
-	my $tdb = $self->opendb("w");
-	if (!$tdb || !$tdb->put($username, $user)) {
-		my $error = $tdb && $tdb->errmsg($tdb->ecode()) || "Internal Error";
-		print STDERR "Failed to add new user: $user: $error\n";
-		return;
-	}
-	# Success
-	return $tdb->close();
+	$self->prepare();
+	$self->{db}->do("replace into users (username, data) values(?, ?)", $username, encode_json($user), sub {
+		my (undef, $err) = @_;
+		print STDERR "Failed to add new user: $username: $err\n" if ($err);
+		$cb->(!$err, $err);
+	});
 }
 
-# Update user settings
+# Update user settings, merged into what's there in one go
 sub update {
+	my $cb = pop;
 	my ($self, %opt) = @_;
 	my $username = $opt{username};
-	my $user = $self->get(username => $username);
-	if (!$user) {
-		print STDERR "No such user $username\n";
-		return;
-	}
-
-	# Update user with data from options
-	$user = { %$user, %opt };
-
-	my $tdb = $self->opendb("w");
-	if (!$tdb || !$tdb->put($username, $user)) {
-		my $error = $tdb && $tdb->errmsg($tdb->ecode()) || "Internal Error";
-		print STDERR "Failed to update user: $username: $error\n";
-		return;
-	}
-	return $tdb->close();
+	$self->prepare();
+	$self->{db}->do("update users set data = json_patch(data, ?) where username = ?", encode_json(\%opt), $username, sub {
+		my ($changes, $err) = @_;
+		$err ||= "No such user $username" if (!$changes);
+		print STDERR "Failed to update user: $username: $err\n" if ($err);
+		$cb->(!$err, $err);
+	});
 }
 
 # Remove user from the database
 sub del {
+	my $cb = pop;
 	my ($self, %opt) = @_;
 	my $username = $opt{username};
-	my $tdb = $self->opendb("w");
-	if (!$tdb || !$tdb->out($username)) {
-		my $error = $tdb && $tdb->errmsg($tdb->ecode()) || "Internal Error";
-		print STDERR "Failed to delete user: $username: $error\n";
-		return;
-	}
-	return $tdb->close();
+	$self->prepare();
+	$self->{db}->do("delete from users where username = ?", $username, sub {
+		my ($changes, $err) = @_;
+		$err ||= "No such user $username" if (!$changes);
+		print STDERR "Failed to delete user: $username: $err\n" if ($err);
+		$cb->(!$err, $err);
+	});
 }
 
-# List users in the database
+# List users in the database, $cb gets up to 25 names containing $search
 sub list {
-	my ($self, $search) = @_;
-	my @results;
-	my $value;
-	my $count = 0;
+	my ($self, $search, $cb) = @_;
 	my $max = 25;
 
-	my $dbfile = $self->{dbfile};
-	my $tdb = $self->opendb("r");
-	return if (!$tdb);
-	for ($tdb->iterinit(), $value = $tdb->iternext(); $value && $count < $max; $value = $tdb->iternext()) {
-		if (!$search || $value =~ /\Q$search\E/) {
-			push(@results, $value);
-			$count++;
-		}
-	}
-	$tdb->close();
-	return @results;
+	$self->prepare();
+	$self->{db}->select("select username from users where instr(username, ?) > 0 order by username limit $max", $search // '', sub {
+		my ($rows, $err) = @_;
+		return $cb->(undef, $err) if ($err);
+		$cb->([ map { $_->{username} } @$rows ]);
+	});
 }
 
 1;
@@ -7,21 +7,120 @@ package mod_perl::modules::utils;
 use strict;
 use warnings;
 
+use HTTP::Request;
+use HTTP::Response;
+use HTTP::Request::Common ();
 use LWP::UserAgent;
-use WWW::Shorten 'TinyURL', ':short';
-use Try::Tiny;
+use URI;
+use URI::Escape;
 
 use constant MIN_LENGTH => 25;
+use constant TINYURL_API => 'http://tinyurl.com/api-create.php?url=';
 
 =pod
 
-=head2 tinyurl
+=head2 http_request
+
+Runs an HTTP request on the worker's event loop (IRC::http) and calls
+$cb with an HTTP::Response once it's done, so handlers don't hold up
+the worker while they wait. Connections are kept alive between calls.
+Takes the same options as IRC::http (timeout, max_size, redirects,
+headers, body, cache, cache_errors). A response cut short at max_size
+has a Client-Aborted header like LWP's, failures are 599 responses.
 
-Takes a $url to shorten and an optional shortening site address
-otherwise uses a random shortener from a builtin list.
+Without https in IRC::http (IRC::http_tls) https urls, and redirects
+to them, are fetched with LWP instead. That holds up the worker until
+it's done and $cb is called before this returns.
 
-Returns the shortened url or an error message. If the URL is shorter than
-a specified default value (usually 25) it will just be returned unshortened.
+Returns the request, $req->cancel means $cb is never called. Nothing
+is returned when $cb was already called.
+
+=over 12
+
+=item B<$method>
+
+GET, HEAD, POST...
+
+=item B<$url>
+
+The URL to request
+
+=item B<$cb>
+
+Called with the HTTP::Response
+
+=back
+
+=cut
+
+sub http_request {
+	my $cb = pop;
+	my ($method, $url, %opt) = @_;
+
+	return http_lwp($method, $url, %opt, $cb) if (!IRC::http_tls() && $url =~ /^https:/i);
+	my $req = eval {
+		IRC::http($method, $url, %opt, sub {
+			my ($body, $headers) = @_;
+			my $location = $headers->{location};
+			if (!IRC::http_tls() && $headers->{Status} =~ /^30[12378]$/ && defined($location)
+					&& ($opt{redirects} // 5) > 0) {
+				$location = URI->new_abs($location, $headers->{URL});
+				# It stopped at a redirect it couldn't follow, carry on from there
+				if ($location->scheme eq 'https') {
+					$method = 'GET' if ($headers->{Status} == 303
+							|| ($method eq 'POST' && $headers->{Status} <= 302));
+					delete($opt{body}) if ($method eq 'GET');
+					return http_lwp($method, "$location", %opt, redirects => ($opt{redirects} // 5) - 1, $cb);
+				}
+			}
+			my $res = HTTP::Response->new($headers->{Status}, $headers->{Reason});
+			while (my ($name, $value) = each %$headers) {
+				# Lower case ones are the real headers
+				$res->header($name => $value) if ($name =~ /^[a-z]/);
+			}
+			$res->header('Client-Aborted' => 'max_size') if ($headers->{Truncated});
+			$res->content($body) if (defined($body));
+			$res->request(HTTP::Request->new($method => $headers->{URL}));
+			$cb->($res);
+		});
+	};
+	if (!$req) {
+		chomp(my $err = $@);
+		$cb->(HTTP::Response->new(599, $err));
+	}
+	return $req;
+}
+
+# http_request over a blocking LWP::UserAgent, for what IRC::http can't fetch
+sub http_lwp {
+	my $cb = pop;
+	my ($method, $url, %opt) = @_;
+	my $ua = LWP::UserAgent->new(
+		timeout => $opt{timeout} || 30,
+		max_size => $opt{max_size} || (1 << 20),
+		max_redirect => $opt{redirects} // 5,
+	);
+	my $headers = $opt{headers} || [];
+	my $req = HTTP::Request->new($method => $url,
+		[ref($headers) eq 'HASH' ? %$headers : @$headers], $opt{body});
+
+	# Like IRC::http's callbacks one that dies only warns
+	eval { $cb->($ua->request($req)); 1 } or warn $@;
+	return;
+}
+
+sub http_get { my $cb = pop; my $url = shift; return http_request('GET', $url, @_, $cb); }
+sub http_head { my $cb = pop; my $url = shift; return http_request('HEAD', $url, @_, $cb); }
+sub http_post { my $cb = pop; my ($url, $body) = (shift, shift); return http_request('POST', $url, body => $body, @_, $cb); }
+
+=pod
+
+=head2 tinyurl
+
+Takes a $url to shorten with TinyURL and calls $cb with the shortened
+url, or the url itself if it couldn't be shortened. If the URL is
+shorter than a specified default value (usually 25) it's passed on
+unshortened right away.
 
 =over 12
 
@@ -29,24 +128,54 @@ a specified default value (usually 25) it will just be returned unshortened.
 
 The URL to shorten
 
+=item B<$cb>
+
+Called with the short url
+
 =back
 
 =cut
 
 sub tinyurl {
-    my ($uri) = @_;
+    my ($uri, $cb) = @_;
 
 	# Don't bother shortening if it's already this short
     if (length($uri) < MIN_LENGTH) {
-        return $uri;
+        return $cb->($uri);
     }
-	my $short_url = $uri;
-	try {
-		$short_url = short_link($uri);
-	} catch { 
-		warn "Failed to shorten $uri: $_";
-	};
-	return $short_url;
+	http_get(TINYURL_API . uri_escape($uri), timeout => 10, cache => 86400, sub {
+		my $res = shift;
+		my $short_url = $res->is_success ? $res->decoded_content : '';
+		$short_url =~ s/\s+$//;
+		if ($short_url !~ m{^https?://}) {
+			warn "Failed to shorten $uri: ".$res->status_line."\n";
+			$short_url = $uri;
+		}
+		$cb->($short_url);
+	});
+}
+
+=pod
+
+=head2 tinyurls
+
+Shortens a list of urls at once, calls $cb with the short ones in the
+same order once they're all done.
+
+=cut
+
+sub tinyurls {
+	my ($uris, $cb) = @_;
+	my @short;
+	my $left = @$uris;
+
+	return $cb->() if (!$left);
+	for my $i (0 .. $#$uris) {
+		tinyurl($uris->[$i], sub {
+			$short[$i] = shift;
+			$cb->(@short) if (!--$left);
+		});
+	}
 }
 
 =pod
@@ -55,9 +184,8 @@ sub tinyurl {
 
 This function takes the given content and uploads it to a
 pastebin site (it must be text only content). It then
-returns the url it got from uploading the text.
-
-If multiple values are passed they are concatenated together and uploaded as one string.
+calls $cb with the url it got from uploading the text,
+undef if the upload failed.
 
 =over 12
 
@@ -65,25 +193,30 @@ If multiple values are passed they are concatenated together and uploaded as one
 
 The content to upload, stored as string.
 
+=item B<$cb>
+
+Called with the url
+
 =back
 
 =cut
 
 sub upload_content {
-	my $content = shift;
-	my $ua = LWP::UserAgent->new;
+	my ($content, $cb) = @_;
 	my $host = 'http://paste.drains.me';
 
-	my $res = $ua->post($host, 'Content-Type' => 'form-data', 'Content' => [ f => $content ]);
-	my $url;
-	if ($res->is_success()) {
-		chomp($url = $res->decoded_content());
-	} else {
-		print STDERR "Failed to post [$content]: ".$res->status_line."\n";
-		return undef;
-	}
-		
-	return $url;
+	# Let HTTP::Request::Common build the form
+	my $form = HTTP::Request::Common::POST($host, 'Content-Type' => 'form-data', 'Content' => [ f => $content ]);
+	http_post($host, $form->content, headers => [ 'Content-Type' => $form->header('Content-Type') ], sub {
+		my $res = shift;
+		my $url;
+		if ($res->is_success()) {
+			chomp($url = $res->decoded_content());
+		} else {
+			print STDERR "Failed to post [$content]: ".$res->status_line."\n";
+		}
+		$cb->($url);
+	});
 }
 
 1;
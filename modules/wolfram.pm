@@ -6,7 +6,6 @@ use mod_perl::modules::utils;
 use strict;
 use warnings;
 
-use LWP::UserAgent;
 use XML::LibXML;
 use URI::Escape;
 use Encode qw(encode_utf8);
@@ -16,28 +15,28 @@ my $wolfram_api = $mod_perl::config::conf{wolfram_api_url} ||
 'https://api.wolframalpha.com/v2/query?format=plaintext&appid=__KEY__&input=';
 my $wolfram_alpha_link = 'http://www.wolframalpha.com/input/?i=';
 
-mod_perl::commands::register_command('wa', \&wolfram_run);
-mod_perl::commands::register_command('wolfram', \&wolfram_run);
+mod_perl::commands::register_command('wa', \&wolfram_run, 'slow');
+mod_perl::commands::register_command('wolfram', \&wolfram_run, 'slow');
 
 my $XML_PARSER;
 sub wolfram_getXMLdoc
 {
-	my ($irc, $source) = @_;
+	my ($irc, $source, $cb) = @_;
 	if (!$XML_PARSER) {
 		$XML_PARSER = XML::LibXML->new;
 	}
-	my $ua = LWP::UserAgent->new;
-	my $r = $ua->get($source);
-
-	my $doc = undef;
-	if ($r->is_success) {
-#		print STDERR "debug:".$r->decoded_content."\n";
-		$doc = $XML_PARSER->load_xml(string => $r->decoded_content);
-	} else {
-		$irc->say("[error] Couldn't retrieve '$source': ".$r->status_line);
-	}
+	mod_perl::modules::utils::http_get($source, cache => 3600, sub {
+		my $r = shift;
+		my $doc = undef;
+		if ($r->is_success) {
+#			print STDERR "debug:".$r->decoded_content."\n";
+			$doc = $XML_PARSER->load_xml(string => $r->decoded_content);
+		} else {
+			$irc->say("[error] Couldn't retrieve '$source': ".$r->status_line);
+		}
 
-	return $doc;
+		$cb->($doc);
+	});
 }
 
 sub wolfram_help {
@@ -50,12 +49,19 @@ sub wolfram_help {
 sub lookup {
     my ($irc, $query) = @_;
 	my $max_results = 5;
-    my $ua = LWP::UserAgent->new;
 	my $key = $mod_perl::config::conf{wolfram_api_key};
 	$wolfram_api =~ s/__KEY__/$key/;
 
-	my $doc = wolfram_getXMLdoc($irc, $wolfram_api . uri_escape($query));
-	return if (!$doc);
+	# The answer comes after we return, reply on a copy of the event
+	$irc = $irc->defer;
+	wolfram_getXMLdoc($irc, $wolfram_api . uri_escape($query), sub {
+		my $doc = shift;
+		answer($irc, $query, $doc, $max_results) if ($doc);
+	});
+}
+
+sub answer {
+	my ($irc, $query, $doc, $max_results) = @_;
 
 	my @pods = $doc->findnodes('//pod');
 	my $count = 0;
@@ -4,10 +4,274 @@
 
 #include "ppport.h"
 
+#include <event2/event.h>
+#include <event2/keyvalq_struct.h>
+
 #include <irc.h> /* irc.* interface */
+#include <mod.h> /* mod_event_base(), mod_http(), mod_cache(), mod_store(), mod_db() */
+#include <http.h> /* http_request(), http_tls() */
+#include <cache.h> /* cache_get() */
+#include <store.h> /* store_get() */
+#include <db.h> /* db_query() */
 
 typedef struct irc * IRC;
 
+/*
+ * A timer or fd watch on the worker's event loop, Perl holds it as an
+ * IRC::Watch and dropping that cancels it (like AnyEvent's watchers).
+ * Callbacks run from the loop between events, so a handler can start
+ * something slow, return, and answer when it's done
+ */
+struct irc_watch {
+    struct event * ev;
+    struct event_base * base; /* The loop it's on, it may be gone before we are */
+    struct timeval interval;  /* Timers: again every interval, once if it's 0 */
+    SV * cb;
+};
+typedef struct irc_watch * IRC__Watch;
+
+static void irc_watch_callback(evutil_socket_t fd, short what, void * data)
+{
+    struct irc_watch * w = data;
+    SV * cb;
+    dTHX;
+    dSP;
+
+    if (evutil_timerisset(&w->interval))
+        evtimer_add(w->ev, &w->interval);
+
+    /* The callback may drop its own watcher, keep the sub until it returns */
+    ENTER;
+    SAVETMPS;
+    cb = sv_2mortal(SvREFCNT_inc(w->cb));
+    PUSHMARK(SP);
+    call_sv(cb, G_DISCARD | G_NOARGS | G_EVAL);
+    if (SvTRUE(ERRSV))
+        warn("[IRC] watch callback died: %s", SvPV_nolen(ERRSV));
+    FREETMPS;
+    LEAVE;
+}
+
+static SV * irc_watch_new(pTHX_ evutil_socket_t fd, short what, const struct timeval * after, double interval, SV * cb)
+{
+    struct event_base * base = mod_event_base();
+    struct irc_watch * w;
+    SV * obj;
+
+    if (!base)
+        croak("IRC: no event loop here, watches only work in a worker's handlers");
+    if (!SvROK(cb) || SvTYPE(SvRV(cb)) != SVt_PVCV)
+        croak("IRC: callback must be a code reference");
+
+    Newxz(w, 1, struct irc_watch);
+    if ( !(w->ev = event_new(base, fd, what, irc_watch_callback, w)) ) {
+        Safefree(w);
+        croak("IRC: event_new failed");
+    }
+    w->base = base;
+    w->cb = newSVsv(cb);
+    if (interval > 0) {
+        w->interval.tv_sec = (time_t)interval;
+        w->interval.tv_usec = (suseconds_t)((interval - (time_t)interval) * 1e6);
+    }
+    event_add(w->ev, after);
+
+    obj = newSV(0);
+    sv_setref_pv(obj, "IRC::Watch", w);
+    return obj;
+}
+
+static void irc_watch_free(pTHX_ struct irc_watch * w)
+{
+    /* Nothing to take it off if the loop went first (the worker exiting) */
+    if (w->base == mod_event_base())
+        event_free(w->ev);
+    SvREFCNT_dec(w->cb);
+    Safefree(w);
+}
+
+/* A Perl file handle or a plain fd number */
+static int irc_watch_fd(pTHX_ SV * fh)
+{
+    IO * io;
+
+    if (!SvROK(fh) && looks_like_number(fh))
+        return SvIV(fh);
+    if ( !(io = sv_2io(fh)) || !IoIFP(io) )
+        return -1;
+    return PerlIO_fileno(IoIFP(io));
+}
+
+/*
+ * An HTTP request (http.h) Perl holds as an IRC::HTTP, it stays in
+ * %IRC::HTTP::pending until it's done so it runs whether or not the
+ * module keeps it. A reload drops them all without their callbacks
+ */
+struct irc_http {
+    struct http_request * req; /* NULL once it's done or cancelled */
+    SV * cb;
+};
+typedef struct irc_http * IRC__HTTP;
+
+static void irc_http_callback(const struct http_response * res, void * data)
+{
+    struct irc_http * h = data;
+    HV * headers = newHV();
+    const struct evkeyval * kv;
+    SV * cb, ** old;
+    char * key, * p;
+    dTHX;
+    dSP;
+
+    h->req = NULL;
+    ENTER;
+    SAVETMPS;
+    /* The pending list lets go of it, it lives until we return */
+    hv_delete(get_hv("IRC::HTTP::pending", GV_ADD), (char *)&h, sizeof h, 0);
+    cb = sv_2mortal(SvREFCNT_inc(h->cb));
+
+    /* Lower case names like AnyEvent::HTTP, repeated ones joined with commas */
+    for (kv = res->headers ? res->headers->tqh_first : NULL; kv; kv = kv->next.tqe_next) {
+        key = savepv(kv->key);
+        SAVEFREEPV(key);
+        for (p = key; *p; ++p)
+            *p = toLOWER(*p);
+        if ( (old = hv_fetch(headers, key, strlen(key), 0)) )
+            sv_catpvf(*old, ",%s", kv->value);
+        else
+            hv_store(headers, key, strlen(key), newSVpv(kv->value, 0), 0);
+    }
+    hv_stores(headers, "Status", newSViv(res->status ? res->status : 599));
+    hv_stores(headers, "Reason", newSVpv(res->reason ? res->reason : "", 0));
+    hv_stores(headers, "URL", newSVpv(res->url, 0));
+    if (res->truncated)
+        hv_stores(headers, "Truncated", newSViv(1));
+
+    PUSHMARK(SP);
+    XPUSHs(res->status ? sv_2mortal(newSVpvn((const char *)res->body, res->len)) : &PL_sv_undef);
+    XPUSHs(sv_2mortal(newRV_noinc((SV *)headers)));
+    PUTBACK;
+    call_sv(cb, G_DISCARD | G_EVAL);
+    if (SvTRUE(ERRSV))
+        warn("[IRC] http callback died: %s", SvPV_nolen(ERRSV));
+    FREETMPS;
+    LEAVE;
+}
+
+/* "headers => {...}" or [...] as name, value, ..., NULL, freed when the XSUB returns */
+static const char ** irc_http_headers(pTHX_ SV * sv)
+{
+    const char ** headers;
+    size_t n = 0;
+    HE * he;
+    SSize_t i;
+
+    if (SvROK(sv) && SvTYPE(SvRV(sv)) == SVt_PVHV) {
+        HV * hv = (HV *)SvRV(sv);
+
+        Newxz(headers, 2 * HvUSEDKEYS(hv) + 1, const char *);
+        SAVEFREEPV(headers);
+        hv_iterinit(hv);
+        while ((he = hv_iternext(hv))) {
+            headers[n++] = HePV(he, PL_na);
+            headers[n++] = SvPV_nolen(HeVAL(he));
+        }
+    } else if (SvROK(sv) && SvTYPE(SvRV(sv)) == SVt_PVAV) {
+        AV * av = (AV *)SvRV(sv);
+
+        Newxz(headers, av_len(av) + 3, const char *);
+        SAVEFREEPV(headers);
+        for (i = 0; i + 1 <= av_len(av); i += 2) {
+            SV ** name = av_fetch(av, i, 0), ** value = av_fetch(av, i + 1, 0);
+
+            if (name && value) {
+                headers[n++] = SvPV_nolen(*name);
+                headers[n++] = SvPV_nolen(*value);
+            }
+        }
+    } else {
+        croak("IRC::http: headers must be a hash or array reference");
+    }
+
+    return headers;
+}
+
+/*
+ * A query to the storage process (db.h) Perl holds as an IRC::DB, it
+ * stays in %IRC::DB::pending until it's answered the same way
+ */
+struct irc_db {
+    struct db_request * req; /* NULL once it's answered or cancelled */
+    SV * cb;                 /* undef for a write nobody waits on */
+    bool write;
+};
+typedef struct irc_db * IRC__DB;
+
+static SV * irc_db_value(pTHX_ const struct db_value * value)
+{
+    switch (value->type) {
+        case DB_INT:
+            return newSViv(value->i);
+        case DB_FLOAT:
+            return newSVnv(value->f);
+        case DB_TEXT:
+        case DB_BLOB:
+            return newSVpvn(value->s.p, value->s.len);
+        default:
+            return newSV(0);
+    }
+}
+
+static void irc_db_callback(const struct db_result * res, void * data)
+{
+    struct irc_db * h = data;
+    const struct db_value * value;
+    unsigned long row;
+    unsigned int col;
+    AV * rows;
+    HV * hv;
+    SV * cb;
+    dTHX;
+    dSP;
+
+    h->req = NULL;
+    ENTER;
+    SAVETMPS;
+    hv_delete(get_hv("IRC::DB::pending", GV_ADD), (char *)&h, sizeof h, 0);
+    cb = sv_2mortal(SvREFCNT_inc(h->cb));
+
+    PUSHMARK(SP);
+    if (res->error) {
+        XPUSHs(&PL_sv_undef);
+        XPUSHs(sv_2mortal(newSVpv(res->error, 0)));
+    } else if (h->write) {
+        XPUSHs(sv_2mortal(newSViv(res->changes)));
+        XPUSHs(&PL_sv_undef);
+        XPUSHs(sv_2mortal(newSViv(res->last_id)));
+    } else {
+        /* A hash per row, like DBI's selectall_arrayref with Slice => {} */
+        rows = newAV();
+        av_extend(rows, res->nrows);
+        for (row = 0, value = res->values; row < res->nrows; ++row) {
+            hv = newHV();
+            for (col = 0; col < res->ncols; ++col, ++value)
+                hv_store(hv, res->names[col], strlen(res->names[col]), irc_db_value(aTHX_ value), 0);
+            av_push(rows, newRV_noinc((SV *)hv));
+        }
+        XPUSHs(sv_2mortal(newRV_noinc((SV *)rows)));
+    }
+    PUTBACK;
+    if (SvOK(cb)) {
+        call_sv(cb, G_DISCARD | G_EVAL);
+        if (SvTRUE(ERRSV))
+            warn("[IRC] db callback died: %s", SvPV_nolen(ERRSV));
+    } else if (res->error) {
+        warn("[IRC] db write failed: %s", res->error);
+    }
+    FREETMPS;
+    LEAVE;
+}
+
 #include "const-c.inc"
 
 MODULE = IRC		PACKAGE = IRC
@@ -62,6 +326,14 @@ servername(event)
     OUTPUT:
         RETVAL
 
+unsigned int
+matched(event)
+    IRC event
+    CODE:
+        RETVAL = irc.matched(event);
+    OUTPUT:
+        RETVAL
+
 
 int
 raw(event,text)
@@ -130,3 +402,377 @@ broadcast(event)
 		RETVAL = irc.broadcast(event);
 	OUTPUT:
 		RETVAL
+
+int
+status(event)
+	IRC event
+	CODE:
+		RETVAL = irc.status(event);
+	OUTPUT:
+		RETVAL
+
+int
+handler(event,name)
+	IRC event
+	const char * name
+	CODE:
+		RETVAL = irc.handler(event, name);
+	OUTPUT:
+		RETVAL
+
+int
+match_set(event,set,key,on)
+	IRC event
+	const char * set
+	const char * key
+	int on
+	CODE:
+		RETVAL = irc.match_set(event, set, key, on);
+	OUTPUT:
+		RETVAL
+
+int
+match_key(set,key,on)
+	const char * set
+	const char * key
+	int on
+	CODE:
+		/* match_set() without an event, it only goes to the master */
+		RETVAL = irc.match_set(NULL, set, key, on);
+	OUTPUT:
+		RETVAL
+
+SV *
+defer(event)
+	IRC event
+	PREINIT:
+		struct irc * copy;
+	CODE:
+		if ( !(copy = irc.copy(event)) )
+			XSRETURN_UNDEF;
+		RETVAL = newSV(0);
+		sv_setref_pv(RETVAL, "IRC::Deferred", copy);
+	OUTPUT:
+		RETVAL
+
+SV *
+timer(after,interval,cb)
+	double after
+	double interval
+	SV * cb
+	PREINIT:
+		struct timeval tv;
+	CODE:
+		if (after < 0)
+			after = 0;
+		tv.tv_sec = (time_t)after;
+		tv.tv_usec = (suseconds_t)((after - (time_t)after) * 1e6);
+		RETVAL = irc_watch_new(aTHX_ -1, 0, &tv, interval, cb);
+	OUTPUT:
+		RETVAL
+
+SV *
+io(fh,poll,cb)
+	SV * fh
+	int poll
+	SV * cb
+	PREINIT:
+		int fd;
+	CODE:
+		if ((fd = irc_watch_fd(aTHX_ fh)) == -1)
+			croak("IRC::io: not a file handle");
+		RETVAL = irc_watch_new(aTHX_ fd, (poll ? EV_WRITE : EV_READ) | EV_PERSIST, NULL, 0, cb);
+	OUTPUT:
+		RETVAL
+
+SV *
+http(method,url,...)
+	const char * method
+	const char * url
+	PREINIT:
+		struct http_options opt = {.redirects = -1};
+		struct http * client = mod_http();
+		struct irc_http * h;
+		const char * key;
+		SV * cb;
+		int i;
+	CODE:
+		if (!client)
+			croak("IRC::http: no event loop here, requests only work in a worker's handlers");
+		cb = ST(items - 1);
+		if (items < 3 || !SvROK(cb) || SvTYPE(SvRV(cb)) != SVt_PVCV)
+			croak("IRC::http: the last argument must be a code reference");
+		if ((items - 3) % 2)
+			croak("IRC::http: options come in name => value pairs");
+		for (i = 2; i < items - 1; i += 2) {
+			key = SvPV_nolen(ST(i));
+			if (!strcmp(key, "timeout"))
+				opt.timeout = SvNV(ST(i + 1));
+			else if (!strcmp(key, "max_size"))
+				opt.max_size = SvUV(ST(i + 1));
+			else if (!strcmp(key, "redirects"))
+				opt.redirects = SvIV(ST(i + 1));
+			else if (!strcmp(key, "body"))
+				opt.body = SvPV(ST(i + 1), opt.blen);
+			else if (!strcmp(key, "headers"))
+				opt.headers = irc_http_headers(aTHX_ ST(i + 1));
+			else if (!strcmp(key, "cache"))
+				opt.cache = SvNV(ST(i + 1));
+			else if (!strcmp(key, "cache_errors"))
+				opt.cache_errors = SvNV(ST(i + 1));
+			else
+				croak("IRC::http: unknown option '%s'", key);
+		}
+
+		Newxz(h, 1, struct irc_http);
+		if ( !(h->req = http_request(client, method, url, &opt, irc_http_callback, h)) ) {
+			Safefree(h);
+			croak("IRC::http: can't %s %s", method, url);
+		}
+		h->cb = newSVsv(cb);
+		RETVAL = newSV(0);
+		sv_setref_pv(RETVAL, "IRC::HTTP", h);
+		hv_store(get_hv("IRC::HTTP::pending", GV_ADD), (char *)&h, sizeof h, newSVsv(RETVAL), 0);
+	OUTPUT:
+		RETVAL
+
+int
+http_tls()
+	CODE:
+		RETVAL = http_tls();
+	OUTPUT:
+		RETVAL
+
+SV *
+cache_get(key)
+	SV * key
+	PREINIT:
+		struct cache * cache = mod_cache();
+		const char * k;
+		STRLEN klen;
+		void * value;
+		size_t len;
+	CODE:
+		k = SvPV(key, klen);
+		if (!cache || cache_get(cache, k, klen, &value, &len) != CACHE_HIT)
+			XSRETURN_UNDEF;
+		RETVAL = newSVpvn(value, len);
+		free(value);
+	OUTPUT:
+		RETVAL
+
+int
+cache_set(key,value,ttl)
+	SV * key
+	SV * value
+	double ttl
+	PREINIT:
+		struct cache * cache = mod_cache();
+		const char * k, * v;
+		STRLEN klen, vlen;
+	CODE:
+		k = SvPV(key, klen);
+		v = SvPV(value, vlen);
+		RETVAL = cache && ttl > 0 && cache_put(cache, k, klen, v, vlen, ttl) == 0;
+	OUTPUT:
+		RETVAL
+
+void
+cache_del(key)
+	SV * key
+	PREINIT:
+		struct cache * cache = mod_cache();
+		const char * k;
+		STRLEN klen;
+	CODE:
+		k = SvPV(key, klen);
+		if (cache)
+			cache_del(cache, k, klen);
+
+void
+store_get(key)
+	SV * key
+	PREINIT:
+		struct store * store = mod_store();
+		const char * k;
+		STRLEN klen;
+		void * value;
+		size_t len;
+		uint64_t version;
+	PPCODE:
+		k = SvPV(key, klen);
+		if (!store || !store_get(store, k, klen, &value, &len, &version))
+			XSRETURN_EMPTY;
+		EXTEND(SP, 2);
+		mPUSHs(newSVpvn(value, len));
+		mPUSHs(newSVuv(version));
+		free(value);
+
+int
+store_set(key,value,ttl=0,version=&PL_sv_undef)
+	SV * key
+	SV * value
+	double ttl
+	SV * version
+	PREINIT:
+		struct store * store = mod_store();
+		const char * k, * v;
+		STRLEN klen, vlen;
+	CODE:
+		if (!store)
+			croak("IRC::store_set: no shared state here");
+		k = SvPV(key, klen);
+		v = SvPV(value, vlen);
+		RETVAL = store_set(store, k, klen, v, vlen, ttl, SvOK(version) ? SvUV(version) : STORE_ANY);
+	OUTPUT:
+		RETVAL
+
+SV *
+store_del(key,version=&PL_sv_undef)
+	SV * key
+	SV * version
+	PREINIT:
+		struct store * store = mod_store();
+		const char * k;
+		STRLEN klen;
+		void * value;
+		size_t len;
+	CODE:
+		if (!store)
+			croak("IRC::store_del: no shared state here");
+		k = SvPV(key, klen);
+		if (!store_del(store, k, klen, SvOK(version) ? SvUV(version) : STORE_ANY, &value, &len))
+			XSRETURN_UNDEF;
+		RETVAL = newSVpvn(value, len);
+		free(value);
+	OUTPUT:
+		RETVAL
+
+void
+store_keys(prefix)
+	SV * prefix
+	PREINIT:
+		struct store * store = mod_store();
+		const char * p;
+		STRLEN plen;
+		uint64_t cursor = 0;
+		void * key;
+		size_t klen;
+	PPCODE:
+		p = SvPV(prefix, plen);
+		while (store && store_next(store, p, plen, &cursor, &key, &klen)) {
+			XPUSHs(sv_2mortal(newSVpvn((char *)key + plen, klen - plen)));
+			free(key);
+		}
+
+SV *
+db_select(database,sql,params,cb=&PL_sv_undef)
+	const char * database
+	const char * sql
+	SV * params
+	SV * cb
+	ALIAS:
+		db_do = 1
+	PREINIT:
+		const char * name = ix ? "IRC::db_do" : "IRC::db_select";
+		struct db * client = mod_db();
+		struct db_value * values = NULL;
+		struct irc_db * h;
+		SV ** sv;
+		AV * av;
+		SSize_t i, n;
+	CODE:
+		if (!client)
+			croak("%s: no storage process here, queries only work in a worker's handlers", name);
+		if (!SvROK(params) || SvTYPE(SvRV(params)) != SVt_PVAV)
+			croak("%s: parameters must be an array reference", name);
+		if ((SvOK(cb) || !ix) && (!SvROK(cb) || SvTYPE(SvRV(cb)) != SVt_PVCV))
+			croak("%s: the callback must be a code reference", name);
+		av = (AV *)SvRV(params);
+		if ((n = av_len(av) + 1)) {
+			Newxz(values, n, struct db_value);
+			SAVEFREEPV(values);
+		}
+		for (i = 0; i < n; ++i) {
+			if (!(sv = av_fetch(av, i, 0)) || !SvOK(*sv)) {
+				values[i].type = DB_NULL;
+			} else if (SvIOK(*sv)) {
+				values[i].type = DB_INT;
+				values[i].i = SvIV(*sv);
+			} else if (SvNOK(*sv)) {
+				values[i].type = DB_FLOAT;
+				values[i].f = SvNV(*sv);
+			} else {
+				values[i].type = DB_TEXT;
+				values[i].s.p = SvPV(*sv, values[i].s.len);
+			}
+		}
+
+		Newxz(h, 1, struct irc_db);
+		h->write = ix;
+		if ( !(h->req = db_query(client, ix ? DB_WRITE : DB_READ, database, sql, values, n, irc_db_callback, h)) ) {
+			Safefree(h);
+			croak("%s: can't reach the storage process", name);
+		}
+		h->cb = newSVsv(cb);
+		RETVAL = newSV(0);
+		sv_setref_pv(RETVAL, "IRC::DB", h);
+		hv_store(get_hv("IRC::DB::pending", GV_ADD), (char *)&h, sizeof h, newSVsv(RETVAL), 0);
+	OUTPUT:
+		RETVAL
+
+MODULE = IRC		PACKAGE = IRC::HTTP
+
+void
+cancel(h)
+	IRC::HTTP h
+	CODE:
+		if (h->req)
+			http_forget(h->req);
+		h->req = NULL;
+		hv_delete(get_hv("IRC::HTTP::pending", GV_ADD), (char *)&h, sizeof h, G_DISCARD);
+
+void
+DESTROY(h)
+	IRC::HTTP h
+	CODE:
+		if (h->req)
+			http_forget(h->req);
+		SvREFCNT_dec(h->cb);
+		Safefree(h);
+
+MODULE = IRC		PACKAGE = IRC::DB
+
+void
+cancel(h)
+	IRC::DB h
+	CODE:
+		if (h->req)
+			db_forget(h->req);
+		h->req = NULL;
+		hv_delete(get_hv("IRC::DB::pending", GV_ADD), (char *)&h, sizeof h, G_DISCARD);
+
+void
+DESTROY(h)
+	IRC::DB h
+	CODE:
+		if (h->req)
+			db_forget(h->req);
+		SvREFCNT_dec(h->cb);
+		Safefree(h);
+
+MODULE = IRC		PACKAGE = IRC::Deferred
+
+void
+DESTROY(event)
+	IRC event
+	CODE:
+		irc.free(event);
+
+MODULE = IRC		PACKAGE = IRC::Watch
+
+void
+DESTROY(w)
+	IRC::Watch w
+	CODE:
+		irc_watch_free(aTHX_ w);
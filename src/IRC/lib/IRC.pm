@@ -1,5 +1,10 @@
 package IRC;
 
+# IRC::http with the method in the name
+sub http_get { return IRC::http('GET', @_); }
+sub http_head { return IRC::http('HEAD', @_); }
+sub http_post { my $url = shift; my $body = shift; return IRC::http('POST', $url, body => $body, @_); }
+
 use 5.012004;
 use strict;
 use warnings;
@@ -57,6 +62,142 @@ XSLoader::load('IRC', $VERSION);
 
 # Preloaded methods go here.
 
+# What $msg->defer returns, an event you can still reply to after the
+# handler returned, it's freed once you drop it
+package IRC::Deferred;
+our @ISA = ('IRC');
+
+# Module state every worker shares, one name's keys in the master's
+# store (IRC::store_*), as an object or a tied hash (see the POD)
+package IRC::Store;
+use Storable ();
+
+sub new
+{
+    my ($class, $name, %opt) = @_;
+    return bless({prefix => "$name\0", ttl => $opt{ttl} || 0, match => $opt{match}}, $class);
+}
+
+# Plain strings are kept as they are, references frozen
+sub freeze { my $value = shift; return !defined($value) ? 'u' : ref($value) ? 'S' . Storable::nfreeze($value) : "=$value"; }
+sub thaw { my $tag = substr($_[0], 0, 1, ''); return $tag eq 'S' ? Storable::thaw($_[0]) : $tag eq '=' ? $_[0] : undef; }
+
+sub get
+{
+    my ($self, $key) = @_;
+    my ($value) = IRC::store_get($self->{prefix} . $key);
+    return defined($value) ? thaw($value) : undef;
+}
+
+sub exists { my ($self, $key) = @_; return scalar(() = IRC::store_get($self->{prefix} . $key)) > 0; }
+
+sub set
+{
+    my ($self, $key, $value, $ttl) = @_;
+    Carp::croak("IRC::Store: no room for $key") if (IRC::store_set($self->{prefix} . $key, freeze($value), $ttl // $self->{ttl}) < 0);
+    IRC::match_key($self->{match}, $key, 1) if ($self->{match});
+    return $value;
+}
+
+sub delete
+{
+    my ($self, $key) = @_;
+    my $value = IRC::store_del($self->{prefix} . $key);
+    return undef if (!defined($value));
+    IRC::match_key($self->{match}, $key, 0) if ($self->{match});
+    return thaw($value);
+}
+
+# $cb gets the value and returns what it becomes (undef deletes it). It's
+# called again if another worker changed it meanwhile, so it must not do
+# anything but work out the new value
+sub update
+{
+    my ($self, $key, $cb, $ttl) = @_;
+    my $k = $self->{prefix} . $key;
+
+    for (;;) {
+        my ($old, $version) = IRC::store_get($k);
+        my $value = $cb->(defined($old) ? thaw($old) : undef);
+        if (!defined($value)) {
+            last if (!$version);
+            next if (!defined(IRC::store_del($k, $version)));
+            IRC::match_key($self->{match}, $key, 0) if ($self->{match});
+            return undef;
+        }
+        my $set = IRC::store_set($k, freeze($value), $ttl // $self->{ttl}, $version || 0);
+        Carp::croak("IRC::Store: no room for $key") if ($set < 0);
+        next if (!$set);
+        IRC::match_key($self->{match}, $key, 1) if ($self->{match});
+        return $value;
+    }
+    return undef;
+}
+
+sub keys { my $self = shift; return IRC::store_keys($self->{prefix}); }
+
+# Put every key in the match set again, for a master that started over
+# from a snapshot
+sub announce
+{
+    my $self = shift;
+    return if (!$self->{match});
+    IRC::match_key($self->{match}, $_, 1) foreach ($self->keys);
+}
+
+sub TIEHASH { my $class = shift; return $class->new(@_); }
+sub FETCH { return $_[0]->get($_[1]); }
+sub STORE { $_[0]->set($_[1], $_[2]); }
+sub DELETE { return $_[0]->delete($_[1]); }
+sub EXISTS { return $_[0]->exists($_[1]); }
+sub CLEAR { my $self = shift; $self->delete($_) foreach ($self->keys); }
+sub FIRSTKEY { my $self = shift; $self->{each} = [$self->keys]; return shift(@{$self->{each}}); }
+sub NEXTKEY { return shift(@{$_[0]{each}}); }
+sub SCALAR { return scalar(my @keys = $_[0]->keys); }
+
+# A module's database, through the storage process (IRC::db_*, see the POD)
+package IRC::Database;
+
+sub new
+{
+    my ($class, $path, %opt) = @_;
+    return bless({path => $path, schema => $opt{schema} || [], pid => 0}, $class);
+}
+
+# The schema goes ahead of a process's first query, the storage
+# process runs its queries in order so nothing has to wait for it
+sub prepare
+{
+    my $self = shift;
+    return if ($self->{pid} == $$);
+    foreach my $sql (@{$self->{schema}}) {
+        IRC::db_do($self->{path}, $sql, [], sub { warn "IRC::Database: $self->{path}: $sql: $_[1]\n" if (defined($_[1])); });
+    }
+    $self->{pid} = $$;
+}
+
+# $cb gets the rows (hash references) and an error
+sub select
+{
+    my $cb = pop;
+    my ($self, $sql, @params) = @_;
+    $self->prepare;
+    return IRC::db_select($self->{path}, $sql, \@params, $cb);
+}
+
+# $cb, if there is one, gets the count of rows it changed, an error and
+# the last rowid it inserted once it's committed
+sub do
+{
+    my $self = shift;
+    my $cb = ref($_[-1]) eq 'CODE' ? pop : undef;
+    my ($sql, @params) = @_;
+    $self->prepare;
+    return IRC::db_do($self->{path}, $sql, \@params, $cb);
+}
+
+package IRC;
+
 # Autoload methods go after =cut, and are processed by the autosplit program.
 
 1;
@@ -80,6 +221,113 @@ unedited.
 
 Blah blah blah.
 
+=head2 EVENT LOOP
+
+Workers run an event loop, handlers that wait on something (the
+network, a child process) can return right away and carry on from
+callbacks on it, so the worker takes other events in the meantime.
+
+  my $later = $msg->defer;           # $msg is only good until we return
+  my $w; $w = IRC::timer(2, 0, sub { # after 2 seconds, once
+      $later->say("done");
+      undef $w;
+  });
+
+  IRC::timer($after, $interval, $cb)  # again every $interval if it's > 0
+  IRC::io($fh, $write, $cb)           # whenever $fh (or an fd) is readable, writable if $write
+
+Both return a watcher, the callback stops once you drop it, so keep it
+somewhere. Callbacks get no arguments, a callback that dies only
+warns. Watchers can't be made while modules load and they are gone
+after a reload.
+
+  IRC::http($method, $url, %options, sub {
+      my ($body, $headers) = @_;
+  });
+  IRC::http_get($url, %options, $cb); # also http_head, http_post($url, $body, ...)
+
+Requests share kept alive connections per host and follow redirects.
+The options are timeout (seconds, 30), max_size (bytes of the body
+kept, 1 MB), redirects (5), headers (hash or array ref) and body.
+Header names in $headers are lower case, $headers->{Status} is the
+HTTP status or 599 when there was no response (the body is undef then
+and $headers->{Reason} says why), $headers->{URL} where it ended up and
+$headers->{Truncated} is set if the body was cut at max_size. Requests
+run whether or not you keep what IRC::http returns, $req->cancel
+drops one. IRC::http_tls is true when https urls work, they need
+machine built against libevent 2.1 (IRC::http dies on them otherwise
+and won't follow a redirect to one).
+
+GET and HEAD requests with a cache option (seconds) are answered from
+memory all the workers share when one of them asked for the same url
+(with the same headers) within that time. Failures and statuses >= 400
+are kept for cache_errors seconds instead (at most 60 by default, < 0
+to not keep them). While a worker fetches one the others asking for it
+wait for its answer rather than fetching it too.
+
+  IRC::cache_set($key, $value, $ttl); # false if it didn't fit
+  IRC::cache_get($key);               # undef once it expired or got evicted
+  IRC::cache_del($key);
+
+The same memory holds whatever else modules want to share, the least
+recently used values go first when it fills up.
+
+=head2 SHARED STATE
+
+State every worker should see goes in the master's store (state_size
+MB in the config, 4 by default), by name so modules keep out of each
+other's way. Nothing is dropped to make room, a key stays until it's
+deleted or its ttl (seconds, 0 for good) runs out. With state_file set
+the master saves it every minute and when it stops, and starts from
+there again.
+
+  my $seen = IRC::Store->new('seen', ttl => 86400);
+  $seen->set($nick, {time => time, text => $text});
+  $seen->get($nick);                  # a copy, set it again to change it
+  $seen->exists($nick); $seen->delete($nick); $seen->keys;
+  $seen->update($nick, sub { my $old = shift; ...; return $new });
+
+  tie my %seen, 'IRC::Store', 'seen'; # the same as a hash
+
+Values are strings or references (frozen with Storable), changing what
+a reference fetched points to changes nothing in the store. update()
+is for changing a value other workers may change too: its sub gets the
+current value and returns the new one (undef deletes it), and it's
+called again if another worker got there first. With match => $set the
+store's keys are kept in that filter set (nick_in, source_in) of the
+master's, $store->announce puts them all in again.
+
+Without a store (or in the master, which loads the modules before
+there's one) nothing is found and setting anything croaks.
+
+=head2 DATABASES
+
+Modules keep their tables in SQLite databases, but they don't open
+them themselves: the master runs a storage process that has them all
+open and workers send it their queries, the answers come back on the
+event loop.
+
+  my $db = IRC::Database->new($mod_perl::config::module_db,
+      schema => ['CREATE TABLE IF NOT EXISTS seen (nick text primary key, time int)']);
+  $db->select('SELECT * FROM seen WHERE nick = ?', $nick, sub {
+      my ($rows, $err) = @_;             # [{nick => ..., time => ...}, ...]
+  });
+  $db->do('REPLACE INTO seen VALUES (?, ?)', $nick, time, sub {
+      my ($changes, $err, $last_id) = @_;
+  });
+
+  IRC::db_select($path, $sql, \@params, $cb); # the same without the object
+  IRC::db_do($path, $sql, \@params, $cb);     # $cb may be undef
+
+The schema statements run before the first query each worker sends.
+Writes from every worker are committed together, a few milliseconds
+after the first of them or once there are enough, and $cb hears about
+a write after it's committed. Without a $cb a failed write only
+warns. A worker's queries run in the order it sends them, so a select
+after a do sees what it wrote. One statement per query, and no
+BEGIN/COMMIT of your own. Like IRC::http it only works from handlers,
+$query->cancel forgets about one (a write is done anyway).
+
 =head2 EXPORT
 
 None by default.
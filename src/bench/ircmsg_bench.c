@@ -0,0 +1,136 @@
+/*
+ * ircmsg_bench.c compare the view based parser against the legacy one
+ *
+ * usage: ircmsg_bench <traffic file> [rounds]
+ *
+ * The traffic file holds one line per message exactly as the workers
+ * receive them ("S<server> <raw irc line>"), e.g. captured by logging
+ * worker_event_callback() on a busy network.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <htable.h>
+#include "../ircmsg.h"
+#include "../ircmsg.t"
+#include "../config.h" /* gconfig */
+#include "../ircscan.h" /* ircscan_impl */
+#include "ircmsg_legacy.h"
+
+#define BENCH_MAXLINES 1000000
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int bench_streq(const char * a, const char * b)
+{
+    return a == b || (a && b && !strcmp(a, b));
+}
+
+/* Check that both parsers agree on every field the legacy parser got right */
+static size_t bench_verify(char ** lines, size_t count)
+{
+    size_t i, mismatch = 0;
+
+    for (i = 0; i < count; ++i) {
+        struct ircmsg * msg = Msg.parse(lines[i]);
+        struct ircmsg_legacy * old = ircmsg_legacy_parse(lines[i]);
+        int argc;
+
+        if (!bench_streq(Msg.nick(msg), old->pfx->nickname)
+                || !bench_streq(Msg.real(msg), old->pfx->realname)
+                || !bench_streq(Msg.host(msg), old->pfx->host)
+                || !bench_streq(Msg.command(msg), old->command)
+                || !bench_streq(Msg.text(msg), old->text)
+                /* Commands the legacy table didn't know are classified now */
+                || (old->type != IRC_UNSET && Msg.type(msg) != old->type)
+                || Msg.numeric(msg) != old->numeric) {
+            fprintf(stderr, "mismatch: %s\n", lines[i]);
+            ++mismatch;
+        }
+        /* The legacy parser dropped the last middle parameter, so only compare what it kept */
+        for (argc = 0; argc < old->argc; ++argc)
+            if (!bench_streq(Msg.argv(msg, argc), old->argv[argc])) {
+                fprintf(stderr, "argv[%d] mismatch: %s\n", argc, lines[i]);
+                ++mismatch;
+            }
+
+        Msg.free(msg);
+        ircmsg_legacy_free(old);
+    }
+
+    return mismatch;
+}
+
+int main(int argc, char ** argv)
+{
+    static char * lines[BENCH_MAXLINES];
+    char buf[BUFSIZ];
+    size_t count = 0, bytes = 0, i;
+    long rounds, r;
+    double start, legacy, views;
+    FILE * fp;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <traffic file> [rounds]\n", argv[0]);
+        return 1;
+    }
+    if (!(fp = fopen(argv[1], "r"))) {
+        perror(argv[1]);
+        return 1;
+    }
+    rounds = argc > 2 ? strtol(argv[2], NULL, 10) : 2000;
+    /* Both parsers look the server up, so give them an (empty) table as main() does */
+    gconfig.servers = htable.new(1000);
+
+    while (count < BENCH_MAXLINES && fgets(buf, sizeof buf, fp)) {
+        buf[strcspn(buf, "\r\n")] = '\0';
+        if (!*buf)
+            continue;
+        bytes += strlen(buf);
+        lines[count++] = strdup(buf);
+    }
+    fclose(fp);
+
+    if (!count) {
+        fprintf(stderr, "no lines in %s\n", argv[1]);
+        return 1;
+    }
+
+    printf("lines: %zu (%zu bytes) rounds: %ld scanner: %s\n", count, bytes, rounds, ircscan_impl());
+    printf("sizeof struct ircmsg_legacy: %zu + prefix %zu\n",
+            sizeof (struct ircmsg_legacy), sizeof (struct ircmsg_legacy_prefix));
+    printf("sizeof struct ircmsg:        %zu + line\n", sizeof (struct ircmsg));
+    printf("field mismatches: %zu\n", bench_verify(lines, count));
+
+    start = bench_now();
+    for (r = 0; r < rounds; ++r)
+        for (i = 0; i < count; ++i)
+            ircmsg_legacy_free(ircmsg_legacy_parse(lines[i]));
+    legacy = bench_now() - start;
+
+    start = bench_now();
+    for (r = 0; r < rounds; ++r)
+        for (i = 0; i < count; ++i)
+            Msg.free(Msg.parse(lines[i]));
+    views = bench_now() - start;
+
+    printf("legacy: %8.1f ns/line %8.1f MB/s\n",
+            legacy * 1e9 / (count * rounds), bytes * rounds / legacy / 1e6);
+    printf("views:  %8.1f ns/line %8.1f MB/s (%.2fx)\n",
+            views * 1e9 / (count * rounds), bytes * rounds / views / 1e6, legacy / views);
+
+    for (i = 0; i < count; ++i)
+        free(lines[i]);
+
+    return 0;
+}
+
+/* end ircmsg_bench.c */
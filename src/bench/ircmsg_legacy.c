@@ -0,0 +1,273 @@
+/*
+ * ircmsg_legacy.c the original (copying) IRC message parser
+ *
+ * Frozen copy of the parser as it was before ircmsg.c switched to
+ * views into a single owned line. Only used by ircmsg_bench to
+ * compare the two on recorded traffic, do not use it anywhere else.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <htable.h> /* Urlib */
+#include "../xstr.h" /* xstrndup */
+#include "../ircmsg.h" /* enum ircmsg_type */
+#include "../config.h" /* gconfig */
+
+#include "ircmsg_legacy.h"
+
+#define ARRAY_SIZE(x) (sizeof (x) / sizeof *(x))
+
+static const struct ircmsg_legacy legacy_initializer;
+
+static enum ircmsg_type legacy_determine_type(struct ircmsg_legacy * msg)
+{
+    struct types_ {
+        const char * s;
+        enum ircmsg_type type;
+    };
+    static struct htable * htab;
+
+    if (!htab) {
+        size_t i;
+        static struct types_ types[] = { 
+            {"JOIN", IRC_JOIN},
+            {"KICK", IRC_KICK},
+            {"MODE", IRC_MODE},
+            {"NICK", IRC_NICK},
+            {"NOTICE", IRC_NOTICE},
+            {"PART", IRC_PART},
+            {"PING", IRC_PING},
+            {"PRIVMSG", IRC_PRIVMSG},
+            {"QUIT", IRC_QUIT},
+            {"TOPIC", IRC_TOPIC},
+        };
+
+        htab = htable.new(30);
+
+        for (i = 0; i < sizeof types / sizeof *types; ++i)
+            htable.store(htab, types[i].s, &types[i]);
+    }
+
+    /* Check for NUMERIC type first as it's the common case, then command */
+    if (*msg->command >= '0' && *msg->command <= '9') {
+        msg->type = IRC_NUMERIC;
+        sscanf(msg->command, "%03hd", &msg->numeric);
+    } else {
+        /* Check hash table for our type */
+        struct types_ * t = htable.lookup(htab, msg->command);
+
+        if (t)
+            msg->type = t->type;
+    }
+
+
+    return msg->type;
+}
+
+/****************************************************************************
+ * FSM parser for IRC Message format
+ ****************************************************************************/
+struct legacy_state {
+    const char * line;
+    struct ircmsg_legacy * event;
+
+    /* Set to next state and return function, NULL stops FSM */
+    struct legacy_state * (*next)(struct legacy_state * state);
+};
+static struct legacy_state * legacy_st_cid(struct legacy_state * state);
+static struct legacy_state * legacy_st_begin(struct legacy_state * state);
+static struct legacy_state * legacy_st_prefix(struct legacy_state * state);
+static struct legacy_state * legacy_st_command(struct legacy_state * state);
+static struct legacy_state * legacy_st_params(struct legacy_state * state);
+
+static struct legacy_state * legacy_st_cid(struct legacy_state * state)
+{
+    int consumed;
+    state->next = legacy_st_begin;
+
+    /* Parse the connection id */
+	/* TODO this is a potential bufferoverflow since we dont check the size on servername in sscanf */
+    if (sscanf(state->line, "S%s %n", state->event->servername, &consumed)) {
+        state->line += consumed;
+		/* Get the server object for this message from the global config */
+		/* TODO decouple this, ircmsg should be agnostic of the htable.lookup server config */
+		state->event->server = htable.lookup(gconfig.servers, state->event->servername);
+	}
+
+
+    return state;
+}
+
+static struct legacy_state * legacy_st_begin(struct legacy_state * state)
+{
+    /* Check for prefix (and skip ':'), or move on to command state */
+    if (*state->line == ':' && ++state->line)
+        state->next = legacy_st_prefix;
+    else
+        state->next = legacy_st_command;
+    return state;
+}
+
+static struct legacy_state * legacy_st_prefix(struct legacy_state * state)
+{
+    const char * p;
+    state->next = legacy_st_command;
+    char cont = 1;
+
+    for (p = state->line; *p && cont; ++p) {
+        enum { BANG=1<<0, ATSIGN=1<<1, SPACE=1<<2 };
+        register short is_tok = (
+                  (*p == '!' ? BANG : 0)
+                | (*p == '@' ? ATSIGN : 0)
+                | (*p == ' ' ? SPACE : 0) 
+        );
+        /* Outer 'if' used to group state->line = p+1 assignment
+         * which has to come after the switch.. and would
+         * otherwise be repeated in each case */
+        if (is_tok) {
+            switch(is_tok) {
+            case BANG:
+                state->event->pfx->nickname = xstrndup(state->line, p - state->line );
+                break;
+            case ATSIGN:
+                state->event->pfx->realname = xstrndup(state->line, p - state->line );
+                break;
+            case SPACE:
+                state->event->pfx->host = xstrndup(state->line, p - state->line );
+                cont = 0; /* Stop looping here.. */
+                break;
+            }
+            /* start at next point (for copy) */
+            state->line = ++p;
+        }
+    }
+
+    return state;
+}
+
+static struct legacy_state * legacy_st_command(struct legacy_state * state)
+{
+    const char * p;
+    state->next = legacy_st_params;
+
+    if ( (p = xstrchrnul(state->line, ' ')) ) {
+        state->event->command = xstrndup(state->line, p - state->line );
+        state->line = p;
+        /* Now check the type we just copied into ->command */
+        legacy_determine_type(state->event);
+        /* Skip over the space we just found now */
+        if (*state->line) ++state->line;
+    }
+
+    return state;
+}
+
+static struct legacy_state * legacy_st_params(struct legacy_state * state)
+{
+    const char * p;
+
+    /* We always end here */
+    state->next = NULL;
+
+    for (p = state->line; *p; ++p) {
+        /* Found a text parameter, rest of string is our text */
+        if (*state->line == ':') {
+            state->event->text = xstrdup(++state->line);
+            break; /* we're done */
+        }
+
+        /* Parameter, copy it in and continue */
+        if (*p == ' ') {
+            if (state->event->argc >= ARRAY_SIZE(state->event->argv)) 
+                break;
+            state->event->argv[state->event->argc++] = xstrndup(state->line, p - state->line );
+            state->line = p+1;
+        }
+    }
+
+    return state;
+}
+
+/*
+ * RUN the FSM
+ */
+static void legacy_run(struct legacy_state * state)
+{
+    /* 
+     * Begin running 
+     */
+    while (state->next != NULL) {
+        /* Run current state (pass self as object) */
+        state->next(state);
+
+
+        /* Parse Failure!
+         * We could check here for the current state
+         * and report some more data..
+         */
+        if (!*state->line) 
+            state->next = NULL;
+    }
+}
+/****************************************************************************
+ * END FSM CODE
+ ****************************************************************************/
+
+struct ircmsg_legacy * ircmsg_legacy_parse(const char * line)
+{
+    struct ircmsg_legacy * msg;
+
+    do {
+        struct legacy_state state;
+
+        msg = malloc(sizeof *msg);
+        if (!msg)
+            break;
+        *msg = legacy_initializer;
+
+        msg->pfx = malloc(sizeof *msg->pfx);
+        if (!msg->pfx) {
+            free(msg);
+            msg = NULL;
+            break;
+        }
+        msg->pfx->host = 
+            msg->pfx->nickname =
+            msg->pfx->realname =
+            NULL;
+
+        /* Begin parsing */
+        state.event = msg;
+        state.line = line;
+        state.next = legacy_st_cid;
+        legacy_run(&state); /* start the EFSM */
+    }while(0);
+
+    return msg;
+}
+
+
+void ircmsg_legacy_free(struct ircmsg_legacy * msg)
+{
+    if (msg) {
+        if (msg->pfx) {
+            free(msg->pfx->nickname);
+            free(msg->pfx->realname);
+            free(msg->pfx->host);
+            free(msg->pfx); msg->pfx = NULL;
+        }
+        free(msg->text);
+        free(msg->command);
+
+        for (--msg->argc; msg->argc >= 0; --msg->argc)
+            free(msg->argv[msg->argc]);
+        /* The original leaked the message itself, free it so the
+         * benchmark doesn't measure a growing heap */
+        free(msg);
+    }
+}
+
+/* end ircmsg_legacy.c */
+
@@ -0,0 +1,28 @@
+#ifndef IRCMSG_LEGACY_HEADER__H_
+#define IRCMSG_LEGACY_HEADER__H_
+
+#define IRCMSG_LEGACY_MAXARGS 15
+
+/* Layout of struct ircmsg before the switch to views, see ircmsg_legacy.c */
+struct ircmsg_legacy_prefix {
+    char * host;
+    char * nickname;
+    char * realname;
+};
+
+struct ircmsg_legacy {
+    enum ircmsg_type type;
+	char servername[BUFSIZ]; 
+	struct server * server;
+    struct ircmsg_legacy_prefix * pfx;
+    short numeric;
+    char * command;
+    char * text;  
+    char * argv[IRCMSG_LEGACY_MAXARGS];
+    int argc;
+};
+
+struct ircmsg_legacy * ircmsg_legacy_parse(const char * line);
+void ircmsg_legacy_free(struct ircmsg_legacy * msg);
+
+#endif
@@ -0,0 +1,433 @@
+/* cache.c shared LRU cache for the workers, see cache.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h> /* kill() to tell if a claim's owner is gone */
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "cache.h"
+#include "log.h"
+
+/* Keys and values are kept in chains of these, the key first */
+#define CACHE_BLOCK 1024
+#define CACHE_BLOCK_DATA (CACHE_BLOCK - sizeof(uint32_t))
+/* Most of the blocks one entry may take, 1/n */
+#define CACHE_ENTRY_SHARE 8
+/* Smallest cache we make */
+#define CACHE_MIN_BLOCKS 64
+
+struct cache_block {
+    uint32_t next;                  /* Next block of its chain or the free list, 0 for none */
+    unsigned char data[CACHE_BLOCK_DATA];
+};
+
+struct cache_entry {
+    uint64_t hash;
+    uint64_t expires;               /* usec (CLOCK_MONOTONIC), a claim's deadline while it's pending */
+    uint32_t klen, vlen;
+    uint32_t block;                 /* First block, 0 for an unused entry */
+    uint32_t chain;                 /* Next entry in its bucket or the free list */
+    uint32_t prev, next;            /* LRU list, most recently used first */
+    pid_t owner;                    /* Who claimed it, 0 once it's filled in */
+};
+
+/*
+ * Everything lives in the one mapping, which every process has at the
+ * same address since they're all forked after it's made. Index 0 of the
+ * entries and blocks is never used so 0 can mean none
+ */
+struct cache {
+    pthread_mutex_t lock;           /* Robust, a worker can be killed holding it */
+    size_t size;                    /* Of the mapping */
+    uint32_t nbuckets, nentries, nblocks;
+    uint32_t fresh_entry, fresh_block; /* Never used up to here, so we don't touch pages we don't need */
+    uint32_t free_entry, free_block;
+    uint32_t free_entries, free_blocks; /* Counting the fresh ones */
+    uint32_t head, tail;            /* LRU list */
+    struct cache_stats stats;
+    uint32_t * buckets;
+    struct cache_entry * entries;
+    struct cache_block * blocks;
+};
+
+static uint64_t cache_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* FNV-1a */
+static uint64_t cache_hash(const void * key, size_t klen)
+{
+    const unsigned char * p = key;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (klen--) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline uint32_t cache_nblocks(size_t len)
+{
+    return len ? (len + CACHE_BLOCK_DATA - 1) / CACHE_BLOCK_DATA : 1;
+}
+
+/* Forget everything, for when we can't trust what's there */
+static void cache_clear(struct cache * cache)
+{
+    memset(cache->buckets, 0, cache->nbuckets * sizeof *cache->buckets);
+    cache->fresh_entry = cache->fresh_block = 1;
+    cache->free_entry = cache->free_block = 0;
+    cache->free_entries = cache->nentries;
+    cache->free_blocks = cache->nblocks;
+    cache->head = cache->tail = 0;
+    cache->stats.entries = 0;
+    cache->stats.used = 0;
+}
+
+struct cache * cache_new(size_t size)
+{
+    struct cache * cache;
+    pthread_mutexattr_t attr;
+    size_t per = CACHE_BLOCK + sizeof(struct cache_entry) + 2 * sizeof(uint32_t);
+    uint32_t nblocks, nbuckets = 1;
+    unsigned char * base;
+
+    if (size < sizeof *cache + (CACHE_MIN_BLOCKS + 1) * per) {
+        log_debug("[cache] %zu bytes is too small", size);
+        return NULL;
+    }
+    nblocks = (size - sizeof *cache) / per - 1;
+    while (nbuckets < nblocks)
+        nbuckets <<= 1;
+
+    /* Pages are only touched as they're used, a big cache costs nothing until it fills up */
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("cache_new mmap");
+        return NULL;
+    }
+    cache = (struct cache *)base;
+    cache->size = size;
+    cache->nbuckets = nbuckets;
+    cache->nentries = cache->nblocks = nblocks;
+    cache->buckets = (uint32_t *)(base + sizeof *cache);
+    cache->entries = (struct cache_entry *)(cache->buckets + nbuckets);
+    cache->blocks = (struct cache_block *)(cache->entries + nblocks + 1);
+    cache->stats.size = (size_t)nblocks * CACHE_BLOCK_DATA;
+    cache_clear(cache);
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if (pthread_mutex_init(&cache->lock, &attr)) {
+        log_debug("[cache] can't make a shared lock");
+        pthread_mutexattr_destroy(&attr);
+        munmap(base, size);
+        return NULL;
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    return cache;
+}
+
+void cache_free(struct cache * cache)
+{
+    if (cache) {
+        pthread_mutex_destroy(&cache->lock);
+        munmap(cache, cache->size);
+    }
+}
+
+static void cache_lock(struct cache * cache)
+{
+    if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD) {
+        log_debug("[cache] a worker died holding the lock, starting over");
+        cache_clear(cache);
+        pthread_mutex_consistent(&cache->lock);
+    }
+}
+
+static void cache_unlock(struct cache * cache)
+{
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static void cache_lru_unlink(struct cache * cache, uint32_t i)
+{
+    struct cache_entry * e = &cache->entries[i];
+
+    if (e->prev)
+        cache->entries[e->prev].next = e->next;
+    else
+        cache->head = e->next;
+    if (e->next)
+        cache->entries[e->next].prev = e->prev;
+    else
+        cache->tail = e->prev;
+    e->prev = e->next = 0;
+}
+
+static void cache_lru_push(struct cache * cache, uint32_t i)
+{
+    struct cache_entry * e = &cache->entries[i];
+
+    e->prev = 0;
+    e->next = cache->head;
+    if (cache->head)
+        cache->entries[cache->head].prev = i;
+    else
+        cache->tail = i;
+    cache->head = i;
+}
+
+/* Read or write 'len' bytes 'offset' into an entry's chain */
+static void cache_copy(struct cache * cache, uint32_t block, size_t offset, void * out, const void * in, size_t len)
+{
+    size_t n;
+
+    for (; offset >= CACHE_BLOCK_DATA; offset -= CACHE_BLOCK_DATA)
+        block = cache->blocks[block].next;
+    while (len) {
+        n = CACHE_BLOCK_DATA - offset < len ? CACHE_BLOCK_DATA - offset : len;
+        if (out) {
+            memcpy(out, cache->blocks[block].data + offset, n);
+            out = (unsigned char *)out + n;
+        } else {
+            memcpy(cache->blocks[block].data + offset, in, n);
+            in = (const unsigned char *)in + n;
+        }
+        len -= n;
+        offset = 0;
+        block = cache->blocks[block].next;
+    }
+}
+
+static bool cache_key_equal(struct cache * cache, const struct cache_entry * e, const void * key, size_t klen)
+{
+    uint32_t block = e->block;
+    size_t n;
+
+    if (e->klen != klen)
+        return false;
+    for (; klen; klen -= n, key = (const unsigned char *)key + n, block = cache->blocks[block].next) {
+        n = klen < CACHE_BLOCK_DATA ? klen : CACHE_BLOCK_DATA;
+        if (memcmp(cache->blocks[block].data, key, n))
+            return false;
+    }
+    return true;
+}
+
+static uint32_t cache_find(struct cache * cache, uint64_t hash, const void * key, size_t klen)
+{
+    uint32_t i;
+
+    for (i = cache->buckets[hash & (cache->nbuckets - 1)]; i; i = cache->entries[i].chain)
+        if (cache->entries[i].hash == hash && cache_key_equal(cache, &cache->entries[i], key, klen))
+            return i;
+    return 0;
+}
+
+static void cache_remove(struct cache * cache, uint32_t i)
+{
+    struct cache_entry * e = &cache->entries[i];
+    uint32_t * link = &cache->buckets[e->hash & (cache->nbuckets - 1)];
+    uint32_t block, next;
+
+    while (*link != i)
+        link = &cache->entries[*link].chain;
+    *link = e->chain;
+    cache_lru_unlink(cache, i);
+
+    for (block = e->block; block; block = next) {
+        next = cache->blocks[block].next;
+        cache->blocks[block].next = cache->free_block;
+        cache->free_block = block;
+        cache->free_blocks++;
+    }
+    cache->stats.entries--;
+    cache->stats.used -= e->klen + e->vlen;
+
+    *e = (struct cache_entry){.chain = cache->free_entry};
+    cache->free_entry = i;
+    cache->free_entries++;
+}
+
+/* A claim nobody is going to fill in anymore, or a value that's past its ttl */
+static bool cache_stale(const struct cache_entry * e, uint64_t now)
+{
+    if (now >= e->expires)
+        return true;
+    return e->owner && e->owner != getpid() && kill(e->owner, 0) == -1 && errno == ESRCH;
+}
+
+/* Evict the least recently used entries until 'blocks' are free and an entry is, false if we can't */
+static bool cache_room(struct cache * cache, uint32_t blocks)
+{
+    uint32_t i = cache->tail, prev;
+
+    while ((cache->free_blocks < blocks || !cache->free_entries) && i) {
+        prev = cache->entries[i].prev;
+        /* Claims aren't ours to drop, they're small and go soon enough */
+        if (!cache->entries[i].owner) {
+            cache_remove(cache, i);
+            cache->stats.evictions++;
+        }
+        i = prev;
+    }
+    return cache->free_blocks >= blocks && cache->free_entries;
+}
+
+/* New entry with room for 'len' bytes after the key, which is copied in, 0 if there's no room */
+static uint32_t cache_insert(struct cache * cache, uint64_t hash, const void * key, size_t klen, size_t len)
+{
+    uint32_t blocks = cache_nblocks(klen + len), i, block, * link;
+    struct cache_entry * e;
+
+    if (blocks > cache->nblocks / CACHE_ENTRY_SHARE || !cache_room(cache, blocks))
+        return 0;
+
+    if ((i = cache->free_entry))
+        cache->free_entry = cache->entries[i].chain;
+    else
+        i = cache->fresh_entry++;
+    cache->free_entries--;
+    e = &cache->entries[i];
+    *e = (struct cache_entry){.hash = hash, .klen = klen, .vlen = len};
+
+    for (link = &e->block; blocks--; link = &cache->blocks[block].next) {
+        if ((block = cache->free_block))
+            cache->free_block = cache->blocks[block].next;
+        else
+            block = cache->fresh_block++;
+        cache->free_blocks--;
+        cache->blocks[block].next = 0;
+        *link = block;
+    }
+    cache_copy(cache, e->block, 0, NULL, key, klen);
+
+    link = &cache->buckets[hash & (cache->nbuckets - 1)];
+    e->chain = *link;
+    *link = i;
+    cache_lru_push(cache, i);
+    cache->stats.entries++;
+    cache->stats.used += klen + len;
+
+    return i;
+}
+
+/* cache_get() and cache_claim(), 'hold' < 0 for no claim */
+static enum cache_result cache_lookup(struct cache * cache, const void * key, size_t klen, double hold, void ** value, size_t * len)
+{
+    uint64_t hash = cache_hash(key, klen), now = cache_now();
+    enum cache_result res = CACHE_MISS;
+    struct cache_entry * e;
+    uint32_t i;
+
+    cache_lock(cache);
+    if ((i = cache_find(cache, hash, key, klen)) && cache_stale(&cache->entries[i], now)) {
+        cache_remove(cache, i);
+        i = 0;
+    }
+    e = i ? &cache->entries[i] : NULL;
+
+    if (e && e->owner) {
+        if (hold >= 0)
+            res = CACHE_PENDING;
+    } else if (e) {
+        if ( (*value = malloc(e->vlen ? e->vlen : 1)) ) {
+            cache_copy(cache, e->block, e->klen, *value, NULL, e->vlen);
+            *len = e->vlen;
+            cache_lru_unlink(cache, i);
+            cache_lru_push(cache, i);
+            cache->stats.hits++;
+            res = CACHE_HIT;
+        } else {
+            perror("cache_lookup malloc");
+        }
+    } else {
+        cache->stats.misses++;
+        /* No room for a claim just means nobody waits on this one */
+        if (hold >= 0 && (i = cache_insert(cache, hash, key, klen, 0))) {
+            cache->entries[i].owner = getpid();
+            cache->entries[i].expires = now + (uint64_t)(hold * 1000000);
+            res = CACHE_CLAIMED;
+        }
+    }
+    cache_unlock(cache);
+
+    return res;
+}
+
+enum cache_result cache_get(struct cache * cache, const void * key, size_t klen, void ** value, size_t * len)
+{
+    return cache_lookup(cache, key, klen, -1, value, len);
+}
+
+enum cache_result cache_claim(struct cache * cache, const void * key, size_t klen, double hold, void ** value, size_t * len)
+{
+    return cache_lookup(cache, key, klen, hold < 0 ? 0 : hold, value, len);
+}
+
+int cache_put(struct cache * cache, const void * key, size_t klen, const void * value, size_t len, double ttl)
+{
+    uint64_t hash = cache_hash(key, klen);
+    uint32_t i;
+
+    cache_lock(cache);
+    if ((i = cache_find(cache, hash, key, klen)))
+        cache_remove(cache, i);
+    if ((i = cache_insert(cache, hash, key, klen, len))) {
+        cache_copy(cache, cache->entries[i].block, klen, NULL, value, len);
+        cache->entries[i].expires = cache_now() + (uint64_t)(ttl * 1000000);
+    }
+    cache_unlock(cache);
+
+    return i ? 0 : -1;
+}
+
+void cache_release(struct cache * cache, const void * key, size_t klen)
+{
+    uint32_t i;
+
+    cache_lock(cache);
+    if ((i = cache_find(cache, cache_hash(key, klen), key, klen)) && cache->entries[i].owner == getpid())
+        cache_remove(cache, i);
+    cache_unlock(cache);
+}
+
+void cache_del(struct cache * cache, const void * key, size_t klen)
+{
+    uint32_t i;
+
+    cache_lock(cache);
+    if ((i = cache_find(cache, cache_hash(key, klen), key, klen)))
+        cache_remove(cache, i);
+    cache_unlock(cache);
+}
+
+void cache_waited(struct cache * cache)
+{
+    cache_lock(cache);
+    cache->stats.waits++;
+    cache_unlock(cache);
+}
+
+void cache_stats(struct cache * cache, struct cache_stats * stats)
+{
+    cache_lock(cache);
+    *stats = cache->stats;
+    cache_unlock(cache);
+}
+
+/* end cache.c */
@@ -0,0 +1,53 @@
+#ifndef CACHE_HEADER__H_
+#define CACHE_HEADER__H_
+
+#include <stddef.h> /* size_t */
+#include <stdint.h>
+
+/* Default size of the workers' shared cache (config: http_cache, in MB) */
+#define CACHE_SIZE (16 << 20)
+
+/*
+ * LRU key/value cache in a shared mapping, made by the master before
+ * it forks so every worker sees the same one. Entries expire after
+ * their ttl and the least recently used ones make room for new ones.
+ *
+ * A miss can be claimed (cache_claim()): the one that got it fetches
+ * the value and cache_put()s it, everyone else asking meanwhile is told
+ * it's pending and waits for it instead of fetching it too. A claim
+ * lapses after the time it was taken for or when its owner died.
+ */
+struct cache;
+
+enum cache_result {
+    CACHE_MISS,
+    CACHE_HIT,
+    CACHE_PENDING, /* Someone else claimed it and is getting it */
+    CACHE_CLAIMED  /* It's ours to get now, put or release it */
+};
+
+struct cache_stats {
+    size_t size, used;           /* Bytes for values, and how many of them hold one */
+    unsigned long entries;
+    unsigned long hits, misses, evictions;
+    unsigned long waits;         /* cache_waited() */
+};
+
+struct cache * cache_new(size_t size);
+void cache_free(struct cache * cache);
+
+/* A copy of the value (caller frees) on CACHE_HIT, a claimed entry is a miss here */
+enum cache_result cache_get(struct cache * cache, const void * key, size_t klen, void ** value, size_t * len);
+/* Same, but claim it for 'hold' seconds if it's missing */
+enum cache_result cache_claim(struct cache * cache, const void * key, size_t klen, double hold, void ** value, size_t * len);
+/* Store a value for 'ttl' seconds (filling in a claim), -1 if it can't fit */
+int cache_put(struct cache * cache, const void * key, size_t klen, const void * value, size_t len, double ttl);
+/* Give up our claim without a value, those waiting on it can claim it next */
+void cache_release(struct cache * cache, const void * key, size_t klen);
+void cache_del(struct cache * cache, const void * key, size_t klen);
+/* Count one that waited on someone else's claim instead of getting it itself */
+void cache_waited(struct cache * cache);
+
+void cache_stats(struct cache * cache, struct cache_stats * stats);
+
+#endif
@@ -20,6 +20,7 @@
 #include <openssl/rand.h>
 
 #include <stdarg.h>
+#include <string.h> /* memchr */
 
 #include "con.h"
 #include "con.t"
@@ -205,7 +206,7 @@ int con_connect(struct con * con, struct event_base * evbase)
 
         /* Establish callbacks (make con object the argument) */
         bufferevent_setcb(bev, con_read_callback, con_write_callback, con_event_callback, con);
-        bufferevent_enable(bev, EV_READ|EV_WRITE);
+        bufferevent_enable(bev, (con->flags & CF_PAUSED) ? EV_WRITE : EV_READ|EV_WRITE);
         /* Set the read timeout on the socket so if we stop getting data for this long, restart */
         bufferevent_set_timeouts(bev, &(struct timeval){.tv_sec = CON_READ_TIMEOUT}, NULL);
 
@@ -295,6 +296,33 @@ int con_puts(struct con * con, const char * s)
     return r;
 }
 
+/*
+ * Write one line of 'len' bytes to a con object, it ends at the
+ * first CR or LF in it (so a payload can't carry a second command)
+ * and CRLF is appended
+ *
+ * Return: number of bytes buffered, -1 on error
+ */
+int con_write(struct con * con, const char * s, size_t len)
+{
+    struct evbuffer * out;
+    const char * eol;
+
+    if (!con)
+        return 0;
+
+    if ( (eol = memchr(s, '\n', len)) )
+        len = eol - s;
+    if ( (eol = memchr(s, '\r', len)) )
+        len = eol - s;
+
+    out = bufferevent_get_output(con->bev);
+    if (evbuffer_add(out, s, len) == -1 || evbuffer_add(out, "\r\n", 2) == -1)
+        return -1;
+
+    return len + 2;
+}
+
 /*
  * Setters/getters for opaque interface
  */
@@ -315,6 +343,24 @@ void con_callbacks(struct con * con, void * readcb, void * writecb, void * event
     if (eventcb) con->cb->eventcb = eventcb;
 }
 
+void con_pause(struct con * con, short tf)
+{
+    if (!con)
+        return;
+
+    if (tf)
+        con->flags |= CF_PAUSED;
+    else
+        con->flags &= ~CF_PAUSED;
+
+    if (con->bev) {
+        if (tf)
+            bufferevent_disable(con->bev, EV_READ);
+        else
+            bufferevent_enable(con->bev, EV_READ);
+    }
+}
+
 /* Set to NULL host if you just want to set port or 0 for port if just host */
 int con_port(struct con * con, int port)
 {
@@ -349,10 +395,12 @@ const struct con_api Con = {
     .cid = con_cid,
     .userdata = con_userdata,
     .callbacks = con_callbacks,
+    .pause = con_pause,
 
     /* Write interface */
     .printf = con_printf,
     .puts = con_puts,
+    .write = con_write,
 };
 
 
@@ -8,6 +8,7 @@ enum con_flags {
     CF_NONE        = 1 << 0, /* default flags */
     CF_SSL         = 1 << 1, /* negotiate SSL for this connection */
     CF_RECONNECT   = 1 << 2, /* automatically reconnect when disconnected */
+    CF_PAUSED      = 1 << 3, /* not reading from the connection (see Con.pause) */
 };
 
 enum con_events {
@@ -40,10 +41,13 @@ struct con_api {
     unsigned long (*cid)(struct con * con);
     void * (*userdata)(struct con * con, void * userdata);
     void (*callbacks)(struct con * con, void * readcb, void * writecb, void * eventcb);
+    /* Stop (tf true) or start reading from the connection again, sticks across reconnects */
+    void (*pause)(struct con * con, short tf);
 
     /* Write interface to connection */
     int (*printf)(struct con * con, const char * fmt, ...);
     int (*puts)(struct con * con, const char * s);
+    int (*write)(struct con * con, const char * s, size_t len); /* one line, CRLF appended */
 };
 
 
@@ -9,6 +9,7 @@
 
 struct server {
     struct con * con; /* Connection object for this server */
+    unsigned short id; /* Index in gconfig.server_ids, identifies the server to the workers */
     const char * name; /* Name that identifies the server, used to key it in the hash of servers */
     const char * host;
     short int port;
@@ -17,6 +18,7 @@ struct server {
     bool use_password;
     bool use_knock;    /* Server requires a knock sequence to open the 'port' above! */
     const char * knock_sequence; /* This will contain a list of space separated ports to knock to open the port above */
+    bool paused;       /* We stopped reading from it until the workers catch up */
 
 	/* identity info */
     const char * nick; // nickname to use on the server
@@ -28,6 +30,8 @@ struct config {
     const char * nick;
     const char * real;
     struct htable * servers;
+    struct server * server_ids[MAX_SERVERS]; /* Servers by id (struct server.id) */
+    unsigned short nservers;
     struct event_base * evbase;
 };
 
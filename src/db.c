@@ -0,0 +1,347 @@
+/* db.c the workers' side of the storage process, and the protocol they speak, see db.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h> /* offsetof */
+#include <unistd.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include "db.h"
+#include "ipc.h"
+#include "log.h"
+
+/* Backlog of connections waiting for the storage process, it may be restarting */
+#define DB_BACKLOG 64
+
+struct db_request {
+    struct db * db;
+    uint32_t seq;
+    db_callback cb;                     /* NULL once it's forgotten */
+    void * data;
+    TAILQ_ENTRY(db_request) next;
+};
+
+struct db {
+    struct event_base * base;
+    char * name;
+    struct bufferevent * bev;           /* NULL until the first query, and after the storage process went away */
+    uint32_t seq;
+    TAILQ_HEAD(, db_request) pending;   /* Sent and not answered yet, writes are answered in order */
+};
+
+/* Abstract address (no file) for 'name', returns its length */
+static socklen_t db_address(const char * name, struct sockaddr_un * sun)
+{
+    size_t len = strlen(name);
+
+    memset(sun, 0, sizeof *sun);
+    sun->sun_family = AF_UNIX;
+    if (len > sizeof sun->sun_path - 1)
+        len = sizeof sun->sun_path - 1;
+    memcpy(sun->sun_path + 1, name, len);
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+int db_listen(const char * name)
+{
+    struct sockaddr_un sun;
+    socklen_t len = db_address(name, &sun);
+    int sock;
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        perror("db_listen socket");
+        return -1;
+    }
+    if (bind(sock, (struct sockaddr *)&sun, len) == -1 || listen(sock, DB_BACKLOG) == -1
+            || evutil_make_socket_nonblocking(sock) == -1) {
+        perror("db_listen bind");
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+int db_put_value(struct evbuffer * out, const struct db_value * value)
+{
+    unsigned char type = value->type;
+    uint32_t len;
+
+    if (evbuffer_add(out, &type, 1) == -1)
+        return -1;
+    switch (value->type) {
+        case DB_INT:
+            return evbuffer_add(out, &value->i, sizeof value->i);
+        case DB_FLOAT:
+            return evbuffer_add(out, &value->f, sizeof value->f);
+        case DB_TEXT:
+        case DB_BLOB:
+            if (value->s.len > IPC_MAXFRAME)
+                return -1;
+            len = value->s.len;
+            if (evbuffer_add(out, &len, sizeof len) == -1)
+                return -1;
+            return evbuffer_add(out, value->s.p, len);
+        default:
+            return 0;
+    }
+}
+
+const unsigned char * db_get_value(const unsigned char * p, const unsigned char * end, struct db_value * value)
+{
+    uint32_t len;
+
+    if (p >= end)
+        return NULL;
+    switch ((value->type = *p++)) {
+        case DB_NULL:
+            return p;
+        case DB_INT:
+            if ((size_t)(end - p) < sizeof value->i)
+                return NULL;
+            memcpy(&value->i, p, sizeof value->i);
+            return p + sizeof value->i;
+        case DB_FLOAT:
+            if ((size_t)(end - p) < sizeof value->f)
+                return NULL;
+            memcpy(&value->f, p, sizeof value->f);
+            return p + sizeof value->f;
+        case DB_TEXT:
+        case DB_BLOB:
+            if ((size_t)(end - p) < sizeof len)
+                return NULL;
+            memcpy(&len, p, sizeof len);
+            p += sizeof len;
+            if ((size_t)(end - p) < len)
+                return NULL;
+            value->s.p = p;
+            value->s.len = len;
+            return p + len;
+        default:
+            return NULL;
+    }
+}
+
+struct db * db_new(struct event_base * base, const char * name)
+{
+    struct db * db;
+
+    if ( !(db = calloc(1, sizeof *db)) || !(db->name = strdup(name)) ) {
+        perror("db_new");
+        free(db);
+        return NULL;
+    }
+    db->base = base;
+    TAILQ_INIT(&db->pending);
+
+    return db;
+}
+
+/* Answer everything still pending with 'error' and let go of the connection */
+static void db_disconnect(struct db * db, const char * error)
+{
+    TAILQ_HEAD(, db_request) failed = TAILQ_HEAD_INITIALIZER(failed);
+    struct db_request * req;
+
+    if (db->bev) {
+        bufferevent_free(db->bev);
+        db->bev = NULL;
+    }
+    /* A callback may send another query, that one goes out on a new connection */
+    TAILQ_CONCAT(&failed, &db->pending, next);
+    while ((req = TAILQ_FIRST(&failed))) {
+        TAILQ_REMOVE(&failed, req, next);
+        if (error && req->cb)
+            req->cb(&(struct db_result){.error = error}, req->data);
+        free(req);
+    }
+}
+
+void db_free(struct db * db)
+{
+    if (!db)
+        return;
+    db_disconnect(db, NULL);
+    free(db->name);
+    free(db);
+}
+
+/* One reply, 'p' past its sequence number */
+static void db_reply(struct db * db, const struct ipc_frame * frame, const unsigned char * p, const unsigned char * end)
+{
+    struct db_result res = {.error = NULL};
+    struct db_request * req;
+    const char ** names = NULL;
+    struct db_value * values = NULL;
+    uint32_t seq, nrows;
+    uint16_t ncols;
+    unsigned long i, n;
+
+    memcpy(&seq, p - sizeof seq, sizeof seq);
+    /* Reads are answered before the writes sent ahead of them, so it's not always the first */
+    TAILQ_FOREACH(req, &db->pending, next)
+        if (req->seq == seq)
+            break;
+    if (!req) {
+        log_debug("[db] reply to a query we didn't send (%u)", seq);
+        return;
+    }
+    TAILQ_REMOVE(&db->pending, req, next);
+
+    switch (frame->id) {
+        case DB_FAILED:
+            res.error = end > p && end[-1] == '\0' ? (const char *)p : "bad reply";
+            break;
+        case DB_DONE:
+            if ((size_t)(end - p) < sizeof res.changes + sizeof res.last_id) {
+                res.error = "bad reply";
+                break;
+            }
+            memcpy(&res.changes, p, sizeof res.changes);
+            memcpy(&res.last_id, p + sizeof res.changes, sizeof res.last_id);
+            break;
+        case DB_ROWS:
+            res.error = "bad reply";
+            if ((size_t)(end - p) < sizeof ncols)
+                break;
+            memcpy(&ncols, p, sizeof ncols);
+            p += sizeof ncols;
+            if ( !(names = calloc(ncols + 1, sizeof *names)) )
+                break;
+            for (i = 0; i < ncols && p < end; ++i) {
+                names[i] = (const char *)p;
+                if ( !(p = memchr(p, '\0', end - p)) )
+                    break;
+                ++p;
+            }
+            if (i < ncols || (size_t)(end - p) < sizeof nrows)
+                break;
+            memcpy(&nrows, p, sizeof nrows);
+            p += sizeof nrows;
+            /* Every value is at least its type byte */
+            n = (unsigned long)nrows * ncols;
+            if (n > (unsigned long)(end - p) || (n && !(values = calloc(n, sizeof *values))))
+                break;
+            for (i = 0; i < n && (p = db_get_value(p, end, &values[i])); ++i)
+                ;
+            if (i < n)
+                break;
+            res.error = NULL;
+            res.ncols = ncols;
+            res.nrows = nrows;
+            res.names = names;
+            res.values = values;
+            break;
+        default:
+            res.error = "bad reply";
+            break;
+    }
+
+    if (req->cb)
+        req->cb(&res, req->data);
+    free(names);
+    free(values);
+    free(req);
+}
+
+static void db_read_callback(struct bufferevent * bev, void * data)
+{
+    struct db * db = data;
+    struct evbuffer * in = bufferevent_get_input(bev);
+    const unsigned char * payload;
+    struct ipc_frame frame;
+
+    while ((payload = ipc_next(in, &frame))) {
+        if (frame.type == IPC_DB_REPLY && frame.len >= sizeof(uint32_t))
+            db_reply(db, &frame, payload + sizeof(uint32_t), payload + frame.len);
+        else
+            log_debug("[db] unexpected frame type %u from the storage process", frame.type);
+        ipc_drain(in, &frame);
+    }
+}
+
+static void db_event_callback(struct bufferevent * bev, short what, void * data)
+{
+    struct db * db = data;
+
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        log_debug("[db] lost the storage process, failing %s queries", TAILQ_EMPTY(&db->pending) ? "no" : "pending");
+        db_disconnect(db, "storage process went away");
+    }
+}
+
+static int db_connect(struct db * db)
+{
+    struct sockaddr_un sun;
+    socklen_t len = db_address(db->name, &sun);
+    int sock;
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        perror("db_connect socket");
+        return -1;
+    }
+    /* A unix socket is connected right away, or not at all */
+    if (connect(sock, (struct sockaddr *)&sun, len) == -1 || evutil_make_socket_nonblocking(sock) == -1) {
+        perror("db_connect");
+        close(sock);
+        return -1;
+    }
+    if ( !(db->bev = bufferevent_socket_new(db->base, sock, BEV_OPT_CLOSE_ON_FREE)) ) {
+        close(sock);
+        return -1;
+    }
+    bufferevent_setcb(db->bev, db_read_callback, NULL, db_event_callback, db);
+    bufferevent_enable(db->bev, EV_READ);
+
+    return 0;
+}
+
+struct db_request * db_query(struct db * db, enum db_op op, const char * database, const char * sql,
+        const struct db_value * params, unsigned int nparams, db_callback cb, void * data)
+{
+    struct db_request * req;
+    struct evbuffer * query;
+    uint16_t n = nparams;
+    unsigned int i;
+    int r = 0;
+
+    if (nparams > UINT16_MAX || (!db->bev && db_connect(db) == -1))
+        return NULL;
+    if ( !(req = calloc(1, sizeof *req)) || !(query = evbuffer_new()) ) {
+        free(req);
+        return NULL;
+    }
+    req->db = db;
+    req->seq = ++db->seq;
+    req->cb = cb;
+    req->data = data;
+
+    r |= evbuffer_add(query, &req->seq, sizeof req->seq);
+    r |= evbuffer_add(query, database, strlen(database) + 1);
+    r |= evbuffer_add(query, sql, strlen(sql) + 1);
+    r |= evbuffer_add(query, &n, sizeof n);
+    for (i = 0; i < nparams; ++i)
+        r |= db_put_value(query, &params[i]);
+    if (r || ipc_add(bufferevent_get_output(db->bev), IPC_DB_QUERY, op,
+                evbuffer_pullup(query, -1), evbuffer_get_length(query), NULL, 0) == -1) {
+        evbuffer_free(query);
+        free(req);
+        return NULL;
+    }
+    evbuffer_free(query);
+    TAILQ_INSERT_TAIL(&db->pending, req, next);
+
+    return req;
+}
+
+void db_forget(struct db_request * req)
+{
+    req->cb = NULL;
+}
@@ -0,0 +1,114 @@
+#ifndef DB_HEADER__H_
+#define DB_HEADER__H_
+
+#include <stddef.h> /* size_t */
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Writes the storage process commits together at most.. */
+#define DB_BATCH 256
+/* ..and the longest one waits for others to join it (msec) */
+#define DB_COMMIT_DELAY 20
+/* Page cache for each database the storage process has open (KB) */
+#define DB_CACHE (16 << 10)
+/* Longest it waits on a database someone else has locked (msec) */
+#define DB_BUSY_TIMEOUT 5000
+/* Prepared statements it keeps per database */
+#define DB_STATEMENTS 64
+/* Seconds before the master starts a storage process that died again */
+#define DB_RESTART 1
+
+/*
+ * Module databases (SQLite) go through one storage process the master
+ * forks, it keeps every database open (WAL journal) with its page cache
+ * warm. Workers send it queries on a unix socket (ipc.h frames) and get
+ * the answers on their event loop, a query never blocks a worker.
+ *
+ * Reads are answered right away. Writes go into a transaction that is
+ * committed once DB_BATCH of them are in or the first one waited
+ * DB_COMMIT_DELAY, they're only acknowledged after that. Queries on one
+ * connection run in the order they're sent, a read sees the writes sent
+ * before it whether or not they're committed yet.
+ *
+ * IPC_DB_QUERY (id: enum db_op) is a uint32_t sequence number,
+ * "<database>\0<sql>\0", uint16_t count of parameters and the
+ * parameters. IPC_DB_REPLY (id: enum db_status) is the sequence number
+ * it answers and:
+ *   DB_ROWS    uint16_t columns, their names ("<name>\0" each), uint32_t rows, the values row by row
+ *   DB_DONE    int64_t rows changed, int64_t last rowid inserted
+ *   DB_FAILED  "<message>\0"
+ * Values are a type byte and an int64_t (DB_INT), double (DB_FLOAT),
+ * uint32_t length and bytes (DB_TEXT, DB_BLOB) or nothing (DB_NULL).
+ */
+enum db_op {
+    DB_READ,
+    DB_WRITE
+};
+
+enum db_status {
+    DB_ROWS,
+    DB_DONE,
+    DB_FAILED
+};
+
+enum db_type {
+    DB_NULL = 'n',
+    DB_INT = 'i',
+    DB_FLOAT = 'f',
+    DB_TEXT = 's',
+    DB_BLOB = 'b'
+};
+
+struct db_value {
+    enum db_type type;
+    union {
+        int64_t i;
+        double f;
+        struct {
+            const void * p;
+            size_t len;
+        } s;                  /* DB_TEXT, DB_BLOB */
+    };
+};
+
+struct db_result {
+    const char * error;       /* NULL if it went through */
+    int64_t changes, last_id; /* Writes */
+    unsigned int ncols;       /* Reads */
+    unsigned long nrows;
+    const char * const * names;
+    const struct db_value * values; /* nrows * ncols, row by row */
+};
+
+/* The storage process counts what it did in here, the master shows it */
+struct db_stats {
+    atomic_ulong reads, writes, commits, failed;
+};
+
+struct db;
+struct db_request;
+struct evbuffer;
+struct event_base;
+
+/* Called once per request, unless it's forgotten before it's done */
+typedef void (*db_callback)(const struct db_result * res, void * data);
+
+/* Listening socket on the abstract unix address 'name', for the storage process, -1 on error */
+int db_listen(const char * name);
+
+/* Client on 'base' for the storage process listening on 'name', it connects on the first query */
+struct db * db_new(struct event_base * base, const char * name);
+/* Queries still going are dropped without their callbacks */
+void db_free(struct db * db);
+
+/* Send a query with 'nparams' parameters, NULL if the storage process can't be reached */
+struct db_request * db_query(struct db * db, enum db_op op, const char * database, const char * sql,
+        const struct db_value * params, unsigned int nparams, db_callback cb, void * data);
+/* Never call a request's callback, it's let go once it's answered */
+void db_forget(struct db_request * req);
+
+/* Protocol: append a value to 'out', and read one back (the next one, NULL if it runs past 'end') */
+int db_put_value(struct evbuffer * out, const struct db_value * value);
+const unsigned char * db_get_value(const unsigned char * p, const unsigned char * end, struct db_value * value);
+
+#endif
@@ -0,0 +1,602 @@
+/* dbd.c the storage process owning the modules' databases, see db.h */
+
+#define _GNU_SOURCE /* accept4, struct ucred */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#include <compat/queue.h> /* TAILQ_FOREACH_SAFE */
+#include <sqlite3.h>
+#include <htable.h>
+
+#include "db.h"
+#include "dbd.h"
+#include "ipc.h"
+#include "log.h"
+
+/* Biggest reply we build, the rest of a frame is headroom */
+#define DBD_MAX_REPLY (IPC_MAXFRAME - 4096)
+
+struct dbd_stmt {
+    char * sql;                         /* Its key in the statement cache */
+    sqlite3_stmt * stmt;
+};
+
+struct dbd_database {
+    char * path;
+    sqlite3 * handle;
+    struct htable * stmts;              /* sql -> struct dbd_stmt, DB_STATEMENTS at most */
+    unsigned int nstmts;
+    bool writing;                       /* In a transaction the next commit ends */
+    bool internal;                      /* Running our own BEGIN/COMMIT, the authorizer lets it */
+    char error[256];                    /* Why its commit failed, its acks get this */
+    SLIST_ENTRY(dbd_database) next;
+};
+
+struct dbd;
+
+struct dbd_conn {
+    struct dbd * dbd;
+    struct bufferevent * bev;
+    LIST_ENTRY(dbd_conn) next;
+};
+
+/* A write that's done, answered once it's committed */
+struct dbd_ack {
+    struct dbd_conn * conn;             /* NULL once the worker is gone */
+    struct dbd_database * database;
+    uint32_t seq;
+    int64_t changes, last_id;
+    TAILQ_ENTRY(dbd_ack) next;
+};
+
+struct dbd {
+    struct event_base * base;
+    struct event * evaccept;
+    struct event * evcommit;            /* Commits what's waiting after DB_COMMIT_DELAY */
+    struct event * evterm;
+    SLIST_HEAD(, dbd_database) databases;
+    LIST_HEAD(, dbd_conn) conns;
+    TAILQ_HEAD(, dbd_ack) acks;
+    unsigned int nacks;
+    struct db_stats * stats;
+    struct db_stats own;                /* Counted here when nobody gave us any */
+};
+
+static void dbd_reply(struct dbd_conn * conn, uint32_t seq, enum db_status status, const void * a, size_t alen)
+{
+    struct evbuffer * out = bufferevent_get_output(conn->bev);
+
+    if (ipc_add(out, IPC_DB_REPLY, status, &seq, sizeof seq, a, alen) == -1)
+        log_debug("[dbd] can't answer query %u", seq);
+}
+
+static void dbd_error(struct dbd_conn * conn, uint32_t seq, const char * error)
+{
+    ++conn->dbd->stats->failed;
+    dbd_reply(conn, seq, DB_FAILED, error, strlen(error) + 1);
+}
+
+/* Modules' statements can't end our transactions or open other files */
+static int dbd_authorizer(void * data, int action, const char * a, const char * b, const char * c, const char * d)
+{
+    struct dbd_database * database = data;
+
+    switch (action) {
+        case SQLITE_TRANSACTION:
+        case SQLITE_SAVEPOINT:
+        case SQLITE_ATTACH:
+        case SQLITE_DETACH:
+            return database->internal ? SQLITE_OK : SQLITE_DENY;
+        default:
+            return SQLITE_OK;
+    }
+}
+
+/* One of our own statements, outside of the statement cache */
+static int dbd_exec(struct dbd_database * database, const char * sql)
+{
+    int rc;
+
+    database->internal = true;
+    rc = sqlite3_exec(database->handle, sql, NULL, NULL, NULL);
+    database->internal = false;
+    if (rc != SQLITE_OK)
+        log_debug("[dbd] %s: %s failed: %s", database->path, sql, sqlite3_errmsg(database->handle));
+    return rc;
+}
+
+static int dbd_stmt_free(const char * key, void * data)
+{
+    struct dbd_stmt * stmt = data;
+
+    sqlite3_finalize(stmt->stmt);
+    free(stmt->sql);
+    free(stmt);
+    return 0;
+}
+
+static void dbd_database_free(struct dbd_database * database)
+{
+    if (database->stmts) {
+        htable.foreach(database->stmts, dbd_stmt_free);
+        htable.free(database->stmts);
+    }
+    /* The last connection to close checkpoints the WAL into the database */
+    sqlite3_close_v2(database->handle);
+    free(database->path);
+    free(database);
+}
+
+/* The open database at 'path', it's opened the first time it's asked for */
+static struct dbd_database * dbd_database(struct dbd * dbd, const char * path, const char ** error)
+{
+    struct dbd_database * database;
+    char pragma[64];
+
+    SLIST_FOREACH(database, &dbd->databases, next)
+        if (!strcmp(database->path, path))
+            return database;
+
+    if ( !(database = calloc(1, sizeof *database)) || !(database->path = strdup(path))
+            || !(database->stmts = htable.new(DB_STATEMENTS)) ) {
+        *error = "out of memory";
+        goto error;
+    }
+    if (sqlite3_open_v2(path, &database->handle, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        log_debug("[dbd] can't open %s: %s", path, database->handle ? sqlite3_errmsg(database->handle) : "out of memory");
+        *error = "can't open the database";
+        goto error;
+    }
+    sqlite3_busy_timeout(database->handle, DB_BUSY_TIMEOUT);
+    /* Readers never wait on the writer, and a commit doesn't wait on the disk */
+    dbd_exec(database, "PRAGMA journal_mode=WAL");
+    dbd_exec(database, "PRAGMA synchronous=NORMAL");
+    snprintf(pragma, sizeof pragma, "PRAGMA cache_size=-%d", DB_CACHE);
+    dbd_exec(database, pragma);
+    sqlite3_set_authorizer(database->handle, dbd_authorizer, database);
+
+    log_debug("[dbd] opened %s", path);
+    SLIST_INSERT_HEAD(&dbd->databases, database, next);
+    return database;
+
+error:
+    if (database) {
+        sqlite3_close_v2(database->handle);
+        if (database->stmts)
+            htable.free(database->stmts);
+        free(database->path);
+        free(database);
+    }
+    return NULL;
+}
+
+/* Prepared statement for 'sql', from the cache if it's there ('*cached' says if it stays) */
+static sqlite3_stmt * dbd_prepare(struct dbd_database * database, const char * sql, bool * cached)
+{
+    struct dbd_stmt * stmt;
+    sqlite3_stmt * prepared;
+    const char * tail;
+
+    if ( (stmt = htable.lookup(database->stmts, sql)) ) {
+        *cached = true;
+        return stmt->stmt;
+    }
+    if (sqlite3_prepare_v2(database->handle, sql, -1, &prepared, &tail) != SQLITE_OK)
+        return NULL;
+    if (!prepared) /* Only a comment or whitespace */
+        return NULL;
+    tail += strspn(tail, " \t\r\n;");
+    if (*tail) {
+        sqlite3_finalize(prepared);
+        return NULL;
+    }
+
+    *cached = false;
+    if (database->nstmts < DB_STATEMENTS && (stmt = malloc(sizeof *stmt))) {
+        if ( (stmt->sql = strdup(sql)) ) {
+            stmt->stmt = prepared;
+            htable.store(database->stmts, stmt->sql, stmt);
+            ++database->nstmts;
+            *cached = true;
+        } else {
+            free(stmt);
+        }
+    }
+    return prepared;
+}
+
+/* Answer every queued write, 'database' only if it's given, with its commit's error if it failed */
+static void dbd_acks(struct dbd * dbd, struct dbd_database * database, const char * error)
+{
+    struct dbd_ack * ack, * tmp;
+    int64_t done[2];
+
+    TAILQ_FOREACH_SAFE(ack, &dbd->acks, next, tmp) {
+        if (database && ack->database != database)
+            continue;
+        TAILQ_REMOVE(&dbd->acks, ack, next);
+        --dbd->nacks;
+        if (ack->conn && (error || ack->database->error[0])) {
+            dbd_error(ack->conn, ack->seq, error ? error : ack->database->error);
+        } else if (ack->conn) {
+            done[0] = ack->changes;
+            done[1] = ack->last_id;
+            dbd_reply(ack->conn, ack->seq, DB_DONE, done, sizeof done);
+        }
+        free(ack);
+    }
+}
+
+/* End every open transaction, then tell the workers how their writes went */
+static void dbd_commit(struct dbd * dbd)
+{
+    struct dbd_database * database;
+    bool open = false;
+
+    evtimer_del(dbd->evcommit);
+    /* Even with nothing to ack, a transaction whose writes all failed still holds the lock */
+    SLIST_FOREACH(database, &dbd->databases, next)
+        open |= database->writing;
+    if (!open && !dbd->nacks)
+        return;
+    SLIST_FOREACH(database, &dbd->databases, next) {
+        if (!database->writing)
+            continue;
+        database->writing = false;
+        if (dbd_exec(database, "COMMIT") != SQLITE_OK) {
+            snprintf(database->error, sizeof database->error, "commit failed: %s", sqlite3_errmsg(database->handle));
+            dbd_exec(database, "ROLLBACK");
+        }
+    }
+    ++dbd->stats->commits;
+    dbd_acks(dbd, NULL, NULL);
+    SLIST_FOREACH(database, &dbd->databases, next)
+        database->error[0] = '\0';
+}
+
+static void dbd_commit_callback(evutil_socket_t fd, short what, void * data)
+{
+    dbd_commit(data);
+}
+
+/* Rows for a read, as one DB_ROWS reply, NULL with the reason in '*error' if it fails */
+static struct evbuffer * dbd_rows(struct dbd_database * database, sqlite3_stmt * stmt, uint32_t seq, const char ** error)
+{
+    struct evbuffer * reply = evbuffer_new(), * rows = evbuffer_new();
+    uint16_t ncols = sqlite3_column_count(stmt);
+    uint32_t nrows = 0;
+    struct db_value value;
+    const char * name;
+    int rc, i;
+
+    if (!reply || !rows) {
+        *error = "out of memory";
+        goto error;
+    }
+    evbuffer_add(reply, &seq, sizeof seq);
+    evbuffer_add(reply, &ncols, sizeof ncols);
+    for (i = 0; i < ncols; ++i) {
+        name = sqlite3_column_name(stmt, i);
+        evbuffer_add(reply, name ? name : "", name ? strlen(name) + 1 : 1);
+    }
+
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        for (i = 0; i < ncols; ++i) {
+            switch (sqlite3_column_type(stmt, i)) {
+                case SQLITE_INTEGER:
+                    value = (struct db_value){.type = DB_INT, .i = sqlite3_column_int64(stmt, i)};
+                    break;
+                case SQLITE_FLOAT:
+                    value = (struct db_value){.type = DB_FLOAT, .f = sqlite3_column_double(stmt, i)};
+                    break;
+                case SQLITE_TEXT:
+                    value = (struct db_value){.type = DB_TEXT, .s.p = sqlite3_column_text(stmt, i)};
+                    value.s.len = sqlite3_column_bytes(stmt, i);
+                    break;
+                case SQLITE_BLOB:
+                    value = (struct db_value){.type = DB_BLOB, .s.p = sqlite3_column_blob(stmt, i)};
+                    value.s.len = sqlite3_column_bytes(stmt, i);
+                    break;
+                default:
+                    value = (struct db_value){.type = DB_NULL};
+                    break;
+            }
+            db_put_value(rows, &value);
+        }
+        ++nrows;
+        if (evbuffer_get_length(reply) + evbuffer_get_length(rows) > DBD_MAX_REPLY) {
+            *error = "too many rows, ask for fewer";
+            goto error;
+        }
+    }
+    if (rc != SQLITE_DONE) {
+        *error = sqlite3_errmsg(database->handle);
+        goto error;
+    }
+
+    evbuffer_add(reply, &nrows, sizeof nrows);
+    evbuffer_add_buffer(reply, rows);
+    evbuffer_free(rows);
+    return reply;
+
+error:
+    if (reply)
+        evbuffer_free(reply);
+    if (rows)
+        evbuffer_free(rows);
+    return NULL;
+}
+
+/* Run one query, reads are answered now and writes once they're committed */
+static void dbd_query(struct dbd_conn * conn, enum db_op op, uint32_t seq, const char * path, const char * sql,
+        const struct db_value * params, unsigned int nparams)
+{
+    struct dbd * dbd = conn->dbd;
+    struct dbd_database * database;
+    struct dbd_ack * ack;
+    struct evbuffer * reply;
+    const char * error = NULL;
+    sqlite3_stmt * stmt;
+    bool cached = false;
+    unsigned int i;
+    int rc;
+
+    if ( !(database = dbd_database(dbd, path, &error)) )
+        return dbd_error(conn, seq, error);
+    if ( !(stmt = dbd_prepare(database, sql, &cached)) ) {
+        char message[512];
+
+        snprintf(message, sizeof message, "%s", sqlite3_errcode(database->handle) != SQLITE_OK
+                ? sqlite3_errmsg(database->handle) : "one statement per query");
+        return dbd_error(conn, seq, message);
+    }
+    if ((unsigned int)sqlite3_bind_parameter_count(stmt) != nparams) {
+        error = "wrong number of parameters";
+        goto done;
+    }
+    if (op == DB_READ && !sqlite3_stmt_readonly(stmt)) {
+        error = "that's a write";
+        goto done;
+    }
+    for (i = 0, rc = SQLITE_OK; i < nparams && rc == SQLITE_OK; ++i) {
+        switch (params[i].type) {
+            case DB_INT:
+                rc = sqlite3_bind_int64(stmt, i + 1, params[i].i);
+                break;
+            case DB_FLOAT:
+                rc = sqlite3_bind_double(stmt, i + 1, params[i].f);
+                break;
+            /* The frame they're in stays until we're done with them */
+            case DB_TEXT:
+                rc = sqlite3_bind_text(stmt, i + 1, params[i].s.p, params[i].s.len, SQLITE_STATIC);
+                break;
+            case DB_BLOB:
+                rc = sqlite3_bind_blob(stmt, i + 1, params[i].s.p, params[i].s.len, SQLITE_STATIC);
+                break;
+            default:
+                rc = sqlite3_bind_null(stmt, i + 1);
+                break;
+        }
+    }
+    if (rc != SQLITE_OK) {
+        error = sqlite3_errmsg(database->handle);
+        goto done;
+    }
+
+    if (op == DB_READ) {
+        ++dbd->stats->reads;
+        if ( (reply = dbd_rows(database, stmt, seq, &error)) ) {
+            ipc_add(bufferevent_get_output(conn->bev), IPC_DB_REPLY, DB_ROWS,
+                    evbuffer_pullup(reply, -1), evbuffer_get_length(reply), NULL, 0);
+            evbuffer_free(reply);
+        }
+        goto done;
+    }
+
+    ++dbd->stats->writes;
+    if (!database->writing) {
+        if (dbd_exec(database, "BEGIN") != SQLITE_OK) {
+            error = sqlite3_errmsg(database->handle);
+            goto done;
+        }
+        database->writing = true;
+        /* It's committed (or ended) in time whether or not this write goes through */
+        if (!evtimer_pending(dbd->evcommit, NULL))
+            evtimer_add(dbd->evcommit, &(struct timeval){.tv_usec = DB_COMMIT_DELAY * 1000});
+    }
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        ;
+    if (rc != SQLITE_DONE) {
+        error = sqlite3_errmsg(database->handle);
+        /* Some errors take the whole transaction with them, the writes in it failed too */
+        if (sqlite3_get_autocommit(database->handle)) {
+            database->writing = false;
+            dbd_acks(dbd, database, "rolled back by a failed write");
+        }
+        goto done;
+    }
+    if ( !(ack = malloc(sizeof *ack)) ) {
+        error = "out of memory";
+        goto done;
+    }
+    *ack = (struct dbd_ack){
+        .conn = conn,
+        .database = database,
+        .seq = seq,
+        .changes = sqlite3_changes(database->handle),
+        .last_id = sqlite3_last_insert_rowid(database->handle),
+    };
+    TAILQ_INSERT_TAIL(&dbd->acks, ack, next);
+    if (++dbd->nacks >= DB_BATCH)
+        dbd_commit(dbd);
+
+done:
+    if (error)
+        dbd_error(conn, seq, error);
+    if (cached) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    } else {
+        sqlite3_finalize(stmt);
+    }
+}
+
+/* Take one IPC_DB_QUERY apart */
+static void dbd_frame(struct dbd_conn * conn, const struct ipc_frame * frame, const unsigned char * p)
+{
+    const unsigned char * end = p + frame->len;
+    const char * path, * sql;
+    struct db_value * params = NULL;
+    uint32_t seq;
+    uint16_t nparams, i;
+
+    if (frame->type != IPC_DB_QUERY || frame->id > DB_WRITE || frame->len < sizeof seq) {
+        log_debug("[dbd] unexpected frame type %u", frame->type);
+        return;
+    }
+    memcpy(&seq, p, sizeof seq);
+    p += sizeof seq;
+    path = (const char *)p;
+    if ( !(p = memchr(p, '\0', end - p)) || (sql = (const char *)++p) >= (const char *)end
+            || !(p = memchr(p, '\0', end - p)) || (size_t)(end - ++p) < sizeof nparams)
+        return dbd_error(conn, seq, "bad query");
+    memcpy(&nparams, p, sizeof nparams);
+    p += sizeof nparams;
+    if (nparams > end - p || (nparams && !(params = calloc(nparams, sizeof *params))))
+        return dbd_error(conn, seq, "bad query");
+    for (i = 0; i < nparams && (p = db_get_value(p, end, &params[i])); ++i)
+        ;
+    if (i < nparams)
+        dbd_error(conn, seq, "bad query");
+    else
+        dbd_query(conn, frame->id, seq, path, sql, params, nparams);
+    free(params);
+}
+
+static void dbd_conn_free(struct dbd_conn * conn)
+{
+    struct dbd_ack * ack;
+
+    /* Its writes still get committed, there's just nobody to tell */
+    TAILQ_FOREACH(ack, &conn->dbd->acks, next)
+        if (ack->conn == conn)
+            ack->conn = NULL;
+    LIST_REMOVE(conn, next);
+    bufferevent_free(conn->bev);
+    free(conn);
+}
+
+static void dbd_read_callback(struct bufferevent * bev, void * data)
+{
+    struct evbuffer * in = bufferevent_get_input(bev);
+    const unsigned char * payload;
+    struct ipc_frame frame;
+
+    while ((payload = ipc_next(in, &frame))) {
+        dbd_frame(data, &frame, payload);
+        ipc_drain(in, &frame);
+    }
+}
+
+static void dbd_event_callback(struct bufferevent * bev, short what, void * data)
+{
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        dbd_conn_free(data);
+}
+
+static void dbd_accept_callback(evutil_socket_t sock, short what, void * data)
+{
+    struct dbd * dbd = data;
+    struct dbd_conn * conn;
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+    int fd;
+
+    while ((fd = accept4(sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        /* The address is abstract, anyone on the box could connect to it */
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 || cred.uid != getuid()) {
+            log_debug("[dbd] refusing a connection from uid %d", (int)cred.uid);
+            close(fd);
+            continue;
+        }
+        if ( !(conn = calloc(1, sizeof *conn)) || !(conn->bev = bufferevent_socket_new(dbd->base, fd, BEV_OPT_CLOSE_ON_FREE)) ) {
+            perror("dbd accept");
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->dbd = dbd;
+        bufferevent_setcb(conn->bev, dbd_read_callback, NULL, dbd_event_callback, conn);
+        bufferevent_enable(conn->bev, EV_READ);
+        LIST_INSERT_HEAD(&dbd->conns, conn, next);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("dbd accept4");
+}
+
+static void dbd_sig_callback(evutil_socket_t sig, short what, void * data)
+{
+    struct dbd * dbd = data;
+
+    log_debug("dbd [%d] caught SIGTERM, committing and exiting...", getpid());
+    dbd_commit(dbd);
+    event_base_loopexit(dbd->base, NULL);
+}
+
+int dbd_main(int sock, struct db_stats * stats)
+{
+    struct dbd dbd = {.stats = stats ? stats : &dbd.own};
+    struct dbd_database * database;
+    int ret = 0;
+
+    SLIST_INIT(&dbd.databases);
+    LIST_INIT(&dbd.conns);
+    TAILQ_INIT(&dbd.acks);
+    if ( !(dbd.base = event_base_new()) ) {
+        perror("dbd base");
+        return -1;
+    }
+    dbd.evaccept = event_new(dbd.base, sock, EV_READ | EV_PERSIST, dbd_accept_callback, &dbd);
+    dbd.evcommit = evtimer_new(dbd.base, dbd_commit_callback, &dbd);
+    dbd.evterm = evsignal_new(dbd.base, SIGTERM, dbd_sig_callback, &dbd);
+    if (!dbd.evaccept || !dbd.evcommit || !dbd.evterm) {
+        perror("dbd events");
+        ret = -1;
+    } else {
+        event_add(dbd.evaccept, NULL);
+        event_add(dbd.evterm, NULL);
+        log_debug("dbd [%d] started", getpid());
+        event_base_dispatch(dbd.base);
+    }
+
+    /* Nothing got answered after a commit that didn't happen */
+    dbd_acks(&dbd, NULL, "storage process stopped");
+    while (!LIST_EMPTY(&dbd.conns))
+        dbd_conn_free(LIST_FIRST(&dbd.conns));
+    while ((database = SLIST_FIRST(&dbd.databases))) {
+        SLIST_REMOVE_HEAD(&dbd.databases, next);
+        dbd_database_free(database);
+    }
+    log_debug("dbd [%d] done: %lu reads, %lu writes in %lu commits, %lu failed", getpid(),
+            (unsigned long)dbd.stats->reads, (unsigned long)dbd.stats->writes,
+            (unsigned long)dbd.stats->commits, (unsigned long)dbd.stats->failed);
+    if (dbd.evaccept)
+        event_free(dbd.evaccept);
+    if (dbd.evcommit)
+        event_free(dbd.evcommit);
+    if (dbd.evterm)
+        event_free(dbd.evterm);
+    event_base_free(dbd.base);
+
+    return ret;
+}
@@ -0,0 +1,13 @@
+#ifndef DBD_HEADER__H_
+#define DBD_HEADER__H_
+
+struct db_stats;
+
+/*
+ * The storage process (db.h), it accepts the workers on 'sock'
+ * (db_listen()) and answers their queries until it gets SIGTERM, then
+ * it commits what it has and returns. 'stats' may be NULL
+ */
+int dbd_main(int sock, struct db_stats * stats);
+
+#endif
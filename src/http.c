@@ -0,0 +1,935 @@
+/* http.c non-blocking HTTP client for the workers' modules, see http.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h> /* strcasecmp */
+#include <math.h>
+#include <sys/queue.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/dns.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#if LIBEVENT_VERSION_NUMBER >= 0x02010000
+#include <event2/bufferevent_ssl.h>
+#include <openssl/ssl.h>
+#endif
+
+#include <htable.h>
+
+#include "http.h"
+#include "cache.h"
+#include "log.h"
+
+/* Connections we keep open to one host */
+#define HTTP_POOL_CONNS 4
+/* evhttp's own read/write timeout (seconds), a request's timeout is ours */
+#define HTTP_IO_TIMEOUT 60
+/* Most body we read for anyone, past max_size it's read and dropped */
+#define HTTP_BODY_LIMIT (64 << 20)
+#define HTTP_USER_AGENT "machine"
+/* How often requests waiting on another worker's fetch look if it's done */
+#define HTTP_CACHE_POLL 25000 /* usec */
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010000
+SSL_CTX * con_ssl_init(void); /* con.c */
+#endif
+
+struct http_conn {
+    struct evhttp_connection * evcon; /* NULL until it's needed */
+    struct http_request * req;        /* Request it's carrying, NULL when idle */
+    unsigned long used;               /* Requests it carried */
+    bool broken;                      /* Failed, it's replaced before it's used again */
+};
+
+struct http_pool {
+    struct http * http;
+    char * host;
+    int port;
+    bool https;
+    struct http_conn conns[HTTP_POOL_CONNS];
+    struct event * reap;              /* Replaces broken connections outside of evhttp's callbacks */
+    TAILQ_HEAD(, http_request) queue; /* Requests waiting for a connection */
+};
+
+struct http {
+    struct event_base * base;
+    struct evdns_base * dns;
+    struct htable * pools;            /* "scheme://host:port" -> struct http_pool */
+    struct cache * cache;
+    struct event * poll;              /* Looks in the cache for the requests waiting */
+    TAILQ_HEAD(, http_request) waiting; /* Requests someone else is fetching the response of */
+#if LIBEVENT_VERSION_NUMBER >= 0x02010000
+    SSL_CTX * ssl_ctx;
+#endif
+};
+
+struct http_request {
+    struct http * http;
+    struct http_pool * pool;
+    struct http_conn * conn;          /* Connection it's on, NULL while it waits for one */
+    enum evhttp_cmd_type method;
+    char * url;                       /* Where we're at after redirects */
+    char * target;                    /* What we ask that host for (path?query) */
+    char ** headers;                  /* Copy of http_options.headers */
+    struct evbuffer * out;            /* Body we send */
+    size_t max_size;
+    int redirects;
+    bool retried;                     /* Sent again after a kept alive connection died on it */
+    struct event * timer;
+    /* What came back */
+    int status;
+    char * reason;
+    struct evkeyvalq in;
+    bool have_headers;
+    struct evbuffer * body;
+    bool truncated;
+    http_callback cb;                 /* NULL once it's forgotten */
+    void * data;
+    /* Cached ones */
+    char * key;                       /* "http <method> <url>\n<headers>", NULL if it's not cached */
+    size_t klen;
+    double ttl, ttl_errors, hold;
+    bool waiting;                     /* On http->waiting instead of a pool's queue */
+    bool claimed;                     /* We're the one fetching it, it goes in the cache when we're done */
+    bool waited;                      /* Someone else was */
+    TAILQ_ENTRY(http_request) next;   /* In its pool's queue or http->waiting */
+};
+
+static const struct {
+    const char * name;
+    enum evhttp_cmd_type method;
+} http_methods[] = {
+    {"GET", EVHTTP_REQ_GET},
+    {"HEAD", EVHTTP_REQ_HEAD},
+    {"POST", EVHTTP_REQ_POST},
+    {"PUT", EVHTTP_REQ_PUT},
+    {"DELETE", EVHTTP_REQ_DELETE},
+    {"OPTIONS", EVHTTP_REQ_OPTIONS},
+};
+
+static void http_dispatch(struct http_pool * pool);
+static void http_poll_callback(evutil_socket_t fd, short what, void * data);
+
+struct http * http_new(struct event_base * base, struct cache * cache)
+{
+    struct http * http;
+
+    if ( !(http = calloc(1, sizeof *http)) ) {
+        perror("http_new calloc");
+        return NULL;
+    }
+    http->base = base;
+    http->cache = cache;
+    TAILQ_INIT(&http->waiting);
+    if ( !(http->dns = evdns_base_new(base, 1)) || !(http->pools = htable.new(16))
+            || !(http->poll = evtimer_new(base, http_poll_callback, http)) ) {
+        log_debug("[http] can't set up dns or pools");
+        http_free(http);
+        return NULL;
+    }
+
+    return http;
+}
+
+static void http_request_free(struct http_request * req)
+{
+    char ** h;
+
+    /* Those waiting on us can have a go */
+    if (req->claimed)
+        cache_release(req->http->cache, req->key, req->klen);
+
+    if (req->timer)
+        event_free(req->timer);
+    if (req->out)
+        evbuffer_free(req->out);
+    if (req->body)
+        evbuffer_free(req->body);
+    if (req->have_headers)
+        evhttp_clear_headers(&req->in);
+    for (h = req->headers; h && *h; ++h)
+        free(*h);
+    free(req->headers);
+    free(req->reason);
+    free(req->target);
+    free(req->url);
+    free(req->key);
+    free(req);
+}
+
+static int http_pool_free(const char * key, void * data)
+{
+    struct http_pool * pool = data;
+    struct http_request * req;
+
+    for (int i = 0; i < HTTP_POOL_CONNS; ++i) {
+        /* evhttp lets go of its requests without calling back */
+        if (pool->conns[i].evcon)
+            evhttp_connection_free(pool->conns[i].evcon);
+        if (pool->conns[i].req)
+            http_request_free(pool->conns[i].req);
+    }
+    while ((req = TAILQ_FIRST(&pool->queue))) {
+        TAILQ_REMOVE(&pool->queue, req, next);
+        http_request_free(req);
+    }
+    if (pool->reap)
+        event_free(pool->reap);
+    free(pool->host);
+    free(pool);
+
+    return 0;
+}
+
+void http_free(struct http * http)
+{
+    struct http_request * req;
+
+    if (!http)
+        return;
+    while ((req = TAILQ_FIRST(&http->waiting))) {
+        TAILQ_REMOVE(&http->waiting, req, next);
+        http_request_free(req);
+    }
+    if (http->poll)
+        event_free(http->poll);
+    if (http->pools) {
+        htable.foreach(http->pools, http_pool_free);
+        htable.free(http->pools);
+    }
+    if (http->dns)
+        evdns_base_free(http->dns, 0);
+#if LIBEVENT_VERSION_NUMBER >= 0x02010000
+    if (http->ssl_ctx)
+        SSL_CTX_free(http->ssl_ctx);
+#endif
+    free(http);
+}
+
+/*
+ * A response as we cache it: "<status>\0<truncated>\0<reason>\0<url>\0",
+ * then "<name>\0<value>\0" for each header, an empty name and the body
+ */
+static void http_store(struct http_request * req, const struct http_response * res)
+{
+    struct evbuffer * buf;
+    struct evkeyval * kv;
+    char status[16];
+    double ttl = res->status && res->status < 400 ? req->ttl : req->ttl_errors;
+
+    if (ttl <= 0 || !(buf = evbuffer_new())) {
+        cache_release(req->http->cache, req->key, req->klen);
+        return;
+    }
+    snprintf(status, sizeof status, "%d", res->status);
+    evbuffer_add(buf, status, strlen(status) + 1);
+    evbuffer_add(buf, res->truncated ? "1" : "0", 2);
+    evbuffer_add(buf, res->reason ? res->reason : "", res->reason ? strlen(res->reason) + 1 : 1);
+    evbuffer_add(buf, res->url, strlen(res->url) + 1);
+    if (res->headers) {
+        TAILQ_FOREACH(kv, res->headers, next) {
+            if (!*kv->key)
+                continue;
+            evbuffer_add(buf, kv->key, strlen(kv->key) + 1);
+            evbuffer_add(buf, kv->value, strlen(kv->value) + 1);
+        }
+    }
+    evbuffer_add(buf, "", 1);
+    evbuffer_add(buf, res->body, res->len);
+
+    /* Too big for it just means nobody else gets it from there */
+    if (cache_put(req->http->cache, req->key, req->klen, evbuffer_pullup(buf, -1), evbuffer_get_length(buf), ttl) == -1)
+        cache_release(req->http->cache, req->key, req->klen);
+    evbuffer_free(buf);
+}
+
+/* Hand the response over and let the request go, it's off its connection and the queue by now */
+static void http_finish(struct http_request * req, int status, const char * reason)
+{
+    struct http * http = req->http;
+    struct http_response res = {
+        .status = status,
+        .reason = reason ? reason : req->reason,
+        .url = req->url,
+        .headers = req->have_headers ? &req->in : NULL,
+        .truncated = req->truncated,
+    };
+
+    res.len = evbuffer_get_length(req->body);
+    res.body = evbuffer_pullup(req->body, -1);
+    if (req->claimed) {
+        http_store(req, &res);
+        req->claimed = false;
+        /* Ours waiting on it don't have to wait for the next poll */
+        if (!TAILQ_EMPTY(&http->waiting))
+            event_active(http->poll, EV_TIMEOUT, 0);
+    }
+    if (req->cb)
+        req->cb(&res, req->data);
+    http_request_free(req);
+}
+
+/* Answer it with what we found in the cache, -1 if that's not good enough for it (or garbage) */
+static int http_cached(struct http_request * req, const char * value, size_t len)
+{
+    const char * end = value + len, * fields[4], * name, * val;
+    struct http_response res = {.status = 0};
+    struct evkeyvalq headers;
+    int i, ret = -1;
+
+    TAILQ_INIT(&headers);
+    for (i = 0; i < 4 && value < end; ++i, value += strlen(value) + 1) {
+        if (!memchr(value, '\0', end - value))
+            return -1;
+        fields[i] = value;
+    }
+    if (i < 4)
+        return -1;
+    res.status = atoi(fields[0]);
+    res.truncated = *fields[1] == '1';
+    res.reason = *fields[2] ? fields[2] : NULL;
+    res.url = fields[3];
+
+    for (;;) {
+        if (value >= end || !memchr(value, '\0', end - value))
+            goto done;
+        if (!*value)
+            break;
+        name = value;
+        val = value + strlen(value) + 1;
+        if (val >= end || !memchr(val, '\0', end - val))
+            goto done;
+        evhttp_add_header(&headers, name, val);
+        value = val + strlen(val) + 1;
+    }
+    res.body = (const unsigned char *)value + 1;
+    res.len = end - value - 1;
+
+    /* Kept short of what this one wants */
+    if (res.truncated && res.len < req->max_size)
+        goto done;
+    if (res.len > req->max_size) {
+        res.len = req->max_size;
+        res.truncated = true;
+    }
+    res.headers = &headers;
+
+    TAILQ_REMOVE(&req->http->waiting, req, next);
+    req->waiting = false;
+    if (req->cb)
+        req->cb(&res, req->data);
+    http_request_free(req);
+    ret = 0;
+done:
+    evhttp_clear_headers(&headers);
+    return ret;
+}
+
+/* Look for it in the cache, it's sent if it's ours to fetch, and stays waiting if it's someone else's */
+static void http_lookup(struct http_request * req)
+{
+    struct http * http = req->http;
+    void * value;
+    size_t len;
+
+    for (;;) {
+        switch (cache_claim(http->cache, req->key, req->klen, req->hold, &value, &len)) {
+        case CACHE_PENDING:
+            if (!req->waited)
+                cache_waited(http->cache);
+            req->waited = true;
+            return;
+        case CACHE_HIT:
+            if (http_cached(req, value, len) == 0) {
+                free(value);
+                return;
+            }
+            free(value);
+            cache_del(http->cache, req->key, req->klen);
+            continue;
+        case CACHE_CLAIMED:
+            req->claimed = true;
+            /* fall through */
+        case CACHE_MISS:
+            TAILQ_REMOVE(&http->waiting, req, next);
+            req->waiting = false;
+            TAILQ_INSERT_TAIL(&req->pool->queue, req, next);
+            event_active(req->pool->reap, EV_TIMEOUT, 0);
+            return;
+        }
+    }
+}
+
+static void http_poll_callback(evutil_socket_t fd, short what, void * data)
+{
+    struct http * http = data;
+    struct http_request * req, * next;
+    struct timeval tv = {0, HTTP_CACHE_POLL};
+
+    /* Forgotten ones stay on the list until we get here, so 'next' can't go away under us */
+    for (req = TAILQ_FIRST(&http->waiting); req; req = next) {
+        next = TAILQ_NEXT(req, next);
+        if (!req->cb) {
+            TAILQ_REMOVE(&http->waiting, req, next);
+            http_request_free(req);
+        } else {
+            http_lookup(req);
+        }
+    }
+    if (!TAILQ_EMPTY(&http->waiting))
+        evtimer_add(http->poll, &tv);
+}
+
+/* Replace the broken connections and send what's waiting */
+static void http_reap_callback(evutil_socket_t fd, short what, void * data)
+{
+    struct http_pool * pool = data;
+
+    for (int i = 0; i < HTTP_POOL_CONNS; ++i) {
+        struct http_conn * conn = &pool->conns[i];
+
+        if (conn->broken && !conn->req) {
+            if (conn->evcon)
+                evhttp_connection_free(conn->evcon);
+            *conn = (struct http_conn){.evcon = NULL};
+        }
+    }
+    http_dispatch(pool);
+}
+
+/* Pool for a host, made the first time we go there */
+static struct http_pool * http_pool(struct http * http, const char * scheme, const char * host, int port)
+{
+    struct http_pool * pool;
+    char key[512];
+
+    snprintf(key, sizeof key, "%s://%s:%d", scheme, host, port);
+    if ( (pool = htable.lookup(http->pools, key)) )
+        return pool;
+
+    if ( !(pool = calloc(1, sizeof *pool)) || !(pool->host = strdup(host)) ) {
+        perror("http_pool calloc");
+        free(pool);
+        return NULL;
+    }
+    pool->http = http;
+    pool->port = port;
+    pool->https = !strcasecmp(scheme, "https");
+    TAILQ_INIT(&pool->queue);
+    pool->reap = event_new(http->base, -1, 0, http_reap_callback, pool);
+    htable.store(http->pools, key, pool);
+
+    return pool;
+}
+
+/* Point the request at 'url', the pool for its host and what we ask it for, -1 if we can't go there */
+static int http_target(struct http_request * req, const char * url)
+{
+    struct evhttp_uri * uri;
+    const char * scheme, * host, * path, * query;
+    struct http_pool * pool = NULL;
+    char * target = NULL, * copy = NULL;
+    int port;
+
+    if ( !(uri = evhttp_uri_parse(url)) )
+        return -1;
+    scheme = evhttp_uri_get_scheme(uri);
+    host = evhttp_uri_get_host(uri);
+    if (scheme && host && *host && (!strcasecmp(scheme, "http") || !strcasecmp(scheme, "https"))) {
+#if LIBEVENT_VERSION_NUMBER < 0x02010000
+        if (!strcasecmp(scheme, "https"))
+            log_debug("[http] https needs libevent 2.1: %s", url);
+        else
+#endif
+        {
+            if ((port = evhttp_uri_get_port(uri)) == -1)
+                port = !strcasecmp(scheme, "https") ? 443 : 80;
+            path = evhttp_uri_get_path(uri);
+            query = evhttp_uri_get_query(uri);
+            if (!path || !*path)
+                path = "/";
+            if ( (target = malloc(strlen(path) + (query ? strlen(query) + 1 : 0) + 1)) )
+                sprintf(target, "%s%s%s", path, query ? "?" : "", query ? query : "");
+            copy = strdup(url);
+            pool = http_pool(req->http, scheme, host, port);
+        }
+    }
+    evhttp_uri_free(uri);
+
+    if (!pool || !target || !copy) {
+        free(target);
+        free(copy);
+        return -1;
+    }
+    free(req->target);
+    free(req->url);
+    req->target = target;
+    req->url = copy;
+    req->pool = pool;
+    return 0;
+}
+
+/* Where a Location header sends us from 'base', caller frees */
+static char * http_resolve(const char * base, const char * location)
+{
+    struct evhttp_uri * uri;
+    const char * scheme, * slash;
+    char * url = NULL;
+    size_t len;
+
+    if ( (uri = evhttp_uri_parse(location)) ) {
+        scheme = evhttp_uri_get_scheme(uri);
+        evhttp_uri_free(uri);
+        if (scheme)
+            return strdup(location);
+    }
+    if ( !(slash = strstr(base, "://")) )
+        return NULL;
+
+    if (!strncmp(location, "//", 2)) {
+        /* Same scheme */
+        len = slash - base + 1;
+    } else if (*location == '/') {
+        /* Same host */
+        slash = strchr(slash + 3, '/');
+        len = slash ? (size_t)(slash - base) : strlen(base);
+    } else {
+        /* Next to where we were, whatever came after the last slash goes */
+        const char * end = strpbrk(slash + 3, "?#");
+        const char * last = slash + 3;
+
+        for (const char * p = last; *p && (!end || p < end); ++p)
+            if (*p == '/')
+                last = p;
+        if (last == slash + 3)
+            len = end ? (size_t)(end - base) : strlen(base);
+        else
+            len = last - base;
+        if ( (url = malloc(len + strlen(location) + 2)) )
+            sprintf(url, "%.*s/%s", (int)len, base, location);
+        return url;
+    }
+
+    if ( (url = malloc(len + strlen(location) + 1)) )
+        sprintf(url, "%.*s%s", (int)len, base, location);
+    return url;
+}
+
+/* Keep a copy of what it sent back, the response may be gone before we're done with it */
+static void http_headers(struct http_request * req, struct evhttp_request * evreq)
+{
+    struct evkeyval * kv;
+    const char * line;
+
+    if (req->have_headers || !evhttp_request_get_response_code(evreq))
+        return;
+
+    TAILQ_INIT(&req->in);
+    TAILQ_FOREACH(kv, evhttp_request_get_input_headers(evreq), next)
+        evhttp_add_header(&req->in, kv->key, kv->value);
+    req->have_headers = true;
+    req->status = evhttp_request_get_response_code(evreq);
+#if LIBEVENT_VERSION_NUMBER >= 0x02010000
+    if ( (line = evhttp_request_get_response_code_line(evreq)) ) {
+        free(req->reason);
+        req->reason = strdup(line);
+    }
+#else
+    (void)line;
+#endif
+}
+
+/* Body as it comes in, we only keep max_size of it */
+static void http_chunk_callback(struct evhttp_request * evreq, void * data)
+{
+    struct http_request * req = data;
+    struct evbuffer * in = evhttp_request_get_input_buffer(evreq);
+    size_t len = evbuffer_get_length(in), room = req->max_size - evbuffer_get_length(req->body);
+
+    http_headers(req, evreq);
+    if (len > room) {
+        req->truncated = true;
+        len = room;
+    }
+    evbuffer_remove_buffer(in, req->body, len);
+}
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010000
+static int http_header_callback(struct evhttp_request * evreq, void * data)
+{
+    http_headers(data, evreq);
+    return 0;
+}
+
+static void http_error_callback(enum evhttp_request_error error, void * data)
+{
+    static const char * const errors[] = {
+        [EVREQ_HTTP_TIMEOUT] = "timed out",
+        [EVREQ_HTTP_EOF] = "connection closed",
+        [EVREQ_HTTP_INVALID_HEADER] = "bad response",
+        [EVREQ_HTTP_BUFFER_ERROR] = "connection failed",
+        [EVREQ_HTTP_REQUEST_CANCEL] = "cancelled",
+        [EVREQ_HTTP_DATA_TOO_LONG] = "response too long",
+    };
+    struct http_request * req = data;
+
+    if (!req->have_headers && (size_t)error < sizeof errors / sizeof *errors && errors[error]) {
+        free(req->reason);
+        req->reason = strdup(errors[error]);
+    }
+}
+#endif
+
+/* Take it off its connection, the connection is replaced if it failed */
+static void http_release(struct http_request * req, bool failed)
+{
+    struct http_conn * conn = req->conn;
+
+    if (!conn)
+        return;
+    conn->req = NULL;
+    conn->used++;
+    if (failed) {
+        conn->broken = true;
+        event_active(req->pool->reap, EV_TIMEOUT, 0);
+    }
+    req->conn = NULL;
+}
+
+/* Queue it again (redirects and retries), the pool may have changed */
+static void http_requeue(struct http_request * req, bool first)
+{
+    if (first)
+        TAILQ_INSERT_HEAD(&req->pool->queue, req, next);
+    else
+        TAILQ_INSERT_TAIL(&req->pool->queue, req, next);
+    http_dispatch(req->pool);
+}
+
+static bool http_redirect(struct http_request * req, struct evhttp_request * evreq)
+{
+    const char * location;
+    char * url;
+
+    if (req->redirects <= 0 || (req->status != 301 && req->status != 302 && req->status != 303
+                && req->status != 307 && req->status != 308))
+        return false;
+    if ( !(location = evhttp_find_header(evhttp_request_get_input_headers(evreq), "Location")) )
+        return false;
+    if ( !(url = http_resolve(req->url, location)) || http_target(req, url) == -1) {
+        log_debug("[http] can't follow redirect from %s to %s", req->url, location);
+        free(url);
+        return false;
+    }
+    free(url);
+
+    /* Browsers turn these into a GET, servers expect them to */
+    if (req->status == 303 || (req->method == EVHTTP_REQ_POST && req->status <= 302)) {
+        req->method = EVHTTP_REQ_GET;
+        evbuffer_drain(req->out, evbuffer_get_length(req->out));
+    }
+    req->redirects--;
+    req->retried = false;
+    req->status = 0;
+    req->truncated = false;
+    free(req->reason);
+    req->reason = NULL;
+    if (req->have_headers)
+        evhttp_clear_headers(&req->in);
+    req->have_headers = false;
+    evbuffer_drain(req->body, evbuffer_get_length(req->body));
+
+    return true;
+}
+
+/* evhttp is done with it, 'evreq' is NULL if it failed */
+static void http_done_callback(struct evhttp_request * evreq, void * data)
+{
+    struct http_request * req = data;
+    struct http_pool * pool = req->pool;
+    bool reused = req->conn && req->conn->used;
+
+    if (!evreq || !evhttp_request_get_response_code(evreq)) {
+        http_release(req, true);
+        /* A connection we kept may have been closed on the other end, ask once more on a fresh one */
+        if (reused && !req->have_headers && !req->retried && req->cb
+                && (req->method == EVHTTP_REQ_GET || req->method == EVHTTP_REQ_HEAD)) {
+            req->retried = true;
+            http_requeue(req, true);
+            return;
+        }
+        /* What we got of a body that was too long is still good */
+        if (req->have_headers)
+            http_finish(req, req->status, NULL);
+        else
+            http_finish(req, 0, req->reason ? NULL : "connection failed");
+        http_dispatch(pool);
+        return;
+    }
+
+    http_headers(req, evreq);
+    evbuffer_add_buffer(req->body, evhttp_request_get_input_buffer(evreq));
+    if (evbuffer_get_length(req->body) > req->max_size) {
+        req->truncated = true;
+        evbuffer_drain(req->body, evbuffer_get_length(req->body) - req->max_size);
+    }
+    http_release(req, false);
+
+    /* A redirect may go to another pool, this one has a free connection now either way */
+    if (req->cb && http_redirect(req, evreq))
+        http_requeue(req, false);
+    else
+        http_finish(req, req->status, NULL);
+    http_dispatch(pool);
+}
+
+static void http_timeout_callback(evutil_socket_t fd, short what, void * data)
+{
+    struct http_request * req = data;
+    struct http_pool * pool = req->pool;
+    struct http_conn * conn = req->conn;
+
+    /* The connection has to go to get evhttp to let go of it */
+    if (conn) {
+        evhttp_connection_free(conn->evcon);
+        *conn = (struct http_conn){.evcon = NULL};
+    } else if (req->waiting) {
+        TAILQ_REMOVE(&req->http->waiting, req, next);
+        req->waiting = false;
+    } else {
+        TAILQ_REMOVE(&pool->queue, req, next);
+    }
+    http_finish(req, 0, "timed out");
+    http_dispatch(pool);
+}
+
+static struct evhttp_connection * http_connect(struct http_pool * pool)
+{
+    struct http * http = pool->http;
+    struct evhttp_connection * evcon = NULL;
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02010000
+    if (pool->https) {
+        struct bufferevent * bev;
+        SSL * ssl;
+
+        if (!http->ssl_ctx && !(http->ssl_ctx = con_ssl_init()))
+            return NULL;
+        if ( !(ssl = SSL_new(http->ssl_ctx)) )
+            return NULL;
+        SSL_set_tlsext_host_name(ssl, pool->host);
+        if ( !(bev = bufferevent_openssl_socket_new(http->base, -1, ssl, BUFFEREVENT_SSL_CONNECTING,
+                        BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS)) ) {
+            SSL_free(ssl);
+            return NULL;
+        }
+        evcon = evhttp_connection_base_bufferevent_new(http->base, http->dns, bev, pool->host, pool->port);
+    } else
+#endif
+        evcon = evhttp_connection_base_new(http->base, http->dns, pool->host, pool->port);
+
+    if (evcon) {
+        evhttp_connection_set_timeout(evcon, HTTP_IO_TIMEOUT);
+        evhttp_connection_set_max_body_size(evcon, HTTP_BODY_LIMIT);
+    }
+    return evcon;
+}
+
+/* Put a request on a connection, -1 if evhttp won't take it */
+static int http_send(struct http_request * req, struct http_conn * conn)
+{
+    struct evhttp_request * evreq;
+    struct evkeyvalq * out;
+    char host[300];
+    char ** h;
+
+    if ( !(evreq = evhttp_request_new(http_done_callback, req)) )
+        return -1;
+    evhttp_request_set_chunked_cb(evreq, http_chunk_callback);
+#if LIBEVENT_VERSION_NUMBER >= 0x02010000
+    evhttp_request_set_header_cb(evreq, http_header_callback);
+    evhttp_request_set_error_cb(evreq, http_error_callback);
+#endif
+
+    out = evhttp_request_get_output_headers(evreq);
+    if (req->pool->port == (req->pool->https ? 443 : 80))
+        snprintf(host, sizeof host, "%s", req->pool->host);
+    else
+        snprintf(host, sizeof host, "%s:%d", req->pool->host, req->pool->port);
+    evhttp_add_header(out, "Host", host);
+    for (h = req->headers; h && h[0] && h[1]; h += 2)
+        evhttp_add_header(out, h[0], h[1]);
+    if (!evhttp_find_header(out, "User-Agent"))
+        evhttp_add_header(out, "User-Agent", HTTP_USER_AGENT);
+    if (evbuffer_get_length(req->out))
+        evbuffer_add(evhttp_request_get_output_buffer(evreq), evbuffer_pullup(req->out, -1), evbuffer_get_length(req->out));
+
+    conn->req = req;
+    req->conn = conn;
+    /* evhttp frees 'evreq' if this fails */
+    if (evhttp_make_request(conn->evcon, evreq, req->method, req->target) == -1) {
+        conn->req = NULL;
+        req->conn = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Give waiting requests the connections that are free, opening more up to HTTP_POOL_CONNS */
+static void http_dispatch(struct http_pool * pool)
+{
+    struct http_request * req;
+    struct http_conn * conn;
+    int i, empty;
+
+    while ((req = TAILQ_FIRST(&pool->queue))) {
+        for (conn = NULL, empty = -1, i = 0; i < HTTP_POOL_CONNS && !conn; ++i) {
+            if (pool->conns[i].broken || pool->conns[i].req)
+                continue;
+            if (pool->conns[i].evcon)
+                conn = &pool->conns[i];
+            else if (empty == -1)
+                empty = i;
+        }
+        if (!conn && empty != -1) {
+            if ( !(pool->conns[empty].evcon = http_connect(pool)) ) {
+                TAILQ_REMOVE(&pool->queue, req, next);
+                http_finish(req, 0, "can't connect");
+                continue;
+            }
+            conn = &pool->conns[empty];
+        }
+        if (!conn)
+            return; /* All busy */
+
+        TAILQ_REMOVE(&pool->queue, req, next);
+        if (http_send(req, conn) == -1) {
+            conn->broken = true;
+            event_active(pool->reap, EV_TIMEOUT, 0);
+            http_finish(req, 0, "can't send request");
+        }
+    }
+}
+
+/* What it's cached as, the headers it sends can change what comes back */
+static int http_key(struct http_request * req, const char * method)
+{
+    struct evbuffer * buf;
+    char ** h;
+    int ret = -1;
+
+    if ( !(buf = evbuffer_new()) )
+        return -1;
+    evbuffer_add_printf(buf, "http %s %s\n", method, req->url);
+    for (h = req->headers; h && h[0] && h[1]; h += 2)
+        evbuffer_add_printf(buf, "%s: %s\n", h[0], h[1]);
+    req->klen = evbuffer_get_length(buf);
+    if ( (req->key = malloc(req->klen)) ) {
+        evbuffer_remove(buf, req->key, req->klen);
+        ret = 0;
+    }
+    evbuffer_free(buf);
+    return ret;
+}
+
+struct http_request * http_request(struct http * http, const char * method, const char * url,
+        const struct http_options * opt, http_callback cb, void * data)
+{
+    static const struct http_options defaults = {.redirects = -1};
+    struct http_request * req;
+    struct timeval tv;
+    size_t i, n = 0;
+    double timeout;
+
+    if (!opt)
+        opt = &defaults;
+    if ( !(req = calloc(1, sizeof *req)) ) {
+        perror("http_request calloc");
+        return NULL;
+    }
+    req->http = http;
+    req->method = (enum evhttp_cmd_type)-1;
+    for (i = 0; i < sizeof http_methods / sizeof *http_methods; ++i)
+        if (!strcasecmp(method, http_methods[i].name))
+            req->method = http_methods[i].method;
+    req->max_size = opt->max_size ? opt->max_size : HTTP_MAX_SIZE;
+    req->redirects = opt->redirects < 0 ? HTTP_REDIRECTS : opt->redirects;
+    req->cb = cb;
+    req->data = data;
+
+    for (; opt->headers && opt->headers[n]; ++n)
+        ;
+    if (req->method == (enum evhttp_cmd_type)-1 || http_target(req, url) == -1
+            || !(req->headers = calloc(n + 1, sizeof *req->headers))
+            || !(req->out = evbuffer_new()) || !(req->body = evbuffer_new())
+            || !(req->timer = evtimer_new(http->base, http_timeout_callback, req))) {
+        http_request_free(req);
+        return NULL;
+    }
+    for (i = 0; i < n; ++i) {
+        if ( !(req->headers[i] = strdup(opt->headers[i])) ) {
+            http_request_free(req);
+            return NULL;
+        }
+    }
+    if (opt->blen)
+        evbuffer_add(req->out, opt->body, opt->blen);
+
+    timeout = opt->timeout > 0 ? opt->timeout : HTTP_TIMEOUT;
+    tv.tv_sec = (time_t)timeout;
+    tv.tv_usec = (suseconds_t)((timeout - floor(timeout)) * 1000000);
+    evtimer_add(req->timer, &tv);
+
+    /* Others waiting on our fetch give up on it once we would have */
+    if (http->cache && opt->cache > 0 && !opt->blen
+            && (req->method == EVHTTP_REQ_GET || req->method == EVHTTP_REQ_HEAD)) {
+        if (http_key(req, method) == -1) {
+            http_request_free(req);
+            return NULL;
+        }
+        req->ttl = opt->cache;
+        req->ttl_errors = opt->cache_errors < 0 ? 0 : opt->cache_errors > 0 ? opt->cache_errors
+            : opt->cache < HTTP_CACHE_ERRORS ? opt->cache : HTTP_CACHE_ERRORS;
+        req->hold = timeout;
+        req->waiting = true;
+        TAILQ_INSERT_TAIL(&http->waiting, req, next);
+        event_active(http->poll, EV_TIMEOUT, 0);
+        return req;
+    }
+
+    /* Sent from the loop, so the callback never runs before we returned */
+    TAILQ_INSERT_TAIL(&req->pool->queue, req, next);
+    event_active(req->pool->reap, EV_TIMEOUT, 0);
+    return req;
+}
+
+void http_forget(struct http_request * req)
+{
+    struct http_pool * pool = req->pool;
+
+    req->cb = NULL;
+    /* Waiting ones are let go from the poll, it may be going through them right now */
+    if (req->waiting) {
+        event_active(req->http->poll, EV_TIMEOUT, 0);
+        return;
+    }
+    /* On a connection evhttp still has it, it goes once that's done */
+    if (!req->conn) {
+        TAILQ_REMOVE(&pool->queue, req, next);
+        http_request_free(req);
+    }
+}
+
+bool http_tls(void)
+{
+#if LIBEVENT_VERSION_NUMBER >= 0x02010000
+    return true;
+#else
+    return false;
+#endif
+}
+
+/* end http.c */
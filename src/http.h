@@ -0,0 +1,68 @@
+#ifndef HTTP_HEADER__H_
+#define HTTP_HEADER__H_
+
+#include <stddef.h> /* size_t */
+#include <stdbool.h>
+
+/* What a request gets when it doesn't say */
+#define HTTP_TIMEOUT 30          /* seconds, for the whole request with its redirects */
+#define HTTP_MAX_SIZE (1 << 20)  /* bytes of the body we keep */
+#define HTTP_REDIRECTS 5
+/* Longest we keep failures and error statuses when a request doesn't say (seconds) */
+#define HTTP_CACHE_ERRORS 60
+
+/*
+ * Non-blocking HTTP client on a libevent loop (evhttp), the workers'
+ * modules use it through IRC.xs. Connections are kept alive in a pool
+ * per host, a request takes an idle one or opens another (up to
+ * HTTP_POOL_CONNS) and waits its turn after that. Redirects are
+ * followed, https needs libevent 2.1.
+ *
+ * GET and HEAD requests can be answered from the workers' shared cache
+ * (cache.h), keyed by method, url and the headers they send. While one
+ * worker fetches something the others asking for it wait for that.
+ */
+struct http;
+struct http_request;
+struct event_base;
+struct evkeyvalq;
+struct cache;
+
+struct http_options {
+    double timeout;               /* 0 for HTTP_TIMEOUT */
+    size_t max_size;              /* Keep this much of the body and drop the rest, 0 for HTTP_MAX_SIZE */
+    int redirects;                /* Most we follow, -1 for HTTP_REDIRECTS */
+    const char * const * headers; /* name, value, name, value ... NULL */
+    const void * body;            /* Request body (POST, PUT) */
+    size_t blen;
+    double cache;                 /* Seconds we keep the response for others asking the same, 0 to not */
+    double cache_errors;          /* Same for failures and statuses >= 400, 0 for at most HTTP_CACHE_ERRORS, < 0 to not */
+};
+
+struct http_response {
+    int status;                   /* HTTP status, 0 if we got none */
+    const char * reason;          /* Why we got none, or the status line's reason (NULL if we don't know it) */
+    const char * url;             /* Where it ended up after redirects */
+    const struct evkeyvalq * headers; /* NULL if we got none */
+    const unsigned char * body;
+    size_t len;
+    bool truncated;               /* There was more than max_size */
+};
+
+/* Called once per request, unless it's forgotten before it's done */
+typedef void (*http_callback)(const struct http_response * res, void * data);
+
+/* 'cache' may be NULL, requests then never are cached */
+struct http * http_new(struct event_base * base, struct cache * cache);
+/* Requests still going are dropped without their callbacks */
+void http_free(struct http * http);
+
+/* Start a request, NULL if it can't (bad url, no https) */
+struct http_request * http_request(struct http * http, const char * method, const char * url,
+        const struct http_options * opt, http_callback cb, void * data);
+/* Never call a request's callback, it's let go once it's done */
+void http_forget(struct http_request * req);
+/* Whether https urls can be requested, it takes libevent 2.1 */
+bool http_tls(void);
+
+#endif
@@ -0,0 +1,183 @@
+/* ipc.c framing for the master <-> worker sockets, see ipc.h */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h> /* usleep */
+#include <sys/uio.h> /* writev */
+#include <sys/socket.h> /* sendmsg, SCM_RIGHTS */
+
+#include <event2/buffer.h> /* evbuffer_* */
+
+#include "ipc.h"
+#include "ring.h"
+#include "log.h"
+
+/* How long a worker backs off while its ring to the master is full */
+#define IPC_RING_WAIT 100 /* usec */
+
+int ipc_master = -1;
+struct ring * ipc_master_ring;
+
+int ipc_send(int fd, enum ipc_type type, unsigned short id, const void * a, size_t alen, const void * b, size_t blen)
+{
+    struct ipc_frame frame = ipc_frame(type, id, alen + blen);
+    struct iovec iov[3] = {
+        {.iov_base = &frame, .iov_len = sizeof frame},
+        {.iov_base = (void *)a, .iov_len = alen},
+        {.iov_base = (void *)b, .iov_len = blen},
+    };
+    struct iovec * v = iov;
+    int iovcnt = b ? 3 : 2;
+    ssize_t r;
+
+    if (frame.len > IPC_MAXFRAME) {
+        log_debug("[ipc] refusing to send %zu byte frame", alen + blen);
+        return -1;
+    }
+
+    while (iovcnt > 0) {
+        if ((r = writev(fd, v, iovcnt)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        /* Partial write, skip what went out */
+        for (; iovcnt > 0 && (size_t)r >= v->iov_len; --iovcnt, ++v)
+            r -= v->iov_len;
+        if (iovcnt > 0) {
+            v->iov_base = (char *)v->iov_base + r;
+            v->iov_len -= r;
+        }
+    }
+
+    return 0;
+}
+
+int ipc_add(struct evbuffer * out, enum ipc_type type, unsigned short id, const void * a, size_t alen, const void * b, size_t blen)
+{
+    struct ipc_frame frame = ipc_frame(type, id, alen + blen);
+
+    if (frame.len > IPC_MAXFRAME) {
+        log_debug("[ipc] refusing to queue %zu byte frame", alen + blen);
+        return -1;
+    }
+    /* Make room first so we never queue half a frame */
+    if (evbuffer_expand(out, sizeof frame + frame.len) == -1)
+        return -1;
+
+    evbuffer_add(out, &frame, sizeof frame);
+    if (alen)
+        evbuffer_add(out, a, alen);
+    if (blen)
+        evbuffer_add(out, b, blen);
+
+    return 0;
+}
+
+int ipc_output(enum ipc_type type, unsigned short id, const void * a, size_t alen, const void * b, size_t blen)
+{
+    if (!ipc_master_ring)
+        return ipc_send(ipc_master, type, id, a, alen, b, blen);
+
+    if (sizeof (struct ipc_frame) + alen + blen > RING_SIZE / 2) {
+        log_debug("[ipc] %zu byte frame is too big for the ring", alen + blen);
+        return -1;
+    }
+    /* Full, the master is awake (it got rung) so it'll make room soon */
+    while (ring_put(ipc_master_ring, type, id, a, alen, b, blen) == -1)
+        usleep(IPC_RING_WAIT);
+
+    return 0;
+}
+
+int ipc_send_fds(int sock, const void * buf, size_t len, const int * fds, int nfds)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof (int) * IPC_MAXFDS)];
+    } control;
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+    struct cmsghdr * cmsg;
+    ssize_t r;
+
+    if (nfds < 0 || nfds > IPC_MAXFDS)
+        return -1;
+    if (nfds) {
+        memset(&control, 0, sizeof control);
+        msg.msg_control = control.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof (int) * nfds);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof (int) * nfds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof (int) * nfds);
+    }
+
+    while ((r = sendmsg(sock, &msg, 0)) == -1 && errno == EINTR)
+        ;
+    return r == (ssize_t)len ? 0 : -1;
+}
+
+int ipc_recv_fds(int sock, void * buf, size_t len, int * fds, int * nfds)
+{
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof (int) * IPC_MAXFDS)];
+    } control;
+    struct iovec iov = {.iov_base = buf, .iov_len = len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof control.buf};
+    struct cmsghdr * cmsg;
+    ssize_t r;
+
+    *nfds = 0;
+    while ((r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+        ;
+    if (r <= 0)
+        return r;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof (int) * *nfds);
+        }
+    }
+
+    return r;
+}
+
+const unsigned char * ipc_next(struct evbuffer * in, struct ipc_frame * frame)
+{
+    size_t avail;
+
+    while ((avail = evbuffer_get_length(in)) >= sizeof *frame) {
+        evbuffer_copyout(in, frame, sizeof *frame);
+
+        /* Can't find the next header after this, throw everything away */
+        if (frame->len > IPC_MAXFRAME) {
+            log_debug("[ipc] bad frame length %u, dropping %zu bytes", frame->len, avail);
+            evbuffer_drain(in, avail);
+            return NULL;
+        }
+        if (avail < sizeof *frame + frame->len)
+            return NULL; /* Rest of the frame hasn't arrived yet */
+
+        if (frame->version != IPC_VERSION) {
+            log_debug("[ipc] skipping version %u frame (we speak %u)", frame->version, IPC_VERSION);
+            ipc_drain(in, frame);
+            continue;
+        }
+
+        return evbuffer_pullup(in, sizeof *frame + frame->len) + sizeof *frame;
+    }
+
+    return NULL;
+}
+
+void ipc_drain(struct evbuffer * in, const struct ipc_frame * frame)
+{
+    evbuffer_drain(in, sizeof *frame + frame->len);
+}
+
+/* end ipc.c */
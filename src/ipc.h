@@ -0,0 +1,87 @@
+#ifndef IPC_HEADER__H_
+#define IPC_HEADER__H_
+
+#include <stddef.h> /* size_t */
+#include <stdint.h>
+
+/*
+ * Master <-> worker socket protocol
+ *
+ * Everything on the socket is a struct ipc_frame followed by 'len'
+ * bytes of payload. Nothing is delimited by newlines, so payloads can
+ * hold any bytes and nobody has to scan for the end of a line.
+ */
+#define IPC_VERSION 1
+/* Anything bigger than this means the stream is garbage */
+#define IPC_MAXFRAME (1 << 20)
+/* Most file descriptors we pass in one ipc_send_fds() */
+#define IPC_MAXFDS 8
+
+enum ipc_type {
+    IPC_UNSET,
+    IPC_EVENT,   /* master -> worker: struct ircmsg_event + line, id is the server */
+    IPC_SERVER,  /* master -> worker: "<name>\0<nick>\0" for server id */
+    IPC_OUTPUT,  /* worker -> master: one raw IRC line (no CRLF) for server id */
+    IPC_CONTROL, /* worker -> master: control command id (enum ipc_control) */
+    IPC_ACK,     /* worker -> master: uint32_t count of events it finished */
+    IPC_RELOAD,  /* master -> worker: reload your interpreter (you have nothing in flight) */
+    IPC_READY,   /* worker -> master: interpreter loaded, after starting or IPC_RELOAD, with what it handles (mod.c) */
+    IPC_DB_QUERY, /* worker -> storage process: a query, id is enum db_op (db.h) */
+    IPC_DB_REPLY, /* storage process -> worker: its answer, id is enum db_status */
+    IPC_TYPE_MAX
+};
+
+enum ipc_control {
+    IPC_CTL_CONNECT,   /* "<nick> <user> <host> <port> <ssl>" */
+    IPC_CTL_RELOAD,    /* optional uint16_t server id + target, the master NOTICEs it when it's done */
+    IPC_CTL_BROADCAST, /* struct ircmsg_event + line, sent on to every worker */
+    IPC_CTL_STATUS,    /* uint16_t server id + target, the master NOTICEs it worker queue stats */
+    IPC_CTL_MATCH,     /* uint8_t on + "<set>\0<key>", adds/removes a key the master's filters look for */
+    IPC_CTL_MAX
+};
+
+struct ipc_frame {
+    uint32_t len;    /* payload bytes following the header */
+    uint8_t version; /* IPC_VERSION */
+    uint8_t type;    /* enum ipc_type */
+    uint16_t id;     /* server id, or enum ipc_control for IPC_CONTROL */
+};
+
+struct evbuffer;
+struct ring;
+
+static inline struct ipc_frame ipc_frame(enum ipc_type type, unsigned short id, size_t len)
+{
+    return (struct ipc_frame){.len = len, .version = IPC_VERSION, .type = type, .id = id};
+}
+
+/* Socket to the master, only valid in worker processes */
+extern int ipc_master;
+/* Shared memory ring to the master if we have one (ring.h), workers only */
+extern struct ring * ipc_master_ring;
+
+/* Worker: send a frame to the master, over the ring when there is one */
+int ipc_output(enum ipc_type type, unsigned short id, const void * a, size_t alen, const void * b, size_t blen);
+
+/* Write one frame with its payload in up to two pieces ('b' may be NULL), -1 on error */
+int ipc_send(int fd, enum ipc_type type, unsigned short id, const void * a, size_t alen, const void * b, size_t blen);
+/* Same but queue it on 'out' (a bufferevent output buffer) */
+int ipc_add(struct evbuffer * out, enum ipc_type type, unsigned short id, const void * a, size_t alen, const void * b, size_t blen);
+
+/*
+ * Pass file descriptors (SCM_RIGHTS) along with a small message on a unix
+ * socket, used to hand a new worker its channels. The receiver gets
+ * the fds close-on-exec; returns what recvmsg() did, 0 when the peer is gone
+ */
+int ipc_send_fds(int sock, const void * buf, size_t len, const int * fds, int nfds);
+int ipc_recv_fds(int sock, void * buf, size_t len, int * fds, int * nfds);
+
+/*
+ * Return the payload of the next complete frame in 'in' (contiguous)
+ * and copy its header to 'frame', NULL if no frame is complete yet.
+ * The frame stays in the buffer until ipc_drain()
+ */
+const unsigned char * ipc_next(struct evbuffer * in, struct ipc_frame * frame);
+void ipc_drain(struct evbuffer * in, const struct ipc_frame * frame);
+
+#endif
@@ -28,6 +28,7 @@ THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
 
 
 #include "con.h"    /* connection handling interface */
@@ -35,6 +36,7 @@ THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "irc.h"    /* our own opaque type hiding all the above */
 #include "mod.h"    /* module interface */
+#include "ipc.h"    /* master socket framing */
 #include "log.h"
 
 
@@ -49,7 +51,10 @@ enum irc_modes {
 static const struct irc {
     struct server * server; /* Con.userdata(con) should provide any user/nicknames we might care about */
     struct ircmsg * msg;
-} irc_initializer; /* static, all NULL */
+    unsigned short cid; /* Server id output for this event goes to */
+} irc_initializer = {
+    .cid = IRCMSG_NOSERVER,
+};
 
 /*  Getters */
 static char * irc_target(struct irc * irc) 
@@ -67,11 +72,61 @@ static char * irc_nick(struct irc * irc) { return Msg.nick(irc->msg); }  /* retu
 static char * irc_real(struct irc * irc) { return Msg.real(irc->msg); }  /* returns realname part of nick who sent this */
 static char * irc_host(struct irc * irc) { return Msg.host(irc->msg); }  /* returns host part of nick who sent this */
 static char * irc_command(struct irc * irc) { return Msg.command(irc->msg); }/* returns command name of this IRC message */
+static int irc_type(struct irc * irc) { return Msg.type(irc->msg); }
 static short irc_numeric(struct irc * irc) { return Msg.numeric(irc->msg); }/* returns numeric of this IRC message */
 static int irc_israw(struct irc * irc) { return (Msg.type(irc->msg) == IRC_NUMERIC); }/* returns numeric of this IRC message */
 static void irc_fdump(struct irc * irc, FILE * fp) { return Msg.fdump(irc->msg, fp); } /* dump message contents to FP */
 /* Set and get the server name for this connection */
 static char * irc_server(struct irc * irc) { return Msg.servername(irc->msg); }
+static unsigned long irc_cid(struct irc * irc) { return irc->cid; }
+static unsigned int irc_matched(struct irc * irc) { return Msg.matched(irc->msg); }
+
+/*
+ * Send one formatted IRC line for server 'cid' to the master, returns
+ * the length of the line or -1
+ */
+static int irc_vout(unsigned short cid, const char * fmt, va_list ap)
+{
+    char buf[1024], * line = buf;
+    va_list copy;
+    int len;
+
+    if (cid == IRCMSG_NOSERVER) {
+        fprintf(stderr, "[error] No server to send output to\n");
+        return -1;
+    }
+
+    va_copy(copy, ap);
+    len = vsnprintf(buf, sizeof buf, fmt, copy);
+    va_end(copy);
+    if (len < 0)
+        return -1;
+    /* Doesn't fit, format again into something that does */
+    if ((size_t)len >= sizeof buf) {
+        if ( !(line = malloc(len + 1)) )
+            return -1;
+        vsnprintf(line, len + 1, fmt, ap);
+    }
+
+    if (ipc_output(IPC_OUTPUT, cid, line, len, NULL, 0) == -1)
+        len = -1;
+
+    if (line != buf)
+        free(line);
+    return len;
+}
+
+static int irc_out(struct irc * irc, const char * fmt, ...)
+{
+    va_list ap;
+    int r;
+
+    va_start(ap, fmt);
+    r = irc_vout(irc->cid, fmt, ap);
+    va_end(ap);
+
+    return r;
+}
 
 /*
  * Dispatch event to our modules/handlers
@@ -114,7 +169,7 @@ static int irc_callback(struct irc * event)
         case IRC_PING:
             /* Respond to ping as quickly as possible */
             log_debug("Sending PONG response: S%s PONG :%s", irc_server(event), Msg.text(event->msg));
-            printf("S%s PONG :%s\n", irc_server(event), Msg.text(event->msg));
+            irc_out(event, "PONG :%s", Msg.text(event->msg));
             break;
 
         case IRC_PRIVMSG:
@@ -149,11 +204,11 @@ static struct irc * irc_parse(const char * line)
     if ( (event = malloc(sizeof *event)) ) {
         *event = irc_initializer;
         event->msg = Msg.parse(line);
-		event->server = Msg.server(event->msg);
         if (!event->msg) {
             irc_free(event);
             event = NULL;
-        }
+        } else if ( (event->server = Msg.server(event->msg)) )
+            event->cid = event->server->id;
     }
 
     return event;
@@ -178,6 +233,7 @@ static struct irc * irc_dispatch(const char * line)
     event = irc_parse(line);
     if (event) {
         irc_callback(event);
+        irc_free(event);
     } else {
         /* Parse failure on line */
         fprintf(stderr, "[error] Failed to parse line '%s'\n", line);
@@ -186,28 +242,76 @@ static struct irc * irc_dispatch(const char * line)
     return NULL;
 }
 
+/*
+ * Rebuild a message the master already parsed (see struct ircmsg_event),
+ * only the views and the line are copied, nothing is parsed again
+ */
+static struct irc * irc_unpack(const struct ircmsg_event * ev, const char * line)
+{
+    struct irc * event = NULL;
+
+    if ( (event = malloc(sizeof *event)) ) {
+        *event = irc_initializer;
+        /* The master sent us its server table (IPC_SERVER) */
+        if ( (event->cid = ev->server) < MAX_SERVERS )
+            event->server = gconfig.server_ids[ev->server];
+        if ( !(event->msg = Msg.unpack(ev, line)) ) {
+            fprintf(stderr, "[error] Failed to unpack event of %u bytes\n", ev->size);
+            irc_free(event);
+            event = NULL;
+        }
+    }
+
+    return event;
+}
+
+static struct irc * irc_dispatch_event(const struct ircmsg_event * ev, const char * line)
+{
+    struct irc * event = irc_unpack(ev, line);
+
+    if (event) {
+        irc_callback(event);
+        irc_free(event);
+    }
+
+    return NULL;
+}
+
+/* Same round trip a broadcast takes, the copy owns its line */
+static struct irc * irc_copy(struct irc * irc)
+{
+    struct ircmsg_event ev;
+    const char * line = Msg.pack(irc->msg, irc->cid, &ev);
+
+    return irc_unpack(&ev, line);
+}
+
 /* Output commands */
-static int raw(struct irc * irc, const char * msg) { return printf("S%s %s\n", irc_server(irc), msg); }
+static int raw(struct irc * irc, const char * msg) { return irc_out(irc, "%s", msg); }
 static int privmsg_server(struct irc * irc, const char * server, const char * target, const char * msg) 
 { 
-    return printf("S%s PRIVMSG %s :%s\n", server, target, msg); 
+    /* Workers know the servers by id (IPC_SERVER), look this one up */
+    struct server * to = htable.lookup(gconfig.servers, server);
+    struct irc other = {.cid = to ? to->id : IRCMSG_NOSERVER};
+
+    return irc_out(&other, "PRIVMSG %s :%s", target, msg); 
 }
 static int privmsg(struct irc * irc, const char * target, const char * msg) 
 { 
-    return printf("S%s PRIVMSG %s :%s\n", irc_server(irc), target, msg); 
+    return irc_out(irc, "PRIVMSG %s :%s", target, msg); 
 }
 
 static int privmsg_len(struct irc * irc, const char * target, const char * msg, size_t len) {
-	return printf("S%s PRIVMSG %s :%.*s\n", irc_server(irc), target, (int)len, msg);
+	return irc_out(irc, "PRIVMSG %s :%.*s", target, (int)len, msg);
 }
 
 static int cprivmsg(struct irc * irc, const char * target, const char * channel, const char * msg) 
 { 
-    return printf("S%s CPRIVMSG %s %s :%s\n", irc_server(irc), target, channel,msg); 
+    return irc_out(irc, "CPRIVMSG %s %s :%s", target, channel,msg); 
 }
 static int notice(struct irc * irc, const char * target, const char * msg) 
 { 
-    return printf("S%s NOTICE %s :%s\n", irc_server(irc), target, msg); 
+    return irc_out(irc, "NOTICE %s :%s", target, msg); 
 }
 
 /* Say, splits msg up into 512 byte increments and sends it off */
@@ -232,80 +336,113 @@ static int say(struct irc * irc, const char * msg)
 /* Channel commands */
 static int join(struct irc * irc, const char * target)
 {
-    return printf("S%s JOIN %s\n", irc_server(irc), target);
+    return irc_out(irc, "JOIN %s", target);
 }
 
 static int joinkeys(struct irc * irc, const char * target, const char * keys)
 {
-    return printf("S%s JOIN %s %s\n", irc_server(irc), target, keys);
+    return irc_out(irc, "JOIN %s %s", target, keys);
 }
 
 static int part(struct irc * irc, const char * target, const char * msg)
 {
-    return printf("S%s PART %s %s\n", irc_server(irc), target, msg ? msg : "");
+    return irc_out(irc, "PART %s %s", target, msg ? msg : "");
 }
 
 static int topic(struct irc * irc, const char * target, const char *msg)
 {
-    return printf("S%s TOPIC %s :%s\n", irc_server(irc), target, msg);
+    return irc_out(irc, "TOPIC %s :%s", target, msg);
 }
 
 static int mode(struct irc * irc, const char * target, const char * flags, const char * args)
 {
-    return printf("S%s MODE %s %s :%s\n", irc_server(irc), target, flags, args);
+    return irc_out(irc, "MODE %s %s :%s", target, flags, args);
 }
 
 static int kick(struct irc * irc, const char * target, const char * ktarget, const char * msg)
 {
-    return printf("S%s KICK %s %s :%s\n", irc_server(irc), target, ktarget, msg);
+    return irc_out(irc, "KICK %s %s :%s", target, ktarget, msg);
 }
 
 /* Info lookup */
 static int whois(struct irc * irc, const char * target)
 {
-    return printf("S%s WHOIS %s\n", irc_server(irc), target);
+    return irc_out(irc, "WHOIS %s", target);
 }
 static int who(struct irc * irc, const char * mask)
 {
-    return printf("S%s WHO %s\n", irc_server(irc), mask);
+    return irc_out(irc, "WHO %s", mask);
 }
 static int userhost(struct irc * irc, const char * users)
 {
-    return printf("S%s USERHOST %s\n", irc_server(irc), users);
+    return irc_out(irc, "USERHOST %s", users);
 }
 
 /* Management commands */
 /* Connect to a new server */
 static int irc_connect(struct irc * irc, const char * nick, const char * username, const char * host, unsigned int port, int ssl)
 {
-    return printf(":CONNECT %s %s %s %d %d\n", nick, username, host, port, ssl);
+    char args[BUFSIZ];
+    int len = snprintf(args, sizeof args, "%s %s %s %d %d", nick, username, host, port, ssl);
+
+    if (len < 0 || (size_t)len >= sizeof args)
+        return -1;
+    return ipc_output(IPC_CONTROL, IPC_CTL_CONNECT, args, len, NULL, 0);
 }
-/* Connect to a new server */
+/* Rolling reload of the workers, the master tells our target when it's done */
 static int irc_reload(struct irc * irc)
 {
-    return printf(":RELOAD\n");
+    const char * target = irc_target(irc);
+    uint16_t cid = irc->cid;
+
+    if (!target || cid == IRCMSG_NOSERVER)
+        return ipc_output(IPC_CONTROL, IPC_CTL_RELOAD, NULL, 0, NULL, 0);
+    return ipc_output(IPC_CONTROL, IPC_CTL_RELOAD, &cid, sizeof cid, target, strlen(target));
 }
-/* Broadcast IRC event to all children */
+/* Broadcast IRC event to all children, it goes out as the same record we got it in */
 static int irc_broadcast(struct irc * irc)
 {
-	char tmpbuf[512] = {0};
-	snprintf(tmpbuf, sizeof tmpbuf, "S%s :%s!%s@%s %s %s :%s", 
-			irc_server(irc),
-			irc_nick(irc),
-			irc_real(irc),
-			irc_host(irc),
-			irc_command(irc), 
-			irc_target(irc) ? irc_target(irc) : "",
-			irc_text(irc) ? irc_text(irc) : ""
-	);
-    return printf(":BROADCAST %s\n", tmpbuf);
+    struct ircmsg_event ev;
+    const char * line = Msg.pack(irc->msg, irc->cid, &ev);
+
+    return ipc_output(IPC_CONTROL, IPC_CTL_BROADCAST, &ev, sizeof ev, line, ev.size);
+}
+/* Worker queue stats, the master answers with NOTICEs to our target */
+static int irc_status(struct irc * irc)
+{
+    const char * target = irc_target(irc);
+    uint16_t cid = irc->cid;
+
+    if (!target || cid == IRCMSG_NOSERVER)
+        return -1;
+    return ipc_output(IPC_CONTROL, IPC_CTL_STATUS, &cid, sizeof cid, target, strlen(target));
+}
+/* Handler we're in for this event, it goes to the master's scoreboard not the socket */
+static int irc_handler(struct irc * irc, const char * name)
+{
+    mod_handler(name);
+    return 0;
+}
+/* Keys for the master's filters, "<on><set>\0" and then the key */
+static int irc_match_set(struct irc * irc, const char * set, const char * key, int on)
+{
+    char args[256];
+    int len = snprintf(args + 1, sizeof args - 1, "%s", set);
+
+    if (len < 0 || (size_t)len >= sizeof args - 1 || !*key)
+        return -1;
+    args[0] = !!on;
+    return ipc_output(IPC_CONTROL, IPC_CTL_MATCH, args, len + 2, key, strlen(key));
 }
 
 
 
 const struct irc_api irc = {
     .dispatch = irc_dispatch,
+    .dispatch_event = irc_dispatch_event,
+    .unpack = irc_unpack,
     .free = irc_free,
+    .copy = irc_copy,
 
     /* Get */
     .target = irc_target,
@@ -314,15 +451,21 @@ const struct irc_api irc = {
     .real = irc_real,
     .host = irc_host,
     .command = irc_command,
+    .type = irc_type,
     .numeric = irc_numeric,
     .israw = irc_israw,
     .server = irc_server,
+    .cid = irc_cid,
+    .matched = irc_matched,
 
     .fdump = irc_fdump,
 
     .connect = irc_connect,
     .reload = irc_reload,
     .broadcast = irc_broadcast,
+    .status = irc_status,
+    .handler = irc_handler,
+    .match_set = irc_match_set,
 
     /* Commands */
     .raw = raw,
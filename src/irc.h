@@ -4,9 +4,17 @@
 /* Interface */
 extern const struct irc_api irc;
 
+struct ircmsg_event; /* ircmsg.h */
+
 struct irc_api {
     struct irc * (*dispatch)(const char * line);
+    /* Dispatch a message parsed by the master, 'line' follows the header on the wire */
+    struct irc * (*dispatch_event)(const struct ircmsg_event * ev, const char * line);
+    /* Same without dispatching it, for handlers that take a batch of them (caller frees) */
+    struct irc * (*unpack)(const struct ircmsg_event * ev, const char * line);
     void (*free)(struct irc * irc);
+    /* Copy of an event that outlives its handler, to reply to later (caller frees) */
+    struct irc * (*copy)(struct irc * irc);
 
     /* Get */
     char * (*target)(struct irc * irc); /* target the message was for */
@@ -15,10 +23,12 @@ struct irc_api {
     char * (*real)(struct irc * irc);  /* returns realname part of nick who sent this */
     char * (*host)(struct irc * irc);  /* returns host part of nick who sent this */
     char * (*command)(struct irc * irc);  /* returns command name of this IRC message */
+    int (*type)(struct irc * irc);  /* enum ircmsg_type of this IRC message */
     short (*numeric)(struct irc * irc);  /* returns command name of this IRC message */
     int (*israw)(struct irc * irc);  /* Returns true if this command is a numeric and not a string command */
     unsigned long (*cid)(struct irc * irc); /* Returns the connection ID for this server to identify outgoing messages with */
     char * (*server)(struct irc * irc); /* Returns the server name used to identify the server in multi-server commands */
+    unsigned int (*matched)(struct irc * irc); /* Filtered handlers the master matched this for (mod.c), 0 if it didn't filter it */
 
     void (*fdump)(struct irc * irc, FILE * fp); /* debugging, dumps contents to FILE ptr */
 
@@ -28,6 +38,12 @@ struct irc_api {
     int (*reload)(struct irc * irc);
     /* Allows child to send the message as a broadcast to all children (including itself) */
     int (*broadcast)(struct irc * irc);
+    /* Have the master report its worker queues to our target */
+    int (*status)(struct irc * irc);
+    /* Name the handler we're running this in, the master reports it if we hang */
+    int (*handler)(struct irc * irc, const char * name);
+    /* Add ('on') or remove a key in a set the master filters events with (nick_in, source_in) */
+    int (*match_set)(struct irc * irc, const char * set, const char * key, int on);
 
     /* Actions/Output */
     int (*raw)(struct irc * irc, const char * msg); /* send raw server command */
@@ -2,10 +2,10 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <string.h> /* strncmp */
+#include <string.h> /* memcpy */
 
-#include <htable.h> /* Urlib */
-#include "xstr.h" /* xstrndup */
+#include <htable.h> /* server lookup */
+#include "ircscan.h" /* delimiter positions */
 
 #include "ircmsg.h"
 #include "ircmsg.t"
@@ -13,57 +13,235 @@
 
 #define ARRAY_SIZE(x) (sizeof (x) / sizeof *(x))
 
-static enum ircmsg_type ircmsg_determine_type(struct ircmsg * msg)
+/* Compare against a literal, the length is known at compile time */
+#define IRCM_IS(s, lit) (!memcmp((s), (lit), sizeof (lit) - 1))
+
+/*
+ * Classify a command of length 'len', the caller already checked the
+ * length so each candidate is a single fixed size compare. Covers
+ * RFC 1459/2812 and the IRCv3 commands, unknown commands are IRC_UNSET.
+ */
+static enum ircmsg_type ircmsg_command_type(const char * c, size_t len)
 {
-    struct types_ {
-        const char * s;
-        enum ircmsg_type type;
-    };
-    static struct htable * htab;
-
-    if (!htab) {
-        size_t i;
-        static struct types_ types[] = { 
-            {"JOIN", IRC_JOIN},
-            {"KICK", IRC_KICK},
-            {"MODE", IRC_MODE},
-            {"NICK", IRC_NICK},
-            {"NOTICE", IRC_NOTICE},
-            {"PART", IRC_PART},
-            {"PING", IRC_PING},
-            {"PRIVMSG", IRC_PRIVMSG},
-            {"QUIT", IRC_QUIT},
-            {"TOPIC", IRC_TOPIC},
-        };
-
-        htab = htable.new(30);
-
-        for (i = 0; i < sizeof types / sizeof *types; ++i)
-            htable.store(htab, types[i].s, &types[i]);
+    switch (len) {
+    case 3:
+        switch (*c) {
+        case 'C':
+            if (IRCM_IS(c, "CAP")) return IRC_CAP;
+            break;
+        case 'D':
+            if (IRCM_IS(c, "DIE")) return IRC_DIE;
+            break;
+        case 'W':
+            if (IRCM_IS(c, "WHO")) return IRC_WHO;
+            break;
+        }
+        break;
+    case 4:
+        switch (*c) {
+        case 'A':
+            if (IRCM_IS(c, "AWAY")) return IRC_AWAY;
+            break;
+        case 'F':
+            if (IRCM_IS(c, "FAIL")) return IRC_FAIL;
+            break;
+        case 'I':
+            if (IRCM_IS(c, "INFO")) return IRC_INFO;
+            if (IRCM_IS(c, "ISON")) return IRC_ISON;
+            break;
+        case 'J':
+            if (IRCM_IS(c, "JOIN")) return IRC_JOIN;
+            break;
+        case 'K':
+            if (IRCM_IS(c, "KICK")) return IRC_KICK;
+            if (IRCM_IS(c, "KILL")) return IRC_KILL;
+            break;
+        case 'L':
+            if (IRCM_IS(c, "LIST")) return IRC_LIST;
+            break;
+        case 'M':
+            if (IRCM_IS(c, "MODE")) return IRC_MODE;
+            if (IRCM_IS(c, "MOTD")) return IRC_MOTD;
+            break;
+        case 'N':
+            if (IRCM_IS(c, "NICK")) return IRC_NICK;
+            if (IRCM_IS(c, "NOTE")) return IRC_NOTE;
+            break;
+        case 'O':
+            if (IRCM_IS(c, "OPER")) return IRC_OPER;
+            break;
+        case 'P':
+            if (IRCM_IS(c, "PART")) return IRC_PART;
+            if (IRCM_IS(c, "PASS")) return IRC_PASS;
+            if (IRCM_IS(c, "PING")) return IRC_PING;
+            if (IRCM_IS(c, "PONG")) return IRC_PONG;
+            break;
+        case 'Q':
+            if (IRCM_IS(c, "QUIT")) return IRC_QUIT;
+            break;
+        case 'T':
+            if (IRCM_IS(c, "TIME")) return IRC_TIME;
+            break;
+        case 'U':
+            if (IRCM_IS(c, "USER")) return IRC_USER;
+            break;
+        case 'W':
+            if (IRCM_IS(c, "WARN")) return IRC_WARN;
+            break;
+        }
+        break;
+    case 5:
+        switch (*c) {
+        case 'A':
+            if (IRCM_IS(c, "ADMIN")) return IRC_ADMIN;
+            break;
+        case 'B':
+            if (IRCM_IS(c, "BATCH")) return IRC_BATCH;
+            break;
+        case 'E':
+            if (IRCM_IS(c, "ERROR")) return IRC_ERROR;
+            break;
+        case 'L':
+            if (IRCM_IS(c, "LINKS")) return IRC_LINKS;
+            break;
+        case 'N':
+            if (IRCM_IS(c, "NAMES")) return IRC_NAMES;
+            if (IRCM_IS(c, "NJOIN")) return IRC_NJOIN;
+            break;
+        case 'S':
+            if (IRCM_IS(c, "SQUIT")) return IRC_SQUIT;
+            if (IRCM_IS(c, "STATS")) return IRC_STATS;
+            break;
+        case 'T':
+            if (IRCM_IS(c, "TOPIC")) return IRC_TOPIC;
+            if (IRCM_IS(c, "TRACE")) return IRC_TRACE;
+            break;
+        case 'U':
+            if (IRCM_IS(c, "USERS")) return IRC_USERS;
+            break;
+        case 'W':
+            if (IRCM_IS(c, "WHOIS")) return IRC_WHOIS;
+            break;
+        }
+        break;
+    case 6:
+        switch (*c) {
+        case 'I':
+            if (IRCM_IS(c, "INVITE")) return IRC_INVITE;
+            break;
+        case 'L':
+            if (IRCM_IS(c, "LUSERS")) return IRC_LUSERS;
+            break;
+        case 'N':
+            if (IRCM_IS(c, "NOTICE")) return IRC_NOTICE;
+            break;
+        case 'R':
+            if (IRCM_IS(c, "REHASH")) return IRC_REHASH;
+            break;
+        case 'S':
+            if (IRCM_IS(c, "SERVER")) return IRC_SERVER;
+            if (IRCM_IS(c, "SQUERY")) return IRC_SQUERY;
+            if (IRCM_IS(c, "SUMMON")) return IRC_SUMMON;
+            break;
+        case 'T':
+            if (IRCM_IS(c, "TAGMSG")) return IRC_TAGMSG;
+            break;
+        case 'W':
+            if (IRCM_IS(c, "WHOWAS")) return IRC_WHOWAS;
+            break;
+        }
+        break;
+    case 7:
+        switch (*c) {
+        case 'A':
+            if (IRCM_IS(c, "ACCOUNT")) return IRC_ACCOUNT;
+            break;
+        case 'C':
+            if (IRCM_IS(c, "CHGHOST")) return IRC_CHGHOST;
+            if (IRCM_IS(c, "CNOTICE")) return IRC_CNOTICE;
+            if (IRCM_IS(c, "CONNECT")) return IRC_CONNECT;
+            break;
+        case 'M':
+            if (IRCM_IS(c, "MONITOR")) return IRC_MONITOR;
+            break;
+        case 'P':
+            if (IRCM_IS(c, "PRIVMSG")) return IRC_PRIVMSG;
+            break;
+        case 'R':
+            if (IRCM_IS(c, "RESTART")) return IRC_RESTART;
+            break;
+        case 'S':
+            if (IRCM_IS(c, "SERVICE")) return IRC_SERVICE;
+            if (IRCM_IS(c, "SETNAME")) return IRC_SETNAME;
+            break;
+        case 'V':
+            if (IRCM_IS(c, "VERSION")) return IRC_VERSION;
+            break;
+        case 'W':
+            if (IRCM_IS(c, "WALLOPS")) return IRC_WALLOPS;
+            break;
+        }
+        break;
+    case 8:
+        switch (*c) {
+        case 'C':
+            if (IRCM_IS(c, "CPRIVMSG")) return IRC_CPRIVMSG;
+            break;
+        case 'S':
+            if (IRCM_IS(c, "SERVLIST")) return IRC_SERVLIST;
+            break;
+        case 'U':
+            if (IRCM_IS(c, "USERHOST")) return IRC_USERHOST;
+            break;
+        }
+        break;
+    case 12:
+        switch (*c) {
+        case 'A':
+            if (IRCM_IS(c, "AUTHENTICATE")) return IRC_AUTHENTICATE;
+            break;
+        }
+        break;
     }
 
-    /* Check for NUMERIC type first as it's the common case, then command */
-    if (*msg->command >= '0' && *msg->command <= '9') {
-        msg->type = IRC_NUMERIC;
-        sscanf(msg->command, "%03hd", &msg->numeric);
-    } else {
-        /* Check hash table for our type */
-        struct types_ * t = htable.lookup(htab, msg->command);
+    return IRC_UNSET;
+}
 
-        if (t)
-            msg->type = t->type;
-    }
+static enum ircmsg_type ircmsg_determine_type(struct ircmsg * msg)
+{
+    const char * command = msg->line + msg->command.off;
+
+    /* Check for NUMERIC type first as it's the common case, then command */
+    if (*command >= '0' && *command <= '9') {
+        unsigned short i;
 
+        msg->type = IRC_NUMERIC;
+        msg->numeric = 0;
+        /* Numerics are 3 digits, decode the same way "%03hd" did */
+        for (i = 0; i < msg->command.len && i < 3 && command[i] >= '0' && command[i] <= '9'; ++i)
+            msg->numeric = msg->numeric * 10 + (command[i] - '0');
+    } else
+        msg->type = ircmsg_command_type(command, msg->command.len);
 
     return msg->type;
 }
 
 /****************************************************************************
  * FSM parser for IRC Message format
+ *
+ * The parser works on the single owned copy of the line stored in
+ * the message. Delimiters are replaced by NUL bytes as they are found
+ * and each field is recorded as an offset/length view, so nothing is
+ * allocated past the message itself.
+ *
+ * The line is scanned for ' ', '!', '@' and ':' up front (see ircscan.c)
+ * and the states below jump from one delimiter position to the next
+ * rather than looking at every byte.
  ****************************************************************************/
 struct ircmsg_state {
-    const char * line;
+    char * line;
     struct ircmsg * event;
+    struct ircscan scan; /* Delimiter positions in event->line */
 
     /* Set to next state and return function, NULL stops FSM */
     struct ircmsg_state * (*next)(struct ircmsg_state * state);
@@ -74,21 +252,45 @@ static struct ircmsg_state * ircm_st_prefix(struct ircmsg_state * state);
 static struct ircmsg_state * ircm_st_command(struct ircmsg_state * state);
 static struct ircmsg_state * ircm_st_params(struct ircmsg_state * state);
 
+/* Record [start,end) as a view and terminate it in place */
+static void ircm_span(struct ircmsg * msg, struct ircmsg_span * span, char * start, char * end)
+{
+    span->off = start - msg->line;
+    span->len = end - start;
+    *end = '\0';
+}
+
+/* Next delimiter at or after 'from', NULL at the end of the line */
+static inline char * ircm_delim(struct ircmsg_state * state, const char * from)
+{
+    return (char *)ircscan_next(&state->scan, from);
+}
+
+/* Next 'c' at or after 'from', or the end of the line */
+static inline char * ircm_find(struct ircmsg_state * state, const char * from, char c)
+{
+    char * p;
+
+    for (p = ircm_delim(state, from); p && *p != c; p = ircm_delim(state, p + 1))
+        ;
+
+    return p ? p : state->event->line + state->event->size;
+}
+
 static struct ircmsg_state * ircm_st_cid(struct ircmsg_state * state)
 {
-    int consumed;
+    char * p;
     state->next = ircm_st_begin;
 
     /* Parse the connection id */
-	/* TODO this is a potential bufferoverflow since we dont check the size on servername in sscanf */
-    if (sscanf(state->line, "S%s %n", state->event->servername, &consumed)) {
-        state->line += consumed;
+    if (*state->line == 'S' && *(p = ircm_find(state, state->line, ' '))) {
+        ircm_span(state->event, &state->event->servername, state->line + 1, p);
+        state->line = p + 1;
 		/* Get the server object for this message from the global config */
 		/* TODO decouple this, ircmsg should be agnostic of the htable.lookup server config */
-		state->event->server = htable.lookup(gconfig.servers, state->event->servername);
+		state->event->server = htable.lookup(gconfig.servers, state->event->line + state->event->servername.off);
 	}
 
-
     return state;
 }
 
@@ -104,36 +306,27 @@ static struct ircmsg_state * ircm_st_begin(struct ircmsg_state * state)
 
 static struct ircmsg_state * ircm_st_prefix(struct ircmsg_state * state)
 {
-    const char * p;
+    char * p;
     state->next = ircm_st_command;
-    char cont = 1;
-
-    for (p = state->line; *p && cont; ++p) {
-        enum { BANG=1<<0, ATSIGN=1<<1, SPACE=1<<2 };
-        register short is_tok = (
-                  (*p == '!' ? BANG : 0)
-                | (*p == '@' ? ATSIGN : 0)
-                | (*p == ' ' ? SPACE : 0) 
-        );
-        /* Outer 'if' used to group state->line = p+1 assignment
-         * which has to come after the switch.. and would
-         * otherwise be repeated in each case */
-        if (is_tok) {
-            switch(is_tok) {
-            case BANG:
-                state->event->pfx->nickname = xstrndup(state->line, p - state->line );
-                break;
-            case ATSIGN:
-                state->event->pfx->realname = xstrndup(state->line, p - state->line );
-                break;
-            case SPACE:
-                state->event->pfx->host = xstrndup(state->line, p - state->line );
-                cont = 0; /* Stop looping here.. */
-                break;
-            }
-            /* start at next point (for copy) */
-            state->line = ++p;
+
+    /* ':' can show up in (IPv6) hosts, only '!', '@' and ' ' matter here */
+    for (p = ircm_delim(state, state->line); p; p = ircm_delim(state, p + 1)) {
+        switch (*p) {
+        case '!':
+            ircm_span(state->event, &state->event->nick, state->line, p);
+            break;
+        case '@':
+            ircm_span(state->event, &state->event->real, state->line, p);
+            break;
+        case ' ':
+            ircm_span(state->event, &state->event->host, state->line, p);
+            state->line = p + 1;
+            return state; /* Stop looping here.. */
+        default:
+            continue;
         }
+        /* start at next point */
+        state->line = p + 1;
     }
 
     return state;
@@ -141,42 +334,52 @@ static struct ircmsg_state * ircm_st_prefix(struct ircmsg_state * state)
 
 static struct ircmsg_state * ircm_st_command(struct ircmsg_state * state)
 {
-    const char * p;
+    char * p;
+    char last;
     state->next = ircm_st_params;
 
-    if ( (p = xstrchrnul(state->line, ' ')) ) {
-        state->event->command = xstrndup(state->line, p - state->line );
-        state->line = p;
-        /* Now check the type we just copied into ->command */
-        ircmsg_determine_type(state->event);
-        /* Skip over the space we just found now */
-        if (*state->line) ++state->line;
-    }
+    p = ircm_find(state, state->line, ' ');
+    last = *p;
+    ircm_span(state->event, &state->event->command, state->line, p);
+    state->line = p;
+    /* Now check the type we just terminated in ->command */
+    ircmsg_determine_type(state->event);
+    /* Skip over the space we just found now */
+    if (last) ++state->line;
 
     return state;
 }
 
 static struct ircmsg_state * ircm_st_params(struct ircmsg_state * state)
 {
-    const char * p;
+    char * p;
+    struct ircmsg * msg = state->event;
+    char * end = msg->line + msg->size;
 
     /* We always end here */
     state->next = NULL;
 
-    for (p = state->line; *p; ++p) {
+    for (;;) {
         /* Found a text parameter, rest of string is our text */
         if (*state->line == ':') {
-            state->event->text = xstrdup(++state->line);
+            ++state->line;
+            ircm_span(msg, &msg->text, state->line, end);
+            state->line = end;
             break; /* we're done */
         }
 
-        /* Parameter, copy it in and continue */
-        if (*p == ' ') {
-            if (state->event->argc >= ARRAY_SIZE(state->event->argv)) 
-                break;
-            state->event->argv[state->event->argc++] = xstrndup(state->line, p - state->line );
-            state->line = p+1;
+        /* Parameter (the last one ends the line), record it and continue */
+        p = ircm_find(state, state->line, ' ');
+        if (p == state->line && p == end)
+            break;
+        if (msg->argc >= ARRAY_SIZE(msg->argv)) 
+            break;
+        ircm_span(msg, &msg->argv[msg->argc++], state->line, p);
+        if (p == end) {
+            state->line = end;
+            break;
         }
+        state->line = p + 1;
     }
 
     return state;
@@ -207,55 +410,160 @@ static void ircm_run(struct ircmsg_state * state)
  * END FSM CODE
  ****************************************************************************/
 
+/*
+ * Allocate a message with room for a 'len' byte line, the message
+ * and its copy of the line are a single allocation released by
+ * ircmsg_free()
+ */
+static struct ircmsg * ircmsg_new(size_t len)
+{
+    struct ircmsg * msg;
+
+    if ( (msg = malloc(sizeof *msg + len + 1)) ) {
+        *msg = ircmsg_initializer;
+        msg->line = (char *)(msg + 1);
+        msg->size = len;
+        msg->line[len] = '\0';
+    }
+
+    return msg;
+}
+
+/* Copy 'line' in after 'skip' bytes already in the message and run the FSM from 'first' */
+static void ircmsg_run(struct ircmsg * msg, size_t skip, const char * line,
+        struct ircmsg_state * (*first)(struct ircmsg_state * state))
+{
+    struct ircmsg_state state;
+
+    memcpy(msg->line + skip, line, msg->size - skip);
+
+    /* Begin parsing */
+    state.event = msg;
+    state.line = msg->line + skip;
+    state.next = first;
+    ircscan_init(&state.scan, msg->line, msg->size);
+    ircm_run(&state); /* start the EFSM */
+}
+
+/* Parse "S<servername> <line>" as the workers receive it */
 static struct ircmsg * ircmsg_parse(const char * line)
 {
     struct ircmsg * msg;
+    size_t len = strlen(line);
 
-    do {
-        struct ircmsg_state state;
+    if (len > IRCMSG_MAXLINE)
+        len = IRCMSG_MAXLINE;
 
-        msg = malloc(sizeof *msg);
-        if (!msg)
-            break;
-        *msg = ircmsg_initializer;
+    if ( (msg = ircmsg_new(len)) )
+        ircmsg_run(msg, 0, line, ircm_st_cid);
 
-        msg->pfx = malloc(sizeof *msg->pfx);
-        if (!msg->pfx) {
-            free(msg);
-            msg = NULL;
-            break;
+    return msg;
+}
+
+/*
+ * Parse a line as read from 'server', the server name is copied
+ * in front of the line ("name\0line") so it can be shipped along
+ * with the rest of the views, no lookup needed.
+ */
+static struct ircmsg * ircmsg_parse_server(const char * line, struct server * server)
+{
+    struct ircmsg * msg;
+    size_t len = strlen(line);
+    size_t nlen = server && server->name ? strlen(server->name) : 0;
+    size_t skip = nlen ? nlen + 1 : 0;
+
+    if (skip + len > IRCMSG_MAXLINE) {
+        if (skip >= IRCMSG_MAXLINE)
+            skip = nlen = 0;
+        len = IRCMSG_MAXLINE - skip;
+    }
+
+    if ( (msg = ircmsg_new(skip + len)) ) {
+        if (nlen) {
+            memcpy(msg->line, server->name, nlen);
+            msg->line[nlen] = '\0';
+            msg->servername.off = 0;
+            msg->servername.len = nlen;
         }
-        msg->pfx->host = 
-            msg->pfx->nickname =
-            msg->pfx->realname =
-            NULL;
-
-        /* Begin parsing */
-        state.event = msg;
-        state.line = line;
-        state.next = ircm_st_cid;
-        ircm_run(&state); /* start the EFSM */
-    }while(0);
+        msg->server = server;
+        ircmsg_run(msg, skip, line, ircm_st_begin);
+    }
 
     return msg;
 }
 
+/*
+ * Wire format
+ */
+static const char * ircmsg_pack(struct ircmsg * msg, unsigned short server_id, struct ircmsg_event * ev)
+{
+    ev->size = msg->size + 1; /* include the final NUL */
+    ev->server = server_id;
+    ev->type = msg->type;
+    ev->argc = msg->argc;
+    ev->numeric = msg->numeric;
+    ev->matched = msg->matched;
+    ev->servername = msg->servername;
+    ev->nick = msg->nick;
+    ev->real = msg->real;
+    ev->host = msg->host;
+    ev->command = msg->command;
+    ev->text = msg->text;
+    memcpy(ev->argv, msg->argv, sizeof ev->argv);
+
+    return msg->line;
+}
 
-static void ircmsg_free(struct ircmsg * msg)
+/* A view from the wire must stay inside the line it came with */
+static inline int ircmsg_span_ok(struct ircmsg_span span, unsigned int size)
 {
-    if (msg) {
-        if (msg->pfx) {
-            free(msg->pfx->nickname);
-            free(msg->pfx->realname);
-            free(msg->pfx->host);
-            free(msg->pfx); msg->pfx = NULL;
-        }
-        free(msg->text);
-        free(msg->command);
+    return span.off == IRCMSG_NOSPAN || (unsigned int)span.off + span.len < size;
+}
 
-        for (--msg->argc; msg->argc >= 0; --msg->argc)
-            free(msg->argv[msg->argc]);
+static struct ircmsg * ircmsg_unpack(const struct ircmsg_event * ev, const char * line)
+{
+    struct ircmsg * msg;
+    int i;
+
+    if (!ev->size || ev->size - 1 > IRCMSG_MAXLINE || ev->argc > IRCMSG_MAXARGS)
+        return NULL;
+    if (!ircmsg_span_ok(ev->servername, ev->size) || !ircmsg_span_ok(ev->nick, ev->size)
+            || !ircmsg_span_ok(ev->real, ev->size) || !ircmsg_span_ok(ev->host, ev->size)
+            || !ircmsg_span_ok(ev->command, ev->size) || !ircmsg_span_ok(ev->text, ev->size))
+        return NULL;
+    for (i = 0; i < ev->argc; ++i)
+        if (!ircmsg_span_ok(ev->argv[i], ev->size))
+            return NULL;
+
+    if ( (msg = ircmsg_new(ev->size - 1)) ) {
+        memcpy(msg->line, line, ev->size - 1);
+        msg->type = ev->type;
+        msg->argc = ev->argc;
+        msg->numeric = ev->numeric;
+        msg->matched = ev->matched;
+        msg->servername = ev->servername;
+        msg->nick = ev->nick;
+        msg->real = ev->real;
+        msg->host = ev->host;
+        msg->command = ev->command;
+        msg->text = ev->text;
+        memcpy(msg->argv, ev->argv, sizeof msg->argv);
+        /* msg->server stays NULL, workers don't hold the server table */
     }
+
+    return msg;
+}
+
+
+static void ircmsg_free(struct ircmsg * msg)
+{
+    free(msg);
+}
+
+/* Resolve a view to a string in our line, NULL if it was never set */
+static inline char * ircmsg_span_str(struct ircmsg * msg, struct ircmsg_span span)
+{
+    return span.off == IRCMSG_NOSPAN ? NULL : msg->line + span.off;
 }
 
 void ircmsg_print(struct ircmsg * msg, FILE * fp)
@@ -263,19 +571,18 @@ void ircmsg_print(struct ircmsg * msg, FILE * fp)
     if (msg) {
         int argc;
 
-        if (msg->pfx) {
-            if (msg->pfx->nickname) 
-                fprintf(fp, "<%s!%s@%s>", msg->pfx->nickname, msg->pfx->realname, msg->pfx->host);
-            else
-                fprintf(fp, "h:%s", msg->pfx->host);
-        }
+        if (msg->nick.off != IRCMSG_NOSPAN) 
+            fprintf(fp, "<%s!%s@%s>", ircmsg_span_str(msg, msg->nick), 
+                    ircmsg_span_str(msg, msg->real), ircmsg_span_str(msg, msg->host));
+        else
+            fprintf(fp, "h:%s", ircmsg_span_str(msg, msg->host));
 
-        fprintf(fp, " c:%s ", msg->command);
+        fprintf(fp, " c:%s ", ircmsg_span_str(msg, msg->command));
 
         for (argc = 0; argc < msg->argc; ++argc)
-            fprintf(fp, "p:%s ", msg->argv[argc]);
+            fprintf(fp, "p:%s ", ircmsg_span_str(msg, msg->argv[argc]));
 
-        fprintf(fp, "t:%s", msg->text);
+        fprintf(fp, "t:%s", ircmsg_span_str(msg, msg->text));
 
         /* end */
         fprintf(fp, "\n");
@@ -286,22 +593,29 @@ void ircmsg_print(struct ircmsg * msg, FILE * fp)
  * Getters
  */
 enum ircmsg_type ircmsg_get_type(struct ircmsg * msg) { return msg->type; }
-char * ircmsg_get_command(struct ircmsg * msg) { return msg->command; }
-char * ircmsg_get_text(struct ircmsg * msg) { return msg->text; }
+char * ircmsg_get_command(struct ircmsg * msg) { return ircmsg_span_str(msg, msg->command); }
+char * ircmsg_get_text(struct ircmsg * msg) { return ircmsg_span_str(msg, msg->text); }
 short ircmsg_get_numeric(struct ircmsg * msg) { return msg->numeric; }
-char * ircmsg_get_nick(struct ircmsg * msg) { return msg->pfx->nickname; }
-char * ircmsg_get_real(struct ircmsg * msg) { return msg->pfx->realname; }
-char * ircmsg_get_host(struct ircmsg * msg) { return msg->pfx->host; }
-char * ircmsg_get_servername(struct ircmsg * msg) { return msg->servername; }
+unsigned int ircmsg_get_matched(struct ircmsg * msg) { return msg->matched; }
+char * ircmsg_get_nick(struct ircmsg * msg) { return ircmsg_span_str(msg, msg->nick); }
+char * ircmsg_get_real(struct ircmsg * msg) { return ircmsg_span_str(msg, msg->real); }
+char * ircmsg_get_host(struct ircmsg * msg) { return ircmsg_span_str(msg, msg->host); }
+char * ircmsg_get_servername(struct ircmsg * msg) { return ircmsg_span_str(msg, msg->servername); }
 struct server * ircmsg_get_server(struct ircmsg * msg) { return msg->server; }
 /* Get parameter at index 'argc' */
-char * ircmsg_get_argv(struct ircmsg * msg, int argc) { if (argc >= msg->argc) return NULL; return msg->argv[argc]; }
+char * ircmsg_get_argv(struct ircmsg * msg, int argc) { if (argc >= msg->argc) return NULL; return ircmsg_span_str(msg, msg->argv[argc]); }
+enum ircmsg_type ircmsg_name_type(const char * command) { return ircmsg_command_type(command, strlen(command)); }
 
 
 const struct ircmsg_api Msg = {
     .parse = ircmsg_parse,
+    .parse_server = ircmsg_parse_server,
     .free = ircmsg_free,
 
+    /* Wire format */
+    .pack = ircmsg_pack,
+    .unpack = ircmsg_unpack,
+
     /* Getters */
     .type =  ircmsg_get_type,
     .command = ircmsg_get_command,
@@ -312,9 +626,11 @@ const struct ircmsg_api Msg = {
     .servername = ircmsg_get_servername,
     .server = ircmsg_get_server,
     .numeric = ircmsg_get_numeric,
+    .matched = ircmsg_get_matched,
 
     /* Get parameter at index 'argc' */
     .argv = ircmsg_get_argv,
+    .command_type = ircmsg_name_type,
 
     /* Dump output */
     .fdump = ircmsg_print
@@ -331,7 +647,7 @@ int main(int argc, char ** argv)
 
     for (--argc; argc > 0; --argc) {
         msg = ircmsg_parse(argv[argc]);
-        ircmsg_print(msg);
+        ircmsg_print(msg, stdout);
         ircmsg_free(msg);
     }
 
@@ -3,6 +3,23 @@
 
 #include <stdio.h> /* FILE * */
 
+#define IRCMSG_MAXARGS 15
+
+/* Offset used to mark a view as absent (getter returns NULL) */
+#define IRCMSG_NOSPAN  0xffff
+/* Server id of a message that didn't come from a configured server */
+#define IRCMSG_NOSERVER 0xffff
+
+/*
+ * View into the line owned by a struct ircmsg, every
+ * field is NUL terminated in place while parsing so
+ * line + off is always a valid C string
+ */
+struct ircmsg_span {
+    unsigned short off;
+    unsigned short len;
+};
+
 enum ircmsg_type {
     IRC_UNSET,
     IRC_INIT,         /* Init event, special user event called once per startup of program */
@@ -17,13 +34,96 @@ enum ircmsg_type {
     IRC_QUIT,
     IRC_TOPIC,
     IRC_NUMERIC,
+
+    /* RFC 1459/2812 */
+    IRC_PASS,
+    IRC_USER,
+    IRC_OPER,
+    IRC_SERVICE,
+    IRC_SQUIT,
+    IRC_NAMES,
+    IRC_LIST,
+    IRC_INVITE,
+    IRC_MOTD,
+    IRC_LUSERS,
+    IRC_VERSION,
+    IRC_STATS,
+    IRC_LINKS,
+    IRC_TIME,
+    IRC_CONNECT,
+    IRC_TRACE,
+    IRC_ADMIN,
+    IRC_INFO,
+    IRC_SERVLIST,
+    IRC_SQUERY,
+    IRC_WHO,
+    IRC_WHOIS,
+    IRC_WHOWAS,
+    IRC_KILL,
+    IRC_PONG,
+    IRC_ERROR,
+    IRC_AWAY,
+    IRC_REHASH,
+    IRC_DIE,
+    IRC_RESTART,
+    IRC_SUMMON,
+    IRC_USERS,
+    IRC_WALLOPS,
+    IRC_USERHOST,
+    IRC_ISON,
+    IRC_SERVER,
+    IRC_NJOIN,
+    IRC_CPRIVMSG,     /* not in the RFCs but widely supported */
+    IRC_CNOTICE,
+
+    /* IRCv3 */
+    IRC_CAP,
+    IRC_AUTHENTICATE,
+    IRC_ACCOUNT,
+    IRC_CHGHOST,
+    IRC_SETNAME,
+    IRC_BATCH,
+    IRC_TAGMSG,
+    IRC_MONITOR,
+    IRC_FAIL,
+    IRC_WARN,
+    IRC_NOTE,
+
+    IRC_TYPE_MAX      /* Number of types, keep last */
+};
+
+/*
+ * Parsed message as the master ships it to a worker, followed by
+ * 'size' bytes of the (already NUL separated) line the views point
+ * into. The worker rebuilds its struct ircmsg from this with a single
+ * copy and no parsing.
+ */
+struct ircmsg_event {
+    unsigned int size;        /* bytes of line following the header */
+    unsigned short server;    /* id of the server in the master (struct server.id) */
+    unsigned char type;       /* enum ircmsg_type */
+    unsigned char argc;
+    short numeric;
+    unsigned int matched;     /* Filtered handlers the master matched it for, see mod.c */
+    struct ircmsg_span servername, nick, real, host, command, text;
+    struct ircmsg_span argv[IRCMSG_MAXARGS];
 };
 
+struct server; /* config.h */
+
 struct ircmsg_api {
     /* Create/Destroy ircmsg object */
     struct ircmsg * (*parse)(const char * line);
+    /* Parse a raw line read from 'server' (no "S<server> " in front of it) */
+    struct ircmsg * (*parse_server)(const char * line, struct server * server);
     void (*free)(struct ircmsg * msg);
 
+    /* Wire format, see struct ircmsg_event above */
+    /* Fill 'ev' for 'msg' from 'server_id', returns the 'ev->size' bytes to send after it */
+    const char * (*pack)(struct ircmsg * msg, unsigned short server_id, struct ircmsg_event * ev);
+    /* Rebuild a message from a header and the line that followed it */
+    struct ircmsg * (*unpack)(const struct ircmsg_event * ev, const char * line);
+
     /* Get */
     enum ircmsg_type (*type)(struct ircmsg * msg);
     char * (*command)(struct ircmsg * msg);
@@ -34,8 +134,12 @@ struct ircmsg_api {
 	char * (*servername)(struct ircmsg * msg); /* Identifies the name of the server this message came from */
 	struct server * (*server)(struct ircmsg * msg); /* Returns the global config object server this message is associated with */
     short (*numeric)(struct ircmsg * msg);
+    /* What the master matched the event for (struct ircmsg_event), 0 if it didn't filter it */
+    unsigned int (*matched)(struct ircmsg * msg);
     /* Get parameter at index 'argc' */
     char * (*argv)(struct ircmsg * msg, int argc);
+    /* Type of a command by name ("PRIVMSG"), IRC_UNSET if we don't know it */
+    enum ircmsg_type (*command_type)(const char * command);
 
     /* Dump to FILE * fp (debugging use.. ) */
     void (*fdump)(struct ircmsg * msg, FILE * fp);
@@ -1,13 +1,8 @@
 #ifndef IRCMSG_TYPE__H_
 #define IRCMSG_TYPE__H_
 
-#define IRCMSG_MAXARGS 15
-
-struct ircmsg_prefix {
-    char * host;        /* user host or server name */
-    char * nickname;    /* may be NULL if server message */
-    char * realname;    /* may be NULL if server message */
-};
+/* Longest line we keep a view into, offsets must fit in an unsigned short */
+#define IRCMSG_MAXLINE 0xfffe
 
 static const struct ircmsg {
     /*
@@ -16,38 +11,60 @@ static const struct ircmsg {
      */
     enum ircmsg_type type;
 
-	/* The name of the server this message came from (for lookup purposes */
-	char servername[BUFSIZ]; 
+    /*
+     * If this is a raw numeric
+     * IRC message, the numeric will
+     * be stored here
+     */
+    short numeric;
+
+    /* Filtered handlers the master matched it for (struct ircmsg_event) */
+    unsigned int matched;
+
 	/* The server object from the config that this message came from */
 	struct server * server;
 
     /*
-     * Stores server or username
-     * information depending
-     * on who sent it
+     * Our one owned copy of the line, allocated in the same
+     * block as the struct itself. Delimiters are overwritten
+     * with NUL bytes and all the spans below point into it.
      */
-    struct ircmsg_prefix * pfx;
+    char * line;
+    unsigned short size;
+
+	/* The name of the server this message came from (for lookup purposes) */
+    struct ircmsg_span servername;
 
     /*
-     * If this is a raw numeric
-     * IRC message, the numeric will
-     * be stored here
+     * Prefix, stores server or username
+     * information depending on who sent it,
+     * nick/real are absent for server messages
      */
-    short numeric;
-    char * command; /* Stores command PRIVMSG, etc. */
+    struct ircmsg_span nick;
+    struct ircmsg_span real;
+    struct ircmsg_span host;
+
+    struct ircmsg_span command; /* Stores command PRIVMSG, etc. */
 
     /*
-     * "Trail" piece of IRC message, may be NULL
+     * "Trail" piece of IRC message, absent
      * if there isn't any
      */
-    char * text;  
+    struct ircmsg_span text;
 
-    /* 
-     * IRC message arguments, maximum 14 plus trailing
+    /*
+     * IRC message arguments, maximum 15 plus trailing
      * message which will be stored in 'text' above
      */
-    char * argv[IRCMSG_MAXARGS];
+    struct ircmsg_span argv[IRCMSG_MAXARGS];
     int argc;
-} ircmsg_initializer;
+} ircmsg_initializer = {
+    .servername = {IRCMSG_NOSPAN, 0},
+    .nick = {IRCMSG_NOSPAN, 0},
+    .real = {IRCMSG_NOSPAN, 0},
+    .host = {IRCMSG_NOSPAN, 0},
+    .command = {IRCMSG_NOSPAN, 0},
+    .text = {IRCMSG_NOSPAN, 0},
+};
 
 #endif
@@ -0,0 +1,223 @@
+/* ircscan.c find IRC delimiters in a line, SIMD where the CPU has it */
+
+#include <stdlib.h> /* getenv */
+#include <string.h> /* strcmp */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#    define IRCSCAN_X86 1
+#    include <immintrin.h>
+#endif
+
+#include "ircscan.h"
+
+/*
+ * Every implementation records delimiter offsets from 'start' on
+ * until it has 'max' of them, and returns the offset to resume at.
+ */
+typedef size_t (*ircscan_func)(const char * s, size_t start, size_t len, unsigned short * pos, unsigned short max, unsigned short * count);
+
+static inline int ircscan_isdelim(char c)
+{
+    return c == ' ' || c == '!' || c == '@' || c == ':';
+}
+
+static size_t ircscan_scalar(const char * s, size_t start, size_t len, unsigned short * pos, unsigned short max, unsigned short * count)
+{
+    size_t i;
+    unsigned short n = 0;
+
+    for (i = start; i < len && n < max; ++i) {
+        if (ircscan_isdelim(s[i])) {
+            pos[n++] = i;
+            if (n == max || n >= IRCSCAN_BATCH) {
+                ++i;
+                break;
+            }
+        }
+    }
+
+    *count = n;
+    return i;
+}
+
+#ifdef IRCSCAN_X86
+/*
+ * Turn a mask of delimiter bytes at s + i into positions, returns
+ * the resume offset if we ran out of room or 0 to keep going
+ */
+static inline size_t ircscan_emit(unsigned int mask, size_t i, unsigned short * pos, unsigned short max, unsigned short * n)
+{
+    while (mask) {
+        size_t at = i + __builtin_ctz(mask);
+        pos[(*n)++] = at;
+        if (*n == max)
+            return at + 1;
+        mask &= mask - 1;
+    }
+    return 0;
+}
+
+__attribute__((target("sse2")))
+static size_t ircscan_sse2(const char * s, size_t start, size_t len, unsigned short * pos, unsigned short max, unsigned short * count)
+{
+    const __m128i space = _mm_set1_epi8(' '), bang = _mm_set1_epi8('!'),
+                  at = _mm_set1_epi8('@'), colon = _mm_set1_epi8(':');
+    size_t i = start, resume;
+    unsigned short n = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i hit = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, bang)),
+                _mm_or_si128(_mm_cmpeq_epi8(v, at), _mm_cmpeq_epi8(v, colon)));
+
+        if ( (resume = ircscan_emit(_mm_movemask_epi8(hit), i, pos, max, &n)) ) {
+            *count = n;
+            return resume;
+        }
+        /* Enough to keep the FSM busy, don't scan text it may never look at */
+        if (n >= IRCSCAN_BATCH) {
+            *count = n;
+            return i + 16;
+        }
+    }
+
+    /* Tail shorter than a vector */
+    if (i < len) {
+        unsigned short tail;
+        i = ircscan_scalar(s, i, len, pos + n, max - n, &tail);
+        n += tail;
+    }
+
+    *count = n;
+    return i;
+}
+
+/*
+ * 256 bit compares only pay for themselves on long stretches (NAMES
+ * replies, netsplit QUIT floods), on short lines the wide units cost
+ * more than they save, so below IRCSCAN_WIDE bytes we stick to 16
+ * byte (VEX encoded) steps.
+ */
+#define IRCSCAN_WIDE 128
+
+__attribute__((target("avx2")))
+static size_t ircscan_avx2(const char * s, size_t start, size_t len, unsigned short * pos, unsigned short max, unsigned short * count)
+{
+    size_t i = start, resume;
+    unsigned short n = 0;
+
+    if (len - i >= IRCSCAN_WIDE) {
+        const __m256i space = _mm256_set1_epi8(' '), bang = _mm256_set1_epi8('!'),
+                      at = _mm256_set1_epi8('@'), colon = _mm256_set1_epi8(':');
+
+        for (; i + 32 <= len; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+            __m256i hit = _mm256_or_si256(
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, bang)),
+                    _mm256_or_si256(_mm256_cmpeq_epi8(v, at), _mm256_cmpeq_epi8(v, colon)));
+
+            if ( (resume = ircscan_emit(_mm256_movemask_epi8(hit), i, pos, max, &n)) ) {
+                *count = n;
+                return resume;
+            }
+            if (n >= IRCSCAN_BATCH) {
+                *count = n;
+                return i + 32;
+            }
+        }
+    }
+
+    /* Same as ircscan_sse2() but done here so it stays VEX encoded
+     * (calling the plain SSE2 version costs a transition penalty) */
+    {
+        const __m128i space = _mm_set1_epi8(' '), bang = _mm_set1_epi8('!'),
+                      at = _mm_set1_epi8('@'), colon = _mm_set1_epi8(':');
+
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+            __m128i hit = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, bang)),
+                    _mm_or_si128(_mm_cmpeq_epi8(v, at), _mm_cmpeq_epi8(v, colon)));
+
+            if ( (resume = ircscan_emit(_mm_movemask_epi8(hit), i, pos, max, &n)) ) {
+                *count = n;
+                return resume;
+            }
+            if (n >= IRCSCAN_BATCH) {
+                *count = n;
+                return i + 16;
+            }
+        }
+    }
+
+    if (i < len) {
+        unsigned short tail;
+        i = ircscan_scalar(s, i, len, pos + n, max - n, &tail);
+        n += tail;
+    }
+
+    *count = n;
+    return i;
+}
+#endif
+
+static const char * ircscan_impl_name = "scalar";
+
+static size_t ircscan_resolve(const char * s, size_t start, size_t len, unsigned short * pos, unsigned short max, unsigned short * count);
+static ircscan_func ircscan_run = ircscan_resolve;
+
+/*
+ * Pick the widest implementation this CPU supports on first use,
+ * IRCSCAN=scalar|sse2|avx2 in the environment overrides it (testing)
+ */
+static size_t ircscan_resolve(const char * s, size_t start, size_t len, unsigned short * pos, unsigned short max, unsigned short * count)
+{
+    const char * want = getenv("IRCSCAN");
+
+    ircscan_run = ircscan_scalar;
+    ircscan_impl_name = "scalar";
+#ifdef IRCSCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && (!want || !strcmp(want, "avx2"))) {
+        ircscan_run = ircscan_avx2;
+        ircscan_impl_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2") && (!want || strcmp(want, "scalar"))) {
+        ircscan_run = ircscan_sse2;
+        ircscan_impl_name = "sse2";
+    }
+#else
+    (void)want;
+#endif
+
+    return ircscan_run(s, start, len, pos, max, count);
+}
+
+/*
+ * INTERFACE
+ */
+void ircscan_init(struct ircscan * sc, const char * line, size_t len)
+{
+    sc->base = line;
+    sc->len = len;
+    sc->next = 0;
+    sc->count = sc->idx = 0;
+}
+
+void ircscan_fill(struct ircscan * sc)
+{
+    sc->idx = 0;
+    sc->next = ircscan_run(sc->base, sc->next, sc->len, sc->pos, IRCSCAN_MAX, &sc->count);
+}
+
+const char * ircscan_impl(void)
+{
+    /* Resolve now if nothing was scanned yet */
+    if (ircscan_run == ircscan_resolve) {
+        unsigned short count;
+        ircscan_run("", 0, 0, NULL, 0, &count);
+    }
+    return ircscan_impl_name;
+}
+
+/* end ircscan.c */
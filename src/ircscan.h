@@ -0,0 +1,49 @@
+#ifndef IRCSCAN_HEADER__H_
+#define IRCSCAN_HEADER__H_
+
+#include <stddef.h> /* size_t */
+
+/* Delimiter positions recorded per pass, the scan is resumed lazily past that */
+#define IRCSCAN_MAX 64
+/* A pass stops at the end of the vector where it has found this many */
+#define IRCSCAN_BATCH 8
+
+/*
+ * Positions of every ' ', '!', '@' and ':' in a line. The line is
+ * scanned in one pass (16 or 32 bytes at a time where the CPU allows it)
+ * and the FSM states in ircmsg.c walk the recorded positions instead
+ * of testing each byte themselves.
+ */
+struct ircscan {
+    const char * base;  /* start of the line */
+    size_t len;         /* length of the line */
+    size_t next;        /* offset the next pass starts at */
+    unsigned short pos[IRCSCAN_MAX];
+    unsigned short count; /* positions recorded by the last pass */
+    unsigned short idx;   /* first position not yet consumed */
+};
+
+/* Start scanning 'len' bytes of 'line' (offsets must fit in unsigned short) */
+void ircscan_init(struct ircscan * sc, const char * line, size_t len);
+/* Record the next batch of positions starting at sc->next */
+void ircscan_fill(struct ircscan * sc);
+/* Name of the implementation picked at runtime (avx2, sse2, scalar) */
+const char * ircscan_impl(void);
+
+/* Return the next delimiter at or after 'from', NULL if there are none left */
+static inline const char * ircscan_next(struct ircscan * sc, const char * from)
+{
+    size_t off = from - sc->base;
+
+    for (;;) {
+        for (; sc->idx < sc->count; ++sc->idx)
+            if (sc->pos[sc->idx] >= off)
+                return sc->base + sc->pos[sc->idx];
+
+        if (sc->next >= sc->len)
+            return NULL;
+        ircscan_fill(sc);
+    }
+}
+
+#endif
@@ -33,14 +33,20 @@
 
 #include <con.h>
 #include <irc.h> 
+#include <ircmsg.h>
 #include <mod.h> /* for mod_initialize() which parses our config also */
 #include <log.h>
 
 int readcb(struct con * con, const char * s, void * userdata)
 {
 	struct server * server = userdata;
-    /* Allocate new event and process it (in a separate thread .. ) */
-    (void)mod_round_robin(server, s);
+    struct ircmsg * msg;
+
+    /* Parse it once here, the workers get the parsed event (in a separate process .. ) */
+    if ( (msg = Msg.parse_server(s, server)) ) {
+        mod_send_event(server, msg);
+        Msg.free(msg);
+    }
 
     return 1;
 }
@@ -76,6 +82,13 @@ void servercb(struct server * server) {
 		log_debug("[cxn] Failed to add server with no name!");
 		return;
 	}
+	if (gconfig.nservers >= MAX_SERVERS) {
+		log_debug("[cxn] Too many servers, not adding %s", server->name);
+		return;
+	}
+	/* The id is what workers know the server by */
+	server->id = gconfig.nservers;
+	gconfig.server_ids[gconfig.nservers++] = server;
 
 	if (server->use_ssl)
 		flags |= CF_SSL;
@@ -89,6 +102,9 @@ void servercb(struct server * server) {
 	server->con = con;
 
 	htable.store(gconfig.servers, server->name, server);
+
+	/* Workers only know it by id until we tell them */
+	mod_server_announce(server);
 }
 
 /*
@@ -110,11 +126,13 @@ int main(int argc, char ** argv)
     gconfig.servers = htable.new(1000); // We could have up to a thousand servers 
     gconfig.evbase  = event_base_new();
 
+	/* Read the config first, it says how to run the workers */
+	mod_conf_init();
+
 	/* Load our perl workers */
     mod_initialize(gconfig.evbase);
 
-	/* Read in the servers from the config */
-	mod_conf_init();
+	/* Connect to the servers from the config */
 	mod_conf_servers(servercb);
 
     /* Begin our loop */
@@ -0,0 +1,154 @@
+/* match.c multi-pattern substring matching for the master's prefilter, see match.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <ctype.h>
+
+#include "match.h"
+#include "log.h"
+
+/* Trie nodes we allow (one per pattern byte), a node is a 1 KB table row */
+#define MATCH_NODES 4096
+
+struct match_node {
+    unsigned int next[256]; /* Node after each byte, 0 (the root) while it's only a trie */
+    unsigned int out;       /* Ids of the patterns that end here, or in any of its suffixes */
+};
+
+struct match {
+    struct match_node * nodes;
+    unsigned int nnodes, alloc;
+    unsigned int ids;       /* Every id added, a scan can stop once it found them all */
+    bool compiled;
+};
+
+struct match * match_new(void)
+{
+    struct match * match;
+
+    if ( !(match = calloc(1, sizeof *match)) ) {
+        perror("match_new calloc");
+        return NULL;
+    }
+    if ( !(match->nodes = calloc(1, sizeof *match->nodes)) ) {
+        perror("match_new calloc");
+        free(match);
+        return NULL;
+    }
+    match->nnodes = match->alloc = 1; /* The root */
+
+    return match;
+}
+
+void match_free(struct match * match)
+{
+    if (match) {
+        free(match->nodes);
+        free(match);
+    }
+}
+
+static int match_node(struct match * match)
+{
+    struct match_node * nodes;
+    unsigned int alloc;
+
+    if (match->nnodes == match->alloc) {
+        if (match->alloc == MATCH_NODES) {
+            log_debug("[match] more than %d pattern bytes", MATCH_NODES);
+            return -1;
+        }
+        alloc = match->alloc * 2 > MATCH_NODES ? MATCH_NODES : match->alloc * 2;
+        if ( !(nodes = realloc(match->nodes, alloc * sizeof *nodes)) ) {
+            perror("match_node realloc");
+            return -1;
+        }
+        match->nodes = nodes;
+        match->alloc = alloc;
+    }
+    match->nodes[match->nnodes] = (struct match_node){.out = 0};
+
+    return match->nnodes++;
+}
+
+int match_add(struct match * match, const char * pattern, unsigned int id)
+{
+    unsigned int state = 0;
+    unsigned char c;
+    int node;
+
+    if (match->compiled || id >= MATCH_IDS || !*pattern)
+        return -1;
+
+    for (; (c = tolower((unsigned char)*pattern)); ++pattern) {
+        if (!match->nodes[state].next[c]) {
+            if ((node = match_node(match)) == -1)
+                return -1;
+            match->nodes[state].next[c] = node;
+        }
+        state = match->nodes[state].next[c];
+    }
+    match->nodes[state].out |= 1u << id;
+    match->ids |= 1u << id;
+
+    return 0;
+}
+
+/*
+ * Fill in the failure transitions breadth first, so a node's missing
+ * bytes go wherever its longest proper suffix would have gone. A
+ * node's row is only rewritten when it's taken off the queue, so until
+ * then anything set in it is a trie edge
+ */
+int match_compile(struct match * match)
+{
+    unsigned int * fail, * queue, head = 0, tail = 0, state, next, c;
+
+    if (match->compiled)
+        return 0;
+    if ( !(fail = calloc(match->nnodes, sizeof *fail)) || !(queue = malloc(match->nnodes * sizeof *queue)) ) {
+        perror("match_compile calloc");
+        free(fail);
+        return -1;
+    }
+
+    for (c = 0; c < 256; ++c)
+        if ((next = match->nodes[0].next[c]))
+            queue[tail++] = next;
+
+    while (head < tail) {
+        state = queue[head++];
+        match->nodes[state].out |= match->nodes[fail[state]].out;
+        for (c = 0; c < 256; ++c) {
+            if ((next = match->nodes[state].next[c])) {
+                fail[next] = match->nodes[fail[state]].next[c];
+                queue[tail++] = next;
+            } else {
+                match->nodes[state].next[c] = match->nodes[fail[state]].next[c];
+            }
+        }
+    }
+
+    free(queue);
+    free(fail);
+    match->compiled = true;
+    return 0;
+}
+
+unsigned int match_scan(const struct match * match, const char * text)
+{
+    unsigned int state = 0, found = 0;
+
+    if (!match->compiled || !match->ids)
+        return 0;
+
+    for (; *text && found != match->ids; ++text) {
+        state = match->nodes[state].next[tolower((unsigned char)*text)];
+        found |= match->nodes[state].out;
+    }
+
+    return found;
+}
+
+/* end match.c */
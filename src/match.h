@@ -0,0 +1,27 @@
+#ifndef MATCH_HEADER__H_
+#define MATCH_HEADER__H_
+
+/* Most patterns ids we tell apart, ids are bits of what match_scan() returns */
+#define MATCH_IDS 32
+
+/*
+ * Multi-pattern substring matcher (Aho-Corasick compiled down to a
+ * DFA), the master runs every line through one of these instead of
+ * having each handler look for its strings. Matching ignores ASCII
+ * case. Add all the patterns, compile once and then scan as much as
+ * you like, a scan is one table lookup per byte of text.
+ */
+struct match;
+
+struct match * match_new(void);
+void match_free(struct match * match);
+
+/* Add a (non empty) pattern for 'id' (< MATCH_IDS), before match_compile(), -1 on error */
+int match_add(struct match * match, const char * pattern, unsigned int id);
+/* Build the DFA, -1 on error */
+int match_compile(struct match * match);
+
+/* Ids (bits) of the patterns found in 'text', 0 before match_compile() */
+unsigned int match_scan(const struct match * match, const char * text);
+
+#endif
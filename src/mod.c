@@ -5,16 +5,25 @@
  * - c modules (handled internally here)
  */
 
+#define _GNU_SOURCE /* close_range */
 #include <stdbool.h>
 #include <stdlib.h>      /* for exit() and etc.. */
 #include <string.h>      /* for strerror() */
+#include <ctype.h>       /* tolower */
 
 /* IPC/msg routines */
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/prctl.h> /* PR_SET_CHILD_SUBREAPER */
+#include <sys/mman.h>  /* mmap for the scoreboard */
+#include <stdatomic.h>
 
 #include <unistd.h> /* getpid */
+#include <signal.h> /* signal() for the storage process */
 #include <errno.h>  /* errno for strerror() */
+#include <time.h>   /* clock_gettime */
+#include <stdio.h>  /* fopen for /proc */
 
 #include <event2/event.h> /* event_base etc.. */
 #include <event2/bufferevent.h> /* bufferevent_* */
@@ -26,6 +35,16 @@
 #include <htable.h>
 #include "xstr.h"
 #include "irc.h"
+#include "ircmsg.h"
+#include "ipc.h"
+#include "ring.h"
+#include "match.h"
+#include "http.h"
+#include "cache.h"
+#include "store.h"
+#include "db.h"
+#include "dbd.h"
+#include "mod.h"
 #include "con.h"
 #include "config.h"
 #include "log.h"
@@ -36,70 +55,755 @@
 #define USE_PERL true
 
 /* Worker process configuration */
-#define MAX_WORKERS  4
-#define MAX_REQUESTS 50
+#define MAX_WORKERS  4  /* Default size of the pool (config: workers_min) */
+#define WORKERS_LIMIT 64 /* Never run more than this many (config: workers_max) */
+/* Default events a worker handles before we recycle it (config: max_requests, 0 for never) */
+#define MAX_REQUESTS 10000
+/* How often we look if a worker is due for recycling */
+#define WORKER_RECYCLE_CHECK 1 /* sec */
+/* Default bytes we let queue up for one worker (config: worker_queue) */
+#define WORKER_QUEUE_MAX (1 << 20)
+/* How often we look if paused servers can be read from again */
+#define WORKER_RESUME_CHECK 100000 /* usec */
+/* How soon we try again to move frames that didn't fit into a ring */
+#define WORKER_FLUSH_CHECK 1000 /* usec */
+/* Send times we remember per worker to tell the age of its queue */
+#define WORKER_INFLIGHT_TRACK 1024
+/* A worker acks events in batches, but right away after one that took this long */
+#define WORKER_ACK_SLOW 1000 /* usec */
+/* A worker whose oldest event has waited this long is busy, whatever its count */
+#define WORKER_STALLED 50000 /* usec */
+/* How often we look if the pool should grow or shrink */
+#define WORKER_SCALE_CHECK 250000 /* usec */
+/* Checks in a row every worker has to be busy before we fork another one */
+#define WORKER_SCALE_SUSTAIN 4
+/* Defaults for when a worker counts as busy (config: scale_latency, scale_inflight) */
+#define WORKER_SCALE_LATENCY 100 /* msec */
+#define WORKER_SCALE_INFLIGHT 16
+/* Default time a worker above the minimum may sit idle before we retire it (config: scale_idle) */
+#define WORKER_SCALE_IDLE 60 /* sec */
+/* Default time a worker may spend on one event or go without a heartbeat before it counts as hung (config: deadline, 0 for never) */
+#define WORKER_DEADLINE 30 /* sec */
+/* How often workers beat and we look for hung ones */
+#define WORKER_HEARTBEAT 1 /* sec */
+/* Scoreboard entries, a draining worker and its replacement need one each */
+#define WORKER_BOARDS (WORKERS_LIMIT * 2)
+/* Sent to the zygote instead of an entry for a worker that has none */
+#define WORKER_NOBOARD 0xff
+/* Longest handler name a worker reports */
+#define WORKER_HANDLER_MAX 192
+/* Lanes: the default one plus up to three from config (config: lanes) */
+#define WORKER_LANES 4
+/* The lane everything goes to that no module put in another one */
+#define WORKER_LANE_DEFAULT 0
+/* Longest command we look up to route it to its lane */
+#define WORKER_COMMAND_MAX 64
+/* Numerics a worker can have raw_NNN handlers for */
+#define WORKER_NUMERICS 1000
+/* Filtered handlers we tell apart, a filter's index is its id in the matcher */
+#define WORKER_FILTERS MATCH_IDS
+/* Prefixes one filter can look for */
+#define WORKER_FILTER_PREFIXES 8
+/* In ircmsg_event.matched: we filtered it, the other bits are the handlers it matched for */
+#define WORKER_MATCHED (1u << 31)
+/* Keys we keep in one filter set before it matches everything */
+#define WORKER_SET_MAX 4096
+/* Longest key in a set (a nick or "server:target") */
+#define WORKER_KEY_MAX 256
+/* Events a worker holds for batch handlers before it runs them anyway */
+#define WORKER_BATCH_MAX 256
+/* Affinity keys we track in flight, keys that hash the same share an entry */
+#define WORKER_KEYS (1 << 14)
+
+/* How mod_send_event() picks a worker (config: dispatch) */
+enum worker_dispatch {
+    WORKER_ROUND_ROBIN, /* Next one in turn */
+    WORKER_AFFINITY,    /* Same server+target goes to the same worker, in order (see workers_affinity()) */
+    WORKER_LEAST,       /* The one with the fewest events in flight */
+    WORKER_P2C,         /* Less loaded of two picked at random */
+    WORKER_DISPATCH_MAX
+};
+static const char * const worker_dispatch_names[WORKER_DISPATCH_MAX] = {
+    [WORKER_ROUND_ROBIN] = "round_robin",
+    [WORKER_AFFINITY] = "affinity",
+    [WORKER_LEAST] = "least_loaded",
+    [WORKER_P2C] = "p2c",
+};
+
+/* What mod_send_event() does with an event when the worker is backed up (config: overflow) */
+enum worker_overflow {
+    WORKER_SKIP,  /* Try the next worker, drop it if they all are (drop for affinity) */
+    WORKER_DROP,  /* Drop it unless it's urgent (PING, numerics, ERROR) */
+    WORKER_PAUSE, /* Queue it anyway and stop reading from that server until they catch up */
+    WORKER_OVERFLOW_MAX
+};
+static const char * const worker_overflow_names[WORKER_OVERFLOW_MAX] = {
+    [WORKER_SKIP] = "skip",
+    [WORKER_DROP] = "drop",
+    [WORKER_PAUSE] = "pause",
+};
+
+/* Where a worker is at, only active ones get events */
+enum worker_state {
+    WORKER_ACTIVE,
+    WORKER_DRAINING,  /* Being recycled, it goes once it finished what it has */
+    WORKER_RELOADING, /* Out for a rolling reload, waiting until it finished what it has */
+    WORKER_LOADING,   /* Reloading its interpreter, back once it says it's ready (IPC_READY) */
+    WORKER_GONE,      /* Hung and killed, or died, a new one takes its place once it's reaped */
+    WORKER_STATE_MAX
+};
+static const char * const worker_state_names[WORKER_STATE_MAX] = {
+    [WORKER_ACTIVE] = "active",
+    [WORKER_DRAINING] = "draining",
+    [WORKER_RELOADING] = "reloading",
+    [WORKER_LOADING] = "loading",
+    [WORKER_GONE] = "gone",
+};
+
+/*
+ * What a worker is up to, in memory it shares with the master so
+ * the watchdog can tell even while it's stuck in a handler
+ */
+struct worker_board {
+    _Atomic uint64_t beat;    /* Last time its event loop came around (usec, CLOCK_MONOTONIC) */
+    _Atomic uint64_t started; /* When it started on the event it's handling, 0 between events */
+    _Atomic unsigned long taken; /* Events it took on, finished or not */
+    char handler[WORKER_HANDLER_MAX]; /* What it's in (mod_handler()), read without locking so only a hint */
+};
+
+/*
+ * What a worker has handlers for, a bit per event type and per numeric.
+ * It sends this along with IPC_READY, the master keeps the rest to itself
+ */
+struct worker_subs {
+    unsigned char types[(IRC_TYPE_MAX + 7) / 8];
+    unsigned char numerics[(WORKER_NUMERICS + 7) / 8];
+};
+
+static inline void worker_subs_set(unsigned char * bits, unsigned int n)
+{
+    bits[n / 8] |= 1u << n % 8;
+}
 
-/* Server names can not be longer than 1024 letters */
-#define MAX_SERVER_NAME 1024
+/* Is there a handler for it, ones we have no bit for always go */
+static inline bool worker_subscribed(const struct worker_subs * subs, const struct ircmsg_event * ev)
+{
+    if (ev->type == IRC_NUMERIC)
+        return ev->numeric < 0 || ev->numeric >= WORKER_NUMERICS || subs->numerics[ev->numeric / 8] & 1u << ev->numeric % 8;
+    return ev->type >= IRC_TYPE_MAX || subs->types[ev->type / 8] & 1u << ev->type % 8;
+}
 
 /* Data used by master to keep track of worker process */
 static const struct worker {
     pid_t pid;
+    unsigned int slot; /* Stays the same across respawns, affinity hashes on it */
+    unsigned int lane; /* The pool it's in, see struct worker_lane */
     int sock; /* Communication channel to child */
     struct bufferevent * bev;
+    struct ring * tx, * rx; /* Shared memory rings to/from the child, NULL if we only use the socket */
+    struct event * evring;  /* rx doorbell */
+    struct evbuffer * pending; /* Frames waiting for room in tx, they go before anything new */
+    struct evbuffer * unacked; /* Socket only: copies of the events it hasn't acked, in case it dies */
+    struct event * evflush;
+    unsigned long dropped;  /* Events we dropped because it was backed up */
+    unsigned long sent, done; /* Events sent to it and events it acked (IPC_ACK) */
+    uint64_t sent_at[WORKER_INFLIGHT_TRACK]; /* When event number n was sent, n % WORKER_INFLIGHT_TRACK */
+    uint64_t idle_since; /* When we first saw it with nothing in flight, 0 if it's busy */
+    enum worker_state state;
+    bool ready;          /* Its interpreter is loaded (IPC_READY) */
+    struct worker_subs subs; /* What it has handlers for, everything until it's ready */
+    unsigned int generation; /* Reload it last got, see workers_reload_step() */
+    int board;           /* Its scoreboard entry, -1 if it has none */
+    uint64_t reported;   /* The stall the watchdog last reported (when it began) */
+    struct evbuffer * held; /* Events for keys it still has in flight, they wait until it's done with those */
     SLIST_ENTRY(worker) next;
-} worker_initializer;
+} worker_initializer = {
+    .board = -1,
+};
 
 /* Data used by worker process */
 struct worker_ctx {
     struct event_base * base;
     struct event * evsigint, * evsighup;
     struct bufferevent * evsock;
+    struct ring * ring; /* From the master, if we use rings */
+    struct event * evring;
+    struct event * evbeat;
     bool restart_loop;
 };
 
+/*
+ * A pool of workers for one class of handlers (config: lanes), modules
+ * say which lane a handler goes in when they register it. Events go to
+ * every lane with a handler for them, so a slow handler only holds up
+ * its own lane
+ */
+struct worker_lane {
+    char name[32];
+    size_t active;
+    size_t want;             /* What workers_fork() fills it up to */
+    struct worker * current; /* For round robin */
+    char * modules;          /* Modules its workers load (space separated), NULL for all */
+    struct evbuffer * held;  /* Events taken back from a dead worker while it had no other */
+    struct worker_subs subs; /* What any of its workers has handlers for */
+};
+
+/*
+ * Where an affinity key's last event went, the key stays with that worker
+ * until it acked it (sent is its worker->sent with the event in)
+ */
+struct worker_key {
+    pid_t pid;
+    unsigned long sent;
+};
+
+/* Keys filters look for (nick_in, source_in), modules keep them up to date (IPC_CTL_MATCH) */
+struct worker_set {
+    struct htable * keys;
+    bool full;               /* Went over WORKER_SET_MAX, everything is in it now */
+};
+
+/*
+ * An event handler that only wants some of its events (event_register()
+ * in base.pm), it matches if any of its predicates does. Its strings
+ * ('contains') are in the list's matcher under the filter's index
+ */
+struct worker_filter {
+    enum ircmsg_type type;
+    unsigned int lane;
+    unsigned int tag;        /* Its bit in ircmsg_event.matched */
+    char * prefixes[WORKER_FILTER_PREFIXES];
+    unsigned int nprefixes;
+    struct worker_set * nicks, * sources; /* NULL for none */
+};
+
 /* Master list of workers */
 static const struct worker_list {
     struct event_base * main_evbase; /* Evbase we need to free in our children */
-    size_t active_workers;
-    struct worker * current; /* For round robin */
+    struct worker_lane lanes[WORKER_LANES];
+    unsigned int nlanes;
+    unsigned int type_lanes[IRC_TYPE_MAX]; /* Lanes (bits) with a handler for an event type */
+    struct htable * command_lanes; /* Command => its lane + 1 */
+    struct worker_filter filters[WORKER_FILTERS];
+    unsigned int nfilters;
+    unsigned int type_filters[IRC_TYPE_MAX]; /* Filters (bits) on an event type */
+    unsigned int type_matched[IRC_TYPE_MAX]; /* Tags always set for a type, handlers we couldn't filter */
+    unsigned int contains;   /* Filters (bits) with strings in 'match' */
+    struct match * match;
+    struct htable * sets;    /* Set name => struct worker_set */
+    bool routed;             /* We know every handler, events none of them wants are dropped */
+    unsigned long filtered;  /* Events dropped for that */
+    size_t min_workers, max_workers; /* The default lane's, it's the one that grows and shrinks */
+    uint64_t scale_latency;  /* A worker whose oldest event is this old (usec) is busy.. */
+    unsigned long scale_inflight; /* ..or one with this many in flight */
+    uint64_t scale_idle;     /* Retire workers above the minimum after this long idle (usec) */
+    unsigned int overloaded; /* Checks in a row every worker was busy */
+    struct event * evscale;  /* Grows and shrinks the pool */
+    unsigned long max_requests; /* Recycle a worker after it handled this many events.. */
+    size_t max_rss;          /* ..or once it's this big (bytes), 0 for no limit */
+    unsigned long recycled;  /* Workers we replaced for getting old or fat */
+    struct event * evrecycle;
+    struct worker_board * boards; /* WORKER_BOARDS entries shared with the workers, NULL without a deadline */
+    struct cache * cache;    /* Shared with the workers too, for their HTTP responses (config: http_cache) */
+    struct store * store;    /* Modules' state every worker shares (config: state_size), NULL if there is none */
+    char * state_file;       /* Where we keep a snapshot of it, NULL for nowhere */
+    uint64_t state_saved;    /* store_version() of the last snapshot */
+    struct event * evstore;  /* Sweeps expired keys and saves it */
+    int db_sock;             /* Where the storage process takes the workers' queries (db.h), -1 if there is none */
+    pid_t db_pid;
+    unsigned long db_restarts;
+    struct db_stats * db_stats; /* Shared with the storage process, it counts in here */
+    struct event * evdb;     /* Starts it again after it died */
+    uint64_t deadline;       /* usec, 0 for no watchdog */
+    bool kill_hung;          /* Kill hung workers instead of just reporting them */
+    unsigned long hung;      /* Times the watchdog found one */
+    struct event * evwatchdog;
+    unsigned int slots;      /* Worker slots handed out so far */
+    enum worker_dispatch dispatch;
+    struct worker_key * keys; /* WORKER_KEYS of them with affinity, NULL otherwise */
+    struct worker * dying;   /* Reaped and being redispatched, its keys are free to go */
     struct event * childsig; /* Handler for SIGCHLD signal */
     struct event * intsig; /* Handler for SIGINT signal */
     struct event * hupsig; /* Handler for SIGHUP signal */
-    pid_t reapme;            /* Last reaped pid */
+    bool use_rings;          /* Talk to children over shared memory rings (config: ipc => 'rings') */
+    size_t queue_max;        /* Bytes we let queue up for one child before it counts as backed up */
+    enum worker_overflow overflow;
+    struct event * evresume; /* Resumes paused servers once the children catch up */
+    unsigned long pauses;    /* Times we had to pause a server */
+    unsigned long unhandled; /* Events we kept because no worker has a handler for them */
+    unsigned int generation; /* Bumped by every reload, workers behind it still have to reload */
+    bool reloading;          /* A rolling reload is going on */
+    uint64_t reload_started, reload_took; /* usec */
+    unsigned short reload_server; /* Who to tell when it's done (IRCMSG_NOSERVER for nobody) */
+    char reload_target[64];
+    int zygote;              /* Socket to the zygote we fork workers from, -1 if we fork them ourselves */
+    pid_t zygote_pid;
     SLIST_HEAD(workers, worker) * list;
-} worker_list_initializer;
+} worker_list_initializer = {
+    .zygote = -1,
+    .db_sock = -1,
+};
 static struct worker_list * worker_list;
 
 
 /* Forward declaration */
 struct worker_list * workers_fork(struct event_base * evbase, register struct worker_list * wl, pid_t child);
 static struct worker_list * workers_free(struct worker_list * wl);
+static int workers_zygote(struct worker_list * wl);
+static void workers_zygote_stop(struct worker_list * wl);
+static void workers_send(struct worker_list * wl, unsigned int lane, struct server * server, struct ircmsg * msg,
+        const struct ircmsg_event * ev, const char * line);
+static void workers_subscribe(struct worker_list * wl, unsigned int lane);
+
+/*
+ * A child forked after we connected inherits the master's servers, they
+ * aren't ours to touch (the master owns their strings and connections).
+ * Forget them, the IPC_SERVER frames tell us about them again
+ */
+static void worker_servers_reset(void)
+{
+    unsigned short id;
+
+    for (id = 0; id < gconfig.nservers; ++id)
+        if (gconfig.server_ids[id] && gconfig.server_ids[id]->name)
+            htable.delete(gconfig.servers, gconfig.server_ids[id]->name);
+    memset(gconfig.server_ids, 0, sizeof gconfig.server_ids);
+    gconfig.nservers = 0;
+}
+
+/* The master tells us the name and nick for a server id ("<name>\0<nick>\0") */
+static void worker_server_update(unsigned short id, const unsigned char * payload, size_t len)
+{
+    const char * name = (const char *)payload, * nick;
+    struct server * server;
+
+    if (id >= MAX_SERVERS || !len || payload[len - 1] != '\0'
+            || (nick = memchr(name, '\0', len) + 1) >= name + len) {
+        log_debug("worker[%d] bad server frame for id %u", getpid(), id);
+        return;
+    }
+
+    if ( (server = gconfig.server_ids[id]) ) {
+        free((char *)server->nick);
+        server->nick = xstrdup(nick);
+        return;
+    }
+
+    if ( !(server = calloc(1, sizeof *server)) ) {
+        perror("worker_server_update calloc");
+        return;
+    }
+    server->id = id;
+    server->name = xstrdup(name);
+    server->nick = xstrdup(nick);
+    gconfig.server_ids[id] = server;
+    if (id >= gconfig.nservers)
+        gconfig.nservers = id + 1;
+    htable.store(gconfig.servers, server->name, server);
+}
+
+static uint64_t mod_usec(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Worker process: events we handled but haven't told the master about yet */
+static uint32_t worker_unacked;
+/* Worker process: our scoreboard entry, NULL if we have none */
+static struct worker_board * worker_board;
+/* Worker process: events of each type kept for its batch handlers until the read is done, they're acked once those ran */
+static struct evbuffer * worker_batches[IRC_TYPE_MAX];
+static size_t worker_batched[IRC_TYPE_MAX];
+/* Worker process: the event loop we're running, NULL outside of it */
+static struct event_base * worker_base;
+
+/* Worker process: HTTP client on that loop, made the first time a module wants one */
+static struct http * worker_http;
+/* The master's cache every worker maps (worker_list.cache), NULL if there is none */
+static struct cache * shared_cache;
+/* Same for the store (worker_list.store) */
+static struct store * shared_store;
+/* Address the storage process listens on, named by the master before it forks anyone */
+static char db_name[64];
+/* Worker process: client for the storage process on our loop, made the first time a module wants one */
+static struct db * worker_db;
+
+/* Worker: our event loop, modules put their timers and fd watches on it (IRC.xs) */
+struct event_base * mod_event_base(void)
+{
+    return worker_base;
+}
+
+struct http * mod_http(void)
+{
+    if (!worker_http && worker_base)
+        worker_http = http_new(worker_base, shared_cache);
+    return worker_http;
+}
+
+struct db * mod_db(void)
+{
+    if (!worker_db && worker_base && *db_name)
+        worker_db = db_new(worker_base, db_name);
+    return worker_db;
+}
+
+struct cache * mod_cache(void)
+{
+    return shared_cache;
+}
+
+struct store * mod_store(void)
+{
+    return shared_store;
+}
+
+/* Worker: name the handler we're in, the master reports it if we hang in there */
+void mod_handler(const char * name)
+{
+    if (worker_board)
+        snprintf(worker_board->handler, sizeof worker_board->handler, "%s", name);
+}
+
+/* mod_perl_subscriptions() callback, 'event' is a boot.pl sub name */
+static void worker_subscribe(void * data, const char * event)
+{
+    struct worker_subs * subs = data;
+    enum ircmsg_type type;
+    unsigned int numeric;
+    int len = 0;
+
+    if (sscanf(event, "raw_%3u%n", &numeric, &len) == 1 && !event[len] && numeric < WORKER_NUMERICS)
+        worker_subs_set(subs->numerics, numeric);
+    else if ((type = Msg.command_type(event)) != IRC_UNSET)
+        worker_subs_set(subs->types, type);
+}
+
+/* Tell the master our interpreter is loaded and what it has handlers for */
+static void worker_ready(void)
+{
+    struct worker_subs subs = {{0}};
+
+    /* Can't tell, better get everything */
+    if (mod_perl_subscriptions(worker_subscribe, &subs) == -1)
+        memset(&subs, 0xff, sizeof subs);
+    ipc_output(IPC_READY, 0, &subs, sizeof subs, NULL, 0);
+}
+
+static void worker_beat_callback(evutil_socket_t fd, short what, void * data)
+{
+    atomic_store(&worker_board->beat, mod_usec());
+}
+
+/* Run the batch handlers on what we kept of one type */
+static void worker_batch_run(enum ircmsg_type type)
+{
+    struct irc * events[WORKER_BATCH_MAX];
+    struct ircmsg_event ev;
+    struct ipc_frame frame;
+    const unsigned char * payload;
+    size_t n = 0, i, kept = worker_batched[type];
+    uint64_t start = mod_usec();
+
+    while (n < WORKER_BATCH_MAX && (payload = ipc_next(worker_batches[type], &frame))) {
+        memcpy(&ev, payload, sizeof ev);
+        if ( (events[n] = irc.unpack(&ev, (const char *)payload + sizeof ev)) )
+            ++n;
+        ipc_drain(worker_batches[type], &frame);
+    }
+    worker_batched[type] = 0;
+    if (!n) {
+        worker_unacked += kept;
+        return;
+    }
+
+    if (worker_board) {
+        worker_board->handler[0] = '\0';
+        atomic_store(&worker_board->started, start);
+    }
+    mod_perl_dispatch_batch(irc.command(events[0]), events, n);
+    if (worker_board) {
+        atomic_store(&worker_board->started, 0);
+        atomic_store(&worker_board->beat, mod_usec());
+    }
+    for (i = 0; i < n; ++i)
+        irc.free(events[i]);
+    /* Only now are they finished, the master can't count them as done before */
+    worker_unacked += kept;
+}
+
+/* Everything kept for batch handlers, once we've read all there was */
+static void worker_batches_run(void)
+{
+    for (int type = 0; type < IRC_TYPE_MAX; ++type)
+        if (worker_batched[type])
+            worker_batch_run(type);
+}
+
+/* Keep an event for the batch handlers of its type, -1 if we couldn't (it's finished then) */
+static int worker_batch_add(const struct ircmsg_event * ev, const struct ipc_frame * frame, const unsigned char * payload)
+{
+    if (!worker_batches[ev->type] && !(worker_batches[ev->type] = evbuffer_new()))
+        return -1;
+    if (ipc_add(worker_batches[ev->type], frame->type, frame->id, payload, frame->len, NULL, 0) == -1)
+        return -1;
+    if (++worker_batched[ev->type] == WORKER_BATCH_MAX)
+        worker_batch_run(ev->type);
+    return 0;
+}
+
+static void worker_ack(void)
+{
+    if (worker_unacked && ipc_output(IPC_ACK, 0, &worker_unacked, sizeof worker_unacked, NULL, 0) == 0)
+        worker_unacked = 0;
+}
+
+/*
+ * Frames from the master, IPC_EVENT carries a struct ircmsg_event
+ * header followed by the line its views point into
+ */
+static void worker_frame(void * data, const struct ipc_frame * frame, const unsigned char * payload)
+{
+    struct ircmsg_event ev;
+    uint64_t start, now;
+
+    switch (frame->type) {
+        case IPC_EVENT:
+            if (worker_board)
+                atomic_fetch_add_explicit(&worker_board->taken, 1, memory_order_relaxed);
+            /* Every event is acked, even the ones we can't make sense of */
+            if (frame->len >= sizeof ev)
+                memcpy(&ev, payload, sizeof ev);
+            if (frame->len < sizeof ev || sizeof ev + ev.size != frame->len) {
+                ++worker_unacked;
+                break;
+            }
+//            log_debug("worker[%d] dispatching: %s", getpid(), (char *)payload + sizeof ev);
+            start = mod_usec();
+            if (worker_board) {
+                worker_board->handler[0] = '\0';
+                atomic_store(&worker_board->started, start);
+            }
+            irc.dispatch_event(&ev, (const char *)payload + sizeof ev);
+            /* One kept for the batch handlers is acked after them (worker_batch_run()) */
+            if (!mod_perl_batched(ev.type) || worker_batch_add(&ev, frame, payload) == -1)
+                ++worker_unacked;
+            now = mod_usec();
+            /* A long batch of quick events counts as a heartbeat too */
+            if (worker_board) {
+                atomic_store(&worker_board->started, 0);
+                atomic_store(&worker_board->beat, now);
+            }
+            /* Let the master know we're free again now, not after the batch (what it's kept for isn't acked yet) */
+            if (now - start >= WORKER_ACK_SLOW)
+                worker_ack();
+            break;
+        /* Our turn in a rolling reload, we have nothing left in flight */
+        case IPC_RELOAD:
+            /* What we kept is for the handlers we have now */
+            worker_batches_run();
+            worker_ack();
+            log_debug("worker[%d] reloading", getpid());
+            mod_perl_reinit();
+            worker_ready();
+            break;
+        case IPC_SERVER:
+            worker_server_update(frame->id, payload, frame->len);
+            break;
+        default:
+            log_debug("worker[%d] unexpected frame type %u", getpid(), frame->type);
+            break;
+    }
+}
 
 static void worker_event_callback(struct bufferevent * bev, void * data)
 {
-    char * line;
     struct evbuffer * input = bufferevent_get_input(bev);
-    
-    while ((line = evbuffer_readln(input, NULL, EVBUFFER_EOL_CRLF))) {
-//        log_debug("worker[%d] dispatching: %s", getpid(), line);
-        irc.dispatch(line);
-        free(line);
+    struct ipc_frame frame;
+    const unsigned char * payload;
+
+    while ((payload = ipc_next(input, &frame))) {
+        worker_frame(data, &frame, payload);
+        ipc_drain(input, &frame);
+    }
+    worker_batches_run();
+    worker_ack();
+}
+
+/*
+ * Handle what's in a ring, at most RING_BATCH frames per call so
+ * a busy ring doesn't starve the rest of the loop ('ev' is made
+ * active again instead). We only go back to waiting on the
+ * doorbell once the ring is really empty.
+ */
+static void mod_ring_drain(struct ring * ring, struct event * ev, short what, void * data,
+        void (*handle)(void * data, const struct ipc_frame * frame, const unsigned char * payload))
+{
+    struct ipc_frame frame;
+    const unsigned char * payload;
+    int n;
+
+    if (what & EV_READ)
+        ring_wakeup(ring);
+
+    do {
+        for (n = 0; n < RING_BATCH && (payload = ring_peek(ring, &frame)); ++n) {
+            handle(data, &frame, payload);
+            ring_consume(ring, &frame);
+        }
+        if (n == RING_BATCH) {
+            event_active(ev, EV_TIMEOUT, 0);
+            return;
+        }
+    } while (ring_sleep(ring));
+}
+
+static void worker_ring_callback(evutil_socket_t fd, short what, void * data)
+{
+    struct worker_ctx * ctx = data;
+
+    mod_ring_drain(ctx->ring, ctx->evring, what, ctx, worker_frame);
+    worker_batches_run();
+    worker_ack();
+}
+
+/* Move frames that didn't fit into the ring earlier, returns bytes still pending */
+static size_t worker_flush(struct worker * worker)
+{
+    struct ipc_frame frame;
+    const unsigned char * payload;
+
+    while ((payload = ipc_next(worker->pending, &frame))) {
+        if (ring_put(worker->tx, frame.type, frame.id, payload, frame.len, NULL, 0) == -1)
+            break;
+        ipc_drain(worker->pending, &frame);
+    }
+
+    return evbuffer_get_length(worker->pending);
+}
+
+static void worker_flush_callback(evutil_socket_t fd, short what, void * data)
+{
+    struct worker * worker = data;
+
+    if (worker_flush(worker))
+        evtimer_add(worker->evflush, &(struct timeval){.tv_usec = WORKER_FLUSH_CHECK});
+}
+
+/*
+ * Send a frame to a child. Nothing here blocks, what the child can't
+ * take yet waits in worker->pending (rings) or the bufferevent (socket),
+ * either way frames reach it in the order we sent them.
+ */
+static int worker_send(struct worker * worker, enum ipc_type type, unsigned short id, const void * a, size_t alen, const void * b, size_t blen)
+{
+    if (worker->tx) {
+        if ((!worker->pending || !worker_flush(worker)) && ring_put(worker->tx, type, id, a, alen, b, blen) == 0)
+            return 0;
+        if (worker->pending) {
+            if (!evtimer_pending(worker->evflush, NULL))
+                evtimer_add(worker->evflush, &(struct timeval){.tv_usec = WORKER_FLUSH_CHECK});
+            return ipc_add(worker->pending, type, id, a, alen, b, blen);
+        }
+    }
+
+    if (worker->bev)
+        return ipc_add(bufferevent_get_output(worker->bev), type, id, a, alen, b, blen);
+    return ipc_send(worker->sock, type, id, a, alen, b, blen);
+}
+
+/* Send an event (struct ircmsg_event + line), it's in flight until the child acks it */
+static int worker_send_event(struct worker * worker, unsigned short server, const void * a, size_t alen, const void * b, size_t blen)
+{
+    if (worker_send(worker, IPC_EVENT, server, a, alen, b, blen) == -1)
+        return -1;
+    if (worker->unacked)
+        ipc_add(worker->unacked, IPC_EVENT, server, a, alen, b, blen);
+
+    worker->sent_at[worker->sent++ % WORKER_INFLIGHT_TRACK] = mod_usec();
+    return 0;
+}
+
+/* Events sent to a child it hasn't finished yet */
+static inline unsigned long worker_inflight(struct worker * worker)
+{
+    return worker->sent - worker->done;
+}
+
+/* How long the oldest event it hasn't finished has been waiting (usec) */
+static uint64_t worker_age(struct worker * worker, uint64_t now)
+{
+    unsigned long oldest = worker->done;
+
+    if (!worker_inflight(worker))
+        return 0;
+    /* We only remember so many, it's at least as old as that */
+    if (worker_inflight(worker) > WORKER_INFLIGHT_TRACK)
+        oldest = worker->sent - WORKER_INFLIGHT_TRACK;
+    return now - worker->sent_at[oldest % WORKER_INFLIGHT_TRACK];
+}
+
+/* Resident set size of a worker in bytes, 0 if we can't tell */
+static size_t worker_rss(struct worker * worker)
+{
+    unsigned long pages = 0;
+    char path[64];
+    FILE * fp;
+
+    snprintf(path, sizeof path, "/proc/%d/statm", (int)worker->pid);
+    if ( (fp = fopen(path, "r")) ) {
+        if (fscanf(fp, "%*u %lu", &pages) != 1)
+            pages = 0;
+        fclose(fp);
     }
+
+    return pages * sysconf(_SC_PAGESIZE);
+}
+
+/* Bytes sent to a child that it hasn't picked up yet */
+static size_t worker_queued(struct worker * worker)
+{
+    size_t queued = worker->bev ? evbuffer_get_length(bufferevent_get_output(worker->bev)) : 0;
+
+    if (worker->tx)
+        queued += ring_used(worker->tx) + (worker->pending ? evbuffer_get_length(worker->pending) : 0);
+    return queued;
+}
+
+/* Workers taking events, in all the lanes */
+static size_t workers_active(struct worker_list * wl)
+{
+    size_t n = 0;
+
+    for (unsigned int lane = 0; lane < wl->nlanes; ++lane)
+        n += wl->lanes[lane].active;
+    return n;
 }
 
 static void parent_event_callback(struct bufferevent * bev, void * data);
 
 static void workers_spawn_callback(evutil_socket_t sock, short what, void * data)
 {
-    struct worker_list * list = data;
-    /* Now fork a new child */
-    workers_fork(list->main_evbase, list, list->reapme);
-    list->reapme = 0;
+    /* Now fork a new child in place of the one that exited (data is its pid) */
+    workers_fork(worker_list->main_evbase, worker_list, (pid_t)(intptr_t)data);
 }
 
 /* Forward declartion for parent_sig_callback below */
-static int workers_command_reload(const char * argline);
+static int workers_command_reload(const unsigned char * args, size_t len);
+
+/* Snapshot the store if it changed since the last time (config: state_file) */
+static void workers_state_save(struct worker_list * wl)
+{
+    uint64_t version;
+
+    if (!wl->store || !wl->state_file || (version = store_version(wl->store)) == wl->state_saved)
+        return;
+    if (store_save(wl->store, wl->state_file) == 0)
+        wl->state_saved = version;
+}
 
 static void parent_sig_callback(evutil_socket_t sig, short what, void * data)
 {
@@ -110,12 +814,13 @@ static void parent_sig_callback(evutil_socket_t sig, short what, void * data)
     switch (sig) {
         case SIGINT:
             log_debug("parent [%d] caught SIGINT exiting...", getpid());
+            workers_state_save(list);
             event_base_loopexit(list->main_evbase, NULL);
             break;
         case SIGHUP:
             log_debug("parent [%d] caught SIGHUP reloading...", getpid());
 			/* TODO RELOAD the config file then reload the children */
-			workers_command_reload(NULL);
+			workers_command_reload(NULL, 0);
             break;
         case SIGCHLD:
 			/* Multiple children may have exited, so we need to keep waiting until we don't get any more children */
@@ -125,8 +830,8 @@ static void parent_sig_callback(evutil_socket_t sig, short what, void * data)
 					break;
 
 				log_debug("parent [%d] caught SIGCHLD for pid [%d]", getpid(), child);
-				list->reapme = child;
-				event_base_once(list->main_evbase, -1, EV_TIMEOUT, workers_spawn_callback, list, NULL);
+				/* Each gets its own callback, several may have exited at once */
+				event_base_once(list->main_evbase, -1, EV_TIMEOUT, workers_spawn_callback, (void *)(intptr_t)child, NULL);
 			}
             break;
         default:
@@ -153,14 +858,20 @@ static void worker_sig_callback(evutil_socket_t sig, short what, void * data)
 
 
 /* Connect to a new server */
-static int workers_command_connect(const char * argline)
+static int workers_command_connect(const unsigned char * args, size_t len)
 {
+    char argline[BUFSIZ];
     char host[BUFSIZ];
     char nick[BUFSIZ];
     char username[BUFSIZ];
     int port;
     int use_ssl;
 
+    if (len >= sizeof argline)
+        return -1;
+    memcpy(argline, args, len);
+    argline[len] = '\0';
+
     /* Connect to new server, %host %port %ssl */
     if (sscanf(argline, "%s %s %s %d %d", nick, username, host, &port, &use_ssl) == 5) {
         struct con * con = Con.new(host, port, CF_RECONNECT | (CF_SSL*use_ssl), worker_list);
@@ -176,40 +887,116 @@ static int workers_command_connect(const char * argline)
 
     return 0;
 }
-/* Restart children */
-static int workers_command_reload(const char * argline)
+static void workers_recycle(struct worker_list * wl, struct worker * worker, const char * why);
+
+/*
+ * Rolling reload, one worker at a time: it leaves the rotation, once it
+ * acked everything it reloads its interpreter (IPC_RELOAD) and comes
+ * back when it says it's ready (IPC_READY). With a zygote it's replaced
+ * by a worker from the new zygote instead, which keeps the sharing.
+ * Called again whenever one of them gets further along.
+ */
+static void workers_reload_step(struct worker_list * wl)
 {
-    struct worker * worker;
+    struct worker * worker, * next = NULL;
+    struct server * server;
 
-    log_debug("[debug] reloading children...");
+    if (!wl->reloading)
+        return;
 
-    SLIST_FOREACH(worker, worker_list->list, next) {
-        if (worker->pid > 0) {
-            log_debug("[debug] sending SIGHUP to %d", worker->pid);
-            kill(worker->pid, SIGHUP);
+    SLIST_FOREACH(worker, wl->list, next) {
+        if (worker->state == WORKER_RELOADING && !worker_inflight(worker)) {
+            if (worker_send(worker, IPC_RELOAD, 0, NULL, 0, NULL, 0) == -1)
+                perror("workers_reload_step send");
+            worker->state = WORKER_LOADING;
+            return;
+        }
+        /* Still waiting on this one */
+        if (worker->state == WORKER_RELOADING || worker->state == WORKER_LOADING
+                || (worker->state == WORKER_ACTIVE && !worker->ready))
+            return;
+        if (worker->state == WORKER_ACTIVE && worker->generation != wl->generation && !next)
+            next = worker;
+    }
+
+    if (next) {
+        if (wl->zygote != -1) {
+            workers_recycle(wl, next, "reload");
         } else {
-            log_debug("[debug] empty worker container? pid: %d", worker->pid);
+            log_debug("[debug] reloading worker[%d]", next->pid);
+            next->state = WORKER_RELOADING;
+            workers_reload_step(wl);
         }
+        return;
     }
 
+    wl->reloading = false;
+    wl->reload_took = mod_usec() - wl->reload_started;
+    log_debug("[debug] reload done in %.1f ms", wl->reload_took / 1000.0);
+    if (wl->reload_server < gconfig.nservers && (server = gconfig.server_ids[wl->reload_server]))
+        Con.printf(server->con, "NOTICE %s :reload done, %zu workers in %.1f s\r\n",
+                wl->reload_target, workers_active(wl), wl->reload_took / 1000000.0);
+}
+
+/* Reload the children one by one, args is who asked (uint16_t server id + target) if anyone */
+static int workers_command_reload(const unsigned char * args, size_t len)
+{
+    struct worker_list * wl = worker_list;
+    uint16_t id;
+
+    log_debug("[debug] reloading children...");
+
+    wl->reload_server = IRCMSG_NOSERVER;
+    if (len > sizeof id && len - sizeof id < sizeof wl->reload_target) {
+        memcpy(&id, args, sizeof id);
+        memcpy(wl->reload_target, args + sizeof id, len - sizeof id);
+        wl->reload_target[len - sizeof id] = '\0';
+        if (!strpbrk(wl->reload_target, " \r\n"))
+            wl->reload_server = id;
+    }
+
+    /* Workers that already reloaded in a reload still going on do it again */
+    ++wl->generation;
+    /* Our routes are the old code's, new handlers could want anything */
+    if (wl->routed) {
+        log_debug("[debug] not filtering events until a restart, the reloaded modules may want others");
+        wl->routed = false;
+    }
+    wl->reloading = true;
+    wl->reload_started = mod_usec();
+
+    /* Replacements have to come from a zygote that loaded the new code */
+    if (wl->zygote != -1) {
+        workers_zygote_stop(wl);
+        workers_zygote(wl);
+    }
+
+    workers_reload_step(wl);
     return 0;
 }
 
-static int workers_command_broadcast(const char * argline)
+/* The worker already packed the event, pass it on to everyone as is */
+static int workers_command_broadcast(const unsigned char * args, size_t len)
 {
     struct worker * worker = NULL;
+    struct ircmsg_event ev;
 
-    log_debug("[debug] broadcasting [%s] to all children...", argline);
+    if (len < sizeof ev)
+        return -1;
+    memcpy(&ev, args, sizeof ev);
+    if (sizeof ev + ev.size != len)
+        return -1;
+
+    log_debug("[debug] broadcasting [%s] to all children...", (const char *)args + sizeof ev);
 
     SLIST_FOREACH(worker, worker_list->list, next) {
+        if (worker->state != WORKER_ACTIVE)
+            continue;
         if (worker->pid > 0) {
-			size_t len = strlen(argline) + 1;
-            log_debug("[debug] sending [%s] size %zu to %d", argline, len, worker->pid);
-			if (send(worker->sock, argline, len, 0) == -1) {
+            log_debug("[debug] sending %zu bytes to %d", len, worker->pid);
+			if (worker_send_event(worker, ev.server, args, len, NULL, 0) == -1) {
 				perror("broadcast send");
 			}
-			/* Ensure CRLF is sent also */
-			send(worker->sock, "\r\n", 2, 0);
         } else {
             log_debug("[debug] empty worker container? pid: %d", worker->pid);
         }
@@ -218,65 +1005,316 @@ static int workers_command_broadcast(const char * argline)
 	return 0;
 }
 
-static int workers_command(struct worker_list * wl, const char * command, const char * argline)
+/* Report the worker queues to "<uint16_t server id><target>" */
+static int workers_command_status(const unsigned char * args, size_t len)
 {
-    static struct htable * command_lookup;
-    int (*func)(const char * argline);
-    
-    if (!command_lookup) {
-        command_lookup = htable.new(15); /* Make sure this is suitably larger than the number of commands */
-        /* Register our commands (declared above) */
-        htable.store(command_lookup, "CONNECT", workers_command_connect);
-        htable.store(command_lookup, "RELOAD", workers_command_reload);
-        htable.store(command_lookup, "BROADCAST", workers_command_broadcast);
-     /* TODO commands */
-     /* TODO htable.store(command_lookup, "RECONNECT", workers_command_reconnect);  */
-     /* TODO htable.store(command_lookup, "DISCONNECT", workers_command_disconnect);  */
+    struct worker * worker;
+    struct server * server;
+    const char * target;
+    int tlen;
+    uint16_t id;
+    uint64_t now = mod_usec();
+
+    if (len <= sizeof id)
+        return -1;
+    memcpy(&id, args, sizeof id);
+    target = (const char *)args + sizeof id;
+    tlen = len - sizeof id;
+    if (id >= gconfig.nservers || !(server = gconfig.server_ids[id]) || memchr(target, ' ', tlen)
+            || memchr(target, '\r', tlen) || memchr(target, '\n', tlen))
+        return -1;
+
+    SLIST_FOREACH(worker, worker_list->list, next) {
+        struct worker_board * board = worker->board != -1 ? &worker_list->boards[worker->board] : NULL;
+        uint64_t started = board ? atomic_load(&board->started) : 0;
+
+        Con.printf(server->con, "NOTICE %.*s :worker[%d] slot %u lane %s %s%s handled %lu in flight %lu (oldest %.1f ms) queued %zu bytes (ring %zu) dropped %lu rss %zu KB%s\r\n",
+                tlen, target, worker->pid, worker->slot, worker_list->lanes[worker->lane].name, worker_state_names[worker->state],
+                worker->ready ? "" : " (not ready)", worker->done,
+                worker_inflight(worker), worker_age(worker, now) / 1000.0,
+                worker_queued(worker), worker->tx ? ring_used(worker->tx) : 0, worker->dropped, worker_rss(worker) >> 10,
+                started && now - started >= worker_list->deadline ? " HUNG" : "");
+    }
+    Con.printf(server->con, "NOTICE %.*s :workers: %zu (%zu-%zu, recycled %lu, hung %lu), dispatch: %s, queue limit %zu bytes, overflow: %s, paused servers %lu times, unhandled events %lu, filtered %lu (%u filters%s)\r\n",
+            tlen, target, workers_active(worker_list), worker_list->min_workers, worker_list->max_workers, worker_list->recycled, worker_list->hung,
+            worker_dispatch_names[worker_list->dispatch], worker_list->queue_max,
+            worker_overflow_names[worker_list->overflow], worker_list->pauses, worker_list->unhandled,
+            worker_list->filtered, worker_list->nfilters, worker_list->routed ? "" : ", off");
+    if (worker_list->nlanes > 1) {
+        char lanes[WORKER_LANES * 48] = "";
+        size_t n = 0;
+
+        for (unsigned int lane = 0; lane < worker_list->nlanes && n < sizeof lanes; ++lane)
+            n += snprintf(lanes + n, sizeof lanes - n, "%s%s %zu/%zu", lane ? ", " : "",
+                    worker_list->lanes[lane].name, worker_list->lanes[lane].active, worker_list->lanes[lane].want);
+        Con.printf(server->con, "NOTICE %.*s :lanes: %s\r\n", tlen, target, lanes);
+    }
+    if (worker_list->cache) {
+        struct cache_stats stats;
+
+        cache_stats(worker_list->cache, &stats);
+        Con.printf(server->con, "NOTICE %.*s :http cache: %zu/%zu KB in %lu entries, hits %lu misses %lu waited %lu evicted %lu\r\n",
+                tlen, target, stats.used >> 10, stats.size >> 10, stats.entries, stats.hits, stats.misses, stats.waits, stats.evictions);
+    }
+    if (worker_list->store) {
+        struct store_stats stats;
+
+        store_stats(worker_list->store, &stats);
+        Con.printf(server->con, "NOTICE %.*s :state: %zu/%zu KB in %lu keys%s%s\r\n",
+                tlen, target, stats.used >> 10, stats.size >> 10, stats.keys,
+                worker_list->state_file ? ", saved to " : "", worker_list->state_file ? worker_list->state_file : "");
+    }
+    if (worker_list->db_sock != -1) {
+        struct db_stats * stats = worker_list->db_stats;
+
+        Con.printf(server->con, "NOTICE %.*s :db: storage process [%d]%s, %lu reads, %lu writes in %lu commits, %lu failed, restarted %lu times\r\n",
+                tlen, target, worker_list->db_pid, worker_list->db_pid ? "" : " (restarting)",
+                stats ? (unsigned long)stats->reads : 0, stats ? (unsigned long)stats->writes : 0,
+                stats ? (unsigned long)stats->commits : 0, stats ? (unsigned long)stats->failed : 0, worker_list->db_restarts);
+    }
+    if (worker_list->reloading) {
+        unsigned int done = 0, total = 0;
+
+        SLIST_FOREACH(worker, worker_list->list, next) {
+            if (worker->state == WORKER_DRAINING)
+                continue;
+            ++total;
+            done += worker->state == WORKER_ACTIVE && worker->ready && worker->generation == worker_list->generation;
+        }
+        Con.printf(server->con, "NOTICE %.*s :reload: %u/%u workers done, running for %.1f s\r\n",
+                tlen, target, done, total, (now - worker_list->reload_started) / 1000000.0);
+    } else if (worker_list->generation) {
+        Con.printf(server->con, "NOTICE %.*s :reload: last one took %.1f s\r\n",
+                tlen, target, worker_list->reload_took / 1000000.0);
     }
 
-    if ( !(func = htable.lookup(command_lookup, command)) ) {
-        log_debug("[debug] invalid command from child: %s", command);
+    return 0;
+}
+
+/* "<uint8_t on><set>\0<key>", a module adding or removing a key filters look for */
+static int workers_command_match(const unsigned char * args, size_t len)
+{
+    const char * name = (const char *)args + 1, * end;
+    char key[WORKER_KEY_MAX];
+    struct worker_set * set;
+    size_t klen, i;
+
+    if (len < 3 || !(end = memchr(name, '\0', len - 1)))
+        return -1;
+    klen = len - (end + 1 - (const char *)args);
+    if (!klen || klen >= sizeof key)
+        return -1;
+    for (i = 0; i < klen; ++i)
+        key[i] = tolower((unsigned char)end[1 + i]);
+    key[klen] = '\0';
+
+    /* No filter looks in it */
+    if (!worker_list->sets || !(set = htable.lookup(worker_list->sets, name)))
+        return 0;
+    if (!args[0]) {
+        htable.delete(set->keys, key);
+    } else if (!set->full && !htable.lookup(set->keys, key)) {
+        if (htable.total(set->keys) >= WORKER_SET_MAX) {
+            log_debug("WARNING set %s has %d keys, everything matches it from now on", name, WORKER_SET_MAX);
+            set->full = true;
+        } else {
+            htable.store(set->keys, key, (void *)1);
+        }
+    }
+
+    return 0;
+}
+
+static int workers_command(struct worker_list * wl, unsigned short command, const unsigned char * args, size_t len)
+{
+    static int (* const commands[IPC_CTL_MAX])(const unsigned char * args, size_t len) = {
+        [IPC_CTL_CONNECT] = workers_command_connect,
+        [IPC_CTL_RELOAD] = workers_command_reload,
+        [IPC_CTL_BROADCAST] = workers_command_broadcast,
+        [IPC_CTL_STATUS] = workers_command_status,
+        [IPC_CTL_MATCH] = workers_command_match,
+     /* TODO [IPC_CTL_RECONNECT] = workers_command_reconnect,  */
+     /* TODO [IPC_CTL_DISCONNECT] = workers_command_disconnect,  */
+    };
+
+    if (command >= IPC_CTL_MAX || !commands[command]) {
+        log_debug("[debug] invalid command from child: %u", command);
         return -1;
     }
 
     /* Execute the command */
-    return func(argline);
+    return commands[command](args, len);
 }
 
 
+static void workers_reap_callback(evutil_socket_t fd, short what, void * data);
+static void workers_release(struct worker_list * wl, struct worker * worker);
+
+/* Forget the first 'n' events in a worker's unacked copies */
+static void worker_forget(struct worker * worker, unsigned long n)
+{
+    struct ipc_frame frame;
+
+    while (n-- && ipc_next(worker->unacked, &frame))
+        ipc_drain(worker->unacked, &frame);
+}
+
+static void parent_frame(void * data, const struct ipc_frame * frame, const unsigned char * payload)
+{
+    struct worker * worker = data;
+    struct server * server;
+    uint32_t acked;
+
+    switch (frame->type) {
+        /* It finished some events */
+        case IPC_ACK:
+            if (frame->len != sizeof acked)
+                break;
+            memcpy(&acked, payload, sizeof acked);
+            if (acked > worker_inflight(worker))
+                acked = worker_inflight(worker);
+            worker->done += acked;
+            if (worker->unacked)
+                worker_forget(worker, acked);
+            if (worker_inflight(worker))
+                break;
+            /* Done with its keys, what waited for them can go on */
+            workers_release(worker_list, worker);
+            /* Its last one, let it go (not from here, we're still reading its frames) */
+            if (worker->state == WORKER_DRAINING)
+                event_base_once(worker_list->main_evbase, -1, EV_TIMEOUT, workers_reap_callback, worker_list, NULL);
+            else if (worker->state == WORKER_RELOADING)
+                workers_reload_step(worker_list);
+            break;
+        /* Done loading its interpreter */
+        case IPC_READY:
+            worker->ready = true;
+            if (frame->len == sizeof worker->subs)
+                memcpy(&worker->subs, payload, sizeof worker->subs);
+            workers_subscribe(worker_list, worker->lane);
+            if (worker->state == WORKER_LOADING) {
+                worker->state = WORKER_ACTIVE;
+                worker->generation = worker_list->generation;
+            }
+            workers_reload_step(worker_list);
+            break;
+        /* We got message to send to the server, output it */
+        case IPC_OUTPUT:
+            if (frame->id < gconfig.nservers && (server = gconfig.server_ids[frame->id])) {
+                Con.write(server->con, (const char *)payload, frame->len);
+            } else {
+                log_debug("Trying to send to invalid server id: %u message: %.*s\n", frame->id, (int)frame->len, payload);
+            }
+            break;
+        /* We got a management command */
+        case IPC_CONTROL:
+            log_debug("parent received command %u", frame->id);
+            workers_command(worker_list, frame->id, payload, frame->len);
+            break;
+        default:
+            log_debug("parent received unexpected frame type %u", frame->type);
+            break;
+    }
+}
+
 static void parent_event_callback(struct bufferevent * bev, void * data)
 {
-    char * line;
     struct evbuffer * input = bufferevent_get_input(bev);
-    struct server * server;
-	char server_name[MAX_SERVER_NAME];
-    int consumed;
+    struct ipc_frame frame;
+    const unsigned char * payload;
 
-    while ((line = evbuffer_readln(input, NULL, EVBUFFER_EOL_CRLF))) {
-        /* We got a management command */
-        if (*line == ':') {
-            char buf[BUFSIZ];
+    while ((payload = ipc_next(input, &frame))) {
+        parent_frame(data, &frame, payload);
+        ipc_drain(input, &frame);
+    }
+}
 
-            /* Process commands */
-            log_debug("parent received command from: %s", line);
-            if (sscanf(line, ":%s %n", buf, &consumed)) 
-                workers_command(data, buf, line + consumed);
-        }
-        /* else we got message to send to the server, output it */
-        else if (sscanf(line, "S%s %n", server_name, &consumed)) {
-            server = htable.lookup(gconfig.servers, server_name);
+static void parent_ring_callback(evutil_socket_t fd, short what, void * data)
+{
+    struct worker * worker = data;
 
-            if (server) {
-                Con.puts(server->con, line + consumed);
-            } else {
-                log_debug("Trying to send to invalid server name: %s message: %s\n", server_name, line + consumed);
-            }
-        }
+    mod_ring_drain(worker->rx, worker->evring, what, worker, parent_frame);
+}
 
-        free(line);
+/* Tell a worker which server an id stands for */
+static int worker_send_server(struct worker * worker, struct server * server)
+{
+    size_t name = strlen(server->name) + 1, nick = server->nick ? strlen(server->nick) + 1 : 1;
+
+    return worker_send(worker, IPC_SERVER, server->id, server->name, name, server->nick ? server->nick : "", nick);
+}
+
+/* A lane takes what any of its workers has handlers for */
+static void workers_subscribe(struct worker_list * wl, unsigned int lane)
+{
+    struct worker_subs * subs = &wl->lanes[lane].subs;
+    struct worker * worker;
+    size_t i;
+
+    memset(subs, 0, sizeof *subs);
+    SLIST_FOREACH(worker, wl->list, next) {
+        if (worker->lane != lane)
+            continue;
+        for (i = 0; i < sizeof subs->types; ++i)
+            subs->types[i] |= worker->subs.types[i];
+        for (i = 0; i < sizeof subs->numerics; ++i)
+            subs->numerics[i] |= worker->subs.numerics[i];
     }
 }
 
+/* Start listening to a child (its socket and the ring if it has one) */
+static void worker_attach(struct worker_list * wl, struct worker * worker)
+{
+    /* We never wait on a child, what it can't take yet stays in worker->bev */
+    evutil_make_socket_nonblocking(worker->sock);
+    worker->bev = bufferevent_socket_new(wl->main_evbase, worker->sock, 0);
+    bufferevent_setcb(worker->bev, parent_event_callback, NULL, NULL, worker);
+    /* Whatever the last one had in flight is gone with it */
+    worker->sent = worker->done = 0;
+    worker->idle_since = 0;
+    /* A new process loads the current code */
+    worker->state = WORKER_ACTIVE;
+    worker->ready = false;
+    worker->generation = wl->generation;
+    memset(&worker->subs, 0xff, sizeof worker->subs);
+    workers_subscribe(wl, worker->lane);
+    bufferevent_enable(worker->bev, EV_READ);
+
+    if (worker->rx) {
+        worker->evring = event_new(wl->main_evbase, ring_bell(worker->rx), EV_READ | EV_PERSIST, parent_ring_callback, worker);
+        event_add(worker->evring, NULL);
+        worker->pending = evbuffer_new();
+        worker->evflush = evtimer_new(wl->main_evbase, worker_flush_callback, worker);
+    } else if (worker->board != -1) {
+        /* The socket takes what we write, we'd have nothing left to send on if it died */
+        worker->unacked = evbuffer_new();
+    }
+}
+
+/* Stop listening to a child and release its channels */
+static void worker_detach(struct worker * worker)
+{
+    if (worker->evring)
+        event_free(worker->evring);
+    if (worker->evflush)
+        event_free(worker->evflush);
+    if (worker->pending)
+        evbuffer_free(worker->pending);
+    if (worker->unacked)
+        evbuffer_free(worker->unacked);
+    if (worker->held)
+        evbuffer_free(worker->held);
+    if (worker->bev)
+        bufferevent_free(worker->bev);
+    close(worker->sock);
+    ring_free(worker->tx);
+    ring_free(worker->rx);
+    worker->evring = worker->evflush = NULL;
+    worker->pending = worker->unacked = worker->held = NULL;
+    worker->bev = NULL;
+    worker->tx = worker->rx = NULL;
+}
+
 /*********************************************************************
  * Worker element interface
  *********************************************************************/
@@ -289,73 +1327,679 @@ static void worker_free(struct worker * worker)
     waitpid(0, NULL, -1);
 
     /* Free resources */
-    close(worker->sock);
-    bufferevent_free(worker->bev);
+    worker_detach(worker);
     free(worker);
 }
 
-static void worker_init(int sock)
+/*
+ * Take a worker off the list. The round-robin pointers walk the whole
+ * list, another lane's can be on it too
+ */
+static void workers_unlink(struct worker_list * wl, struct worker * worker)
+{
+    for (unsigned int lane = 0; lane < WORKER_LANES; ++lane)
+        if (wl->lanes[lane].current == worker)
+            wl->lanes[lane].current = SLIST_NEXT(worker, next);
+    SLIST_REMOVE(wl->list, worker, worker, next);
+}
+
+/* Take a worker off the list and let it go */
+static void workers_remove(struct worker_list * wl, struct worker * worker)
+{
+    workers_unlink(wl, worker);
+    worker_free(worker);
+}
+
+static void worker_init(int sock, struct ring * ring, bool loaded)
 {
     struct worker_ctx ctx = {.base = NULL};
 
     do {
         ctx.restart_loop = 0;
-        /* Init perl in our child */
-        mod_perl_reinit(); 
+        /* Init perl in our child, unless the zygote already did */
+        if (loaded)
+            mod_perl_post_fork();
+        else
+            mod_perl_reinit();
+        loaded = false;
 
         ctx.base = event_base_new();
         if (!ctx.base) {
             perror("child base");
             break;
         }
+        worker_base = ctx.base;
 
         ctx.evsock = bufferevent_socket_new(ctx.base, sock, 0);
         bufferevent_setcb(ctx.evsock, worker_event_callback, NULL, NULL, ctx.evsock);
         bufferevent_enable(ctx.evsock, EV_READ);
 
-		/* Add sig handler */
-		ctx.evsigint = evsignal_new(ctx.base, SIGHUP, worker_sig_callback, &ctx);
+        if ( (ctx.ring = ring) ) {
+            ctx.evring = event_new(ctx.base, ring_bell(ring), EV_READ | EV_PERSIST, worker_ring_callback, &ctx);
+            event_add(ctx.evring, NULL);
+            /* Pick up anything the master queued before we got here */
+            event_active(ctx.evring, EV_TIMEOUT, 0);
+        }
+
+		/* Add sig handler */
+		ctx.evsigint = evsignal_new(ctx.base, SIGHUP, worker_sig_callback, &ctx);
+
+        /* Show the master's watchdog we're alive, we're ready from here on */
+        if (worker_board) {
+            atomic_store(&worker_board->beat, mod_usec());
+            ctx.evbeat = event_new(ctx.base, -1, EV_PERSIST, worker_beat_callback, NULL);
+            evtimer_add(ctx.evbeat, &(struct timeval){.tv_sec = WORKER_HEARTBEAT});
+        }
+
+		sigset_t allsigs;
+		sigfillset(&allsigs);
+		sigprocmask(SIG_UNBLOCK, &allsigs, NULL);
+        /* The master holds a rolling reload until we got here */
+        worker_ready();
+        /* Begin main loop */
+        event_base_dispatch(ctx.base);
+
+        /* Cleanup */
+        bufferevent_free(ctx.evsock);
+        if (ctx.evring)
+            event_free(ctx.evring);
+        if (ctx.evbeat)
+            event_free(ctx.evbeat);
+        ctx.evring = ctx.evbeat = NULL;
+        event_free(ctx.evsigint);
+        http_free(worker_http);
+        worker_http = NULL;
+        db_free(worker_db);
+        worker_db = NULL;
+        worker_base = NULL;
+        event_base_free(ctx.base);
+    } while(ctx.restart_loop);
+
+    close(sock);
+}
+
+/* Worker process from here on, we never return */
+static void worker_child(int sock, struct ring * tx, struct ring * rx, struct worker_board * board, bool loaded)
+{
+    worker_board = board;
+
+    /* Our output to the master goes out as frames on the socket (ipc.h),
+     * anything printed by modules on stdout ends up on stderr instead */
+    ipc_master = sock;
+    ipc_master_ring = tx ? rx : NULL;
+    fflush(stdout);
+    if (dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+        perror("worker_child dup2");
+
+    /* Call our child function */
+    worker_init(sock, tx, loaded);
+
+    exit(0);
+}
+
+/*********************************************************
+ * Zygote, a process that loads all the perl once and
+ * forks the workers, so they share it copy-on-write
+ *********************************************************/
+/* The fds that come with a spawn request, just the socket if there are no rings */
+enum zygote_fd {
+    ZYGOTE_SOCK,
+    ZYGOTE_TX, ZYGOTE_TX_BELL,
+    ZYGOTE_RX, ZYGOTE_RX_BELL,
+    ZYGOTE_FDS
+};
+
+/* Spawn requests are two bytes, the scoreboard entry of the worker (or WORKER_NOBOARD) and its lane */
+enum zygote_req {
+    ZYGOTE_BOARD,
+    ZYGOTE_LANE,
+    ZYGOTE_REQ
+};
+
+static void zygote_main(int sock, struct worker_list * wl)
+{
+    int fds[IPC_MAXFDS], nfds, i;
+    pid_t pid, worker;
+    unsigned char req[ZYGOTE_REQ];
+
+    /* A zygote started later (on reload) has the master's servers too */
+    worker_servers_reset();
+    /* A fresh interpreter, so a new zygote picks up changed modules */
+    mod_perl_reinit();
+    log_debug("zygote [%d] loaded", getpid());
+
+    while (ipc_recv_fds(sock, req, sizeof req, fds, &nfds) > 0) {
+        worker = -1;
+        if (nfds == 1 || nfds == ZYGOTE_FDS)
+            pid = fork();
+        else
+            pid = -1;
+
+        if (pid == 0) {
+            /* Fork again and leave, the worker gets reparented to the master (its subreaper) */
+            if ((worker = fork()) == 0) {
+                struct ring * tx = NULL, * rx = NULL;
+
+                close(sock);
+                if (nfds == ZYGOTE_FDS && (!(tx = ring_open(fds[ZYGOTE_TX], fds[ZYGOTE_TX_BELL]))
+                            || !(rx = ring_open(fds[ZYGOTE_RX], fds[ZYGOTE_RX_BELL]))))
+                    _exit(1); /* The master is set on rings, it'll get SIGCHLD and try again */
+                /* We loaded every lane, it drops what isn't its own (mod_perl_post_fork()) */
+                if (wl->nlanes > 1 && req[ZYGOTE_LANE] < wl->nlanes)
+                    mod_perl_lane(wl->lanes[req[ZYGOTE_LANE]].name, wl->lanes[req[ZYGOTE_LANE]].modules);
+                worker_child(fds[ZYGOTE_SOCK], tx, rx, wl->boards && req[ZYGOTE_BOARD] < WORKER_BOARDS ? &wl->boards[req[ZYGOTE_BOARD]] : NULL, true);
+            }
+            if (write(sock, &worker, sizeof worker) != sizeof worker)
+                perror("zygote write");
+            _exit(0);
+        }
+
+        for (i = 0; i < nfds; ++i)
+            close(fds[i]);
+        if (pid == -1) {
+            perror("zygote fork");
+            if (write(sock, &worker, sizeof worker) != sizeof worker)
+                perror("zygote write");
+        } else {
+            waitpid(pid, NULL, 0);
+        }
+    }
+
+    /* The master went away */
+    exit(0);
+}
+
+/* Start a zygote, the workers get forked by it from now on */
+static int workers_zygote(struct worker_list * wl)
+{
+    int sockpair[2];
+    pid_t pid;
+
+    /* Workers are the zygote's grandchildren, this makes them ours (SIGCHLD and all) */
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+        perror("workers_zygote prctl");
+        return -1;
+    }
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sockpair) == -1) {
+        perror("workers_zygote socketpair");
+        return -1;
+    }
+
+    if ((pid = fork()) == 0) {
+        if (wl->main_evbase) {
+            event_reinit(wl->main_evbase);
+            event_base_free(wl->main_evbase);
+        }
+        /* Nothing the master has open (servers, other workers) is any of our business */
+        if (sockpair[0] != 3 && (dup2(sockpair[0], 3) == -1 || close(sockpair[0]) == -1)) {
+            perror("zygote dup2");
+            _exit(1);
+        }
+        close_range(4, ~0U, 0);
+        zygote_main(3, wl);
+    } else if (pid == -1) {
+        perror("workers_zygote fork");
+        close(sockpair[0]);
+        close(sockpair[1]);
+        return -1;
+    }
+
+    close(sockpair[0]);
+    wl->zygote = sockpair[1];
+    wl->zygote_pid = pid;
+    log_debug("zygote launch pid [%d] socket fd[%d]", pid, wl->zygote);
+
+    return 0;
+}
+
+/* Stop using the zygote, it exits once it sees its socket close */
+static void workers_zygote_stop(struct worker_list * wl)
+{
+    if (wl->zygote != -1) {
+        close(wl->zygote);
+        wl->zygote = -1;
+        wl->zygote_pid = 0;
+    }
+}
+
+/* Have the zygote fork a worker on these channels, -1 if it can't (then we stop using it) */
+static pid_t workers_zygote_spawn(struct worker_list * wl, int sock, struct ring * tx, struct ring * rx, int board, unsigned int lane)
+{
+    int fds[ZYGOTE_FDS] = {[ZYGOTE_SOCK] = sock}, nfds = 1;
+    unsigned char req[ZYGOTE_REQ] = {[ZYGOTE_BOARD] = board == -1 ? WORKER_NOBOARD : board, [ZYGOTE_LANE] = lane};
+    pid_t pid = -1;
+    ssize_t r;
+
+    if (tx) {
+        fds[ZYGOTE_TX] = ring_fd(tx);
+        fds[ZYGOTE_TX_BELL] = ring_bell(tx);
+        fds[ZYGOTE_RX] = ring_fd(rx);
+        fds[ZYGOTE_RX_BELL] = ring_bell(rx);
+        nfds = ZYGOTE_FDS;
+    }
+
+    if (ipc_send_fds(wl->zygote, req, sizeof req, fds, nfds) == 0) {
+        while ((r = recv(wl->zygote, &pid, sizeof pid, 0)) == -1 && errno == EINTR)
+            ;
+        if (r != sizeof pid)
+            pid = -1;
+    }
+    if (pid == -1) {
+        log_debug("WARNING zygote [%d] didn't give us a worker, forking them ourselves", wl->zygote_pid);
+        workers_zygote_stop(wl);
+    }
+
+    return pid;
+}
+
+/* Fork the storage process (db.h), the workers connect to it on wl->db_sock */
+static int workers_db_start(struct worker_list * wl)
+{
+    pid_t master = getpid(), pid;
+    sigset_t allsigs;
+
+    if ((pid = fork()) == 0) {
+        if (wl->main_evbase) {
+            event_reinit(wl->main_evbase);
+            event_base_free(wl->main_evbase);
+        }
+        /* Like the zygote, all it keeps is its socket */
+        if (wl->db_sock != 3 && dup2(wl->db_sock, 3) == -1) {
+            perror("dbd dup2");
+            _exit(1);
+        }
+        close_range(4, ~0U, 0);
+        /* Ctrl-C is for the master, we stop when it's gone (and commit first) */
+        signal(SIGINT, SIG_IGN);
+        signal(SIGHUP, SIG_IGN);
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != master)
+            _exit(0);
+        sigfillset(&allsigs);
+        sigprocmask(SIG_UNBLOCK, &allsigs, NULL);
+        _exit(dbd_main(3, wl->db_stats) == -1);
+    } else if (pid == -1) {
+        perror("workers_db_start fork");
+        return -1;
+    }
+
+    wl->db_pid = pid;
+    log_debug("storage process launch pid [%d] on %s", pid, db_name);
+    return 0;
+}
+
+static void workers_db_callback(evutil_socket_t fd, short what, void * data)
+{
+    struct worker_list * wl = data;
+
+    if (!wl->db_pid && workers_db_start(wl) == -1)
+        evtimer_add(wl->evdb, &(struct timeval){.tv_sec = DB_RESTART});
+}
+
+/* Stop the storage process, it commits what it has before it goes */
+static void workers_db_stop(struct worker_list * wl)
+{
+    if (wl->db_pid > 0) {
+        kill(wl->db_pid, SIGTERM);
+        while (waitpid(wl->db_pid, NULL, 0) == -1 && errno == EINTR)
+            ;
+        wl->db_pid = 0;
+    }
+    if (wl->db_sock != -1)
+        close(wl->db_sock);
+    wl->db_sock = -1;
+}
+
+/*********************************************************
+ * Workers container
+ *********************************************************/
+/* htable.free_cb() callback for wl->sets */
+static void workers_set_free(const char * name, void * data)
+{
+    struct worker_set * set = data;
+
+    htable.free(set->keys);
+    free(set);
+}
+
+static struct worker_list * workers_free(struct worker_list * wl)
+{
+    if (!wl) 
+        return NULL;
+
+    while (!SLIST_EMPTY(wl->list)) {
+        struct worker * worker = SLIST_FIRST(wl->list);
+        SLIST_REMOVE_HEAD(wl->list, next);
+
+        worker_free(worker);
+    }
+    event_free(wl->childsig);
+    event_free(wl->intsig);
+    event_free(wl->hupsig);
+    workers_zygote_stop(wl);
+    /* The workers are gone, nothing writes anymore */
+    workers_db_stop(wl);
+    if (wl->evdb)
+        event_free(wl->evdb);
+    if (wl->db_stats)
+        munmap(wl->db_stats, sizeof *wl->db_stats);
+    if (wl->evrecycle)
+        event_free(wl->evrecycle);
+    if (wl->evresume)
+        event_free(wl->evresume);
+    if (wl->evscale)
+        event_free(wl->evscale);
+    if (wl->evwatchdog)
+        event_free(wl->evwatchdog);
+    if (wl->boards)
+        munmap(wl->boards, WORKER_BOARDS * sizeof *wl->boards);
+    if (wl->cache) {
+        cache_free(wl->cache);
+        shared_cache = NULL;
+    }
+    if (wl->evstore)
+        event_free(wl->evstore);
+    if (wl->store) {
+        /* The workers are gone, nothing changes it anymore */
+        workers_state_save(wl);
+        store_free(wl->store);
+        shared_store = NULL;
+    }
+    free(wl->state_file);
+    free(wl->keys);
+    for (unsigned int lane = 0; lane < wl->nlanes; ++lane) {
+        free(wl->lanes[lane].modules);
+        if (wl->lanes[lane].held)
+            evbuffer_free(wl->lanes[lane].held);
+    }
+    if (wl->command_lanes)
+        htable.free(wl->command_lanes);
+    for (unsigned int i = 0; i < wl->nfilters; ++i)
+        for (unsigned int j = 0; j < wl->filters[i].nprefixes; ++j)
+            free(wl->filters[i].prefixes[j]);
+    match_free(wl->match);
+    if (wl->sets)
+        htable.free_cb(wl->sets, workers_set_free);
+    free(wl->list);
+    free(wl);
+    return NULL;
+}
+
+/* Scoreboard entry for a new worker: the one of the worker it replaces, else a free one (-1 if none is) */
+static int workers_board(struct worker_list * wl, pid_t child)
+{
+    bool used[WORKER_BOARDS] = {false};
+    struct worker * worker;
+    int board;
+
+    if (!wl->boards)
+        return -1;
+    SLIST_FOREACH(worker, wl->list, next) {
+        if (child > 0 && worker->pid == child)
+            return worker->board;
+        if (worker->board != -1)
+            used[worker->board] = true;
+    }
+    for (board = 0; board < WORKER_BOARDS && used[board]; ++board)
+        ;
+    return board < WORKER_BOARDS ? board : -1;
+}
+
+/* Send an event we took back from a dead worker to another one in its lane, 1 if it was one */
+static int workers_resend(struct worker_list * wl, unsigned int lane, const struct ipc_frame * frame, const unsigned char * payload)
+{
+    struct ircmsg_event ev;
+    struct ircmsg * msg;
+
+    if (frame->type != IPC_EVENT || frame->len < sizeof ev)
+        return 0;
+    memcpy(&ev, payload, sizeof ev);
+    if (sizeof ev + ev.size != frame->len || !(msg = Msg.unpack(&ev, (const char *)payload + sizeof ev)))
+        return 0;
+
+    workers_send(wl, lane, ev.server < gconfig.nservers ? gconfig.server_ids[ev.server] : NULL, msg, &ev, (const char *)payload + sizeof ev);
+    Msg.free(msg);
+    return 1;
+}
+
+static unsigned long workers_resend_buffer(struct worker_list * wl, unsigned int lane, struct evbuffer * buf)
+{
+    struct ipc_frame frame;
+    const unsigned char * payload;
+    unsigned long n = 0;
+
+    while ((payload = ipc_next(buf, &frame))) {
+        n += workers_resend(wl, lane, &frame, payload);
+        ipc_drain(buf, &frame);
+    }
+
+    return n;
+}
+
+/* Send on what waited for a worker to be done with its keys (workers_send()), they go where the keys are now */
+static void workers_release(struct worker_list * wl, struct worker * worker)
+{
+    if (worker->held && evbuffer_get_length(worker->held))
+        workers_resend_buffer(wl, worker->lane, worker->held);
+}
+
+/*
+ * Hand the events a dead worker never got to to the others, in the order
+ * it would have seen them: what's left in its ring and what waited for
+ * room in it, or on a socket the copies of what it hadn't acked minus
+ * what the scoreboard says it took on. The event it died on isn't sent
+ * on, it could take down the next one too. Without a scoreboard we can't
+ * tell that on a socket and nothing is sent on.
+ */
+static void workers_redispatch(struct worker_list * wl, struct worker * worker)
+{
+    struct worker_board * board = worker->board != -1 ? &wl->boards[worker->board] : NULL;
+    unsigned long n = 0, inflight = worker_inflight(worker);
+    struct ipc_frame frame;
+    const unsigned char * payload;
+    /* A frame is only consumed once it's handled, the one it died on is still in the ring */
+    bool skip = board && atomic_load(&board->started);
+
+    /* It's gone, we're the consumer now */
+    if (worker->tx) {
+        while ((payload = ring_peek(worker->tx, &frame))) {
+            if (skip && frame.type == IPC_EVENT)
+                skip = false;
+            else
+                n += workers_resend(wl, worker->lane, &frame, payload);
+            ring_consume(worker->tx, &frame);
+        }
+    }
+    if (worker->pending)
+        n += workers_resend_buffer(wl, worker->lane, worker->pending);
+    if (worker->unacked) {
+        worker_forget(worker, atomic_load(&board->taken) - worker->done);
+        n += workers_resend_buffer(wl, worker->lane, worker->unacked);
+    }
+
+    if (inflight)
+        log_debug("[debug] worker[%d] had %lu events in flight, %lu sent to other workers", worker->pid, inflight, n);
+}
+
+/* Event types modules register handlers for (event_register() in base.pm), the ones we route */
+static bool mod_event_routed(enum ircmsg_type type)
+{
+    return type == IRC_PRIVMSG || type == IRC_NOTICE || type == IRC_JOIN;
+}
+
+/* Lane by name, lanes that aren't configured are the default one */
+static unsigned int workers_lane(struct worker_list * wl, const char * name)
+{
+    for (unsigned int lane = 0; lane < wl->nlanes; ++lane)
+        if (!strcmp(wl->lanes[lane].name, name))
+            return lane;
+    return WORKER_LANE_DEFAULT;
+}
+
+/* mod_perl_lanes() callback, where a module put one of its commands or events */
+static void workers_lane_route(void * data, const char * kind, const char * name, const char * lane)
+{
+    struct worker_list * wl = data;
+    unsigned int n = workers_lane(wl, lane);
+    enum ircmsg_type type;
+
+    if (!strcmp(kind, "command")) {
+        htable.store(wl->command_lanes, name, (void *)(intptr_t)(n + 1));
+        return;
+    }
+    if (mod_event_routed(type = Msg.command_type(name)))
+        wl->type_lanes[type] |= 1u << n;
+}
+
+/* A set filters look in, made the first time one does */
+static struct worker_set * workers_set(struct worker_list * wl, const char * name)
+{
+    struct worker_set * set;
+
+    if ( (set = htable.lookup(wl->sets, name)) )
+        return set;
+    if ( !(set = calloc(1, sizeof *set)) || !(set->keys = htable.new(64)) ) {
+        free(set);
+        return NULL;
+    }
+    htable.store(wl->sets, name, set);
+    return set;
+}
+
+/* mod_perl_filters() callback, one predicate of a filtered handler */
+static void workers_filter_add(void * data, const char * event, unsigned int tag, const char * lane, const char * kind, const char * arg)
+{
+    struct worker_list * wl = data;
+    enum ircmsg_type type = Msg.command_type(event);
+    unsigned int n = workers_lane(wl, lane), i;
+    struct worker_filter * filter;
+    struct worker_set ** set = NULL;
 
-		sigset_t allsigs;
-		sigfillset(&allsigs);
-		sigprocmask(SIG_UNBLOCK, &allsigs, NULL);
-        /* Begin main loop */
-        event_base_dispatch(ctx.base);
+    if (!mod_event_routed(type) || tag >= 31)
+        return;
+    /* Handlers that hash to the same bit in a lane share one */
+    for (i = 0; i < wl->nfilters; ++i)
+        if (wl->filters[i].type == type && wl->filters[i].lane == n && wl->filters[i].tag == tag)
+            break;
+    if (i == WORKER_FILTERS)
+        goto unfiltered;
+    filter = &wl->filters[i];
+    if (i == wl->nfilters) {
+        *filter = (struct worker_filter){.type = type, .lane = n, .tag = tag};
+        wl->type_filters[type] |= 1u << i;
+        ++wl->nfilters;
+    }
 
-        /* Cleanup */
-        bufferevent_free(ctx.evsock);
-        event_free(ctx.evsigint);
-        event_base_free(ctx.base);
-    } while(ctx.restart_loop);
+    if (!strcmp(kind, "contains")) {
+        if (match_add(wl->match, arg, i) == -1)
+            goto unfiltered;
+        wl->contains |= 1u << i;
+        return;
+    }
+    if (!strcmp(kind, "prefix")) {
+        if (filter->nprefixes == WORKER_FILTER_PREFIXES || !(filter->prefixes[filter->nprefixes] = strdup(arg)))
+            goto unfiltered;
+        ++filter->nprefixes;
+        return;
+    }
+    if (!strcmp(kind, "nick_in"))
+        set = &filter->nicks;
+    else if (!strcmp(kind, "source_in"))
+        set = &filter->sources;
+    /* One set of each kind */
+    if (set && (!*set || *set == htable.lookup(wl->sets, arg)) && (*set = workers_set(wl, arg)))
+        return;
 
-    close(sock);
+unfiltered:
+    /* Can't check it for the handler, it gets all of them */
+    log_debug("[debug] can't filter %s for %s on %s %s, it gets every one", event, lane, kind, arg);
+    wl->type_lanes[type] |= 1u << n;
+    wl->type_matched[type] |= 1u << tag;
 }
 
-/*********************************************************
- * Workers container
- *********************************************************/
-static struct worker_list * workers_free(struct worker_list * wl)
+/*
+ * Where every handler goes, out of our own interpreter: the lanes of
+ * commands and events, and the filters of handlers that only want some
+ * events, their strings compiled into one matcher
+ */
+static void workers_routes(struct worker_list * wl)
 {
-    if (!wl) 
-        return NULL;
-
-    while (!SLIST_EMPTY(wl->list)) {
-        struct worker * worker = SLIST_FIRST(wl->list);
-        SLIST_REMOVE_HEAD(wl->list, next);
+    if ( !(wl->command_lanes = htable.new(128)) || !(wl->sets = htable.new(16)) || !(wl->match = match_new()) )
+        return;
+    if (mod_perl_lanes(workers_lane_route, wl) == -1 || mod_perl_filters(workers_filter_add, wl) == -1
+            || match_compile(wl->match) == -1) {
+        log_debug("WARNING can't tell which events the modules want, sending them all");
+        return;
+    }
+    log_debug("[debug] %u filtered handlers", wl->nfilters);
+    wl->routed = true;
+}
 
-        worker_free(worker);
+/*
+ * Set up the lanes from config ("<name>:<workers> ..."), lane 0 is the
+ * default one, sized by workers_min. What goes to which lane is up to
+ * where the modules in our own interpreter registered their handlers
+ */
+static void workers_lanes(struct worker_list * wl, const char * conf)
+{
+    struct worker_lane * lane;
+    char name[sizeof lane->name];
+    unsigned int n;
+    int len;
+
+    wl->nlanes = 1;
+    lane = &wl->lanes[WORKER_LANE_DEFAULT];
+    strcpy(lane->name, "default");
+    lane->want = wl->min_workers;
+
+    for (; conf && *(conf += strspn(conf, " \t,")); conf += len) {
+        n = 1;
+        if (sscanf(conf, "%31[^:, \t]%n:%u%n", name, &len, &n, &len) < 1)
+            break;
+        if (workers_lane(wl, name) != WORKER_LANE_DEFAULT || !strcmp(name, "default")) {
+            log_debug("[debug] lane '%s' is already there", name);
+            continue;
+        }
+        if (wl->nlanes == WORKER_LANES) {
+            log_debug("[debug] only %d lanes besides the default one, ignoring '%s'", WORKER_LANES - 1, name);
+            break;
+        }
+        lane = &wl->lanes[wl->nlanes++];
+        strcpy(lane->name, name);
+        lane->want = n < 1 ? 1 : n > WORKERS_LIMIT ? WORKERS_LIMIT : n;
     }
-    event_free(wl->childsig);
-    event_free(wl->intsig);
-    event_free(wl->hupsig);
-    free(wl->list);
-    free(wl);
-    return NULL;
+    /* Just the default lane, every worker loads everything */
+    for (n = 0; wl->nlanes > 1 && n < wl->nlanes; ++n) {
+        lane = &wl->lanes[n];
+        if ( !(lane->modules = mod_perl_lane_modules(lane->name)) ) {
+            log_debug("WARNING can't tell which modules lane %s needs, not using lanes", lane->name);
+            while (n--) {
+                free(wl->lanes[n].modules);
+                wl->lanes[n].modules = NULL;
+            }
+            wl->nlanes = 1;
+            break;
+        }
+        log_debug("[debug] lane %s: %zu workers, modules: %s", lane->name, lane->want, lane->modules);
+    }
+    workers_routes(wl);
+}
+
+/* A lane short of workers, 'prefer' if it is one, -1 if they all have theirs */
+static int workers_lacking(struct worker_list * wl, int prefer)
+{
+    if (prefer != -1 && wl->lanes[prefer].active < wl->lanes[prefer].want)
+        return prefer;
+    for (unsigned int lane = 0; lane < wl->nlanes; ++lane)
+        if (wl->lanes[lane].active < wl->lanes[lane].want)
+            return lane;
+    return -1;
 }
 
 struct worker_list * workers_fork(struct event_base * evbase, register struct worker_list * wl, pid_t child)
 {
     struct worker * worker;
+    int board, lane = -1;
 
     if (!wl) {
         if (!(wl = malloc(sizeof *wl))) {
@@ -371,23 +2015,164 @@ struct worker_list * workers_fork(struct event_base * evbase, register struct wo
             goto error;
         }
         SLIST_INIT(wl->list);
+
+        const char * ipc = mod_conf_get("ipc");
+        const char * queue = mod_conf_get("worker_queue");
+        const char * overflow = mod_conf_get("overflow");
+        const char * dispatch = mod_conf_get("dispatch");
+        const char * min = mod_conf_get("workers_min");
+        const char * max = mod_conf_get("workers_max");
+        const char * latency = mod_conf_get("scale_latency");
+        const char * inflight = mod_conf_get("scale_inflight");
+        const char * idle = mod_conf_get("scale_idle");
+        const char * requests = mod_conf_get("max_requests");
+        const char * rss = mod_conf_get("max_rss");
+        const char * zygote = mod_conf_get("zygote");
+        const char * deadline = mod_conf_get("deadline");
+        const char * kill_hung = mod_conf_get("kill_hung");
+        const char * lanes = mod_conf_get("lanes");
+        const char * cache = mod_conf_get("http_cache");
+        const char * state = mod_conf_get("state_size");
+        const char * state_file = mod_conf_get("state_file");
+
+        wl->use_rings = ipc && !strcmp(ipc, "rings");
+        wl->queue_max = queue ? strtoul(queue, NULL, 10) : WORKER_QUEUE_MAX;
+        for (wl->overflow = WORKER_SKIP; overflow && wl->overflow < WORKER_OVERFLOW_MAX; ++wl->overflow)
+            if (!strcmp(overflow, worker_overflow_names[wl->overflow]))
+                break;
+        if (wl->overflow == WORKER_OVERFLOW_MAX) {
+            log_debug("[debug] unknown overflow policy '%s', using skip", overflow);
+            wl->overflow = WORKER_SKIP;
+        }
+        for (wl->dispatch = WORKER_ROUND_ROBIN; dispatch && wl->dispatch < WORKER_DISPATCH_MAX; ++wl->dispatch)
+            if (!strcmp(dispatch, worker_dispatch_names[wl->dispatch]))
+                break;
+        if (wl->dispatch == WORKER_DISPATCH_MAX) {
+            log_debug("[debug] unknown dispatch mode '%s', using round_robin", dispatch);
+            wl->dispatch = WORKER_ROUND_ROBIN;
+        }
+        if (wl->dispatch == WORKER_AFFINITY && !(wl->keys = calloc(WORKER_KEYS, sizeof *wl->keys))) {
+            perror("workers_init calloc");
+            goto error;
+        }
+
+        /* No workers_max means a fixed size pool */
+        wl->min_workers = min ? strtoul(min, NULL, 10) : MAX_WORKERS;
+        wl->min_workers = wl->min_workers < 1 ? 1 : wl->min_workers > WORKERS_LIMIT ? WORKERS_LIMIT : wl->min_workers;
+        wl->max_workers = max ? strtoul(max, NULL, 10) : wl->min_workers;
+        wl->max_workers = wl->max_workers < wl->min_workers ? wl->min_workers : wl->max_workers > WORKERS_LIMIT ? WORKERS_LIMIT : wl->max_workers;
+        workers_lanes(wl, lanes);
+        wl->scale_latency = (latency ? strtoull(latency, NULL, 10) : WORKER_SCALE_LATENCY) * 1000;
+        wl->scale_inflight = inflight ? strtoul(inflight, NULL, 10) : WORKER_SCALE_INFLIGHT;
+        wl->scale_idle = (idle ? strtoull(idle, NULL, 10) : WORKER_SCALE_IDLE) * 1000000;
+        wl->max_requests = requests ? strtoul(requests, NULL, 10) : MAX_REQUESTS;
+        wl->max_rss = rss ? strtoull(rss, NULL, 10) << 20 : 0; /* MB */
+        wl->deadline = (deadline ? strtoull(deadline, NULL, 10) : WORKER_DEADLINE) * 1000000;
+        wl->kill_hung = kill_hung && strtol(kill_hung, NULL, 10);
+
+        /* Before any fork (the zygote's too), so every worker maps the same ones */
+        if (wl->deadline) {
+            wl->boards = mmap(NULL, WORKER_BOARDS * sizeof *wl->boards, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (wl->boards == MAP_FAILED) {
+                perror("workers_init mmap");
+                wl->boards = NULL;
+            }
+        }
+        if (!cache || strtoul(cache, NULL, 10))
+            shared_cache = wl->cache = cache_new(cache ? strtoull(cache, NULL, 10) << 20 : CACHE_SIZE); /* MB */
+        if (!state || strtoul(state, NULL, 10))
+            shared_store = wl->store = store_new(state ? strtoull(state, NULL, 10) << 20 : STORE_SIZE); /* MB */
+        if (wl->store && state_file && *state_file) {
+            wl->state_file = strdup(state_file);
+            if (store_load(wl->store, state_file) == -1)
+                log_debug("WARNING can't load the state snapshot %s", state_file);
+            wl->state_saved = store_version(wl->store);
+        }
+
+        /* Its address goes to every worker, the zygote doesn't need its socket */
+        snprintf(db_name, sizeof db_name, "machine-db.%d", getpid());
+        if ((wl->db_sock = db_listen(db_name)) == -1) {
+            log_debug("WARNING no storage process, modules can't use their databases");
+            *db_name = '\0';
+        } else {
+            wl->db_stats = mmap(NULL, sizeof *wl->db_stats, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+            if (wl->db_stats == MAP_FAILED)
+                wl->db_stats = NULL;
+            wl->evdb = evtimer_new(evbase, workers_db_callback, wl);
+            workers_db_start(wl);
+        }
+
+        /* We just fork them ourselves if this doesn't work out */
+        if (zygote && strtol(zygote, NULL, 10))
+            workers_zygote(wl);
     }
 
+    /* Queries wait for the new one in its socket's backlog meanwhile */
+    if (child > 0 && child == wl->db_pid) {
+        log_debug("WARNING storage process [%d] died, starting another in %d s", child, DB_RESTART);
+        wl->db_pid = 0;
+        ++wl->db_restarts;
+        evtimer_add(wl->evdb, &(struct timeval){.tv_sec = DB_RESTART});
+        return wl;
+    }
     /* We got called from SIGCHLD we need to fork a new child */
-    if (child > 0) 
-        --wl->active_workers;
+    if (child > 0 && child == wl->zygote_pid) {
+        log_debug("WARNING zygote [%d] died, forking workers ourselves", child);
+        workers_zygote_stop(wl);
+        return wl;
+    }
+    if (child > 0) {
+        SLIST_FOREACH(worker, wl->list, next)
+            if (worker->pid == child)
+                break;
+        /* One we retired (workers_retire()), it stays gone */
+        if (!worker) {
+            log_debug("reaped retired worker[%d]", child);
+            return wl;
+        }
+        /* Out of the rotation, then what it had queued goes to the others */
+        if (worker->state != WORKER_DRAINING)
+            worker->state = WORKER_GONE;
+        wl->dying = worker;
+        workers_redispatch(wl, worker);
+        /* And after it what waited for its keys */
+        workers_release(wl, worker);
+        wl->dying = NULL;
+        /* Died while draining, its replacement is already running */
+        if (worker->state == WORKER_DRAINING) {
+            log_debug("WARNING draining worker[%d] died with %lu events in flight", child, worker_inflight(worker));
+            workers_unlink(wl, worker);
+            worker_detach(worker);
+            free(worker);
+            return wl;
+        }
+        lane = worker->lane;
+        --wl->lanes[lane].active;
+    }
 
-    for (; wl->active_workers < MAX_WORKERS; ++wl->active_workers) {
+    /* Its own lane first, so a dead worker's container goes to its replacement */
+    while ((lane = workers_lacking(wl, lane)) != -1) {
         int sockpair[2];
+        struct ring * tx = NULL, * rx = NULL;
         pid_t pid;
 
         if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockpair) == -1) {
             perror("workers_init socketpair");
             goto error;
         }
+        /* The rings have to exist before the fork so both of us map them */
+        if (wl->use_rings && (!(tx = ring_new(RING_SIZE)) || !(rx = ring_new(RING_SIZE)))) {
+            ring_free(tx);
+            tx = NULL; /* Just use the socket for this one */
+        }
+
+        /* Its watchdog entry starts out clean */
+        if ((board = workers_board(wl, child)) != -1)
+            memset(&wl->boards[board], 0, sizeof wl->boards[board]);
 
-        /* Fork */
-        pid = fork();
+        /* Fork, or have the zygote do it */
+        if (wl->zygote == -1 || (pid = workers_zygote_spawn(wl, sockpair[0], tx, rx, board, lane)) == -1)
+            pid = fork();
         if (pid == 0) {
             /******************
              * Child process *
@@ -401,17 +2186,15 @@ struct worker_list * workers_fork(struct event_base * evbase, register struct wo
             }
             /* Close parents end of the socket */
             close(sockpair[1]);
-            printf("\n"); // TODO Flush stdout for some reason this is necessary?
-            /* Dup stdout in our child to the other end of our socket */
-            if (dup2(sockpair[0], STDOUT_FILENO) == -1) {
-                perror("workers_init dup2");
-                goto error;
-            }
-
-            /* Call our child function */
-            worker_init(sockpair[0]);
-
-            exit(0);
+            if (wl->zygote != -1)
+                close(wl->zygote);
+            if (wl->db_sock != -1)
+                close(wl->db_sock);
+            worker_servers_reset();
+            if (wl->nlanes > 1)
+                mod_perl_lane(wl->lanes[lane].name, wl->lanes[lane].modules);
+
+            worker_child(sockpair[0], tx, rx, board == -1 ? NULL : &wl->boards[board], false);
         } else if (pid == -1) {
             perror("worker_init fork");
             goto error;
@@ -428,12 +2211,8 @@ struct worker_list * workers_fork(struct event_base * evbase, register struct wo
                 SLIST_FOREACH(worker, wl->list, next) {
                     if (worker->pid == child) {
 
-                        /* Free our old bufferevent and get a new one for the new socket */
-                        bufferevent_free(worker->bev);
-                        close(worker->sock);
-                        worker->bev = bufferevent_socket_new(wl->main_evbase, sockpair[1], 0);
-                        bufferevent_setcb(worker->bev, parent_event_callback, NULL, NULL, wl);
-                        bufferevent_enable(worker->bev, EV_READ);
+                        /* Free our old channels, new ones get attached below */
+                        worker_detach(worker);
                         log_debug("reusing old worker[%d] container for new worker[%d]->bev[%p] with socket: %d", 
                                 child, worker->pid, worker->bev, worker->sock);
                         break;
@@ -444,6 +2223,7 @@ struct worker_list * workers_fork(struct event_base * evbase, register struct wo
                     break;
                 /* If we got here, we are probably in trouble.. */
                 log_debug("WARNING we didn't find a container for pid: %d", child);
+                child = 0;
             }
 
             worker = malloc(sizeof *worker);
@@ -452,6 +2232,7 @@ struct worker_list * workers_fork(struct event_base * evbase, register struct wo
                 goto error;
             }
             *worker = worker_initializer;
+            worker->slot = wl->slots++;
             SLIST_INSERT_HEAD(wl->list, worker, next);
 
             log_debug("inserted new worker [%p]", worker);
@@ -459,10 +2240,26 @@ struct worker_list * workers_fork(struct event_base * evbase, register struct wo
 
         close(sockpair[0]); /* Close childs side of the socket */
         worker->pid = pid;
+        worker->lane = lane;
+        worker->board = board;
         worker->sock = sockpair[1]; 
-        log_debug("worker launch pid [%d] socket fd[%d]", worker->pid, worker->sock);
+        worker->tx = tx;
+        worker->rx = tx ? rx : NULL;
+        worker_attach(wl, worker);
+        log_debug("worker launch pid [%d] socket fd[%d] rings: %s", worker->pid, worker->sock, worker->tx ? "yes" : "no");
+
+        /* A replacement needs to know the servers we already have */
+        for (unsigned short id = 0; id < gconfig.nservers; ++id)
+            if (gconfig.server_ids[id])
+                worker_send_server(worker, gconfig.server_ids[id]);
+        ++wl->lanes[lane].active;
     }
 
+    /* What a lane's only worker left behind goes to its replacement */
+    for (lane = 0; lane < (int)wl->nlanes; ++lane)
+        if (wl->lanes[lane].held && evbuffer_get_length(wl->lanes[lane].held))
+            workers_resend_buffer(wl, lane, wl->lanes[lane].held);
+
     return wl;
 
 error:
@@ -470,6 +2267,213 @@ error:
     return NULL;
 }
 
+/* Stop reading from 'server' until the workers catch up */
+static void workers_pause(struct worker_list * wl, struct server * server)
+{
+    if (!server || server->paused)
+        return;
+
+    log_debug("[debug] workers backed up, pausing %s", server->name);
+    server->paused = true;
+    Con.pause(server->con, 1);
+    ++wl->pauses;
+
+    if (!evtimer_pending(wl->evresume, NULL))
+        evtimer_add(wl->evresume, &(struct timeval){.tv_usec = WORKER_RESUME_CHECK});
+}
+
+static void workers_resume_callback(evutil_socket_t fd, short what, void * data)
+{
+    struct worker_list * wl = data;
+    struct worker * worker;
+    unsigned short id;
+
+    /* Wait until they're all down to half the limit */
+    SLIST_FOREACH(worker, wl->list, next) {
+        if (worker_queued(worker) > wl->queue_max / 2) {
+            evtimer_add(wl->evresume, &(struct timeval){.tv_usec = WORKER_RESUME_CHECK});
+            return;
+        }
+    }
+
+    for (id = 0; id < gconfig.nservers; ++id) {
+        struct server * server = gconfig.server_ids[id];
+
+        if (server && server->paused) {
+            log_debug("[debug] resuming %s", server->name);
+            server->paused = false;
+            Con.pause(server->con, 0);
+        }
+    }
+}
+
+/* Take a worker out of the pool for good, SIGCHLD won't bring it back */
+static void workers_retire(struct worker_list * wl, struct worker * worker)
+{
+    log_debug("[debug] retiring idle worker[%d], %zu left", worker->pid, wl->lanes[worker->lane].active - 1);
+    --wl->lanes[worker->lane].active;
+    --wl->lanes[worker->lane].want;
+    workers_remove(wl, worker);
+}
+
+/*
+ * Replace a worker: it stops getting events, its replacement gets
+ * forked (into the same slot, so affinity keys stay put) and it is
+ * reaped by workers_reap_callback() once it acked everything it has.
+ * Events for the keys it still has in flight wait in the master until
+ * then, so the two never run a key's events at the same time
+ */
+static void workers_recycle(struct worker_list * wl, struct worker * worker, const char * why)
+{
+    struct worker * replacement;
+
+    log_debug("[debug] recycling worker[%d] (%s) with %lu events in flight", worker->pid, why, worker_inflight(worker));
+    worker->state = WORKER_DRAINING;
+    --wl->lanes[worker->lane].active;
+    if (!workers_fork(wl->main_evbase, wl, 0))
+        return;
+    /* New containers go in at the head */
+    replacement = SLIST_FIRST(wl->list);
+    if (replacement != worker)
+        replacement->slot = worker->slot;
+}
+
+/* Let go of the draining workers that finished everything, batch handlers included (worker_batch_run()) */
+static void workers_reap_callback(evutil_socket_t fd, short what, void * data)
+{
+    struct worker_list * wl = data;
+    struct worker * worker, * next;
+
+    for (worker = SLIST_FIRST(wl->list); worker; worker = next) {
+        next = SLIST_NEXT(worker, next);
+        if (worker->state == WORKER_DRAINING && !worker_inflight(worker)) {
+            log_debug("[debug] worker[%d] drained, letting it go", worker->pid);
+            workers_release(wl, worker);
+            workers_remove(wl, worker);
+        }
+    }
+}
+
+/* Recycle workers that handled max_requests events or grew past max_rss */
+static void workers_recycle_callback(evutil_socket_t fd, short what, void * data)
+{
+    struct worker_list * wl = data;
+    struct worker * worker, * next;
+
+    for (worker = SLIST_FIRST(wl->list); worker; worker = next) {
+        next = SLIST_NEXT(worker, next);
+        if (worker->state != WORKER_ACTIVE)
+            continue;
+        /* One at a time, so they don't all start over at once */
+        if (wl->max_requests && worker->done >= wl->max_requests) {
+            workers_recycle(wl, worker, "max_requests");
+            ++wl->recycled;
+            break;
+        }
+        if (wl->max_rss && worker_rss(worker) > wl->max_rss) {
+            workers_recycle(wl, worker, "max_rss");
+            ++wl->recycled;
+            break;
+        }
+    }
+
+    workers_reap_callback(fd, what, data);
+}
+
+/*
+ * Fork another worker once every one of them has been busy for a while,
+ * retire one that has sat idle for scale_idle while we're above the minimum.
+ * Only the default lane scales, the others keep the size they were given
+ */
+static void workers_scale_callback(evutil_socket_t fd, short what, void * data)
+{
+    struct worker_list * wl = data;
+    struct worker_lane * pool = &wl->lanes[WORKER_LANE_DEFAULT];
+    struct worker * worker, * idlest = NULL;
+    uint64_t now = mod_usec();
+    bool busy = true;
+
+    SLIST_FOREACH(worker, wl->list, next) {
+        if (worker->state != WORKER_ACTIVE || worker->lane != WORKER_LANE_DEFAULT)
+            continue;
+        if (worker_age(worker, now) < wl->scale_latency && worker_inflight(worker) < wl->scale_inflight)
+            busy = false;
+
+        if (worker_inflight(worker))
+            worker->idle_since = 0;
+        else if (!worker->idle_since)
+            worker->idle_since = now;
+        if (worker->idle_since && (!idlest || worker->idle_since < idlest->idle_since))
+            idlest = worker;
+    }
+
+    wl->overloaded = busy ? wl->overloaded + 1 : 0;
+    if (wl->overloaded >= WORKER_SCALE_SUSTAIN && pool->want < wl->max_workers) {
+        log_debug("[debug] all %zu workers busy, adding one", pool->active);
+        wl->overloaded = 0;
+        ++pool->want;
+        workers_fork(wl->main_evbase, wl, 0);
+    } else if (!busy && idlest && pool->want > wl->min_workers && pool->active == pool->want
+            && now - idlest->idle_since >= wl->scale_idle) {
+        workers_retire(wl, idlest);
+    }
+}
+
+/*
+ * Look for workers stuck on one event past the deadline, or whose event
+ * loop stopped coming around. They get reported with the handler they're
+ * in and, with kill_hung, killed: SIGCHLD brings a new one into the slot
+ * and what the old one had queued goes to the others (workers_redispatch())
+ */
+static void workers_watchdog_callback(evutil_socket_t fd, short what, void * data)
+{
+    struct worker_list * wl = data;
+    struct worker * worker;
+    struct worker_board * board;
+    char handler[WORKER_HANDLER_MAX];
+    uint64_t now = mod_usec(), started, beat;
+
+    SLIST_FOREACH(worker, wl->list, next) {
+        /* Loading an interpreter takes a while, it isn't beating then */
+        if (worker->board == -1 || !worker->ready || worker->state == WORKER_LOADING || worker->state == WORKER_GONE)
+            continue;
+        board = &wl->boards[worker->board];
+        started = atomic_load(&board->started);
+        beat = atomic_load(&board->beat);
+        if (now - (started ? started : beat) < wl->deadline || worker->reported == (started ? started : beat))
+            continue;
+        worker->reported = started ? started : beat;
+        ++wl->hung;
+
+        memcpy(handler, board->handler, sizeof handler);
+        handler[sizeof handler - 1] = '\0';
+        if (started)
+            log_debug("WARNING worker[%d] stuck in %s for %.1f s with %lu events in flight", worker->pid,
+                    *handler ? handler : "an event", (now - started) / 1000000.0, worker_inflight(worker));
+        else
+            log_debug("WARNING worker[%d] missed its heartbeat for %.1f s", worker->pid, (now - beat) / 1000000.0);
+
+        if (!wl->kill_hung)
+            continue;
+        log_debug("[debug] killing hung worker[%d]", worker->pid);
+        /* A draining one isn't replaced, it has been already */
+        if (worker->state != WORKER_DRAINING)
+            worker->state = WORKER_GONE;
+        kill(worker->pid, SIGKILL);
+    }
+}
+
+/* Drop the store's expired keys, and snapshot it if it changed since the last time */
+static void workers_store_callback(evutil_socket_t fd, short what, void * data)
+{
+    struct worker_list * wl = data;
+    unsigned long expired = store_expire(wl->store);
+
+    if (expired)
+        log_debug("[debug] state: %lu keys expired", expired);
+    workers_state_save(wl);
+}
+
 int mod_conf_init(void) {
 	/* perl for global config reading */
 	mod_perl_reinit();
@@ -488,12 +2492,8 @@ int mod_initialize(struct event_base * evbase)
     /* TODO */
     /* Init our worker modules, each of wich has it's own perl interpreter  */
     worker_list = workers_fork(evbase, NULL, 0);
-    /* Init the Listeners for each child on the parent side */
-    /* Recreate any bufferevents if necessary */
+    /* The listeners for each child on the parent side got attached as they were forked */
     SLIST_FOREACH(worker, worker_list->list, next) {
-        worker->bev = bufferevent_socket_new(evbase, worker->sock, 0);
-        bufferevent_setcb(worker->bev, parent_event_callback, NULL, NULL, worker_list);
-        bufferevent_enable(worker->bev, EV_READ);
         log_debug("worker[%d]->bev[%p] with socket: %d", 
                 worker->pid, worker->bev, worker->sock);
     }
@@ -504,6 +2504,24 @@ int mod_initialize(struct event_base * evbase)
     event_add(worker_list->childsig, NULL);
     event_add(worker_list->intsig, NULL);
     event_add(worker_list->hupsig, NULL);
+    worker_list->evresume = evtimer_new(evbase, workers_resume_callback, worker_list);
+    if (worker_list->max_requests || worker_list->max_rss) {
+        worker_list->evrecycle = event_new(evbase, -1, EV_PERSIST, workers_recycle_callback, worker_list);
+        evtimer_add(worker_list->evrecycle, &(struct timeval){.tv_sec = WORKER_RECYCLE_CHECK});
+    }
+    if (worker_list->boards) {
+        worker_list->evwatchdog = event_new(evbase, -1, EV_PERSIST, workers_watchdog_callback, worker_list);
+        evtimer_add(worker_list->evwatchdog, &(struct timeval){.tv_sec = WORKER_HEARTBEAT});
+    }
+    if (worker_list->store) {
+        worker_list->evstore = event_new(evbase, -1, EV_PERSIST, workers_store_callback, worker_list);
+        evtimer_add(worker_list->evstore, &(struct timeval){.tv_sec = STORE_SWEEP});
+    }
+    /* Only an elastic pool needs watching */
+    if (worker_list->max_workers > worker_list->min_workers) {
+        worker_list->evscale = event_new(evbase, -1, EV_PERSIST, workers_scale_callback, worker_list);
+        evtimer_add(worker_list->evscale, &(struct timeval){.tv_usec = WORKER_SCALE_CHECK});
+    }
 
     return 1;
 }
@@ -533,31 +2551,385 @@ void mod_conf_foreach(const char * key, void (*cb)(const char * key, const char
 
 int mod_dispatch(struct irc * event)
 {
+    /* The event is released by whoever dispatched it (irc.dispatch*) */
     mod_perl_dispatch(event);
-    /* Release the memory associated with our event */
-    irc.free(event);     
     return 0;
 }
 
-void mod_round_robin(struct server * server, const char * line)
+/* Let every worker know about a new server (its id, name and nick) */
+void mod_server_announce(struct server * server)
 {
-    char * data;
-    bool try_again;
-    /* Send our event to the current child in our round-robin scheme */
-    do {
-        size_t linesize;
-        try_again = false;
-        worker_list->current = 
-            worker_list->current ? worker_list->current : SLIST_FIRST(worker_list->list);
+    struct worker * worker;
+
+    SLIST_FOREACH(worker, worker_list->list, next)
+        if (worker->pid > 0 && worker_send_server(worker, server) == -1)
+            perror("mod_server_announce send");
+}
+
+/* Events a worker has to see even when it is backed up */
+static bool mod_event_urgent(const struct ircmsg_event * ev)
+{
+    return ev->type == IRC_PING || ev->type == IRC_NUMERIC || ev->type == IRC_ERROR;
+}
+
+/*
+ * Next child of a lane in our round-robin scheme, ones that aren't active
+ * are passed over. With none active it's one of the lane's anyway
+ */
+static struct worker * workers_next(struct worker_list * wl, unsigned int lane)
+{
+    struct worker_lane * pool = &wl->lanes[lane];
+    struct worker * worker = pool->current ? pool->current : SLIST_FIRST(wl->list), * first = worker, * any = NULL;
+
+    while (worker->state != WORKER_ACTIVE || worker->lane != lane) {
+        if (!any && worker->lane == lane)
+            any = worker;
+        worker = SLIST_NEXT(worker, next) ? SLIST_NEXT(worker, next) : SLIST_FIRST(wl->list);
+        if (worker == first) {
+            worker = any ? any : first;
+            break;
+        }
+    }
+
+    pool->current = SLIST_NEXT(worker, next);
+    return worker;
+}
+
+static inline bool mod_is_channel(const char * s)
+{
+    return s && (*s == '#' || *s == '&' || *s == '+' || *s == '!');
+}
+
+/*
+ * What an event is ordered by: the first channel it mentions, else
+ * who sent it (private messages, QUIT, NICK), else nothing (server
+ * messages, which then all go to the same worker)
+ */
+static const char * mod_affinity_key(struct ircmsg * msg)
+{
+    const char * arg;
+    int i;
+
+    for (i = 0; (arg = Msg.argv(msg, i)); ++i)
+        if (mod_is_channel(arg))
+            return arg;
+    if (Msg.type(msg) == IRC_JOIN && mod_is_channel(Msg.text(msg)))
+        return Msg.text(msg);
+    if ( (arg = Msg.nick(msg)) )
+        return arg;
+
+    return "";
+}
+
+static inline uint64_t mod_mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* The worker an affinity key's last event is still in flight on, NULL once it acked it */
+static struct worker * workers_key_owner(struct worker_list * wl, unsigned int lane, const struct worker_key * key)
+{
+    struct worker * worker;
+
+    if (!key->pid)
+        return NULL;
+    SLIST_FOREACH(worker, wl->list, next)
+        if (worker->pid == key->pid)
+            break;
+    if (!worker || worker == wl->dying || worker->lane != lane || worker->done >= key->sent)
+        return NULL;
+    return worker;
+}
+
+/*
+ * Rendezvous hashing: every worker slot scores the key and the highest
+ * wins. A key stays with its worker for as long as that slot exists and
+ * adding or removing a slot only moves the keys that slot wins or loses.
+ * A key that moves only does once its old worker acked the last event
+ * it sent there, until then it keeps following it ('track' is where we
+ * remember that, workers_send() updates it)
+ */
+static struct worker * workers_affinity(struct worker_list * wl, unsigned int lane, unsigned short server, const char * key,
+        struct worker_key ** track)
+{
+    struct worker * worker, * best = NULL, * owner;
+    uint64_t h = 1469598103934665603ULL ^ server, score, top = 0;
+
+    /* FNV-1a, case folded since IRC names are case insensitive */
+    for (; *key; ++key)
+        h = (h ^ (unsigned char)tolower((unsigned char)*key)) * 1099511628211ULL;
+    /* Each lane has its own workers for the same key */
+    *track = &wl->keys[mod_mix64(h ^ lane) % WORKER_KEYS];
+
+    SLIST_FOREACH(worker, wl->list, next) {
+        if (worker->state != WORKER_ACTIVE || worker->lane != lane)
+            continue;
+        score = mod_mix64(h ^ (0x9e3779b97f4a7c15ULL * (worker->slot + 1)));
+        if (!best || score > top) {
+            best = worker;
+            top = score;
+        }
+    }
+
+    if ((!best || best->pid != (*track)->pid) && (owner = workers_key_owner(wl, lane, *track)))
+        return owner;
+    return best ? best : workers_next(wl, lane);
+}
 
-        xsprintf(&data, "S%s %s\n%zn", server->name, line, &linesize); 
-//        log_debug("mod_round_robin dispatch: [%s]", data);
-        if (send(worker_list->current->sock, data, linesize, 0) == -1) {
-            perror("mod_round_robin send");
-            try_again = true;
+/*
+ * Fewest events in flight wins, unless it's been stuck on one for a while,
+ * a worker in a slow handler is worse than one with a few quick ones queued.
+ * Ties go to the one with the younger queue
+ */
+static inline bool worker_less_loaded(struct worker * a, struct worker * b, uint64_t now)
+{
+    uint64_t age_a = worker_age(a, now), age_b = worker_age(b, now);
+
+    if ((age_a >= WORKER_STALLED) != (age_b >= WORKER_STALLED))
+        return age_a < WORKER_STALLED;
+    if (worker_inflight(a) != worker_inflight(b))
+        return worker_inflight(a) < worker_inflight(b);
+    return age_a < age_b;
+}
+
+/* Least loaded worker, the scan starts at the round-robin pointer so idle ones take turns */
+static struct worker * workers_least(struct worker_list * wl, unsigned int lane)
+{
+    struct worker * worker, * first, * best;
+    uint64_t now = mod_usec();
+
+    best = first = workers_next(wl, lane);
+    for (worker = workers_next(wl, lane); worker != first; worker = workers_next(wl, lane))
+        if (worker_less_loaded(worker, best, now))
+            best = worker;
+    wl->lanes[lane].current = SLIST_NEXT(first, next);
+
+    return best;
+}
+
+/* Power of two choices, the less loaded of two random workers */
+static struct worker * workers_p2c(struct worker_list * wl, unsigned int lane)
+{
+    static uint64_t x = 0x2545f4914f6cdd1dULL;
+    struct worker * worker, * a = NULL, * b = NULL;
+    unsigned int i, n = 0, pick;
+
+    SLIST_FOREACH(worker, wl->list, next)
+        n += worker->state == WORKER_ACTIVE && worker->lane == lane;
+    if (n < 2)
+        return workers_next(wl, lane);
+
+    /* xorshift64, no need for anything better */
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    pick = x % (n * (n - 1));
+    i = 0;
+    SLIST_FOREACH(worker, wl->list, next) {
+        if (worker->state != WORKER_ACTIVE || worker->lane != lane)
+            continue;
+        if (i == pick / (n - 1))
+            a = worker;
+        /* Second pick skips over the first */
+        if (i == (pick % (n - 1) + (pick % (n - 1) >= pick / (n - 1))))
+            b = worker;
+        ++i;
+    }
+
+    return worker_less_loaded(b, a, mod_usec()) ? b : a;
+}
+
+/* Is the lowercased key (snprintf() said it's 'len' long) in 'set', one too long to be a key might be */
+static bool workers_set_has(struct worker_set * set, char * key, int len)
+{
+    if (set->full || len < 0 || len >= WORKER_KEY_MAX)
+        return true;
+    for (char * p = key; *p; ++p)
+        *p = tolower((unsigned char)*p);
+    return htable.lookup(set->keys, key) != NULL;
+}
+
+/* The predicates of a filter the matcher doesn't do */
+static bool workers_filter_check(struct worker_filter * filter, struct server * server, struct ircmsg * msg, const char * text)
+{
+    char key[WORKER_KEY_MAX];
+    const char * nick = Msg.nick(msg), * target = Msg.argv(msg, 0);
+
+    for (unsigned int i = 0; text && i < filter->nprefixes; ++i)
+        if (!strncasecmp(text, filter->prefixes[i], strlen(filter->prefixes[i])))
+            return true;
+    if (filter->nicks && nick && workers_set_has(filter->nicks, key, snprintf(key, sizeof key, "%s", nick)))
+        return true;
+    if (filter->sources && server) {
+        /* What irc.target() gives the worker */
+        if (!target)
+            target = text;
+        else if (nick && server->nick && !strcmp(target, server->nick))
+            target = nick;
+        if (target && workers_set_has(filter->sources, key, snprintf(key, sizeof key, "%s:%s", server->name, target)))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Lanes (bits) an event goes to: the ones with a handler for its type,
+ * the ones of filtered handlers that want it and the one of the command
+ * in it. 'matched' gets which filtered handlers want it. 0 if no handler
+ * does, events modules can't register for go to the default lane
+ */
+static unsigned int workers_route(struct worker_list * wl, struct server * server, struct ircmsg * msg, enum ircmsg_type type, unsigned int * matched)
+{
+    char command[WORKER_COMMAND_MAX];
+    const char * text = Msg.text(msg);
+    unsigned int lanes, filters = wl->type_filters[type], found = 0, i;
+    void * lane;
+
+    *matched = 0;
+    if (!mod_event_routed(type))
+        return 1u << WORKER_LANE_DEFAULT;
+
+    lanes = wl->type_lanes[type];
+    if (filters && wl->routed) {
+        if (text && filters & wl->contains)
+            found = match_scan(wl->match, text);
+        for (i = 0; i < wl->nfilters; ++i) {
+            if (filters & 1u << i && (found & 1u << i || workers_filter_check(&wl->filters[i], server, msg, text))) {
+                lanes |= 1u << wl->filters[i].lane;
+                *matched |= 1u << wl->filters[i].tag;
+            }
+        }
+        *matched |= WORKER_MATCHED | wl->type_matched[type];
+    } else {
+        /* Can't tell, they all get it and run */
+        for (i = 0; i < wl->nfilters; ++i)
+            if (filters & 1u << i)
+                lanes |= 1u << wl->filters[i].lane;
+    }
+    /* Commands are run out of PRIVMSG and NOTICE, see boot.pl */
+    if ((type == IRC_PRIVMSG || type == IRC_NOTICE) && wl->command_lanes && text && *text && strchr("%/.#", *text)) {
+        for (i = 0, ++text; i < sizeof command - 1 && text[i] && !isspace((unsigned char)text[i]); ++i)
+            command[i] = tolower((unsigned char)text[i]);
+        command[i] = '\0';
+        if (i && (lane = htable.lookup(wl->command_lanes, command)))
+            lanes |= 1u << ((intptr_t)lane - 1);
+    }
+
+    return lanes || wl->routed ? lanes : 1u << WORKER_LANE_DEFAULT;
+}
+
+/* Pick a worker in the lane for a packed event and send it there */
+static void workers_send(struct worker_list * wl, unsigned int lane, struct server * server, struct ircmsg * msg,
+        const struct ircmsg_event * ev, const char * line)
+{
+    struct worker * worker, * first;
+    struct worker_key * key = NULL;
+
+    switch (wl->dispatch) {
+        case WORKER_AFFINITY:
+            worker = workers_affinity(wl, lane, ev->server, mod_affinity_key(msg), &key);
+            break;
+        case WORKER_LEAST:
+            worker = workers_least(wl, lane);
+            break;
+        case WORKER_P2C:
+            worker = workers_p2c(wl, lane);
+            break;
+        default:
+            worker = workers_next(wl, lane);
+            break;
+    }
+    first = worker;
+
+    /*
+     * Its key is in flight on a worker on its way out (draining, reloading,
+     * dead), it waits until that one is done with it: workers_release()
+     * once it acked everything, or after what it had if it died
+     */
+    if (key && worker->state != WORKER_ACTIVE && worker == workers_key_owner(wl, lane, key)) {
+        if (!worker->held)
+            worker->held = evbuffer_new();
+        if (!worker->held || evbuffer_get_length(worker->held) >= wl->queue_max
+                || ipc_add(worker->held, IPC_EVENT, ev->server, ev, sizeof *ev, line, ev->size) == -1)
+            ++worker->dropped;
+        return;
+    }
+
+    /* The lane's only worker died, hold it for the one that replaces it */
+    if (worker->state == WORKER_GONE) {
+        if (!wl->lanes[lane].held)
+            wl->lanes[lane].held = evbuffer_new();
+        if (!wl->lanes[lane].held || ipc_add(wl->lanes[lane].held, IPC_EVENT, ev->server, ev, sizeof *ev, line, ev->size) == -1)
+            ++worker->dropped;
+        return;
+    }
+
+    if (worker_queued(worker) >= wl->queue_max) {
+        switch (wl->overflow) {
+            case WORKER_SKIP:
+                /* Moving a key to another worker would break its ordering */
+                if (wl->dispatch != WORKER_AFFINITY) {
+                    while ((worker = workers_next(wl, lane)) != first && worker_queued(worker) >= wl->queue_max)
+                        ;
+                    if (worker != first || mod_event_urgent(ev))
+                        break;
+                }
+                /* They all are, fall through */
+            case WORKER_DROP:
+                if (mod_event_urgent(ev))
+                    break;
+                ++worker->dropped;
+                return;
+            case WORKER_PAUSE:
+                workers_pause(wl, server);
+                break;
+            default:
+                break;
         }
-        free(data);
+    }
+
+//    log_debug("mod_send_event dispatch: [%s]", line);
+    if (worker_send_event(worker, ev->server, ev, sizeof *ev, line, ev->size) == -1) {
+        perror("mod_send_event send");
+        return;
+    }
+    if (key) {
+        key->pid = worker->pid;
+        key->sent = worker->sent;
+    }
+}
+
+void mod_send_event(struct server * server, struct ircmsg * msg)
+{
+    struct ircmsg_event ev;
+    const char * line, * text;
+    unsigned int lanes, lane;
+    bool sent = false;
+
+    /* Answer it right here, a PONG shouldn't wait behind a busy worker */
+    if (Msg.type(msg) == IRC_PING && server) {
+        text = Msg.text(msg) ? Msg.text(msg) : Msg.argv(msg, 0);
+        Con.printf(server->con, "PONG :%s\r\n", text ? text : "");
+        return;
+    }
 
-        worker_list->current = SLIST_NEXT(worker_list->current, next);
-    } while(try_again);
+    line = Msg.pack(msg, server ? server->id : IRCMSG_NOSERVER, &ev);
+    /* No handler wants it, it never gets to Perl */
+    if (!(lanes = workers_route(worker_list, server, msg, ev.type, &ev.matched))) {
+        ++worker_list->filtered;
+        return;
+    }
+    for (lane = 0; lane < worker_list->nlanes; ++lane) {
+        /* Nobody in the lane has a handler for it, don't bother them */
+        if (!(lanes & 1u << lane) || !worker_subscribed(&worker_list->lanes[lane].subs, &ev))
+            continue;
+        workers_send(worker_list, lane, server, msg, &ev, line);
+        sent = true;
+    }
+    if (!sent)
+        ++worker_list->unhandled;
 }
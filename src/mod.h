@@ -3,10 +3,25 @@
 
 #include "config.h"
 
-void mod_round_robin(struct server * server, const char * line);
+struct ircmsg;
+
+void mod_send_event(struct server * server, struct ircmsg * msg);
+void mod_server_announce(struct server * server);
 int mod_dispatch(struct irc * event);
 int mod_initialize(struct event_base * evbase);
 void mod_shutdown(void);
+/* Worker: name the handler we're in for the master's hung worker watchdog */
+void mod_handler(const char * name);
+/* Worker: our event loop for modules' timers and fd watches (IRC.xs), NULL outside of it */
+struct event_base * mod_event_base(void);
+/* Worker: HTTP client on that loop (http.h), NULL outside of it */
+struct http * mod_http(void);
+/* The cache shared by the master and its workers (cache.h), NULL if there is none */
+struct cache * mod_cache(void);
+/* Same for the modules' shared state (store.h) */
+struct store * mod_store(void);
+/* Worker: client for the storage process on our loop (db.h), NULL outside of it or without one */
+struct db * mod_db(void);
 
 /* module config */
 int mod_conf_init(void);
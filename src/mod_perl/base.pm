@@ -3,26 +3,214 @@ use strict;
 use warnings;
 
 use mod_perl::config;
+use B ();
 
 my $cmd_char_pat = qr/^[%\/\.#]/o;
 our %event_registry = ();
+our %batch_registry = ();  # event => handlers that take an array of them
 our %command_registry = ();
+our @post_fork_registry = ();
+my %handler_names = ();
 
-sub event_register
+#
+# Lanes: modules say which pool of workers their handlers run in
+# (a lane from config 'lanes', anything else is the 'default' one).
+# The master routes every event to the lanes with a handler for it,
+# a worker only loads the modules of its own lane and only keeps
+# their handlers. These stay undef/empty in the master and a zygote,
+# which load everything
+#
+our $lane;              # Lane this interpreter serves, set from C
+our @lane_modules;      # Modules it loads (with a lane), set from C
+our %command_lanes = ();  # command => lane
+our %event_lanes = ();    # event => {lane => 1}
+our %module_lanes = ();   # module package => {lane => 1}
+my %code_lanes = ();      # handler/hook => lane or module package
+
+#
+# Filters: a handler can say which of its events it wants (see
+# filter_parse()), the master checks that for it and only sends
+# what some handler wants. The bits of $msg->matched say which
+# filtered handlers it matched for, by a hash of their name so
+# every interpreter agrees on them. Two handlers sharing a bit
+# only means one of them runs for nothing now and then. It's
+# only a hint, handlers still check for themselves: after a
+# reload the master can't tell and they get everything
+#
+our @event_filters = ();  # [event, tag, lane, kind, arg] for the master
+my %code_tags = ();       # filtered handler => its bit in $msg->matched
+my %filter_kinds = (
+    contains => 1,  # text has one of these strings (any case)
+    prefix => 1,    # text starts with one of these
+    nick_in => 1,   # lc(nick) is in this set, modules fill it with $msg->match_set()
+    source_in => 1, # lc("server:target") is in this set
+);
+
+# Bit of a filtered handler in $msg->matched (31 is the master's "filtered" flag),
+# not by file, a module's path isn't the same in every interpreter
+sub filter_tag
+{
+    my $cv = B::svref_2object(shift);
+    my $hash = 5381;
+    my $name = join(' ', $cv->GV->STASH->NAME, $cv->GV->NAME, $cv->START->can('line') ? $cv->START->line : 0);
+
+    $hash = ($hash * 33 + $_) & 0xffffffff foreach (unpack('C*', $name));
+    return $hash % 31;
+}
+
+# What a handler registered with, as @event_filters entries (none means it wants everything)
+sub filter_parse
+{
+    my ($event, $code, $want, %when) = @_;
+    my $tag = filter_tag($code);
+    my @filters;
+
+    foreach my $kind (sort keys %when) {
+        if (!$filter_kinds{$kind}) {
+            print STDERR "[error] unknown filter '$kind' for '$event' handler, it gets every '$event'\n";
+            return ();
+        }
+        foreach my $arg (ref($when{$kind}) eq 'ARRAY' ? @{$when{$kind}} : $when{$kind}) {
+            # An empty string is in every line
+            return () if (!defined($arg) || $arg eq '');
+            push(@filters, [$event, $tag, $want, $kind, $arg]);
+        }
+    }
+
+    return @filters;
+}
+
+# A lane from config, or 'default'
+sub lane_of
+{
+    my $want = shift;
+    my %lanes = map { (split(/:/))[0] => 1 } split(/[\s,]+/, $mod_perl::config::conf{lanes} || '');
+
+    return (defined($want) && exists($lanes{$want})) ? $want : 'default';
+}
+
+# Is it ours to run
+sub lane_mine
+{
+    my $want = shift;
+    return !defined($lane) || $lane eq $want;
+}
+
+# Package of the module that's registering something, undef for our own
+sub registrant
+{
+    my $i = 1;
+    $i++ while ((caller($i))[0] && (caller($i))[0] =~ /^mod_perl::(?:base|commands)$/);
+    return (caller($i))[0];
+}
+
+sub lane_record
+{
+    my $want = shift;
+    my $module = registrant();
+
+    $module_lanes{$module}{$want} = 1 if ($module);
+}
+
+# Modules (plugin names) the workers of a lane need, ones that register nothing go everywhere
+sub lane_modules
 {
-    my ($event,$code) = @_;
+    my ($want, @plugins) = @_;
+    my @modules;
+
+    foreach my $plugin (@plugins) {
+        push(@modules, $plugin) if (!$module_lanes{$plugin} || $module_lanes{$plugin}{$want});
+    }
+
+    return join(' ', @modules);
+}
+
+# Check an event handler and note where it goes, the event if it runs here
+sub event_record
+{
+    my ($event,$code,$want,%when) = @_;
     $event = uc($event);
+    $want = lane_of($want);
     my $evmap = {'PRIVMSG' => 1, 'NOTICE' => 1, JOIN => 1};
 
     if (!exists($evmap->{$event})) {
         print STDERR "[error] Attempt to register invalid event '$event'\n";
         return;
     } else {
-        print "[info] Registered event '$event' -> '$code'\n";
+        print "[info] Registered event '$event' -> '$code' ($want lane)\n";
     }
 
+    my @filters = filter_parse($event, $code, $want, %when);
+    if (@filters) {
+        push(@event_filters, @filters);
+        $code_tags{$code} = $filters[0][1];
+    } else {
+        $event_lanes{$event}{$want} = 1;
+    }
+    lane_record($want);
+    return if (!lane_mine($want));
+
+    $code_lanes{$code} = $want;
+    return $event;
+}
+
+sub event_register
+{
+    my $event = event_record(@_) or return;
+
     # Push our code ref onto our event array
-    push(@{$event_registry{$event}}, $code);
+    push(@{$event_registry{$event}}, $_[1]);
+}
+
+#
+# A handler for events that come in bursts (logging, stats..),
+# it gets an array ref of the ones a worker read in one go
+# instead of being called for each of them
+#
+sub batch_register
+{
+    my $event = event_record(@_) or return;
+
+    push(@{$batch_registry{$event}}, $_[1]);
+}
+
+#
+# Name of a handler for the master's watchdog, so a hung
+# worker gets reported with what it was stuck in
+#
+sub handler_name
+{
+    my $code = shift;
+
+    return $handler_names{$code} //= do {
+        my $cv = B::svref_2object($code);
+        my $gv = $cv->GV;
+        my $name = $gv->STASH->NAME . '::' . $gv->NAME;
+        # Anonymous subs share one glob, where their first statement is tells them apart
+        if ($gv->NAME eq '__ANON__' && $cv->START->can('line')) {
+            $name .= ' at ' . $cv->FILE . ' line ' . $cv->START->line;
+        }
+        $name;
+    };
+}
+
+# Run the batch handlers for an event, each gets the ones its filter matched (in order)
+sub run_batch
+{
+    my ($event, $events) = @_;
+
+    foreach my $code (@{$batch_registry{$event} || []}) {
+        my @mine = @$events;
+        if (exists($code_tags{$code})) {
+            my $bit = 1 << $code_tags{$code};
+            @mine = grep { !$_->matched || ($_->matched & $bit) } @mine;
+        }
+        next if (!@mine);
+
+        $mine[0]->handler(handler_name($code) . ' (' . scalar(@mine) . " $event)");
+        eval { $code->(\@mine); };
+        print STDERR "[error] batch handler " . handler_name($code) . ": $@" if ($@);
+    }
 }
 
 # Check event registry
@@ -30,14 +218,18 @@ sub check_and_run_events
 {
     my ($event, $msg) = @_;
     return if (!exists($mod_perl::base::event_registry{$event}));
+    my $matched = $msg->matched;
 
     # Execute our event handler for this event
     my $ref = $mod_perl::base::event_registry{$event}; 
-    if (ref($ref) eq 'CODE') { $ref->($msg); }
+    if (ref($ref) eq 'CODE') { $msg->handler(handler_name($ref)); $ref->($msg); }
     elsif (ref($ref) eq 'ARRAY') {
         foreach my $code (@$ref) {
             # Execute each handler in this array
             next if (ref($code) ne 'CODE');
+            # The master filtered it and this one's filter didn't match
+            next if ($matched && exists($code_tags{$code}) && !($matched & (1 << $code_tags{$code})));
+            $msg->handler(handler_name($code));
             $code->($msg);
         }
     }
@@ -50,16 +242,68 @@ sub check_and_run_events
 
 sub command_register
 {
-    my ($cmd,$code) = @_;
+    my ($cmd,$code,$want) = @_;
     $cmd = lc($cmd);
+    $want = lane_of($want);
 
     if (exists($command_registry{$cmd})) {
         print STDERR "[warn] overwriting existing '$cmd'\n";
     }
 
+    $command_lanes{$cmd} = $want;
+    lane_record($want);
+    return if (!lane_mine($want));
+
     $command_registry{$cmd} = $code;
 }
 
+#
+# Code to run in a worker forked from an already loaded
+# interpreter (zygote mode), for things that can't be
+# shared between processes like database handles
+#
+sub post_fork_register
+{
+    my $code = shift;
+    $code_lanes{$code} = registrant();
+    push(@post_fork_registry, $code);
+}
+
+#
+# The zygote loaded every lane, a worker forked from
+# it keeps only what its own lane runs
+#
+sub lane_prune
+{
+    $lane = shift;
+
+    foreach my $cmd (keys %command_registry) {
+        delete($command_registry{$cmd}) if (!lane_mine($command_lanes{$cmd}));
+    }
+    foreach my $registry (\%event_registry, \%batch_registry) {
+        foreach my $event (keys %$registry) {
+            @{$registry->{$event}} = grep { lane_mine($code_lanes{$_}) } @{$registry->{$event}};
+        }
+    }
+    @post_fork_registry = grep {
+        my $module = $code_lanes{$_};
+        !$module || !$module_lanes{$module} || $module_lanes{$module}{$lane};
+    } @post_fork_registry;
+}
+
+sub run_post_fork
+{
+    my $want = shift;
+
+    lane_prune($want) if (defined($want));
+    # Don't have every worker roll the same numbers
+    srand();
+    foreach my $code (@post_fork_registry) {
+        eval { $code->(); };
+        print STDERR "[error] post fork hook: $@" if ($@);
+    }
+}
+
 # Clears the command register
 sub clear_register {
 	%command_registry = ();
@@ -68,6 +312,7 @@ sub clear_register {
 # Clears the event register
 sub clear_event_register {
 	%event_registry = ();
+	%batch_registry = ();
 }
 
 sub check_and_run_commands
@@ -95,6 +340,7 @@ sub exec_command
 {
     my ($msg,$cmd,$arg) = @_;
 
+    $msg->handler(".$cmd: " . handler_name($command_registry{$cmd}));
     $command_registry{$cmd}->($msg,$arg);
 }
 
@@ -64,17 +64,18 @@ sub NOTICE
     event_handler('NOTICE', $msg);
 }
 
-sub KICK
-{
-    my $msg = shift;
+# Nothing to do for these yet, without a sub the master doesn't send them (subscriptions())
+#sub KICK
+#{
+#    my $msg = shift;
 #    event_handler('NOTICE', $msg);
-}
+#}
 
-sub NICK
-{
-    my $msg = shift;
+#sub NICK
+#{
+#    my $msg = shift;
 #    event_handler('NOTICE', $msg);
-}
+#}
 
 sub JOIN
 {
@@ -83,17 +84,17 @@ sub JOIN
     mod_perl::base::check_and_run_events('JOIN',$msg);
 }
 
-sub PART
-{
-    my $msg = shift;
+#sub PART
+#{
+#    my $msg = shift;
 #    event_handler('NOTICE', $msg);
-}
+#}
 
-sub QUIT
-{
-    my $msg = shift;
+#sub QUIT
+#{
+#    my $msg = shift;
 #    event_handler('NOTICE', $msg);
-}
+#}
 
 sub raw_485 {
 	my $msg = shift;
@@ -115,4 +116,22 @@ sub raw_408 {
 	print STDERR $msg->text(), "\n";
 }
 
+#
+# What we have handlers for (event and raw_NNN subs), the master
+# only sends us those. The subs that just hand events on to the
+# registries only count when something is registered there
+#
+sub subscriptions
+{
+    my $handlers = sub { @{$mod_perl::base::event_registry{$_[0]} || []} || @{$mod_perl::base::batch_registry{$_[0]} || []} };
+    my %registries = (
+        PRIVMSG => sub { $handlers->('PRIVMSG') || %mod_perl::base::command_registry },
+        NOTICE => sub { $handlers->('NOTICE') || %mod_perl::base::command_registry },
+        JOIN => sub { $handlers->('JOIN') },
+    );
+
+    no strict 'refs';
+    return grep { /^(?:[A-Z]+|raw_\d{3})$/ && defined(&{"main::$_"}) && (!$registries{$_} || $registries{$_}->()) } keys(%main::);
+}
+
 1;
@@ -11,7 +11,6 @@ use mod_perl::config;
 use Getopt::Long qw(:config no_ignore_case);
 use Safe;
 use Module::Pluggable 
-	require => 1, 
 	search_dirs => [$mod_perl::config::conf{module_path}, @mod_perl::config::module_dirs],
 	search_path => ['mod_perl::modules', 'mod_perl::commands'];
 
@@ -30,7 +29,22 @@ sub load_modules {
 	print "Directories: " . join(" ", @mod_perl::config::module_dirs, $mod_perl::config::conf{module_path}). "\n";
 	my $self = mod_perl::commands->new();
 	my @plugins = $self->plugins();
-	print "modules: " . join(", ", @plugins) . "\n";
+
+	# A worker in a lane only loads the modules the master says it needs
+	if (defined($mod_perl::base::lane)) {
+		my %want = map { $_ => 1 } @mod_perl::base::lane_modules;
+		@plugins = grep { $want{$_} } @plugins;
+	}
+	foreach my $plugin (@plugins) {
+		eval "require $plugin; 1" or print STDERR "[error] loading $plugin: $@";
+	}
+	print "modules: " . join(", ", @plugins) . ($mod_perl::base::lane ? " ($mod_perl::base::lane lane)" : "") . "\n";
+}
+
+# Modules the workers of a lane load (space separated), asked by the master
+sub lane_modules {
+	my $want = shift;
+	return mod_perl::base::lane_modules($want, mod_perl::commands->new()->plugins());
 }
 
 
@@ -59,14 +73,16 @@ sub handle_arg {
 # so you can register the commands from within 
 # your module instead of rewriting
 # the main command module all the time
+# An optional lane (e.g. 'slow' for network bound
+# handlers) runs it in that pool of workers
 sub register_command {
-    my ($command, $coderef) = @_;
+    my ($command, $coderef, $lane) = @_;
     if (!ref($coderef) || ref($coderef) ne 'CODE') {
         print STDERR "Invalid command registry: $command: $coderef\n";
         return;
     }
 
-    mod_perl::base::command_register($command, $coderef);
+    mod_perl::base::command_register($command, $coderef, $lane);
 }
 
 #
@@ -74,14 +90,46 @@ sub register_command {
 # so you can register the event handlers from within 
 # your module instead of rewriting
 # the main command module all the time
+# An optional lane (e.g. 'slow' for network bound
+# handlers) runs it in that pool of workers, after it
+# filters say which events it wants so the rest never
+# get to Perl, e.g. contains => ['://'] or
+# nick_in => 'set' (see mod_perl::base::filter_parse)
 sub register_handler {
-    my ($event, $coderef) = @_;
+    my ($event, $coderef, $lane, %when) = @_;
     if (!ref($coderef) || ref($coderef) ne 'CODE') {
         print STDERR "Invalid command registry: $event: $coderef\n";
         return;
     }
 
-    mod_perl::base::event_register($event, $coderef);
+    mod_perl::base::event_register($event, $coderef, $lane, %when);
+}
+
+#
+## Register a handler that gets events in batches, an array
+# ref of the ones a worker read in one go (for logging, stats
+# and such), same arguments as register_handler
+sub register_batch_handler {
+    my ($event, $coderef, $lane, %when) = @_;
+    if (!ref($coderef) || ref($coderef) ne 'CODE') {
+        print STDERR "Invalid batch registry: $event: $coderef\n";
+        return;
+    }
+
+    mod_perl::base::batch_register($event, $coderef, $lane, %when);
+}
+
+#
+## Register code to run in each worker right after it's forked
+# (zygote mode), reopen database handles, sockets etc. here
+sub register_post_fork {
+    my ($coderef) = @_;
+    if (!ref($coderef) || ref($coderef) ne 'CODE') {
+        print STDERR "Invalid post fork registry: $coderef\n";
+        return;
+    }
+
+    mod_perl::base::post_fork_register($coderef);
 }
 
 ##################################################################
@@ -93,6 +141,7 @@ mod_perl::base::command_register('perl', \&execperl);
 mod_perl::base::command_register('help', \&help);
 mod_perl::base::command_register('connect', \&connect);
 mod_perl::base::command_register('reload', sub { my $irc = shift; $irc->say("Reloading..."); $irc->reload(); });
+mod_perl::base::command_register('status', sub { my $irc = shift; $irc->status(); });
 # Example event register 
 #mod_perl::base::event_register('JOIN',
 #  sub {
@@ -10,7 +10,7 @@
 
 #include "../config.h"    /* We load and parse the config in perl here */
 #include "../irc.h"
-#include "../xstr.h"
+#include "../ircmsg.h" /* IRC_TYPE_MAX */
 #include "../log.h"
 
 #define STRINGIFYX(a) #a
@@ -21,8 +21,10 @@
 #endif
 #define MOD_PERL_BOOT_DFLT STRINGIFY(MOD_BOOTSCRIPT_DIR) "boot.pl"
 #define MOD_PERL_CONF_NAME "mod_perl::config::conf"
-/* Beware side-effects */
-#define mod_newSVpv(s) ( newSVpvn((s), (s) ? strlen(s) : 0) )
+/* raw_NNN subs we keep track of */
+#define MOD_PERL_NUMERICS 1000
+/* Longest command we look up a sub for */
+#define MOD_PERL_SUB_MAX 32
 
 EXTERN_C void xs_init (pTHX);
 
@@ -39,18 +41,49 @@ xs_init(pTHX)
 }
 
 
+/* boot.pl's sub for an event, looked up the first time we need it */
+struct mp_sub {
+    CV * cv;     /* We hold a reference, NULL if there's no such sub */
+    bool looked;
+};
+
 static PerlInterpreter * my_perl; /* Perl(older) API requires this be called my_perl (can you believe this?) */
 static struct mp {
     const char * boot; /* Path to boot script */
     short int init; /* Is my_perl initialized? */
+    const char * lane; /* Lane we serve, NULL for all of them (mod_perl_lane()) */
+    const char * modules; /* Modules that lane loads */
+    SV * ircobj; /* The IRC object handlers get, see mod_perl_to_ircobj() */
+    struct mp_sub types[IRC_TYPE_MAX]; /* By event type, IRC_UNSET ones are looked up by name every time */
+    struct mp_sub numerics[MOD_PERL_NUMERICS]; /* raw_NNN */
+    bool batched[IRC_TYPE_MAX]; /* Event types with batch handlers (mod_perl_batched()).. */
+    bool batched_looked;        /* ..once we looked */
 } mp_state = {
     .boot = (MOD_PERL_BOOT_DFLT),
     .init = 0,
 };
 
+/* Drop what we hold in the interpreter, before it goes away */
+static void mod_perl_forget(struct mp * state)
+{
+    size_t i;
+
+    for (i = 0; i < IRC_TYPE_MAX; ++i)
+        SvREFCNT_dec(state->types[i].cv);
+    for (i = 0; i < MOD_PERL_NUMERICS; ++i)
+        SvREFCNT_dec(state->numerics[i].cv);
+    memset(state->types, 0, sizeof state->types);
+    memset(state->numerics, 0, sizeof state->numerics);
+    memset(state->batched, 0, sizeof state->batched);
+    state->batched_looked = false;
+    SvREFCNT_dec(state->ircobj);
+    state->ircobj = NULL;
+}
+
 static void mod_perl_destroy(struct mp * state)
 {
     if (state->init) {
+        mod_perl_forget(state);
         /* Allow subsequent create/destroy of perl interpreter 
          * Must be set twice, construct sets it back to 0 so we need to set to 1 again */
         PL_perl_destruct_level = 1;
@@ -79,6 +112,23 @@ void mod_perl_init(struct mp * state)
     PL_exit_flags |= PERL_EXIT_DESTRUCT_END;
 	perl_construct(my_perl);
 	perl_parse(my_perl, xs_init, sizeof parg / sizeof parg[0], parg, NULL);
+
+	/* Before boot.pl runs, it loads the modules */
+	if (state->lane) {
+		AV * modules = get_av("mod_perl::base::lane_modules", GV_ADD);
+		const char * p = state->modules, * end;
+
+		sv_setpv(get_sv("mod_perl::base::lane", GV_ADD), state->lane);
+		av_clear(modules);
+		while (p && *p) {
+			if ( !(end = strchr(p, ' ')) )
+				end = p + strlen(p);
+			if (end > p)
+				av_push(modules, newSVpvn(p, end - p));
+			p = *end ? end + 1 : end;
+		}
+	}
+
 	perl_run(my_perl);
 }
 
@@ -91,78 +141,238 @@ static void mod_perl_reinit_state(struct mp * state)
 
 /*
  * Converts IRC event object to perl IRC object
- * (as defined by IRC perl module)
+ * (as defined by IRC perl module). There's just the one,
+ * pointed at each event in turn instead of blessing a new
+ * one every time. If a handler kept it (or overwrote its
+ * $_[0]) that one is theirs and we make another
  */
-static SV * mod_perl_to_ircobj(struct irc * event)
+static SV * mod_perl_to_ircobj(struct mp * state, struct irc * event)
 {
-	SV * obj;
+	SV * obj = state->ircobj;
 
-	if (event) {
-		obj = newSV(0);
+	if (obj && (!SvROK(obj) || SvREFCNT(SvRV(obj)) > 1)) {
+		SvREFCNT_dec(obj);
+		obj = state->ircobj = NULL;
+	}
+	if (!obj) {
+		obj = state->ircobj = newSV(0);
 		sv_setref_pv(obj, "IRC", event);
-		//fprintf(stderr, "added %p as 'IRC' object\n", (void *)event);
+	} else {
+		sv_setiv(SvRV(obj), PTR2IV(event));
 	}
 
 	return obj;
 }
 
-static SV * mod_perl_call(SV * href, SV * sub)
+/* A sub in main:: from the cache, looking it up if we haven't yet */
+static CV * mod_perl_sub(struct mp_sub * sub, const char * name)
+{
+	if (!sub->looked) {
+		if ((sub->cv = get_cv(name, 0)))
+			SvREFCNT_inc_simple_void_NN(sub->cv);
+		sub->looked = true;
+	}
+	return sub->cv;
+}
+
+/* boot.pl's sub for an event, NULL if it has none */
+static CV * mod_perl_event_sub(struct mp * state, struct irc * event)
+{
+	char name[MOD_PERL_SUB_MAX];
+	const char * command;
+	int type = irc.type(event), numeric;
+
+	/*
+	 * Currently we look up commands (in boot.pl)
+	 * by 'msg->command', numerics as 'raw_NUM'.
+	 * Usually PRIVMSG, KICK, etc..
+	 */
+	if (type == IRC_NUMERIC) {
+		numeric = irc.numeric(event);
+		if (numeric < 0 || numeric >= MOD_PERL_NUMERICS)
+			return NULL;
+		snprintf(name, sizeof name, "raw_%03d", numeric);
+		return mod_perl_sub(&state->numerics[numeric], name);
+	}
+	if (!(command = irc.command(event)))
+		return NULL;
+	/* Names we don't know a type for aren't worth keeping */
+	if (type <= IRC_UNSET || type >= IRC_TYPE_MAX)
+		return get_cv(command, 0);
+	return mod_perl_sub(&state->types[type], command);
+}
+
+static void mod_perl_call(SV * obj, CV * sub, const char * name)
 {
 	dSP;
 	ENTER;
 	SAVETMPS;
 
-	/* Push our message hash ref onto the stack */
+	/* Push our IRC object onto the stack, it's ours so no copy */
 	PUSHMARK(SP);
-	XPUSHs(sv_2mortal(newSVsv(href)));
+	XPUSHs(obj);
 	PUTBACK;
 
     /* Actually call our function with no return expected */
-	call_sv(sub, G_EVAL|G_SCALAR|G_DISCARD);
+	call_sv((SV *)sub, G_EVAL|G_SCALAR|G_DISCARD);
 	SPAGAIN;
 	/* Check the eval first */
 	if (SvTRUE(ERRSV))
 	{
-		fprintf(stderr, "mod_dispatch_perl(%s): %s", SvPV_nolen(sub), SvPV_nolen(ERRSV));
+		fprintf(stderr, "mod_dispatch_perl(%s): %s", name, SvPV_nolen(ERRSV));
 	}
 	FREETMPS;
 	LEAVE;
+}
+
+
+/********************************************************************************************
+ * INTERFACE
+ ********************************************************************************************/
+void mod_perl_reinit(void)
+{
+    mod_perl_reinit_state(&mp_state);
+}
+
+/* We got forked from a loaded interpreter, drop other lanes' handlers and let modules reopen what they can't share */
+void mod_perl_post_fork(void)
+{
+	dSP;
 
-	return sub;
+	if (!mp_state.init)
+		return;
+
+	ENTER;
+	SAVETMPS;
+	PUSHMARK(SP);
+	if (mp_state.lane)
+		XPUSHs(sv_2mortal(newSVpv(mp_state.lane, 0)));
+	PUTBACK;
+	call_pv("mod_perl::base::run_post_fork", G_EVAL|G_DISCARD);
+	if (SvTRUE(ERRSV))
+		fprintf(stderr, "mod_perl_post_fork: %s", SvPV_nolen(ERRSV));
+	FREETMPS;
+	LEAVE;
 }
 
-/* Simple func to call a perl sub passed in
-   with the href */
-static SV * mod_perl_call_simple(SV * href, const char * sub)
+void mod_perl_lane(const char * lane, const char * modules)
 {
-	SV * nsv = mod_newSVpv(sub);
-	mod_perl_call(href, nsv);
-	return nsv;
+	mp_state.lane = lane;
+	mp_state.modules = modules;
 }
-/*
- *  Got numeric event, lookup 'raw_NUM' as command sub
- */
-static SV * mod_perl_call_numeric_simple(SV * href, short sub)
+
+/* Walk one of the lane hashes in mod_perl::base, 'nested' ones are event => {lane => 1} */
+static void mod_perl_lanes_hash(const char * name, const char * kind, int nested,
+		void (*cb)(void * data, const char * kind, const char * name, const char * lane), void * data)
 {
-    SV * nsv = NULL;
-    char * s = NULL;
-
-    xsprintf(&s, "raw_%03d", sub);
-    if (s) {
-        nsv = mod_newSVpv(s);
-        mod_perl_call(href, nsv);
-        free(s);
-    }
-    return nsv;
+	HV * hash = get_hv(name, 0), * lanes;
+	HE * he, * lane;
+
+	if (!hash)
+		return;
+	for (hv_iterinit(hash); (he = hv_iternext(hash)); ) {
+		SV * sv = hv_iterval(hash, he);
+		I32 len;
+		char * key = hv_iterkey(he, &len);
+
+		if (!nested) {
+			if (SvPOK(sv))
+				cb(data, kind, key, SvPV_nolen(sv));
+		} else if (SvROK(sv) && SvTYPE(SvRV(sv)) == SVt_PVHV) {
+			lanes = (HV *)SvRV(sv);
+			for (hv_iterinit(lanes); (lane = hv_iternext(lanes)); )
+				cb(data, kind, key, hv_iterkey(lane, &len));
+		}
+	}
 }
 
+int mod_perl_lanes(void (*cb)(void * data, const char * kind, const char * name, const char * lane), void * data)
+{
+	if (!mp_state.init)
+		return -1;
+	mod_perl_lanes_hash("mod_perl::base::command_lanes", "command", 0, cb, data);
+	mod_perl_lanes_hash("mod_perl::base::event_lanes", "event", 1, cb, data);
+	return 0;
+}
 
-/********************************************************************************************
- * INTERFACE
- ********************************************************************************************/
-void mod_perl_reinit(void)
+int mod_perl_filters(void (*cb)(void * data, const char * event, unsigned int tag, const char * lane, const char * kind, const char * arg), void * data)
 {
-    mod_perl_reinit_state(&mp_state);
+	AV * filters, * filter;
+	SV ** sv, ** f[5];
+	I32 i, j;
+
+	if (!mp_state.init || !(filters = get_av("mod_perl::base::event_filters", 0)))
+		return -1;
+	/* [event, tag, lane, kind, arg] each */
+	for (i = 0; i <= av_len(filters); ++i) {
+		if (!(sv = av_fetch(filters, i, 0)) || !SvROK(*sv) || SvTYPE(SvRV(*sv)) != SVt_PVAV)
+			continue;
+		filter = (AV *)SvRV(*sv);
+		for (j = 0; j < 5 && (f[j] = av_fetch(filter, j, 0)) && SvOK(*f[j]); ++j)
+			;
+		if (j == 5)
+			cb(data, SvPV_nolen(*f[0]), SvUV(*f[1]), SvPV_nolen(*f[2]), SvPV_nolen(*f[3]), SvPV_nolen(*f[4]));
+	}
+	return 0;
+}
+
+char * mod_perl_lane_modules(const char * lane)
+{
+	char * modules = NULL;
+	SV * ret;
+	dSP;
+
+	if (!mp_state.init)
+		return NULL;
+
+	ENTER;
+	SAVETMPS;
+	PUSHMARK(SP);
+	XPUSHs(sv_2mortal(newSVpv(lane, 0)));
+	PUTBACK;
+	if (call_pv("mod_perl::commands::lane_modules", G_EVAL|G_SCALAR) == 1) {
+		SPAGAIN;
+		ret = POPs;
+		if (!SvTRUE(ERRSV) && SvOK(ret))
+			modules = strdup(SvPV_nolen(ret));
+		PUTBACK;
+	}
+	if (SvTRUE(ERRSV))
+		fprintf(stderr, "mod_perl_lane_modules: %s", SvPV_nolen(ERRSV));
+	FREETMPS;
+	LEAVE;
+
+	return modules;
+}
+
+int mod_perl_subscriptions(void (*cb)(void * data, const char * event), void * data)
+{
+	I32 count;
+	int ret = 0;
+	dSP;
+
+	if (!mp_state.init)
+		return -1;
+
+	ENTER;
+	SAVETMPS;
+	PUSHMARK(SP);
+	count = call_pv("subscriptions", G_EVAL|G_ARRAY|G_NOARGS);
+	SPAGAIN;
+	if (SvTRUE(ERRSV)) {
+		fprintf(stderr, "mod_perl_subscriptions: %s", SvPV_nolen(ERRSV));
+		ret = -1;
+	} else {
+		while (count-- > 0) {
+			SV * event = POPs; /* SvPV_nolen() evaluates it more than once */
+			cb(data, SvPV_nolen(event));
+		}
+	}
+	PUTBACK;
+	FREETMPS;
+	LEAVE;
+
+	return ret;
 }
 
 void mod_perl_shutdown(void)
@@ -182,8 +392,8 @@ const char * mod_perl_conf_get(const char * key, size_t len)
     } else {
         SV ** entry = hv_fetch(hv, key, len, 0);
 
-        /* Get the string in the SV** */
-        if (entry && SvPOKp(*entry))
+        /* Get the string in the SV** (numbers are stringified) */
+        if (entry && SvOK(*entry) && !SvROK(*entry))
             p = SvPV_nolen(*entry);
     }
 
@@ -340,34 +550,81 @@ void * mod_perl_dispatch(void * ctx)
 {
     struct irc * event = ctx;
     SV * ircobj;
+    CV * sub;
 
     /* Make sure our perl interpreter is initialized */
     if (!mp_state.init) 
         mod_perl_init(&mp_state);
 
-    ircobj = mod_perl_to_ircobj(event);
-    if (!ircobj) {
-        fprintf(stderr, "Failed to convert ircobj to perl class, skipping..\n");
-        return 0;
-    }
+    /* Nothing in boot.pl for it, nothing to do */
+    if (!(sub = mod_perl_event_sub(&mp_state, event)))
+        return NULL;
 
-    /*
-     * Currently we look up commands (in boot.pl)
-     * by 'msg->command'. We could enhance this
-     * but we do all the handling in boot.pl anyways
-     *
-     * Usually PRIVMSG, KICK, etc..
-     *
-     */
-
-    if (irc.israw(event))
-	    mod_perl_call_numeric_simple(ircobj, irc.numeric(event));
-    else
-	    mod_perl_call_simple(ircobj, irc.command(event));
+    ircobj = mod_perl_to_ircobj(&mp_state, event);
+    mod_perl_call(ircobj, sub, irc.command(event));
 
     return NULL;
 }
 
+/* Not before the modules are loaded, and a worker forked from a zygote only keeps its own lane's */
+bool mod_perl_batched(int type)
+{
+	HV * batches;
+	HE * he;
+	I32 len;
+	int t;
+
+	if (!mp_state.init || type <= IRC_UNSET || type >= IRC_TYPE_MAX)
+		return false;
+	if (!mp_state.batched_looked) {
+		mp_state.batched_looked = true;
+		if ((batches = get_hv("mod_perl::base::batch_registry", 0))) {
+			for (hv_iterinit(batches); (he = hv_iternext(batches)); ) {
+				SV * handlers = hv_iterval(batches, he);
+
+				if (SvROK(handlers) && SvTYPE(SvRV(handlers)) == SVt_PVAV && av_len((AV *)SvRV(handlers)) >= 0
+						&& (t = Msg.command_type(hv_iterkey(he, &len))) != IRC_UNSET)
+					mp_state.batched[t] = true;
+			}
+		}
+	}
+
+	return mp_state.batched[type];
+}
+
+/*
+ * Hand 'n' events of one kind to the batch handlers as an array. They
+ * all live at once so each gets an IRC object of its own
+ */
+void mod_perl_dispatch_batch(const char * event, struct irc ** events, size_t n)
+{
+	AV * batch;
+	size_t i;
+	dSP;
+
+	if (!mp_state.init || !n)
+		return;
+
+	ENTER;
+	SAVETMPS;
+	batch = newAV();
+	av_extend(batch, n - 1);
+	for (i = 0; i < n; ++i) {
+		SV * obj = newSV(0);
+
+		sv_setref_pv(obj, "IRC", events[i]);
+		av_push(batch, obj);
+	}
+	PUSHMARK(SP);
+	XPUSHs(sv_2mortal(newSVpv(event, 0)));
+	XPUSHs(sv_2mortal(newRV_noinc((SV *)batch)));
+	PUTBACK;
+	call_pv("mod_perl::base::run_batch", G_EVAL|G_DISCARD);
+	if (SvTRUE(ERRSV))
+		fprintf(stderr, "mod_perl_dispatch_batch(%s): %s", event, SvPV_nolen(ERRSV));
+	FREETMPS;
+	LEAVE;
+}
 
 
 /* TEST */
@@ -2,7 +2,22 @@
 #define MOD_PERL_HEADER__H_
 
 void * mod_perl_dispatch(void * obj);
+/* Does an event type (enum ircmsg_type) have handlers that take a batch of them */
+bool mod_perl_batched(int type);
+/* Run the batch handlers for 'event' ("PRIVMSG") on 'n' events in the order they came */
+void mod_perl_dispatch_batch(const char * event, struct irc ** events, size_t n);
 void mod_perl_reinit(void);
+void mod_perl_post_fork(void);
+/* Lane the interpreters from now on serve and the modules they load (space separated, NULL for all) */
+void mod_perl_lane(const char * lane, const char * modules);
+/* Every lane a module put a command or unfiltered event in, 'kind' is "command" or "event", -1 without an interpreter */
+int mod_perl_lanes(void (*cb)(void * data, const char * kind, const char * name, const char * lane), void * data);
+/* Every predicate of a filtered event handler (base.pm event_register()), 'tag' is its bit in struct ircmsg_event.matched */
+int mod_perl_filters(void (*cb)(void * data, const char * event, unsigned int tag, const char * lane, const char * kind, const char * arg), void * data);
+/* Modules the workers of a lane need (space separated), caller frees */
+char * mod_perl_lane_modules(const char * lane);
+/* Every event boot.pl has a handler for, by sub name ("PRIVMSG", "raw_433"), -1 if it can't tell */
+int mod_perl_subscriptions(void (*cb)(void * data, const char * event), void * data);
 void mod_perl_shutdown(void);
 const char * mod_perl_conf_get(const char * key, size_t len);
 void mod_perl_conf_foreach(const char * key, size_t len, void (*cb)(const char * key, const char * val));
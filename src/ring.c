@@ -0,0 +1,229 @@
+/* ring.c shared memory SPSC frame rings between master and workers, see ring.h */
+
+#define _GNU_SOURCE /* memfd_create */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#include "ring.h"
+#include "log.h"
+
+/* Frames start on this boundary so payloads can be used in place */
+#define RING_ALIGN 8
+#define RING_ROUND(n) (((n) + RING_ALIGN - 1) & ~(size_t)(RING_ALIGN - 1))
+/* Keep the producer and consumer indexes on separate cache lines */
+#define RING_LINE 64
+
+/* The shared part, in a memfd so processes we didn't fork can map it too (ring_open()) */
+struct ring_shm {
+    _Alignas(RING_LINE) _Atomic uint32_t head; /* written by the producer */
+    _Alignas(RING_LINE) _Atomic uint32_t tail; /* written by the consumer */
+    _Alignas(RING_LINE) _Atomic int sleeping;  /* consumer is (about to be) waiting on the bell */
+    _Alignas(RING_LINE) unsigned char data[];
+};
+
+/* Our handle on it, fd numbers are per process */
+struct ring {
+    struct ring_shm * shm;
+    uint32_t size;
+    int fd;
+    int bell;
+};
+
+static struct ring * ring_map(int fd, int bell, size_t size)
+{
+    struct ring * ring;
+
+    if ( !(ring = malloc(sizeof *ring)) ) {
+        perror("ring_map malloc");
+        return NULL;
+    }
+    ring->shm = mmap(NULL, sizeof *ring->shm + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring->shm == MAP_FAILED) {
+        perror("ring_map mmap");
+        free(ring);
+        return NULL;
+    }
+    ring->size = size;
+    ring->fd = fd;
+    ring->bell = bell;
+
+    return ring;
+}
+
+struct ring * ring_new(size_t size)
+{
+    struct ring * ring;
+    int fd, bell;
+
+    if (size & (size - 1) || size < RING_ALIGN * 2 || size > (1u << 30)) {
+        log_debug("[ring] size %zu must be a power of two", size);
+        return NULL;
+    }
+
+    if ((fd = memfd_create("ring", MFD_CLOEXEC)) == -1) {
+        perror("ring_new memfd_create");
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof (struct ring_shm) + size) == -1) {
+        perror("ring_new ftruncate");
+        close(fd);
+        return NULL;
+    }
+    if ((bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("ring_new eventfd");
+        close(fd);
+        return NULL;
+    }
+    if ( !(ring = ring_map(fd, bell, size)) ) {
+        close(bell);
+        close(fd);
+        return NULL;
+    }
+
+    atomic_init(&ring->shm->head, 0);
+    atomic_init(&ring->shm->tail, 0);
+    atomic_init(&ring->shm->sleeping, 1); /* Nobody has looked yet */
+
+    return ring;
+}
+
+struct ring * ring_open(int fd, int bell)
+{
+    struct stat st;
+    size_t size;
+
+    if (fstat(fd, &st) == -1) {
+        perror("ring_open fstat");
+        return NULL;
+    }
+    size = st.st_size - sizeof (struct ring_shm);
+    if (st.st_size <= (off_t)sizeof (struct ring_shm) || size & (size - 1)) {
+        log_debug("[ring] fd %d is not a ring", fd);
+        return NULL;
+    }
+
+    return ring_map(fd, bell, size);
+}
+
+void ring_free(struct ring * ring)
+{
+    if (ring) {
+        close(ring->bell);
+        close(ring->fd);
+        munmap(ring->shm, sizeof *ring->shm + ring->size);
+        free(ring);
+    }
+}
+
+int ring_bell(struct ring * ring)
+{
+    return ring->bell;
+}
+
+int ring_fd(struct ring * ring)
+{
+    return ring->fd;
+}
+
+int ring_put(struct ring * ring, enum ipc_type type, unsigned short id, const void * a, size_t alen, const void * b, size_t blen)
+{
+    struct ipc_frame frame = ipc_frame(type, id, alen + blen);
+    uint32_t head = atomic_load_explicit(&ring->shm->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->shm->tail, memory_order_acquire);
+    uint32_t mask = ring->size - 1, off = head & mask, pad = 0;
+    size_t need = RING_ROUND(sizeof frame + alen + blen);
+    unsigned char * p;
+
+    if (need > ring->size / 2)
+        return -1;
+    /* Doesn't fit before the end, skip to the start */
+    if (off + need > ring->size)
+        pad = ring->size - off;
+    if (need + pad > ring->size - (head - tail))
+        return -1;
+
+    if (pad) {
+        struct ipc_frame skip = {.len = pad - sizeof skip, .version = IPC_VERSION, .type = IPC_UNSET};
+        memcpy(ring->shm->data + off, &skip, sizeof skip);
+        head += pad;
+        off = 0;
+    }
+
+    p = ring->shm->data + off;
+    memcpy(p, &frame, sizeof frame);
+    if (alen)
+        memcpy(p + sizeof frame, a, alen);
+    if (blen)
+        memcpy(p + sizeof frame + alen, b, blen);
+
+    atomic_store_explicit(&ring->shm->head, head + need, memory_order_seq_cst);
+
+    /* Only ring if the consumer went idle, and only once per nap */
+    if (atomic_exchange_explicit(&ring->shm->sleeping, 0, memory_order_seq_cst)) {
+        if (eventfd_write(ring->bell, 1) == -1)
+            perror("ring_put eventfd_write");
+    }
+
+    return 0;
+}
+
+size_t ring_used(struct ring * ring)
+{
+    return atomic_load_explicit(&ring->shm->head, memory_order_relaxed)
+        - atomic_load_explicit(&ring->shm->tail, memory_order_relaxed);
+}
+
+const unsigned char * ring_peek(struct ring * ring, struct ipc_frame * frame)
+{
+    uint32_t tail = atomic_load_explicit(&ring->shm->tail, memory_order_relaxed);
+
+    while (tail != atomic_load_explicit(&ring->shm->head, memory_order_acquire)) {
+        const unsigned char * p = ring->shm->data + (tail & (ring->size - 1));
+
+        memcpy(frame, p, sizeof *frame);
+        if (frame->type != IPC_UNSET)
+            return p + sizeof *frame;
+
+        /* Padding up to the end of the ring */
+        tail += sizeof *frame + frame->len;
+        atomic_store_explicit(&ring->shm->tail, tail, memory_order_release);
+    }
+
+    return NULL;
+}
+
+void ring_consume(struct ring * ring, const struct ipc_frame * frame)
+{
+    uint32_t tail = atomic_load_explicit(&ring->shm->tail, memory_order_relaxed);
+
+    atomic_store_explicit(&ring->shm->tail, tail + RING_ROUND(sizeof *frame + frame->len), memory_order_release);
+}
+
+void ring_wakeup(struct ring * ring)
+{
+    eventfd_t count;
+
+    (void)eventfd_read(ring->bell, &count);
+}
+
+int ring_sleep(struct ring * ring)
+{
+    atomic_store_explicit(&ring->shm->sleeping, 1, memory_order_seq_cst);
+
+    if (atomic_load_explicit(&ring->shm->tail, memory_order_relaxed)
+            == atomic_load_explicit(&ring->shm->head, memory_order_seq_cst))
+        return 0;
+
+    /* Raced with the producer, if it already rang we just get a spurious wakeup */
+    atomic_store_explicit(&ring->shm->sleeping, 0, memory_order_relaxed);
+    return 1;
+}
+
+/* end ring.c */
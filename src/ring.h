@@ -0,0 +1,54 @@
+#ifndef RING_HEADER__H_
+#define RING_HEADER__H_
+
+#include <stddef.h> /* size_t */
+
+#include "ipc.h" /* struct ipc_frame, enum ipc_type */
+
+/* Bytes of frame data in each ring (power of two) */
+#define RING_SIZE (1 << 20)
+/* Frames handled per wakeup before we give the event loop back */
+#define RING_BATCH 256
+
+/*
+ * Single producer/single consumer ring of IPC frames in a shared
+ * mapping, created before fork() so the master and one worker both
+ * see it. Frames are the same as on the socket (ipc.h) and are never
+ * split over the end of the ring, so the payload can be used in place.
+ *
+ * Rings are backed by a memfd, so one can also be handed to a process
+ * that wasn't forked from its creator (SCM_RIGHTS, see ring_open()).
+ *
+ * The eventfd doorbell (ring_bell()) is only written when the consumer
+ * said it's going idle, a busy consumer never costs the producer a
+ * syscall.
+ */
+struct ring;
+
+struct ring * ring_new(size_t size);
+/* Map a ring another process made from its ring_fd() and ring_bell(), takes over both fds */
+struct ring * ring_open(int fd, int bell);
+void ring_free(struct ring * ring);
+/* The doorbell fd the consumer waits on for EV_READ */
+int ring_bell(struct ring * ring);
+/* The memfd the ring lives in */
+int ring_fd(struct ring * ring);
+
+/* Producer: add a frame, -1 if there is no room for it right now */
+int ring_put(struct ring * ring, enum ipc_type type, unsigned short id, const void * a, size_t alen, const void * b, size_t blen);
+
+/* Bytes the producer has queued that the consumer hasn't taken yet */
+size_t ring_used(struct ring * ring);
+
+/* Consumer: next frame or NULL, the frame is kept until ring_consume() */
+const unsigned char * ring_peek(struct ring * ring, struct ipc_frame * frame);
+void ring_consume(struct ring * ring, const struct ipc_frame * frame);
+/* Consumer: clear a doorbell that woke us up */
+void ring_wakeup(struct ring * ring);
+/*
+ * Consumer: about to wait on the doorbell, returns 0 if it is
+ * safe to, or 1 if a frame came in meanwhile (keep reading)
+ */
+int ring_sleep(struct ring * ring);
+
+#endif
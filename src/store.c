@@ -0,0 +1,578 @@
+/* store.c shared key/value store for the modules' state, see store.h */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <limits.h> /* PATH_MAX */
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "store.h"
+#include "log.h"
+
+/* Keys and values are kept in chains of these, the key first. Module state is mostly small */
+#define STORE_BLOCK 256
+#define STORE_BLOCK_DATA (STORE_BLOCK - sizeof(uint32_t))
+/* Most of the blocks one key may take, 1/n */
+#define STORE_ENTRY_SHARE 8
+/* Smallest store we make */
+#define STORE_MIN_BLOCKS 64
+/* First line of a snapshot */
+#define STORE_MAGIC "cbot state 1\n"
+
+struct store_block {
+    uint32_t next;                  /* Next block of its chain or the free list, 0 for none */
+    unsigned char data[STORE_BLOCK_DATA];
+};
+
+struct store_entry {
+    uint64_t hash;
+    uint64_t version;
+    uint64_t expires;               /* usec (CLOCK_MONOTONIC), 0 for never */
+    uint32_t klen, vlen;
+    uint32_t block;                 /* First block */
+    uint32_t chain;                 /* Next entry in its bucket or the free list */
+};
+
+/* What a snapshot has for each key, followed by the key and the value */
+struct store_record {
+    uint32_t klen, vlen;
+    int64_t expires;                /* time(), 0 for never */
+};
+
+/*
+ * Everything lives in the one mapping, which every process has at the
+ * same address since they're all forked after it's made. Index 0 of the
+ * entries and blocks is never used so 0 can mean none.
+ *
+ * A bucket's chain is only touched under its stripe's lock, the free
+ * lists and the stats under 'alloc' (taken after a stripe, never
+ * before). Changes are made so that a worker killed halfway leaves the
+ * tables intact, at worst with a few entries or blocks nobody gets back
+ */
+struct store {
+    pthread_mutex_t stripes[STORE_STRIPES];
+    pthread_mutex_t alloc;
+    size_t size;                    /* Of the mapping */
+    uint32_t nbuckets, nentries, nblocks;
+    uint32_t fresh_entry, fresh_block; /* Never used up to here, so we don't touch pages we don't need */
+    uint32_t free_entry, free_block;
+    uint32_t free_entries, free_blocks; /* Counting the fresh ones */
+    _Atomic uint64_t version;       /* The last one a value got */
+    struct store_stats stats;
+    uint32_t * buckets;
+    struct store_entry * entries;
+    struct store_block * blocks;
+};
+
+static uint64_t store_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* FNV-1a */
+static uint64_t store_hash(const void * key, size_t klen)
+{
+    const unsigned char * p = key;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    while (klen--) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline uint32_t store_nblocks(size_t len)
+{
+    return len ? (len + STORE_BLOCK_DATA - 1) / STORE_BLOCK_DATA : 1;
+}
+
+static inline pthread_mutex_t * store_stripe(struct store * store, uint32_t bucket)
+{
+    return &store->stripes[bucket % STORE_STRIPES];
+}
+
+static void store_lock(pthread_mutex_t * lock)
+{
+    if (pthread_mutex_lock(lock) == EOWNERDEAD) {
+        log_debug("[store] a worker died holding a lock, carrying on");
+        pthread_mutex_consistent(lock);
+    }
+}
+
+static void store_unlock(pthread_mutex_t * lock)
+{
+    pthread_mutex_unlock(lock);
+}
+
+struct store * store_new(size_t size)
+{
+    struct store * store;
+    pthread_mutexattr_t attr;
+    size_t per = STORE_BLOCK + sizeof(struct store_entry) + 2 * sizeof(uint32_t);
+    uint32_t nblocks, nbuckets = STORE_STRIPES;
+    unsigned char * base;
+    int i, err = 0;
+
+    if (size < sizeof *store + (STORE_MIN_BLOCKS + 1) * per) {
+        log_debug("[store] %zu bytes is too small", size);
+        return NULL;
+    }
+    nblocks = (size - sizeof *store) / per - 1;
+    while (nbuckets < nblocks)
+        nbuckets <<= 1;
+
+    /* Pages are only touched as they're used */
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        perror("store_new mmap");
+        return NULL;
+    }
+    store = (struct store *)base;
+    store->size = size;
+    store->nbuckets = nbuckets;
+    store->nentries = store->nblocks = nblocks;
+    store->buckets = (uint32_t *)(base + sizeof *store);
+    store->entries = (struct store_entry *)(store->buckets + nbuckets);
+    store->blocks = (struct store_block *)(store->entries + nblocks + 1);
+    store->fresh_entry = store->fresh_block = 1;
+    store->free_entries = store->free_blocks = nblocks;
+    store->stats.size = (size_t)nblocks * STORE_BLOCK_DATA;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    for (i = 0; i < STORE_STRIPES && !err; ++i)
+        err = pthread_mutex_init(&store->stripes[i], &attr);
+    if (!err)
+        err = pthread_mutex_init(&store->alloc, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (err) {
+        log_debug("[store] can't make a shared lock");
+        munmap(base, size);
+        return NULL;
+    }
+
+    return store;
+}
+
+void store_free(struct store * store)
+{
+    int i;
+
+    if (store) {
+        for (i = 0; i < STORE_STRIPES; ++i)
+            pthread_mutex_destroy(&store->stripes[i]);
+        pthread_mutex_destroy(&store->alloc);
+        munmap(store, store->size);
+    }
+}
+
+/* Read or write 'len' bytes 'offset' into an entry's chain */
+static void store_copy(struct store * store, uint32_t block, size_t offset, void * out, const void * in, size_t len)
+{
+    size_t n;
+
+    for (; offset >= STORE_BLOCK_DATA; offset -= STORE_BLOCK_DATA)
+        block = store->blocks[block].next;
+    while (len) {
+        n = STORE_BLOCK_DATA - offset < len ? STORE_BLOCK_DATA - offset : len;
+        if (out) {
+            memcpy(out, store->blocks[block].data + offset, n);
+            out = (unsigned char *)out + n;
+        } else {
+            memcpy(store->blocks[block].data + offset, in, n);
+            in = (const unsigned char *)in + n;
+        }
+        len -= n;
+        offset = 0;
+        block = store->blocks[block].next;
+    }
+}
+
+/* Whether an entry's key starts with 'len' bytes of 'key' */
+static bool store_key_prefix(struct store * store, const struct store_entry * e, const void * key, size_t len)
+{
+    uint32_t block = e->block;
+    size_t n;
+
+    if (e->klen < len)
+        return false;
+    for (; len; len -= n, key = (const unsigned char *)key + n, block = store->blocks[block].next) {
+        n = len < STORE_BLOCK_DATA ? len : STORE_BLOCK_DATA;
+        if (memcmp(store->blocks[block].data, key, n))
+            return false;
+    }
+    return true;
+}
+
+static inline bool store_expired(const struct store_entry * e, uint64_t now)
+{
+    return e->expires && now >= e->expires;
+}
+
+/* New entry with its blocks for 'len' bytes of key and value, 0 if there's no room */
+static uint32_t store_alloc(struct store * store, size_t len)
+{
+    uint32_t blocks = store_nblocks(len), i, block, * link;
+
+    store_lock(&store->alloc);
+    if (store->free_blocks < blocks || !store->free_entries) {
+        store_unlock(&store->alloc);
+        return 0;
+    }
+    if ((i = store->free_entry))
+        store->free_entry = store->entries[i].chain;
+    else
+        i = store->fresh_entry++;
+    store->free_entries--;
+    store->entries[i] = (struct store_entry){.block = 0};
+
+    for (link = &store->entries[i].block; blocks--; link = &store->blocks[block].next) {
+        if ((block = store->free_block))
+            store->free_block = store->blocks[block].next;
+        else
+            block = store->fresh_block++;
+        store->free_blocks--;
+        store->blocks[block].next = 0;
+        *link = block;
+    }
+    store->stats.keys++;
+    store->stats.used += len;
+    store_unlock(&store->alloc);
+
+    return i;
+}
+
+/* Give back an entry that's no longer in any bucket */
+static void store_release(struct store * store, uint32_t i)
+{
+    struct store_entry * e = &store->entries[i];
+    uint32_t block, next;
+
+    store_lock(&store->alloc);
+    for (block = e->block; block; block = next) {
+        next = store->blocks[block].next;
+        store->blocks[block].next = store->free_block;
+        store->free_block = block;
+        store->free_blocks++;
+    }
+    store->stats.keys--;
+    store->stats.used -= e->klen + e->vlen;
+
+    *e = (struct store_entry){.chain = store->free_entry};
+    store->free_entry = i;
+    store->free_entries++;
+    store_unlock(&store->alloc);
+}
+
+/* Take an entry out of its bucket ('link' points at it) and give it back */
+static void store_remove(struct store * store, uint32_t * link)
+{
+    uint32_t i = *link;
+
+    *link = store->entries[i].chain;
+    store_release(store, i);
+}
+
+/*
+ * Entry for a key in its bucket (with the stripe locked), 0 if it's not
+ * there or has expired, which it's dropped for. 'link' is set to where
+ * it's linked from if it's found, the bucket otherwise
+ */
+static uint32_t store_find(struct store * store, uint64_t hash, const void * key, size_t klen, uint32_t ** link)
+{
+    uint32_t * at = &store->buckets[hash & (store->nbuckets - 1)], i;
+
+    if (link)
+        *link = at;
+    for (; (i = *at); at = &store->entries[i].chain) {
+        struct store_entry * e = &store->entries[i];
+
+        if (e->hash != hash || e->klen != klen || !store_key_prefix(store, e, key, klen))
+            continue;
+        if (store_expired(e, store_now())) {
+            store_remove(store, at);
+            return 0;
+        }
+        if (link)
+            *link = at;
+        return i;
+    }
+    return 0;
+}
+
+int store_get(struct store * store, const void * key, size_t klen, void ** value, size_t * len, uint64_t * version)
+{
+    uint64_t hash = store_hash(key, klen);
+    pthread_mutex_t * lock = store_stripe(store, hash & (store->nbuckets - 1));
+    struct store_entry * e;
+    uint32_t i;
+    int found = 0;
+
+    store_lock(lock);
+    if ((i = store_find(store, hash, key, klen, NULL))) {
+        e = &store->entries[i];
+        if (!value || (*value = malloc(e->vlen ? e->vlen : 1))) {
+            if (value) {
+                store_copy(store, e->block, e->klen, *value, NULL, e->vlen);
+                *len = e->vlen;
+            }
+            if (version)
+                *version = e->version;
+            found = 1;
+        } else {
+            perror("store_get malloc");
+        }
+    }
+    store_unlock(lock);
+
+    return found;
+}
+
+int store_set(struct store * store, const void * key, size_t klen, const void * value, size_t len, double ttl, uint64_t version)
+{
+    uint64_t hash = store_hash(key, klen);
+    pthread_mutex_t * lock = store_stripe(store, hash & (store->nbuckets - 1));
+    struct store_entry * e;
+    uint32_t i, n, * link;
+    int res = 1;
+
+    if (klen > UINT32_MAX || len > UINT32_MAX || store_nblocks(klen + len) > store->nblocks / STORE_ENTRY_SHARE)
+        return -1;
+
+    store_lock(lock);
+    i = store_find(store, hash, key, klen, &link);
+    if (version != STORE_ANY && version != (i ? store->entries[i].version : 0)) {
+        res = 0;
+    } else if (!(n = store_alloc(store, klen + len))) {
+        res = -1;
+    } else {
+        /* Filled in before it's linked, then it takes the old one's place in one go */
+        e = &store->entries[n];
+        e->hash = hash;
+        e->klen = klen;
+        e->vlen = len;
+        e->version = atomic_fetch_add(&store->version, 1) + 1;
+        e->expires = ttl > 0 ? store_now() + (uint64_t)(ttl * 1000000) : 0;
+        store_copy(store, e->block, 0, NULL, key, klen);
+        store_copy(store, e->block, klen, NULL, value, len);
+        e->chain = i ? store->entries[i].chain : *link;
+        *link = n;
+        if (i)
+            store_release(store, i);
+    }
+    store_unlock(lock);
+
+    return res;
+}
+
+int store_del(struct store * store, const void * key, size_t klen, uint64_t version, void ** value, size_t * len)
+{
+    uint64_t hash = store_hash(key, klen);
+    pthread_mutex_t * lock = store_stripe(store, hash & (store->nbuckets - 1));
+    struct store_entry * e;
+    uint32_t i, * link;
+    int res = 0;
+
+    store_lock(lock);
+    if ((i = store_find(store, hash, key, klen, &link)) && (version == STORE_ANY || version == store->entries[i].version)) {
+        e = &store->entries[i];
+        if (value && (*value = malloc(e->vlen ? e->vlen : 1))) {
+            store_copy(store, e->block, e->klen, *value, NULL, e->vlen);
+            *len = e->vlen;
+        } else if (value) {
+            perror("store_del malloc");
+        }
+        if (!value || *value) {
+            store_remove(store, link);
+            atomic_fetch_add(&store->version, 1);
+            res = 1;
+        }
+    }
+    store_unlock(lock);
+
+    return res;
+}
+
+/* The cursor is the bucket and how far down its chain we got */
+int store_next(struct store * store, const void * prefix, size_t plen, uint64_t * cursor, void ** key, size_t * klen)
+{
+    uint32_t bucket = *cursor >> 32, skip = (uint32_t)*cursor, pos, i;
+    uint64_t now = store_now();
+    struct store_entry * e;
+
+    for (; bucket < store->nbuckets; ++bucket, skip = 0) {
+        store_lock(store_stripe(store, bucket));
+        for (pos = 0, i = store->buckets[bucket]; i; i = e->chain, ++pos) {
+            e = &store->entries[i];
+            if (pos < skip || store_expired(e, now) || !store_key_prefix(store, e, prefix, plen))
+                continue;
+            if (!(*key = malloc(e->klen ? e->klen : 1))) {
+                perror("store_next malloc");
+                store_unlock(store_stripe(store, bucket));
+                return 0;
+            }
+            store_copy(store, e->block, 0, *key, NULL, e->klen);
+            *klen = e->klen;
+            *cursor = (uint64_t)bucket << 32 | (pos + 1);
+            store_unlock(store_stripe(store, bucket));
+            return 1;
+        }
+        store_unlock(store_stripe(store, bucket));
+    }
+    *cursor = (uint64_t)store->nbuckets << 32;
+    return 0;
+}
+
+unsigned long store_expire(struct store * store)
+{
+    unsigned long n = 0;
+    uint64_t now = store_now();
+    uint32_t bucket, * link;
+
+    for (bucket = 0; bucket < store->nbuckets; ++bucket) {
+        store_lock(store_stripe(store, bucket));
+        for (link = &store->buckets[bucket]; *link; ) {
+            if (store_expired(&store->entries[*link], now)) {
+                store_remove(store, link);
+                ++n;
+            } else {
+                link = &store->entries[*link].chain;
+            }
+        }
+        store_unlock(store_stripe(store, bucket));
+    }
+    return n;
+}
+
+uint64_t store_version(struct store * store)
+{
+    return atomic_load(&store->version);
+}
+
+/* Write what's in one bucket (with its stripe locked), false on a write error */
+static bool store_save_bucket(struct store * store, uint32_t bucket, FILE * fp, uint64_t now, time_t wall)
+{
+    struct store_record rec;
+    struct store_entry * e;
+    uint32_t i, block;
+    size_t left, n;
+
+    for (i = store->buckets[bucket]; i; i = e->chain) {
+        e = &store->entries[i];
+        if (store_expired(e, now))
+            continue;
+        /* Rounded up, so it can't come back already expired */
+        rec = (struct store_record){.klen = e->klen, .vlen = e->vlen,
+            .expires = e->expires ? wall + (int64_t)((e->expires - now) / 1000000) + 1 : 0};
+        if (fwrite(&rec, sizeof rec, 1, fp) != 1)
+            return false;
+        for (block = e->block, left = e->klen + e->vlen; left; left -= n, block = store->blocks[block].next) {
+            n = left < STORE_BLOCK_DATA ? left : STORE_BLOCK_DATA;
+            if (fwrite(store->blocks[block].data, 1, n, fp) != n)
+                return false;
+        }
+    }
+    return true;
+}
+
+int store_save(struct store * store, const char * path)
+{
+    char tmp[PATH_MAX];
+    uint64_t now = store_now();
+    time_t wall = time(NULL);
+    uint32_t bucket;
+    bool ok = true;
+    FILE * fp;
+
+    if ((size_t)snprintf(tmp, sizeof tmp, "%s.tmp", path) >= sizeof tmp) {
+        log_debug("[store] snapshot path is too long: %s", path);
+        return -1;
+    }
+    if (!(fp = fopen(tmp, "w"))) {
+        perror("store_save fopen");
+        return -1;
+    }
+    ok = fputs(STORE_MAGIC, fp) != EOF;
+    for (bucket = 0; ok && bucket < store->nbuckets; ++bucket) {
+        store_lock(store_stripe(store, bucket));
+        ok = store_save_bucket(store, bucket, fp, now, wall);
+        store_unlock(store_stripe(store, bucket));
+    }
+    /* Only ever replace the last snapshot with a whole one */
+    ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) || !ok || rename(tmp, path) == -1) {
+        perror("store_save");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int store_load(struct store * store, const char * path)
+{
+    char magic[sizeof STORE_MAGIC] = "";
+    struct store_record rec;
+    time_t wall = time(NULL);
+    unsigned long keys = 0, lost = 0;
+    unsigned char * buf;
+    FILE * fp;
+    int res = 0;
+
+    /* Nothing saved yet */
+    if (!(fp = fopen(path, "r")))
+        return errno == ENOENT ? 0 : -1;
+    if (fread(magic, 1, sizeof magic - 1, fp) != sizeof magic - 1 || strcmp(magic, STORE_MAGIC)) {
+        log_debug("[store] %s isn't a snapshot", path);
+        fclose(fp);
+        return -1;
+    }
+    while (fread(&rec, sizeof rec, 1, fp) == 1) {
+        if (!(buf = malloc((size_t)rec.klen + rec.vlen + 1))) {
+            perror("store_load malloc");
+            res = -1;
+            break;
+        }
+        if (fread(buf, 1, (size_t)rec.klen + rec.vlen, fp) != (size_t)rec.klen + rec.vlen) {
+            free(buf);
+            res = -1;
+            break;
+        }
+        if (!rec.expires || rec.expires > wall) {
+            if (store_set(store, buf, rec.klen, buf + rec.klen, rec.vlen, rec.expires ? rec.expires - wall : 0, STORE_ANY) == 1)
+                ++keys;
+            else
+                ++lost;
+        }
+        free(buf);
+    }
+    if (ferror(fp))
+        res = -1;
+    if (res)
+        log_debug("[store] %s is cut short", path);
+    if (lost)
+        log_debug("[store] no room for %lu keys from %s", lost, path);
+    log_debug("[store] loaded %lu keys from %s", keys, path);
+    fclose(fp);
+
+    return res;
+}
+
+void store_stats(struct store * store, struct store_stats * stats)
+{
+    store_lock(&store->alloc);
+    *stats = store->stats;
+    store_unlock(&store->alloc);
+}
+
+/* end store.c */
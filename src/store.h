@@ -0,0 +1,68 @@
+#ifndef STORE_HEADER__H_
+#define STORE_HEADER__H_
+
+#include <stddef.h> /* size_t */
+#include <stdint.h>
+
+/* Default size of the modules' shared state (config: state_size, in MB) */
+#define STORE_SIZE (4 << 20)
+/* Seconds between the master's sweeps for expired keys, and its snapshots (config: state_file) */
+#define STORE_SWEEP 60
+/* Locks, a key's bucket decides which one it's under */
+#define STORE_STRIPES 64
+/* store_set() version for setting it whatever is there */
+#define STORE_ANY UINT64_MAX
+
+/*
+ * Key/value store in a shared mapping for the modules' state, made by
+ * the master before it forks so every worker sees the same one. Unlike
+ * the cache (cache.h) nothing is dropped to make room, keys only go
+ * when they're deleted or their ttl runs out.
+ *
+ * Buckets are spread over STORE_STRIPES locks so workers only wait on
+ * each other for keys that share one. Every value has a version, a
+ * store_set() or store_del() given one only goes through if the key
+ * is still at it, for changing a value without holding a lock.
+ *
+ * The master can save it to a file (store_save()) and load that again
+ * when it starts (store_load()).
+ */
+struct store;
+
+struct store_stats {
+    size_t size, used;             /* Bytes for keys and values, and how many of them hold one */
+    unsigned long keys;
+};
+
+struct store * store_new(size_t size);
+void store_free(struct store * store);
+
+/* 1 with a copy of the value (caller frees, skipped if 'value' is NULL) and its version, 0 if there is none */
+int store_get(struct store * store, const void * key, size_t klen, void ** value, size_t * len, uint64_t * version);
+/*
+ * Set a value for 'ttl' seconds (0 for good) if the key is at 'version'
+ * (0 for not being there, STORE_ANY for whatever it's at). 1 if it's set,
+ * 0 if the version didn't match and -1 if there's no room for it
+ */
+int store_set(struct store * store, const void * key, size_t klen, const void * value, size_t len, double ttl, uint64_t version);
+/* Same for deleting it, 1 with what it was (if 'value' isn't NULL) when it's gone */
+int store_del(struct store * store, const void * key, size_t klen, uint64_t version, void ** value, size_t * len);
+/*
+ * Next key starting with 'prefix' (caller frees), 0 when there are no
+ * more. '*cursor' starts at 0, keys set or deleted meanwhile may or may
+ * not turn up
+ */
+int store_next(struct store * store, const void * prefix, size_t plen, uint64_t * cursor, void ** key, size_t * klen);
+
+/* Drop the keys whose ttl ran out, returns how many */
+unsigned long store_expire(struct store * store);
+/* Changes whenever a key does, to tell whether it needs saving again */
+uint64_t store_version(struct store * store);
+/* Write everything to 'path' (by way of a temporary file), -1 on error */
+int store_save(struct store * store, const char * path);
+/* Set what a store_save() wrote, -1 if it can't read it */
+int store_load(struct store * store, const char * path);
+
+void store_stats(struct store * store, struct store_stats * stats);
+
+#endif
@@ -0,0 +1,172 @@
+/*
+ * http_test.c run the HTTP client (http.c) against a local evhttp server
+ *
+ * usage: http_test
+ *
+ * The server listens on a free port of 127.0.0.1 on the same event
+ * loop, the requests go one after another so a kept alive connection
+ * can be told from a new one by the port the server sees it come from.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+#include "../http.h"
+
+/* More than any max_size we ask for, less than HTTP_MAX_SIZE */
+#define TEST_BIG (256 << 10)
+
+struct http_test {
+    const char * what;
+    const char * path;         /* On the server, or a whole url */
+    struct http_options opt;
+    int status;                /* What we expect, -1 for http_request() to refuse it */
+    const char * url;          /* Where it ends up, NULL for where it started */
+    size_t len;                /* Body length, 0 to not look */
+    bool truncated;
+    bool same;                 /* On the connection the one before had */
+};
+
+static const struct http_test tests[] = {
+    {"first request", "/port", {.redirects = -1}, 200},
+    {"kept alive", "/port", {.redirects = -1}, 200, .same = true},
+    {"redirects", "/redirect?n=3", {.redirects = -1}, 200, "/port", .same = true},
+    {"redirect limit", "/redirect?n=3", {.redirects = 2}, 302, "/redirect?n=1"},
+    {"max_size", "/big", {.redirects = -1, .max_size = 1000}, 200, .len = 1000, .truncated = true},
+    {"after max_size", "/port", {.redirects = -1}, 200},
+    {"timeout", "/hang", {.redirects = -1, .timeout = 0.2}, 0},
+    {"after timeout", "/port", {.redirects = -1}, 200},
+    {"kept alive after timeout", "/port", {.redirects = -1}, 200, .same = true},
+};
+
+static struct event_base * base;
+static struct http * client;
+static int port;
+static size_t current, failed;
+static char last[16];
+
+static void test_next(evutil_socket_t fd, short what, void * data);
+
+/* /port answers with the port the request came from, /redirect?n=<n> sends it n more times */
+static void test_server_callback(struct evhttp_request * req, void * data)
+{
+    const char * uri = evhttp_request_get_uri(req);
+    struct evbuffer * out = evbuffer_new();
+    char * peer, location[32];
+    ev_uint16_t from;
+    int n;
+
+    if (!strcmp(uri, "/port")) {
+        evhttp_connection_get_peer(evhttp_request_get_connection(req), &peer, &from);
+        evbuffer_add_printf(out, "%u", from);
+        evhttp_send_reply(req, 200, "OK", out);
+    } else if (sscanf(uri, "/redirect?n=%d", &n) == 1) {
+        if (n > 1)
+            snprintf(location, sizeof location, "/redirect?n=%d", n - 1);
+        else
+            strcpy(location, "/port");
+        evhttp_add_header(evhttp_request_get_output_headers(req), "Location", location);
+        evhttp_send_reply(req, 302, "Found", out);
+    } else if (!strcmp(uri, "/big")) {
+        while (evbuffer_get_length(out) < TEST_BIG)
+            evbuffer_add(out, "0123456789abcdef", 16);
+        evhttp_send_reply(req, 200, "OK", out);
+    } else if (strcmp(uri, "/hang")) {
+        evhttp_send_reply(req, 404, "Not Found", out);
+    }
+    /* /hang never gets an answer */
+    evbuffer_free(out);
+}
+
+static void test_callback(const struct http_response * res, void * data)
+{
+    const struct http_test * t = &tests[current];
+    char url[64];
+    size_t len;
+    bool ok;
+
+    snprintf(url, sizeof url, "http://127.0.0.1:%d%s", port, t->url ? t->url : t->path);
+    ok = res->status == t->status && !strcmp(res->url, url) && res->truncated == t->truncated
+        && (!t->len || res->len == t->len);
+    if (ok && t->same)
+        ok = res->len == strlen(last) && !memcmp(res->body, last, res->len);
+    printf("%-4s %s: %d %s (%zu bytes%s)\n", ok ? "ok" : "FAIL", t->what, res->status,
+            res->reason ? res->reason : "", res->len, res->truncated ? ", truncated" : "");
+    failed += !ok;
+
+    len = res->len < sizeof last ? res->len : sizeof last - 1;
+    if (res->status == 200 && !strcmp(res->url + strlen(res->url) - 5, "/port")) {
+        memcpy(last, res->body, len);
+        last[len] = '\0';
+    }
+    current++;
+    event_base_once(base, -1, EV_TIMEOUT, test_next, NULL, NULL);
+}
+
+static void test_next(evutil_socket_t fd, short what, void * data)
+{
+    const struct http_test * t;
+    char url[64];
+
+    if (current == sizeof tests / sizeof *tests) {
+        event_base_loopexit(base, NULL);
+        return;
+    }
+    t = &tests[current];
+    snprintf(url, sizeof url, "http://127.0.0.1:%d%s", port, t->path);
+    if (!http_request(client, "GET", url, &t->opt, test_callback, NULL)) {
+        printf("FAIL %s: can't request %s\n", t->what, url);
+        failed++;
+        current++;
+        event_base_once(base, -1, EV_TIMEOUT, test_next, NULL, NULL);
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    struct evhttp * server;
+    struct evhttp_bound_socket * bound;
+    struct sockaddr_in sin;
+    socklen_t slen = sizeof sin;
+    char url[64];
+
+    if ( !(base = event_base_new()) || !(server = evhttp_new(base))
+            || !(client = http_new(base, NULL)) ) {
+        fprintf(stderr, "can't set up the event loop\n");
+        return 1;
+    }
+    if ( !(bound = evhttp_bind_socket_with_handle(server, "127.0.0.1", 0))
+            || getsockname(evhttp_bound_socket_get_fd(bound), (struct sockaddr *)&sin, &slen) == -1) {
+        fprintf(stderr, "can't listen on 127.0.0.1\n");
+        return 1;
+    }
+    port = ntohs(sin.sin_port);
+    evhttp_set_gencb(server, test_server_callback, NULL);
+
+    /* Without TLS an https url is refused right away */
+    snprintf(url, sizeof url, "https://127.0.0.1:%d/port", port);
+    if (!http_tls()) {
+        if (http_request(client, "GET", url, NULL, test_callback, NULL)) {
+            printf("FAIL https without tls: requested\n");
+            return 1;
+        }
+        printf("ok   https without tls: refused\n");
+    }
+
+    event_base_once(base, -1, EV_TIMEOUT, test_next, NULL, NULL);
+    event_base_dispatch(base);
+
+    http_free(client);
+    evhttp_free(server);
+    event_base_free(base);
+    printf("%zu of %zu failed\n", failed, sizeof tests / sizeof *tests);
+    return failed ? 1 : 0;
+}